@@ -1,21 +1,21 @@
-@echo off
-set OUTDIR=build
-set EXECLI64=sdp.exe
-set EXECLI32=sdp_x86.exe
-
-set SRCCLI=src/common/cap.c src/common/uac.c src/common/unit.c src/common/multisz.c src/common/disk.c src/cli/cmd.c src/cli/sdp.c
-
-set GCC64=x86_64-w64-mingw32-gcc.exe
-set GCC32=i686-w64-mingw32-gcc.exe
-
-set CFLAGS=-Wno-incompatible-pointer-types -s -O2 -D _UNICODE -D UNICODE
-set LDFLAGS=-mwin32 -municode -mconsole
-
-set ARGS64=%CFLAGS% -o %OUTDIR%/%EXECLI64% %SRCCLI% %LDFLAGS%
-set ARGS32=%CFLAGS% -o %OUTDIR%/%EXECLI32% %SRCCLI% %LDFLAGS%
-
-echo Building 64-bit binary...
-%GCC64% %ARGS64%
-echo Building 32-bit binary...
-%GCC32% %ARGS32%
-echo Done.
+@echo off
+set OUTDIR=build
+set EXECLI64=sdp.exe
+set EXECLI32=sdp_x86.exe
+
+set SRCCLI=src/common/cap.c src/common/uac.c src/common/unit.c src/common/multisz.c src/common/disk.c src/common/task.c src/common/quirk.c src/common/inventory.c src/common/monitor.c src/common/governor.c src/common/spin.c src/common/transport.c src/common/simdisk.c src/common/stats.c src/common/trace.c src/common/idmap.c src/common/devlist.c src/common/hotplug.c src/common/emit.c src/common/report.c src/cli/batch.c src/cli/cmd.c src/cli/sdp.c
+
+set GCC64=x86_64-w64-mingw32-gcc.exe
+set GCC32=i686-w64-mingw32-gcc.exe
+
+set CFLAGS=-Wno-incompatible-pointer-types -s -O2 -D _UNICODE -D UNICODE
+set LDFLAGS=-mwin32 -municode -mconsole -lcfgmgr32
+
+set ARGS64=%CFLAGS% -o %OUTDIR%/%EXECLI64% %SRCCLI% %LDFLAGS%
+set ARGS32=%CFLAGS% -o %OUTDIR%/%EXECLI32% %SRCCLI% %LDFLAGS%
+
+echo Building 64-bit binary...
+%GCC64% %ARGS64%
+echo Building 32-bit binary...
+%GCC32% %ARGS32%
+echo Done.
@@ -0,0 +1,208 @@
+#include "batch.h"
+
+#include <sdkddkver.h>
+#include <Windows.h>
+
+#include <stddef.h> // offsetof, GCC x686 requires
+
+#include "../common/heap.h"
+
+
+enum {
+	kMinCapacity = 4096,
+	kMaxSize = 16 * 1024 * 1024, // Much more than any batch needs
+	kMaxArgs = 256, // Per line, including the program name
+};
+
+static const wchar_t* kLowMem = L"Low memory to load batch.";
+
+
+// Read h until end of file or pipe.
+// Return: data to be freed by caller, or NULL if failed
+static char*
+readAll(HANDLE h, DWORD* size, const wchar_t** errmsg) {
+	static const wchar_t* kReadFailed = L"Failed to read batch file.";
+	static const wchar_t* kTooLarge = L"Batch file too large.";
+
+	DWORD capacity = kMinCapacity;
+	char* data = heap_alloc(0, capacity);
+	*size = 0;
+	for (;;) {
+		if (!data) {
+			*errmsg = kLowMem;
+			return NULL;
+		}
+		if (*size == capacity) {
+			if (capacity == kMaxSize) {
+				*errmsg = kTooLarge;
+				break;
+			}
+			char* p = heap_alloc(0, capacity * 2);
+			if (p) CopyMemory(p, data, *size);
+			heap_free(0, data);
+			data = p;
+			capacity *= 2;
+			continue;
+		}
+
+		DWORD cb = 0;
+		if (!ReadFile(h, data + *size, capacity - *size, &cb, NULL)) {
+			if (GetLastError() == ERROR_BROKEN_PIPE) return data;
+			*errmsg = kReadFailed;
+			break;
+		}
+		if (!cb) return data;
+		*size += cb;
+	}
+	heap_free(0, data);
+	return NULL;
+}
+
+// UTF-8, with or without BOM
+static wchar_t*
+manuText(const char* data, DWORD size, const wchar_t** errmsg) {
+	static const wchar_t* kBadText = L"Batch file is not UTF-8 text.";
+
+	if (size >= 3 && data[0] == '\xEF' && data[1] == '\xBB' && data[2] == '\xBF') {
+		data += 3;
+		size -= 3;
+	}
+	int cch = size ? MultiByteToWideChar(CP_UTF8, 0, data, (int)size, NULL, 0) : 0;
+	if (size && !cch) {
+		*errmsg = kBadText;
+		return NULL;
+	}
+	wchar_t* text = heap_alloc(0, sizeof(*text) * ((size_t)cch + 1));
+	if (!text) {
+		*errmsg = kLowMem;
+		return NULL;
+	}
+	if (cch) MultiByteToWideChar(CP_UTF8, 0, data, (int)size, text, cch);
+	text[cch] = L'\0';
+	return text;
+}
+
+static wchar_t*
+manuBatchText(const wchar_t* path, const wchar_t** errmsg) {
+	static const wchar_t* kOpenFailed = L"Failed to open batch file.";
+
+	const bool isStdin = path[0] == L'-' && !path[1];
+	HANDLE h = isStdin
+		? GetStdHandle(STD_INPUT_HANDLE)
+		: CreateFile(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (h == INVALID_HANDLE_VALUE || !h) {
+		*errmsg = kOpenFailed;
+		return NULL;
+	}
+
+	DWORD size;
+	char* data = readAll(h, &size, errmsg);
+	if (!isStdin) CloseHandle(h);
+	if (!data) return NULL;
+
+	wchar_t* text = manuText(data, size, errmsg);
+	heap_free(0, data);
+	return text;
+}
+
+static inline bool
+isBlank(wchar_t c) {
+	return c == L' ' || c == L'\t' || c == L'\r';
+}
+
+// Split line into args in place. argv[0] is the program name, as cmd_parse expects.
+// Return: count of args, or 0 if more than kMaxArgs
+static int
+splitArgs(wchar_t* line, const wchar_t** argv) {
+	int argc = 0;
+	argv[argc++] = L"SDP";
+	for (wchar_t* p = line; *p;) {
+		while (isBlank(*p)) *p++ = L'\0';
+		if (!*p) break;
+
+		if (argc == kMaxArgs) return 0;
+		argv[argc++] = p;
+		while (*p && !isBlank(*p)) ++p;
+	}
+	return argc;
+}
+
+static inline bool
+isBatchIntent(enum Intent intent) {
+	return intent == cmd_kList || intent == cmd_kTimerList || intent == cmd_kTimerWrite || intent == cmd_kStop;
+}
+
+Batch*
+batch_load(const wchar_t* path, uint32_t* errLine, const wchar_t** errmsg)
+{
+	static const wchar_t* kTooManyArgs = L"Too many arguments in a line.";
+	static const wchar_t* kBadIntent = L"Only L, WL, W and P are allowed in batch.";
+	static const wchar_t* kNoOp = L"No operation in batch file.";
+
+	*errLine = 0;
+	wchar_t* text = manuBatchText(path, errmsg);
+	if (!text) return NULL;
+
+	uint32_t lineCount = 1;
+	for (const wchar_t* p = text; *p; ++p) {
+		if (*p == L'\n') ++lineCount;
+	}
+	Batch* b = heap_alloc(0, offsetof(Batch, ops[lineCount]));
+	if (!b) {
+		heap_free(0, text);
+		*errmsg = kLowMem;
+		return NULL;
+	}
+	b->text = text;
+	b->count = 0;
+
+	const wchar_t* argv[kMaxArgs];
+	wchar_t* line = text;
+	for (uint32_t n = 1; line; ++n) {
+		wchar_t* next = wcschr(line, L'\n');
+		if (next) *next++ = L'\0';
+		int argc = splitArgs(line, argv);
+		line = next;
+		if (!argc) {
+			*errLine = n;
+			*errmsg = kTooManyArgs;
+			goto err;
+		}
+		if (argc == 1 || argv[1][0] == L'#') continue;
+
+		Cmd* cmd = cmd_parse(argc, argv, errmsg);
+		if (!cmd) {
+			*errLine = n;
+			goto err;
+		}
+		b->ops[b->count].line = n;
+		b->ops[b->count].cmd = cmd;
+		++b->count;
+		if (!isBatchIntent(cmd->intent)) {
+			*errLine = n;
+			*errmsg = kBadIntent;
+			goto err;
+		}
+	}
+	if (!b->count) {
+		*errmsg = kNoOp;
+		goto err;
+	}
+	return b;
+
+err:
+	batch_destroy(b);
+	return NULL;
+}
+
+void
+batch_destroy(Batch* b)
+{
+	if (!b) return;
+
+	for (uint32_t i = 0; i < b->count; ++i) {
+		heap_free(0, b->ops[i].cmd);
+	}
+	heap_free(0, b->text);
+	heap_free(0, b);
+}
@@ -0,0 +1,31 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <wchar.h>
+
+#include "cmd.h"
+
+
+typedef struct BatchOp {
+	uint32_t line; // Where it is in the batch file, from 1
+	Cmd* cmd;
+}BatchOp;
+
+typedef struct Batch {
+	wchar_t* text; // Options of cmds point into it
+	uint32_t count;
+	BatchOp ops[1];
+}Batch;
+
+
+// Read operations from path, or stdin if path is "-". All lines are parsed before any is run.
+// Each line is like a command line without "SDP": "WL 3 5", "P 3 --wait=60". Only L, WL, W and P are allowed.
+// Empty lines and lines starting with "#" are skipped. Options for the whole run, like --simulate or --trace, are ignored.
+// errLine: Set to the line of the error, or 0 if the error is not about a line
+// Return NULL if failed
+Batch*
+batch_load(const wchar_t* path, uint32_t* errLine, const wchar_t** errmsg);
+
+void
+batch_destroy(Batch* b);
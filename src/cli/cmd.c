@@ -1,231 +1,422 @@
-#include "cmd.h"
-
-#include <sdkddkver.h>
-#include <Windows.h>
-
-#include <stddef.h> // offsetof, GCC x686 requires
-#include <assert.h>
-
-#include "../common/disk.h" // dskid_parse
-#include "../common/heap.h"
-
-
-static const wchar_t* kEmptyTimerNumber = L"Timer without a number is not allowed.";
-
-
-static bool
-addDrive(Cmd* cmd, const wchar_t* arg, const wchar_t** errmsg) {
-	static const wchar_t* kBadId = L"Unrecognized disk number.";
-
-	int n = dskid_parse(arg);
-	if (n < 0) {
-		*errmsg = kBadId;
-		return false;
-	}
-
-	cmd->diskIds[cmd->diskCount++] = (uint32_t)n;
-	return true;
-}
-
-static bool
-doParseTimerNumber(uint32_t* v, const wchar_t** p, const wchar_t** errmsg) {
-	static const wchar_t* kBadNumRange = L"Too large timer number.";
-	uint64_t n = 0;
-	const wchar_t* t = *p;
-	for (; *t; ++t) {
-		if (*t < L'0' || *t > L'9') break;
-		n *= 10;
-		n += *t - L'0';
-		if (n > 0xFFFFFFFF) goto err;
-	}
-	if (*p == t) {
-		*errmsg = kEmptyTimerNumber;
-		return false;
-	}
-
-	n *= 10;
-	if (n > 0xFFFFFFFF) goto err;
-
-	*v = (uint32_t)n;
-	*p = t;
-	return true;
-
-err:
-	*errmsg = kBadNumRange;
-	return false;
-}
-
-static bool
-parseTimerNumber(uint32_t* timer, const wchar_t** p, const wchar_t** errmsg) {
-	++*p;
-	if (!**p) {
-		*errmsg = kEmptyTimerNumber;
-		return false;
-	}
-	return doParseTimerNumber(timer, p, errmsg);
-}
-
-static bool
-parseNextTimer(Cmd* cmd, const wchar_t** p, const wchar_t** errmsg) {
-	static const wchar_t* kBadTimerId = L"Unrecognized timer condition identifier.";
-	static const wchar_t* kDupItmerId = L"Duplicate timer condition identifiers not allowed.";
-
-	switch (**p) {
-	case L'i':
-	case L'I':
-	case L'a':
-	case L'A':
-		if (cmd->timerIdleA) goto err;
-		cmd->timerIdleA = 1;
-		return parseTimerNumber(cmd->timers + unit_kIdleA, p, errmsg);
-	case L'b':
-	case L'B':
-		if (cmd->timerIdleB) goto err;
-		cmd->timerIdleB = 1;
-		return parseTimerNumber(cmd->timers + unit_kIdleB, p, errmsg);
-	case L'c':
-	case L'C':
-		if (cmd->timerIdleC) goto err;
-		cmd->timerIdleC = 1;
-		return parseTimerNumber(cmd->timers + unit_kIdleC, p, errmsg);
-	case L'y':
-	case L'Y':
-		if (cmd->timerStandbyY) goto err;
-		cmd->timerStandbyY = 1;
-		return parseTimerNumber(cmd->timers + unit_kStandbyY, p, errmsg);
-	case L'z':
-	case L'Z':
-	case L's':
-	case L'S':
-		if (cmd->timerStandbyZ) goto err;
-		cmd->timerStandbyZ = 1;
-		return parseTimerNumber(cmd->timers + unit_kStandbyZ, p, errmsg);
-	default:
-		*errmsg = kBadTimerId;
-		return false;
-	}
-	return true;
-
-err:;
-	*errmsg = kDupItmerId;
-	return false;
-}
-
-static bool
-parseTimers(Cmd* cmd, const wchar_t* t, const wchar_t** errmsg) {
-	// t points to the char behind 'w/W'
-	cmd->timerMask = 0;
-	bool ok = parseNextTimer(cmd, &t, errmsg);
-	while(ok && *t) {
-		ok = parseNextTimer(cmd, &t, errmsg);
-	}
-	if (ok) cmd->intent = cmd_kTimerWrite;
-	return ok;
-}
-
-static bool
-parseTimerIntent(Cmd* cmd, const wchar_t* t, const wchar_t** errmsg) {
-	// t points to the char behind 'w/W'
-	switch (*t) {
-	case L'\0':
-		cmd->intent = cmd_kTimerHelp;
-		break;
-	case L'l':
-	case L'L':
-		cmd->intent = cmd_kTimerList;
-		break;
-	default:
-		return parseTimers(cmd, t, errmsg);
-		break;
-	}
-	return true;
-}
-
-static bool
-parseIntent(Cmd* cmd, const wchar_t* arg, const wchar_t** errmsg) {
-	static const wchar_t* kMultiIntent = L"Multiple commands not allowed.";
-
-	if (cmd->intent != cmd_kNone) {
-		*errmsg = kMultiIntent;
-		return false;
-	}
-
-	// Eat leading '-' and '/'
-	for (;; ++arg) {
-		if (!*arg) return true; // Tolerate dangling '-'s and '/'s.
-		if (*arg == L'-' || *arg == L'/') continue;
-		break;
-	}
-
-	switch (*arg) {
-	case L'l':
-	case L'L':
-		cmd->intent = cmd_kList;
-		break;
-	case L'p':
-	case L'P':
-		cmd->intent = cmd_kStop;
-		break;
-	case L'w':
-	case L'W':
-		return parseTimerIntent(cmd, arg + 1, errmsg);
-		break;
-	default:
-		cmd->intent = cmd_kHelp;
-		break;
-	}
-	return true;
-}
-
-static bool
-validateIntent(Cmd* cmd, const wchar_t** errmsg) {
-	static const wchar_t* kNoTarget = L"Must specify one or more disk numbers.";
-
-	switch (cmd->intent) {
-	case cmd_kNone:
-		cmd->intent = cmd->diskCount ? cmd_kList : cmd_kHelp;
-		break;
-	case cmd_kTimerHelp:
-		if (cmd->diskCount) cmd->intent = cmd_kTimerList;
-		break;
-	case cmd_kStop:
-	case cmd_kTimerWrite:
-		if (!cmd->diskCount) {
-			*errmsg = kNoTarget;
-			return false;
-		}
-		break;
-	}
-	return true;
-}
-
-Cmd*
-cmd_parse(int argc, const wchar_t* const* argv, const wchar_t** errmsg)
-{
-	static const wchar_t* kLowMem = L"Low memory to parse command.";
-
-	Cmd* cmd = heap_alloc(0, offsetof(Cmd, diskIds[(argc - 1)]));
-	if (!cmd) {
-		*errmsg = kLowMem;
-		return NULL;
-	}
-
-	cmd->intent = cmd_kNone;
-	cmd->diskCount = 0;
-
-	for (int i = 1; i < argc; ++i) {
-		wchar_t c = argv[i][0];
-		if (c >= L'0' && c <= L'9') {
-			if (!addDrive(cmd, argv[i], errmsg)) goto err;
-		}
-		else {
-			if (!parseIntent(cmd, argv[i], errmsg)) goto err;
-		}
-	}
-	if (!validateIntent(cmd, errmsg)) goto err;
-	return cmd;
-
-err:
-	heap_free(0, cmd);
-	return NULL;
-}
+#include "cmd.h"
+
+#include <sdkddkver.h>
+#include <Windows.h>
+
+#include <stddef.h> // offsetof, GCC x686 requires
+#include <wctype.h> // towlower
+#include <assert.h>
+
+#include "../common/disk.h" // dskid_parse
+#include "../common/heap.h"
+
+
+static const wchar_t* kEmptyTimerNumber = L"Timer without a number is not allowed.";
+
+
+static bool
+addDrive(Cmd* cmd, const wchar_t* arg, const wchar_t** errmsg) {
+	static const wchar_t* kBadId = L"Unrecognized disk number.";
+
+	int n = dskid_parse(arg);
+	if (n < 0) {
+		*errmsg = kBadId;
+		return false;
+	}
+
+	cmd->diskIds[cmd->diskCount++] = (uint32_t)n;
+	return true;
+}
+
+static bool
+doParseTimerNumber(uint32_t* v, const wchar_t** p, const wchar_t** errmsg) {
+	static const wchar_t* kBadNumRange = L"Too large timer number.";
+	uint64_t n = 0;
+	const wchar_t* t = *p;
+	for (; *t; ++t) {
+		if (*t < L'0' || *t > L'9') break;
+		n *= 10;
+		n += *t - L'0';
+		if (n > 0xFFFFFFFF) goto err;
+	}
+	if (*p == t) {
+		*errmsg = kEmptyTimerNumber;
+		return false;
+	}
+
+	n *= 10;
+	if (n > 0xFFFFFFFF) goto err;
+
+	*v = (uint32_t)n;
+	*p = t;
+	return true;
+
+err:
+	*errmsg = kBadNumRange;
+	return false;
+}
+
+static bool
+parseTimerNumber(uint32_t* timer, const wchar_t** p, const wchar_t** errmsg) {
+	++*p;
+	if (!**p) {
+		*errmsg = kEmptyTimerNumber;
+		return false;
+	}
+	return doParseTimerNumber(timer, p, errmsg);
+}
+
+static bool
+parseNextTimer(Cmd* cmd, const wchar_t** p, const wchar_t** errmsg) {
+	static const wchar_t* kBadTimerId = L"Unrecognized timer condition identifier.";
+	static const wchar_t* kDupItmerId = L"Duplicate timer condition identifiers not allowed.";
+
+	switch (**p) {
+	case L'i':
+	case L'I':
+	case L'a':
+	case L'A':
+		if (cmd->timerIdleA) goto err;
+		cmd->timerIdleA = 1;
+		return parseTimerNumber(cmd->timers + unit_kIdleA, p, errmsg);
+	case L'b':
+	case L'B':
+		if (cmd->timerIdleB) goto err;
+		cmd->timerIdleB = 1;
+		return parseTimerNumber(cmd->timers + unit_kIdleB, p, errmsg);
+	case L'c':
+	case L'C':
+		if (cmd->timerIdleC) goto err;
+		cmd->timerIdleC = 1;
+		return parseTimerNumber(cmd->timers + unit_kIdleC, p, errmsg);
+	case L'y':
+	case L'Y':
+		if (cmd->timerStandbyY) goto err;
+		cmd->timerStandbyY = 1;
+		return parseTimerNumber(cmd->timers + unit_kStandbyY, p, errmsg);
+	case L'z':
+	case L'Z':
+	case L's':
+	case L'S':
+		if (cmd->timerStandbyZ) goto err;
+		cmd->timerStandbyZ = 1;
+		return parseTimerNumber(cmd->timers + unit_kStandbyZ, p, errmsg);
+	default:
+		*errmsg = kBadTimerId;
+		return false;
+	}
+	return true;
+
+err:;
+	*errmsg = kDupItmerId;
+	return false;
+}
+
+static bool
+parseTimers(Cmd* cmd, const wchar_t* t, const wchar_t** errmsg) {
+	// t points to the char behind 'w/W'
+	cmd->timerMask = 0;
+	bool ok = parseNextTimer(cmd, &t, errmsg);
+	while(ok && *t) {
+		ok = parseNextTimer(cmd, &t, errmsg);
+	}
+	if (ok) cmd->intent = cmd_kTimerWrite;
+	return ok;
+}
+
+static bool
+parseTimerIntent(Cmd* cmd, const wchar_t* t, const wchar_t** errmsg) {
+	// t points to the char behind 'w/W'
+	switch (*t) {
+	case L'\0':
+		cmd->intent = cmd_kTimerHelp;
+		break;
+	case L'l':
+	case L'L':
+		cmd->intent = cmd_kTimerList;
+		break;
+	default:
+		return parseTimers(cmd, t, errmsg);
+		break;
+	}
+	return true;
+}
+
+static bool
+parseIntent(Cmd* cmd, const wchar_t* arg, const wchar_t** errmsg) {
+	static const wchar_t* kMultiIntent = L"Multiple commands not allowed.";
+
+	if (cmd->intent != cmd_kNone) {
+		*errmsg = kMultiIntent;
+		return false;
+	}
+
+	// Eat leading '-' and '/'
+	for (;; ++arg) {
+		if (!*arg) return true; // Tolerate dangling '-'s and '/'s.
+		if (*arg == L'-' || *arg == L'/') continue;
+		break;
+	}
+
+	switch (*arg) {
+	case L'l':
+	case L'L':
+		cmd->intent = cmd_kList;
+		break;
+	case L'p':
+	case L'P':
+		cmd->intent = cmd_kStop;
+		break;
+	case L's':
+	case L'S':
+		cmd->intent = cmd_kState;
+		break;
+	case L'm':
+	case L'M':
+		cmd->intent = cmd_kMonitor;
+		break;
+	case L'g':
+	case L'G':
+		cmd->intent = cmd_kGovern;
+		break;
+	case L'u':
+	case L'U':
+		cmd->intent = cmd_kStart;
+		break;
+	case L'w':
+	case L'W':
+		return parseTimerIntent(cmd, arg + 1, errmsg);
+		break;
+	default:
+		cmd->intent = cmd_kHelp;
+		break;
+	}
+	return true;
+}
+
+static bool
+parseCountOption(uint32_t* v, const wchar_t* t, const wchar_t** errmsg) {
+	static const wchar_t* kBadCount = L"Option needs a number from 1 to 64.";
+
+	int n = dskid_parse(t);
+	if (n < 1 || n > 64) {
+		*errmsg = kBadCount;
+		return false;
+	}
+	*v = (uint32_t)n;
+	return true;
+}
+
+static bool
+parseFleetOption(uint32_t* v, const wchar_t* t, const wchar_t** errmsg) {
+	static const wchar_t* kBadFleet = L"Option needs a number from 1 to 1024.";
+
+	int n = dskid_parse(t);
+	if (n < 1 || n > 1024) {
+		*errmsg = kBadFleet;
+		return false;
+	}
+	*v = (uint32_t)n;
+	return true;
+}
+
+static bool
+parseSecondsOption(uint32_t* v, const wchar_t* t, const wchar_t** errmsg) {
+	static const wchar_t* kBadSeconds = L"Option needs seconds from 1 to 86400.";
+
+	int n = dskid_parse(t);
+	if (n < 1 || n > 86400) {
+		*errmsg = kBadSeconds;
+		return false;
+	}
+	*v = (uint32_t)n;
+	return true;
+}
+
+static bool
+parsePercentOption(uint32_t* v, const wchar_t* t, const wchar_t** errmsg) {
+	static const wchar_t* kBadPercent = L"Option needs a percentage from 0 to 50.";
+
+	int n = dskid_parse(t);
+	if (!*t || n < 0 || n > 50) {
+		*errmsg = kBadPercent;
+		return false;
+	}
+	*v = (uint32_t)n;
+	return true;
+}
+
+static bool
+parsePathOption(const wchar_t** v, const wchar_t* t, const wchar_t** errmsg) {
+	static const wchar_t* kNoPath = L"Option needs a file name.";
+
+	if (!*t) {
+		*errmsg = kNoPath;
+		return false;
+	}
+	*v = t;
+	return true;
+}
+
+static bool
+parseFormatOption(enum OutputFormat* v, const wchar_t* t, const wchar_t** errmsg) {
+	static const wchar_t* kBadFormat = L"Option needs text, json or csv.";
+
+	if (!_wcsicmp(t, L"text")) {
+		*v = cmd_kFormatText;
+	}
+	else if (!_wcsicmp(t, L"json")) {
+		*v = cmd_kFormatJson;
+	}
+	else if (!_wcsicmp(t, L"csv")) {
+		*v = cmd_kFormatCsv;
+	}
+	else {
+		*errmsg = kBadFormat;
+		return false;
+	}
+	return true;
+}
+
+static bool
+parseSwitchOption(bool* v, const wchar_t* t, const wchar_t** errmsg) {
+	static const wchar_t* kBadSwitch = L"Option doesn't take a value.";
+
+	if (*t) {
+		*errmsg = kBadSwitch;
+		return false;
+	}
+	*v = true;
+	return true;
+}
+
+// Return pointer to option value, which is the text after "=".
+// If arg doesn't match name, return NULL.
+static const wchar_t*
+matchOption(const wchar_t* arg, const wchar_t* name) {
+	for (; *name; ++arg, ++name) {
+		if (towlower(*arg) != *name) return NULL;
+	}
+	if (*arg == L'=') return arg + 1;
+	return *arg ? NULL : arg;
+}
+
+// arg points to the char behind "--"
+static bool
+parseOption(Cmd* cmd, const wchar_t* arg, const wchar_t** errmsg) {
+	static const wchar_t* kBadOption = L"Unrecognized option.";
+
+	const wchar_t* v;
+	if ((v = matchOption(arg, L"jobs"))) return parseCountOption(&cmd->jobs, v, errmsg);
+	if ((v = matchOption(arg, L"allpages"))) return parseSwitchOption(&cmd->allPages, v, errmsg);
+	if ((v = matchOption(arg, L"refresh"))) return parseSwitchOption(&cmd->refresh, v, errmsg);
+	if ((v = matchOption(arg, L"interval"))) return parseSecondsOption(&cmd->interval, v, errmsg);
+	if ((v = matchOption(arg, L"jitter"))) return parsePercentOption(&cmd->jitter, v, errmsg);
+	if ((v = matchOption(arg, L"idle"))) return parseSecondsOption(&cmd->idle, v, errmsg);
+	if ((v = matchOption(arg, L"mingap"))) return parseSecondsOption(&cmd->minGap, v, errmsg);
+	if ((v = matchOption(arg, L"wait"))) return parseSecondsOption(&cmd->wait, v, errmsg);
+	if ((v = matchOption(arg, L"lockwait"))) return parseSecondsOption(&cmd->lockWait, v, errmsg);
+	if ((v = matchOption(arg, L"spinup"))) return parseCountOption(&cmd->spinUp, v, errmsg);
+	if ((v = matchOption(arg, L"simulate"))) return parseFleetOption(&cmd->simulate, v, errmsg);
+	if ((v = matchOption(arg, L"simhang"))) return parseFleetOption(&cmd->simHang, v, errmsg);
+	if ((v = matchOption(arg, L"stats"))) return parseSwitchOption(&cmd->stats, v, errmsg);
+	if ((v = matchOption(arg, L"trace"))) return parsePathOption(&cmd->tracePath, v, errmsg);
+	if ((v = matchOption(arg, L"deadline"))) return parseSecondsOption(&cmd->deadline, v, errmsg);
+	if ((v = matchOption(arg, L"hotplug"))) return parseSwitchOption(&cmd->hotplug, v, errmsg);
+	if ((v = matchOption(arg, L"format"))) return parseFormatOption(&cmd->format, v, errmsg);
+	if ((v = matchOption(arg, L"batch"))) return parsePathOption(&cmd->batchPath, v, errmsg);
+
+	*errmsg = kBadOption;
+	return false;
+}
+
+// Options are "--name" or "--name=value". Single letter after "--" is still a command
+static inline bool
+isOption(const wchar_t* arg) {
+	return arg[0] == L'-' && arg[1] == L'-' && arg[2] && arg[2] != L'-' && arg[3];
+}
+
+static bool
+validateIntent(Cmd* cmd, const wchar_t** errmsg) {
+	static const wchar_t* kNoTarget = L"Must specify one or more disk numbers.";
+	static const wchar_t* kBatchIntent = L"Batch takes no other command.";
+
+	if (cmd->batchPath) {
+		if (cmd->intent != cmd_kNone) {
+			*errmsg = kBatchIntent;
+			return false;
+		}
+		cmd->intent = cmd_kBatch;
+		return true;
+	}
+
+	switch (cmd->intent) {
+	case cmd_kNone:
+		cmd->intent = cmd->diskCount ? cmd_kList : cmd_kHelp;
+		break;
+	case cmd_kTimerHelp:
+		if (cmd->diskCount) cmd->intent = cmd_kTimerList;
+		break;
+	case cmd_kStop:
+	case cmd_kGovern:
+	case cmd_kTimerWrite:
+		if (!cmd->diskCount) {
+			*errmsg = kNoTarget;
+			return false;
+		}
+		break;
+	}
+	return true;
+}
+
+Cmd*
+cmd_parse(int argc, const wchar_t* const* argv, const wchar_t** errmsg)
+{
+	static const wchar_t* kLowMem = L"Low memory to parse command.";
+
+	Cmd* cmd = heap_alloc(0, offsetof(Cmd, diskIds[(argc - 1)]));
+	if (!cmd) {
+		*errmsg = kLowMem;
+		return NULL;
+	}
+
+	cmd->intent = cmd_kNone;
+	cmd->jobs = 0;
+	cmd->allPages = false;
+	cmd->refresh = false;
+	cmd->interval = 0;
+	cmd->jitter = cmd_kDefaultJitter;
+	cmd->idle = 0;
+	cmd->minGap = 0;
+	cmd->wait = 0;
+	cmd->lockWait = 0;
+	cmd->spinUp = 0;
+	cmd->simulate = 0;
+	cmd->simHang = 0;
+	cmd->stats = false;
+	cmd->tracePath = NULL;
+	cmd->deadline = 0;
+	cmd->hotplug = false;
+	cmd->format = cmd_kFormatText;
+	cmd->batchPath = NULL;
+	cmd->diskCount = 0;
+
+	for (int i = 1; i < argc; ++i) {
+		wchar_t c = argv[i][0];
+		if (c >= L'0' && c <= L'9') {
+			if (!addDrive(cmd, argv[i], errmsg)) goto err;
+		}
+		else if (isOption(argv[i])) {
+			if (!parseOption(cmd, argv[i] + 2, errmsg)) goto err;
+		}
+		else {
+			if (!parseIntent(cmd, argv[i], errmsg)) goto err;
+		}
+	}
+	if (!validateIntent(cmd, errmsg)) goto err;
+	return cmd;
+
+err:
+	heap_free(0, cmd);
+	return NULL;
+}
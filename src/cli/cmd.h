@@ -1,29 +1,64 @@
-#pragma once
-
-#include <stdint.h>
-#include <wchar.h>
-
-#include "../common/unit.h" // unit_kPowerConditionCount, union TimerMask
-
-
-enum Intent{
-	cmd_kNone,
-	cmd_kHelp,
-	cmd_kList,
-	cmd_kStop,
-	cmd_kTimerHelp,
-	cmd_kTimerList,
-	cmd_kTimerWrite,
-};
-
-typedef struct Cmd {
-	enum Intent intent;
-	union TimerMask;
-	uint32_t timers[unit_kPowerConditionCount];
-	uint32_t diskCount;
-	uint32_t diskIds[1];
-}Cmd;
-
-
-Cmd*
-cmd_parse(int argc, const wchar_t* const* argv, const wchar_t** errmsg);
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <wchar.h>
+
+#include "../common/unit.h" // unit_kPowerConditionCount, union TimerMask
+
+
+enum Intent{
+	cmd_kNone,
+	cmd_kHelp,
+	cmd_kList,
+	cmd_kStop,
+	cmd_kState,
+	cmd_kMonitor,
+	cmd_kGovern,
+	cmd_kStart,
+	cmd_kTimerHelp,
+	cmd_kTimerList,
+	cmd_kTimerWrite,
+	cmd_kBatch,
+};
+
+// Of disk listing
+enum OutputFormat {
+	cmd_kFormatText,
+	cmd_kFormatJson,
+	cmd_kFormatCsv,
+};
+
+enum {
+	cmd_kDefaultJitter = 10,
+};
+
+typedef struct Cmd {
+	enum Intent intent;
+	union TimerMask;
+	uint32_t timers[unit_kPowerConditionCount];
+	uint32_t jobs; // Max disks to query at the same time. 0 means default
+	bool allPages; // Read all mode pages at once
+	bool refresh; // List by querying disks, not from inventory
+	uint32_t interval; // Seconds between polls in monitor. 0 means default
+	uint32_t jitter; // Percent to randomize each interval by
+	uint32_t idle; // Seconds without I/O before governor stops a disk. 0 means default
+	uint32_t minGap; // Minimum seconds between two stops of a disk by governor. 0 means default
+	uint32_t wait; // Max seconds to wait for disks to reach a power state. 0 means default
+	uint32_t lockWait; // Max seconds to wait for each volume lock. 0 means default
+	uint32_t spinUp; // Max disks spinning up at the same time. 0 means default
+	uint32_t simulate; // Count of simulated disks to run on instead of real ones. 0 means real disks
+	uint32_t simHang; // Every Nth simulated disk hangs, so its commands time out. 0 means none
+	bool stats; // Show time, commands and memory of each phase
+	const wchar_t* tracePath; // Write trace of commands and phases to it. NULL means no trace
+	uint32_t deadline; // Max seconds for the whole run. 0 means no limit
+	bool hotplug; // Follow disks arriving and leaving in monitor and governor
+	enum OutputFormat format; // Of disk listing in L and WL
+	const wchar_t* batchPath; // Run operations listed in it on disks opened once. "-" for stdin. NULL if not batch
+	uint32_t diskCount;
+	uint32_t diskIds[1];
+}Cmd;
+
+
+Cmd*
+cmd_parse(int argc, const wchar_t* const* argv, const wchar_t** errmsg);
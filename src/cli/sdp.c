@@ -1,484 +1,1409 @@
-#include <sdkddkver.h>
-#include <Windows.h>
-#include <strsafe.h>
-
-#include <stdbool.h>
-
-#include "cmd.h"
-#include "../common/uac.h"
-#include "../common/unit.h"
-#include "../common/cap.h"
-#include "../common/disk.h"
-#include "../common/heap.h"
-
-
-#define MYVER  L"1.10"
-#define MYNAME L"SDP SCSI Disk Power"
-#define MYLIC  L"MIT License"
-#define MYTITLE MYNAME L" " MYVER L"          " MYLIC L"\n\n"
-
-#define SHOW_STATIC_TEXT(x) WriteConsole(GetStdHandle(STD_OUTPUT_HANDLE), x, _countof(x) - 1, &(DWORD){0}, NULL)
-
-
-static const wchar_t kTextDone[] = L"Done\n";
-static const wchar_t kTextFailed[] = L"Failed\n";
-static const wchar_t kTextNoInfo[] = L"No Info\n";
-
-
-static inline void
-indent(void) {
-	WriteConsole(GetStdHandle(STD_OUTPUT_HANDLE), L"    ", 4, &(DWORD){0}, NULL);
-}
-
-static inline void
-volIndent(void) {
-	WriteConsole(GetStdHandle(STD_OUTPUT_HANDLE), L"         ", 9, &(DWORD){0}, NULL);
-}
-
-static inline void
-newline(void) {
-	WriteConsole(GetStdHandle(STD_OUTPUT_HANDLE), L"\n", 1, &(DWORD){0}, NULL);
-}
-
-static inline WORD
-swapColor(WORD attr) {
-	WORD rlt = attr & 0xFF00;
-	rlt |= (attr & 0x0F) << 4;
-	rlt |= (attr & 0xF0) >> 4;
-	return rlt;
-}
-
-static inline void
-invertStderrColor(void) {
-	HANDLE h = GetStdHandle(STD_ERROR_HANDLE);
-	CONSOLE_SCREEN_BUFFER_INFO info;
-	GetConsoleScreenBufferInfo(h, &info);
-	WORD attr = swapColor(info.wAttributes);
-	SetConsoleTextAttribute(h, attr);
-}
-
-static void
-showError(const wchar_t* msg) {
-	if (!msg) msg = L"Unknown error.";
-
-	invertStderrColor();
-	fwprintf(stderr, L"%ls", msg);
-	invertStderrColor();
-}
-
-static inline void
-showAttrText(const wchar_t* t, DWORD cch, WORD attr) {
-	HANDLE h = GetStdHandle(STD_OUTPUT_HANDLE);
-	CONSOLE_SCREEN_BUFFER_INFO info;
-	GetConsoleScreenBufferInfo(h, &info);
-	SetConsoleTextAttribute(h, attr);
-	WriteConsoleW(h, t, cch, &(DWORD){0}, NULL);
-	SetConsoleTextAttribute(h, info.wAttributes);
-	newline();
-}
-
-static inline void
-warn(void) {
-	static const wchar_t t[] = L"CAUTION: Improper usage may cause MAJOR DAMAGE to DATA/DEVICES!";
-	static const WORD attr = BACKGROUND_RED | FOREGROUND_BLUE | FOREGROUND_GREEN | FOREGROUND_RED | FOREGROUND_INTENSITY;
-	showAttrText(t, _countof(t) - 1, attr);
-}
-
-static inline void
-showTitle(void) {
-	static const wchar_t t[] = MYTITLE;
-	SHOW_STATIC_TEXT(t);
-}
-
-static void
-help(void) {
-	static const wchar_t t[] =
-		L"SDP [command] [diskNum] [diskNum] ...\n"
-		L"Only one command is allowed, - or / is optional\n"
-		L"Command is case-insensitive. Command and drive numbers can be input in any order\n"
-		L"Commands:\n"
-		L"  L: List, can be omitted if specified diskNum\n"
-		L"  P: Stop\n"
-		L"  W: Write power condition timer. Use \"SDP W\" for more help\n"
-		L"Examples:\n"
-		L"  List all drives: SDP L\n"
-		L"  List drive0 and drive2: SDP L 0 2\n"
-		L"  Stop drive2 and drive3: SDP P 2 3\n";
-	SHOW_STATIC_TEXT(t);
-}
-
-static void
-timerHelp() {
-	static const wchar_t t[] =
-		L"SDP WL [diskNum] [diskNum] ...\n"
-		L"  List power condition timers\n"
-		L"  L can be omitted if specified diskNum\n"
-		L"SDP W[I|A#][B#][C#][Y#][S|Z#] [diskNum] [diskNum] ...\n"
-		L"  Write power condition timers as # seconds\n"
-		L"Example:\n"
-		L"  Set drive5 Standby_Z timer to 7200 seconds: SDP 5 WZ7200\n"
-		L"  Set drive3 Idle_A to 1800 and Standby_Z to 3600: SDP 3 Wa1800z3600\n"
-		L"Power Consumption: Idle_A >= Idle_B >= Idle_C > Standby_Y >= Standby_Z\n"
-		L"Caution:\n"
-		L"  Avoid setting timers to excessively low values, because\n"
-		L"  short spin down/up and head unload/load cycles\n"
-		L"  can harm your hard drives!\n";
-	SHOW_STATIC_TEXT(t);
-}
-
-static inline void
-showPrivilegeTip(void) {
-	static const wchar_t* t = L"TIP: Run as Administrator to do actual work.";
-	showError(t);
-}
-
-static inline void
-showPrivilegeError(void) {
-	static const wchar_t* t = L"Please run as administrator.";
-	showError(t);
-}
-
-// Return pointer to inner static buffer
-static const wchar_t*
-getFormFactorText(enum UnitFormFactor f) {
-	static const wchar_t* kText[] = {
-		L"n/a",
-		L"5.25",
-		L"3.5",
-		L"2.5",
-		L"1.8",
-		L"1.8-",
-		L"oth",
-	};
-	return f < unit_kFormFactorOther ? kText[f] : kText[unit_kFormFactorOther];
-}
-
-// Retruns pointer to inner static buffer
-static const wchar_t*
-getRpmText(WORD rpm) {
-	static wchar_t t[8];
-
-	if (rpm == 1) {
-		StringCchCopy(t, _countof(t), L"SSD");
-	}
-	else if (rpm >= 0x401 && rpm <= 0xFFFE) {
-		StringCchPrintf(t, _countof(t), L"%hu", rpm);
-	}
-	else {
-		StringCchCopy(t, _countof(t), L"n/a");
-	}
-	return t;
-}
-
-static inline void
-showCommonHeader(void) {
-	static const wchar_t kT[] =
-		L"ID: FF   RPM   CAP  BS   Vendor   Product          Rev  Serial\n";
-	SHOW_STATIC_TEXT(kT);
-}
-
-static inline void
-showTimerHeader(void) {
-	static const wchar_t kT[] =
-		L"    Cond:Current/Mask(Hex)/Default ...\n";
-	SHOW_STATIC_TEXT(kT);
-}
-
-static inline void
-showHeaderSplitter(void) {
-	static const wchar_t kT[] =
-		L"--------------------------------------------------------------\n";
-	SHOW_STATIC_TEXT(kT);
-}
-
-static void
-showHeader(bool hasTimer) {
-	showCommonHeader();
-	if (hasTimer) showTimerHeader();
-	showHeaderSplitter();
-}
-
-static inline void
-showInfo(const UnitInfo* p) {
-	const wchar_t* ff = getFormFactorText(p->formFactor);
-	const wchar_t* rpm = getRpmText(p->rpm);
-	wchar_t bs[5];
-	cap_getShortText(p->blockSize, bs);
-	const wchar_t* cap = cap_getShortText(p->blockCount * p->blockSize, NULL);
-	wprintf(
-		L"%-4ls %-5ls %-4ls %-4ls %-8ls %-16ls %-4ls %ls\n",
-		ff, rpm, cap, bs, p->vendor, p->product, p->revision, p->serial
-	);
-}
-
-// Return pointer to inner static buffer
-//static const wchar_t*
-//getTimerMaskText(BYTE powcon) {
-//	static wchar_t t[unit_kPowerConditionCount + 1];
-//	static const wchar_t kT[] = L"ABCYZ";
-//	for (int i = 0; i < unit_kPowerConditionCount; ++i) {
-//		t[i] = powcon & (1 << i) ? kT[i] : L'-';
-//	}
-//	t[unit_kPowerConditionCount] = L'\0';
-//	return t;
-//}
-
-static void
-showTimers(const UnitInfo* p) {
-	static const wchar_t kT[] = L"ABCYZ";
-	for (int i = 0; i < unit_kPowerConditionCount; ++i) {
-		if (!(p->timerMask & 1 << i)) continue;
-		wprintf(
-			L"%lc:%u/%X/%u",
-			kT[i], p->timers[i] / 10, p->timersModMask[i], p->timersDefault[i] / 10
-		);
-	}
-}
-
-static void
-showDiskTimers(HANDLE h, UnitInfo* p) {
-	unit_getTimers(h, p);
-	indent();
-	if (p->timerMask) {
-		showTimers(p);
-	}
-	else {
-		wprintf(L"-");
-	}
-	newline();
-}
-
-static inline void
-showVolumeName(const VolumeInfo* vi) {
-	wprintf(L"%ls", vi->name);
-}
-
-// Show the first mount point
-static inline void
-showMountPoint(const VolumeInfo* vi) {
-	if (vi->mountPoints) wprintf(L" \"%ls\"", vi->mountPoints);
-}
-
-static inline void
-showVolumeDisks(const VolumeInfo* vi) {
-	if (!vi->diskCount) return;
-
-	wprintf(L"%ls", L" Disks[");
-	wprintf(L"%lu", vi->disks[0]);
-	for (UINT32 i = 1; i < vi->diskCount; ++i) {
-		wprintf(L" %u", vi->disks[i]);
-	}
-	wprintf(L"%ls", L"]");
-}
-
-static void
-showSpannedVolume(const VolumeInfo* vi) {
-	static const WORD kAttr = FOREGROUND_RED | FOREGROUND_GREEN;
-	HANDLE h = GetStdHandle(STD_OUTPUT_HANDLE);
-	CONSOLE_SCREEN_BUFFER_INFO info;
-	GetConsoleScreenBufferInfo(h, &info);
-	SetConsoleTextAttribute(h, kAttr);
-	
-	showVolumeName(vi);
-	SetConsoleTextAttribute(h, info.wAttributes);
-
-	showMountPoint(vi);
-	showVolumeDisks(vi);
-}
-
-static void
-showSimpleVolume(const VolumeInfo* vi) {
-	showVolumeName(vi);
-	showMountPoint(vi);
-}
-
-static void
-showVolumeInfo(const DiskInfo* di) {
-	for (UINT32 i = 0; i < di->volumeCount; ++i) {
-		const VolumeInfo* vi = di->volumes[i];
-
-		volIndent();
-		if (vi->diskCount > 1) {
-			showSpannedVolume(vi);
-		}
-		else {
-			showSimpleVolume(vi);
-		}
-		newline();
-	}
-}
-
-static bool
-showDiskInfo(DiskInfo* di, void* ex) {
-	wprintf(L"%2u: ", di->id);
-
-	UnitInfo d;
-	if (unit_getInfo(di->handle, &d)) {
-		showInfo(&d);
-		if (ex) showDiskTimers(di->handle, &d);
-		showVolumeInfo(di);
-	}
-	else {
-		wprintf(kTextNoInfo);
-	}
-	return true;
-}
-
-static bool
-stopDisk(DiskInfo* di, void* ex) {
-	static const wchar_t* kInUse = L"Disk in use.";
-
-	showDiskInfo(di, 0);
-	indent();
-	wprintf(L"Stopping... ");
-
-	if (!dsk_eject(di)) {
-		wprintf(kTextFailed);
-		indent();
-		showError(kInUse);
-		return false;
-	}
-
-	if (!unit_stop(di->handle)) {
-		wprintf(kTextFailed);
-		return false;
-	}
-
-	wprintf(kTextDone);
-	return true;
-}
-
-static bool
-writeTimers(DiskInfo* di, void* ex) {
-	showDiskInfo(di, 0);
-
-	const Cmd* cmd = (const Cmd*)ex;
-	indent();
-	wprintf(L"Writing timers... ");
-	const wchar_t* errmsg;
-	bool ok = unit_setTimers(di->handle, cmd->timerMask, cmd->timers, &errmsg);
-	if (!ok) {
-		wprintf(kTextFailed);
-		indent();
-		showError(errmsg);
-		return false;
-	}
-
-	wprintf(L"Done. Check with \"SDP W %u\"\n", di->id);
-	return true;
-}
-
-typedef bool (*DiskHandler)(DiskInfo*, void*);
-
-static bool
-forEachDiskDo(DiskSet* ds, DiskHandler func, void* ex) {
-	for (UINT32 i = 0; i < ds->count; ++i) {
-		bool ok = func(ds->items[i], ex);
-		newline();
-		if (!ok) return false;
-	}
-	return true;
-}
-
-static wchar_t*
-manuDosDevices(void) {
-	DWORD cch = 20480; // Initial buffer size. will be doubled each time if seen not enough.
-	wchar_t* p = heap_alloc(0, sizeof(*p) * cch);
-	if (!p) return NULL;
-	DWORD rcch = QueryDosDevice(NULL, p, cch);
-	if (rcch) return p;
-
-	while (GetLastError() == ERROR_INSUFFICIENT_BUFFER) {
-		cch += cch;
-		heap_free(0, p);
-		p = heap_alloc(0, sizeof(*p) * cch);
-		if (!p) return NULL;
-		rcch = QueryDosDevice(NULL, p, cch);
-		if (rcch) return p;
-	}
-
-	heap_free(0, p);
-	return NULL;
-}
-
-static DiskSet*
-createDiskSet(const Cmd* cmd, const wchar_t** errmsg) {
-	static const wchar_t* kLowMem = L"Low memory to get device list.";
-
-	wchar_t* dosDevices = manuDosDevices();
-	if (!dosDevices) {
-		*errmsg = kLowMem;
-		return NULL;
-	}
-	DiskSet* ds = dskset_create(cmd->diskCount ? cmd->diskIds : NULL, cmd->diskCount, dosDevices, errmsg);
-	heap_free(0, dosDevices);
-	return ds;
-}
-
-enum {
-	kExitSuccess,
-	kExitFail,
-	kExitCmd,
-	kExitPrivilege,
-	kExitDiskSet,
-};
-
-int wmain(int argc, wchar_t** argv)
-{
-	warn();
-	showTitle();
-
-	const wchar_t* errmsg = NULL;
-	Cmd* cmd = cmd_parse(argc, argv, &errmsg);
-	if (!cmd) {
-		showError(errmsg);
-		return kExitCmd;
-	}
-
-	bool isElevated = uac_isElevated();
-	switch (cmd->intent) {
-	case cmd_kHelp:
-		help();
-		if (!isElevated) showPrivilegeTip();
-		return kExitSuccess;
-	case cmd_kTimerHelp:
-		timerHelp();
-		if (!isElevated) showPrivilegeTip();
-		return kExitSuccess;
-	}
-
-	if (!isElevated) {
-		showPrivilegeError();
-		return kExitPrivilege;
-	}
-
-	DiskSet* ds = createDiskSet(cmd, &errmsg);
-	if (!ds) {
-		showError(errmsg);
-		return kExitDiskSet;
-	}
-
-	int ret = kExitSuccess;
-	bool hasTimer = false;
-
-	switch (cmd->intent) {
-	case cmd_kTimerList:
-		hasTimer = true;
-		// fall through
-	case cmd_kList:
-		showHeader(hasTimer);
-		forEachDiskDo(ds, showDiskInfo, (void*)hasTimer);
-		break;
-	case cmd_kStop:
-		showHeader(false);
-		if (!forEachDiskDo(ds, stopDisk, 0)) ret = kExitFail;
-		break;
-	case cmd_kTimerWrite:
-		showHeader(false);
-		if (!forEachDiskDo(ds, writeTimers, cmd)) ret = kExitFail;
-		break;
-	}
-
-	dskset_destroy(ds);
-	return ret;
-}
+#include <sdkddkver.h>
+#include <Windows.h>
+#include <strsafe.h>
+
+#include <stdbool.h>
+
+#include "cmd.h"
+#include "batch.h"
+#include "../common/uac.h"
+#include "../common/unit.h"
+#include "../common/cap.h"
+#include "../common/disk.h"
+#include "../common/devlist.h"
+#include "../common/heap.h"
+#include "../common/task.h"
+#include "../common/quirk.h"
+#include "../common/inventory.h"
+#include "../common/monitor.h"
+#include "../common/governor.h"
+#include "../common/spin.h"
+#include "../common/hotplug.h"
+#include "../common/emit.h"
+#include "../common/report.h"
+#include "../common/simdisk.h"
+#include "../common/stats.h"
+#include "../common/trace.h"
+#include "../common/transport.h"
+
+
+#define MYVER  L"1.10"
+#define MYNAME L"SDP SCSI Disk Power"
+#define MYLIC  L"MIT License"
+#define MYTITLE MYNAME L" " MYVER L"          " MYLIC L"\n\n"
+
+#define SHOW_STATIC_TEXT(x) WriteConsole(GetStdHandle(STD_OUTPUT_HANDLE), x, _countof(x) - 1, &(DWORD){0}, NULL)
+
+
+static const wchar_t kTextDone[] = L"Done\n";
+static const wchar_t kTextFailed[] = L"Failed\n";
+static const wchar_t kTextNoInfo[] = L"No Info\n";
+static const wchar_t kTextTimedOut[] = L"Timed out\n";
+static const wchar_t kQuirkFileName[] = L"quirks.dat";
+static const wchar_t kInventoryFileName[] = L"inventory.dat";
+
+
+static inline void
+indent(void) {
+	WriteConsole(GetStdHandle(STD_OUTPUT_HANDLE), L"    ", 4, &(DWORD){0}, NULL);
+}
+
+static inline void
+newline(void) {
+	WriteConsole(GetStdHandle(STD_OUTPUT_HANDLE), L"\n", 1, &(DWORD){0}, NULL);
+}
+
+static inline WORD
+swapColor(WORD attr) {
+	WORD rlt = attr & 0xFF00;
+	rlt |= (attr & 0x0F) << 4;
+	rlt |= (attr & 0xF0) >> 4;
+	return rlt;
+}
+
+static inline void
+invertStderrColor(void) {
+	HANDLE h = GetStdHandle(STD_ERROR_HANDLE);
+	CONSOLE_SCREEN_BUFFER_INFO info;
+	GetConsoleScreenBufferInfo(h, &info);
+	WORD attr = swapColor(info.wAttributes);
+	SetConsoleTextAttribute(h, attr);
+}
+
+static void
+showError(const wchar_t* msg) {
+	if (!msg) msg = L"Unknown error.";
+
+	invertStderrColor();
+	fwprintf(stderr, L"%ls", msg);
+	invertStderrColor();
+}
+
+static inline void
+showAttrText(const wchar_t* t, DWORD cch, WORD attr) {
+	HANDLE h = GetStdHandle(STD_OUTPUT_HANDLE);
+	CONSOLE_SCREEN_BUFFER_INFO info;
+	GetConsoleScreenBufferInfo(h, &info);
+	SetConsoleTextAttribute(h, attr);
+	WriteConsoleW(h, t, cch, &(DWORD){0}, NULL);
+	SetConsoleTextAttribute(h, info.wAttributes);
+	newline();
+}
+
+static inline void
+warn(void) {
+	static const wchar_t t[] = L"CAUTION: Improper usage may cause MAJOR DAMAGE to DATA/DEVICES!";
+	static const WORD attr = BACKGROUND_RED | FOREGROUND_BLUE | FOREGROUND_GREEN | FOREGROUND_RED | FOREGROUND_INTENSITY;
+	showAttrText(t, _countof(t) - 1, attr);
+}
+
+static inline void
+showTitle(void) {
+	static const wchar_t t[] = MYTITLE;
+	SHOW_STATIC_TEXT(t);
+}
+
+static void
+help(void) {
+	static const wchar_t t[] =
+		L"SDP [command] [diskNum] [diskNum] ...\n"
+		L"Only one command is allowed, - or / is optional\n"
+		L"Command is case-insensitive. Command and drive numbers can be input in any order\n"
+		L"Commands:\n"
+		L"  L: List, can be omitted if specified diskNum\n"
+		L"  P: Stop\n"
+		L"  S: Show power state, without waking disks up\n"
+		L"  M: Monitor power state until Ctrl+C, then show time spent in each state\n"
+		L"  G: Stop disks idle for a while, until Ctrl+C. For disks without timers\n"
+		L"  U: Start disks, a few at a time, and bring their volumes online\n"
+		L"  W: Write power condition timer. Use \"SDP W\" for more help\n"
+		L"Options:\n"
+		L"  --jobs=N: Query at most N disks at the same time, 1 to 64. Default is 8\n"
+		L"  --allpages: Read all mode pages at once for timers, saves commands on timer writes\n"
+		L"  --refresh: Query disks for L instead of listing from saved inventory\n"
+		L"  --interval=N: Poll every N seconds for M and G, 1 to 86400. Default is 60\n"
+		L"  --jitter=P: Randomize each interval by up to P percent for M and G, 0 to 50. Default is 10\n"
+		L"  --idle=N: Stop disks without I/O for N seconds for G, 1 to 86400. Default is 1800\n"
+		L"  --mingap=N: Stop a disk at most once in N seconds for G, 1 to 86400. Default is 3600\n"
+		L"  --wait=N: Wait at most N seconds for disks to stop or start for P and U, 1 to 86400. Default is 120\n"
+		L"  --lockwait=N: Wait at most N seconds for files on each volume to be closed before P gives up on its disk, 1 to 86400. Default is 10\n"
+		L"  --spinup=N: Spin up at most N disks at the same time for U, 1 to 64. Default is 1. A disk not ready in time holds its place up to 60 seconds more\n"
+		L"  --simulate=N: Run on N simulated disks instead of real ones, 1 to 1024. No privilege needed\n"
+		L"  --simhang=N: With --simulate, make every Nth simulated disk hang, so its commands time out. 1 to 1024\n"
+		L"  --stats: Show time, commands and heap use of enumeration and the command, tab-separated\n"
+		L"  --trace=FILE: Save recent SCSI commands and enumeration phases to FILE for chrome://tracing or Perfetto\n"
+		L"  --format=F: List disks for L and WL as text, json (one object per line) or csv. Default is text\n"
+		L"  --batch=FILE: Run operations listed in FILE, or stdin if -, on disks opened once. One per line, like \"WL 3 5\" or \"P 3 --wait=60\". Only L, WL, W and P\n"
+		L"  --hotplug: Follow disks arriving and leaving for M and G, without reopening the others. Not with --simulate\n"
+		L"  --deadline=N: Finish in N seconds, 1 to 86400. Commands still running are cancelled, and their disks shown as timed out\n"
+		L"Examples:\n"
+		L"  List all drives: SDP L\n"
+		L"  List drive0 and drive2: SDP L 0 2\n"
+		L"  Stop drive2 and drive3: SDP P 2 3\n"
+		L"  Show power state of all drives: SDP S\n"
+		L"  Monitor drive1 every 5 minutes: SDP M 1 --interval=300\n"
+		L"  Stop drive4 after 20 minutes without I/O: SDP G 4 --idle=1200\n"
+		L"  Start drive2 to drive5, two at a time: SDP U 2 3 4 5 --spinup=2\n"
+		L"  Try monitoring a fleet of 200 disks: SDP M --simulate=200 --interval=5\n"
+		L"  Trace a slow stop: SDP P 3 --trace=stop.json\n"
+		L"  Monitor all disks, including ones plugged in later: SDP M --hotplug\n"
+		L"  Run a job on one shelf, opening its disks once: SDP 3 4 5 --batch=job.txt\n"
+		L"  Feed disk info to other tools: SDP WL --format=json > disks.ndjson\n"
+		L"  Give up on hung disks after a minute: SDP L --refresh --deadline=60\n"
+		L"  Measure listing 1000 disks: SDP L --simulate=1000 --stats\n"
+		L"  See a run survive hung disks: SDP L --simulate=20 --simhang=7 --deadline=30\n";
+	SHOW_STATIC_TEXT(t);
+}
+
+static void
+timerHelp() {
+	static const wchar_t t[] =
+		L"SDP WL [diskNum] [diskNum] ...\n"
+		L"  List power condition timers\n"
+		L"  L can be omitted if specified diskNum\n"
+		L"SDP W[I|A#][B#][C#][Y#][S|Z#] [diskNum] [diskNum] ...\n"
+		L"  Write power condition timers as # seconds\n"
+		L"Example:\n"
+		L"  Set drive5 Standby_Z timer to 7200 seconds: SDP 5 WZ7200\n"
+		L"  Set drive3 Idle_A to 1800 and Standby_Z to 3600: SDP 3 Wa1800z3600\n"
+		L"Power Consumption: Idle_A >= Idle_B >= Idle_C > Standby_Y >= Standby_Z\n"
+		L"Caution:\n"
+		L"  Avoid setting timers to excessively low values, because\n"
+		L"  short spin down/up and head unload/load cycles\n"
+		L"  can harm your hard drives!\n";
+	SHOW_STATIC_TEXT(t);
+}
+
+static inline void
+showPrivilegeTip(void) {
+	static const wchar_t* t = L"TIP: Run as Administrator to do actual work.";
+	showError(t);
+}
+
+static inline void
+showPrivilegeError(void) {
+	static const wchar_t* t = L"Please run as administrator.";
+	showError(t);
+}
+
+// Return pointer to inner static buffer
+static const wchar_t*
+getFormFactorText(enum UnitFormFactor f) {
+	static const wchar_t* kText[] = {
+		L"n/a",
+		L"5.25",
+		L"3.5",
+		L"2.5",
+		L"1.8",
+		L"1.8-",
+		L"oth",
+	};
+	return f < unit_kFormFactorOther ? kText[f] : kText[unit_kFormFactorOther];
+}
+
+enum {
+	kCchRpmText = 8,
+};
+
+// Result stored in t[]. Return t
+static const wchar_t*
+getRpmText(WORD rpm, wchar_t t[kCchRpmText]) {
+	if (rpm == 1) {
+		StringCchCopy(t, kCchRpmText, L"SSD");
+	}
+	else if (rpm >= 0x401 && rpm <= 0xFFFE) {
+		StringCchPrintf(t, kCchRpmText, L"%hu", rpm);
+	}
+	else {
+		StringCchCopy(t, kCchRpmText, L"n/a");
+	}
+	return t;
+}
+
+static inline void
+showCommonHeader(void) {
+	static const wchar_t kT[] =
+		L"ID: FF   RPM   CAP  BS   Vendor   Product          Rev  Serial\n";
+	SHOW_STATIC_TEXT(kT);
+}
+
+static inline void
+showTimerHeader(void) {
+	static const wchar_t kT[] =
+		L"    Cond:Current/Mask(Hex)/Default ...\n";
+	SHOW_STATIC_TEXT(kT);
+}
+
+static inline void
+showHeaderSplitter(void) {
+	static const wchar_t kT[] =
+		L"--------------------------------------------------------------\n";
+	SHOW_STATIC_TEXT(kT);
+}
+
+static void
+showHeader(bool hasTimer) {
+	showCommonHeader();
+	if (hasTimer) showTimerHeader();
+	showHeaderSplitter();
+}
+
+static inline void
+putInfo(Emitter* o, const UnitInfo* p) {
+	const wchar_t* ff = getFormFactorText(p->formFactor);
+	wchar_t rpm[kCchRpmText];
+	getRpmText(p->rpm, rpm);
+	wchar_t bs[5];
+	cap_getShortText(p->blockSize, bs);
+	wchar_t cap[5];
+	cap_getShortText(p->blockCount * p->blockSize, cap);
+	emit_printf(o,
+		L"%-4ls %-5ls %-4ls %-4ls %-8ls %-16ls %-4ls %ls\n",
+		ff, rpm, cap, bs, p->vendor, p->product, p->revision, p->serial
+	);
+}
+
+// Return pointer to inner static buffer
+//static const wchar_t*
+//getTimerMaskText(BYTE powcon) {
+//	static wchar_t t[unit_kPowerConditionCount + 1];
+//	static const wchar_t kT[] = L"ABCYZ";
+//	for (int i = 0; i < unit_kPowerConditionCount; ++i) {
+//		t[i] = powcon & (1 << i) ? kT[i] : L'-';
+//	}
+//	t[unit_kPowerConditionCount] = L'\0';
+//	return t;
+//}
+
+static void
+putTimers(Emitter* o, const UnitInfo* p) {
+	static const wchar_t kT[] = L"ABCYZ";
+	for (int i = 0; i < unit_kPowerConditionCount; ++i) {
+		if (!(p->timerMask & 1 << i)) continue;
+		emit_printf(o,
+			L"%lc:%u/%X/%u",
+			kT[i], p->timers[i] / 10, p->timersModMask[i], p->timersDefault[i] / 10
+		);
+	}
+}
+
+static void
+putDiskTimers(Emitter* o, const UnitInfo* p) {
+	EMIT_STATIC_TEXT(o, L"    ");
+	if (p->timerMask) {
+		putTimers(o, p);
+	}
+	else {
+		EMIT_STATIC_TEXT(o, L"-");
+	}
+	EMIT_STATIC_TEXT(o, L"\n");
+}
+
+static inline void
+putVolumeName(Emitter* o, const VolumeInfo* vi) {
+	emit_text(o, vi->name, wcslen(vi->name));
+}
+
+// Put the first mount point
+static inline void
+putMountPoint(Emitter* o, VolumeInfo* vi) {
+	const wchar_t* mountPoints = vol_getMountPoints(vi);
+	if (!mountPoints) return;
+
+	EMIT_STATIC_TEXT(o, L" \"");
+	emit_text(o, mountPoints, wcslen(mountPoints));
+	EMIT_STATIC_TEXT(o, L"\"");
+}
+
+static inline void
+putVolumeDisks(Emitter* o, const VolumeInfo* vi) {
+	if (!vi->diskCount) return;
+
+	EMIT_STATIC_TEXT(o, L" Disks[");
+	emit_printf(o, L"%lu", vi->disks[0]);
+	for (UINT32 i = 1; i < vi->diskCount; ++i) {
+		emit_printf(o, L" %u", vi->disks[i]);
+	}
+	EMIT_STATIC_TEXT(o, L"]");
+}
+
+// The colored name is written on its own, since console attributes can't be buffered
+static void
+putSpannedVolume(Emitter* o, VolumeInfo* vi) {
+	static const WORD kAttr = FOREGROUND_RED | FOREGROUND_GREEN;
+	const WORD attr = emit_setAttr(o, kAttr);
+	putVolumeName(o, vi);
+	emit_setAttr(o, attr);
+
+	putMountPoint(o, vi);
+	putVolumeDisks(o, vi);
+}
+
+static void
+putSimpleVolume(Emitter* o, VolumeInfo* vi) {
+	putVolumeName(o, vi);
+	putMountPoint(o, vi);
+}
+
+static void
+putVolumeInfo(Emitter* o, const DiskInfo* di) {
+	for (UINT32 i = 0; i < di->volumeCount; ++i) {
+		VolumeInfo* vi = di->volumes[i];
+
+		EMIT_STATIC_TEXT(o, L"         ");
+		if (vi->diskCount > 1) {
+			putSpannedVolume(o, vi);
+		}
+		else {
+			putSimpleVolume(o, vi);
+		}
+		EMIT_STATIC_TEXT(o, L"\n");
+	}
+}
+
+static void
+queryDisk(InventoryItem* q, bool hasTimer, bool allPages) {
+	SetLastError(ERROR_SUCCESS);
+	q->hasInfo = unit_getInfo(q->disk->handle, &q->info);
+	q->timedOut = !q->hasInfo && tp_isTimeout(GetLastError());
+	if (!q->hasInfo || !hasTimer) return;
+
+	if (allPages) {
+		UnitModePages pages;
+		unit_getTimers(q->disk->handle, &q->info, &pages);
+	}
+	else {
+		unit_getTimers(q->disk->handle, &q->info, NULL);
+	}
+}
+
+static void
+putDiskQuery(Emitter* o, const InventoryItem* q, bool hasTimer) {
+	emit_printf(o, L"%2u: ", q->disk->id);
+
+	if (q->hasInfo) {
+		putInfo(o, &q->info);
+		if (hasTimer) putDiskTimers(o, &q->info);
+		putVolumeInfo(o, q->disk);
+	}
+	else if (q->timedOut) {
+		EMIT_STATIC_TEXT(o, kTextTimedOut);
+	}
+	else {
+		EMIT_STATIC_TEXT(o, kTextNoInfo);
+	}
+}
+
+// Put q in format. In text, each disk is followed by a blank line.
+static void
+putDiskItem(Emitter* o, const InventoryItem* q, bool hasTimer, enum OutputFormat format) {
+	switch (format) {
+	case cmd_kFormatJson:
+		report_putJson(o, q, hasTimer);
+		break;
+	case cmd_kFormatCsv:
+		report_putCsv(o, q, hasTimer);
+		break;
+	default:
+		putDiskQuery(o, q, hasTimer);
+		EMIT_STATIC_TEXT(o, L"\n");
+		break;
+	}
+}
+
+// Start a listing on stdout. Text header is shown by showHeader.
+static void
+beginListing(Emitter* o, bool hasTimer, enum OutputFormat format) {
+	emit_init(o, GetStdHandle(STD_OUTPUT_HANDLE));
+	if (format == cmd_kFormatCsv) report_putCsvHeader(o, hasTimer);
+}
+
+static void
+endListing(Emitter* o) {
+	emit_flush(o);
+	emit_destroy(o);
+}
+
+static void
+showDiskQuery(const InventoryItem* q, bool hasTimer) {
+	Emitter o;
+	emit_init(&o, GetStdHandle(STD_OUTPUT_HANDLE));
+	putDiskQuery(&o, q, hasTimer);
+	endListing(&o);
+}
+
+static bool
+showDiskInfo(DiskInfo* di, void* ex) {
+	InventoryItem q = { .disk = di };
+	queryDisk(&q, (bool)ex, false);
+	showDiskQuery(&q, (bool)ex);
+	return true;
+}
+
+static bool
+writeTimers(DiskInfo* di, void* ex) {
+	InventoryItem q = { .disk = di };
+	queryDisk(&q, false, false);
+	showDiskQuery(&q, false);
+
+	const Cmd* cmd = (const Cmd*)ex;
+	indent();
+	wprintf(L"Writing timers... ");
+	const wchar_t* errmsg;
+	UnitModePages pages;
+	bool ok = unit_setTimers(di->handle, &q.info, cmd->allPages ? &pages : NULL, cmd->timerMask, cmd->timers, &errmsg);
+	if (!ok) {
+		wprintf(kTextFailed);
+		indent();
+		showError(errmsg);
+		return false;
+	}
+
+	wprintf(L"Done. Check with \"SDP W %u\"\n", di->id);
+	return true;
+}
+
+typedef bool (*DiskHandler)(DiskInfo*, void*);
+
+static bool
+forEachDiskDo(DiskSet* ds, DiskHandler func, void* ex) {
+	for (UINT32 i = 0; i < ds->count; ++i) {
+		bool ok = func(ds->items[i], ex);
+		newline();
+		if (!ok) return false;
+	}
+	return true;
+}
+
+enum {
+	kDefaultJobs = 8,
+};
+
+typedef struct ListJob {
+	InventoryItem* items;
+	bool hasTimer;
+	bool allPages;
+}ListJob;
+
+static void
+queryDiskTask(size_t index, void* ex) {
+	ListJob* job = (ListJob*)ex;
+	queryDisk(&job->items[index], job->hasTimer, job->allPages);
+}
+
+// Query disks concurrently with at most jobs workers, then show them in the order of the set.
+// The whole listing is assembled first, and written at once.
+// Return: Queried items to be freed by caller, items[i] is of ds->items[i].
+//         NULL if low memory, in which case disks are queried and shown one by one.
+static InventoryItem*
+listDisks(DiskSet* ds, bool hasTimer, const Cmd* cmd, enum OutputFormat format) {
+	const UINT32 jobs = cmd->jobs ? cmd->jobs : kDefaultJobs;
+	Emitter o;
+	beginListing(&o, hasTimer, format);
+	InventoryItem* items = heap_alloc(0, sizeof(*items) * ds->count);
+	if (!items) {
+		for (UINT32 i = 0; i < ds->count; ++i) {
+			InventoryItem q = { .disk = ds->items[i] };
+			queryDisk(&q, hasTimer, cmd->allPages);
+			putDiskItem(&o, &q, hasTimer, format);
+			emit_flush(&o);
+		}
+		endListing(&o);
+		return NULL;
+	}
+
+	for (UINT32 i = 0; i < ds->count; ++i) {
+		items[i].disk = ds->items[i];
+	}
+	ListJob job = {
+		.items = items,
+		.hasTimer = hasTimer,
+		.allPages = cmd->allPages,
+	};
+	task_run(ds->count, jobs, queryDiskTask, &job);
+
+	for (UINT32 i = 0; i < ds->count; ++i) {
+		putDiskItem(&o, &items[i], hasTimer, format);
+	}
+	endListing(&o);
+	return items;
+}
+
+enum {
+	kDefaultWait = 120,
+	kDefaultLockWait = 10,
+	kDefaultSpinUp = 1,
+	kSpinFirstDelay = 500,
+	kSpinMaxDelay = 5000,
+	kSpinHoldGrace = 60, // Seconds a start that timed out may still hold its --spinup slot
+};
+
+// jobs[i] is of ds->items[i]
+static void
+showSpinResults(const DiskSet* ds, const SpinJob* jobs, const wchar_t* skipped) {
+	SHOW_STATIC_TEXT(L"Results:\n");
+	for (UINT32 i = 0; i < ds->count; ++i) {
+		const SpinJob* job = &jobs[i];
+		indent();
+		wprintf(L"%2u: ", ds->items[i]->id);
+		switch (job->result) {
+		case spin_kDone:
+			wprintf(L"Done in %u.%u seconds\n", job->elapsed / 1000, job->elapsed % 1000 / 100);
+			break;
+		case spin_kTimedOut:
+			wprintf(L"Not there after %u seconds\n", job->elapsed / 1000);
+			break;
+		case spin_kSkipped:
+			wprintf(L"Failed. %ls\n", skipped);
+			break;
+		default:
+			wprintf(kTextFailed);
+			break;
+		}
+	}
+}
+
+static inline void
+getSpinPolicy(SpinPolicy* policy, const Cmd* cmd) {
+	policy->firstDelay = kSpinFirstDelay;
+	policy->maxDelay = kSpinMaxDelay;
+	policy->timeout = (cmd->wait ? cmd->wait : kDefaultWait) * 1000;
+	policy->maxActive = 0;
+	policy->holdLimit = policy->timeout + kSpinHoldGrace * 1000;
+}
+
+// Eject volumes of all disks at once, each spanned volume only once.
+// Then send STOP with IMMED to the disks whose volumes are all locked, and poll until each is stopped.
+// A failed disk doesn't stop the others.
+// Return: true if all disks are stopped
+static bool
+stopDisks(DiskSet* ds, const Cmd* cmd) {
+	static const wchar_t* kLowMem = L"Low memory to stop disks.";
+	static const wchar_t* kInUse = L"Disk in use.";
+
+	InventoryItem* items = listDisks(ds, false, cmd, cmd_kFormatText);
+	if (items) heap_free(0, items);
+
+	SpinJob* jobs = heap_alloc(HEAP_ZERO_MEMORY, sizeof(*jobs) * ds->count);
+	bool* ejected = heap_alloc(0, sizeof(*ejected) * ds->count);
+	const UINT32 workers = cmd->jobs ? cmd->jobs : kDefaultJobs;
+	const DWORD lockWait = (cmd->lockWait ? cmd->lockWait : kDefaultLockWait) * 1000;
+	if (!jobs || !ejected || !dskset_eject(ds, workers, lockWait, ejected)) {
+		if (jobs) heap_free(0, jobs);
+		if (ejected) heap_free(0, ejected);
+		showError(kLowMem);
+		return false;
+	}
+
+	for (UINT32 i = 0; i < ds->count; ++i) {
+		jobs[i].handle = ds->items[i]->handle;
+		jobs[i].result = ejected[i] ? spin_kPending : spin_kSkipped;
+	}
+	heap_free(0, ejected);
+	SHOW_STATIC_TEXT(L"Stopping...\n");
+	SpinPolicy policy;
+	getSpinPolicy(&policy, cmd);
+	spin_run(jobs, ds->count, spin_kStop, &policy);
+
+	showSpinResults(ds, jobs, kInUse);
+	bool ok = true;
+	for (UINT32 i = 0; i < ds->count; ++i) {
+		if (jobs[i].result != spin_kDone) ok = false;
+	}
+	heap_free(0, jobs);
+	return ok;
+}
+
+// Spin up at most spinUp disks at the same time to limit inrush current.
+// The next disk is started as soon as one is ready.
+// Return: true if all disks are ready
+static bool
+startDisks(DiskSet* ds, const Cmd* cmd) {
+	static const wchar_t* kLowMem = L"Low memory to start disks.";
+
+	SpinJob* jobs = heap_alloc(HEAP_ZERO_MEMORY, sizeof(*jobs) * ds->count);
+	if (!jobs) {
+		showError(kLowMem);
+		return false;
+	}
+	for (UINT32 i = 0; i < ds->count; ++i) {
+		jobs[i].handle = ds->items[i]->handle;
+		jobs[i].result = spin_kPending;
+	}
+
+	SpinPolicy policy;
+	getSpinPolicy(&policy, cmd);
+	policy.maxActive = cmd->spinUp ? cmd->spinUp : kDefaultSpinUp;
+	wprintf(L"Starting %u disks, %u at a time...\n", ds->count, policy.maxActive);
+	const UINT64 begin = GetTickCount64();
+	spin_run(jobs, ds->count, spin_kStart, &policy);
+	const DWORD total = (DWORD)(GetTickCount64() - begin);
+
+	showSpinResults(ds, jobs, NULL);
+	bool ok = true;
+	for (UINT32 i = 0; i < ds->count; ++i) {
+		if (jobs[i].result != spin_kDone) {
+			ok = false;
+			continue;
+		}
+		dsk_online(ds->items[i]);
+	}
+	wprintf(L"Total %u.%u seconds\n", total / 1000, total % 1000 / 100);
+	heap_free(0, jobs);
+	return ok;
+}
+
+static inline void
+showInventoryTip(void) {
+	static const wchar_t kT[] = L"TIP: Listed from saved inventory without touching disks. Use --refresh to query disks.\n";
+	SHOW_STATIC_TEXT(kT);
+}
+
+static void
+showInventory(const Inventory* inv, enum OutputFormat format) {
+	Emitter o;
+	beginListing(&o, false, format);
+	for (UINT32 i = 0; i < inv->count; ++i) {
+		putDiskItem(&o, &inv->items[i], false, format);
+	}
+	endListing(&o);
+	if (format == cmd_kFormatText) showInventoryTip();
+}
+
+// Return pointer to inner static buffer
+static const wchar_t*
+getPowerStateText(enum UnitPowerState s) {
+	static const wchar_t* kText[] = {
+		L"Unknown",
+		L"Active",
+		L"Idle_A",
+		L"Idle_B",
+		L"Idle_C",
+		L"Standby_Y",
+		L"Standby_Z",
+		L"Stopped",
+	};
+	return s < unit_kStateCount ? kText[s] : kText[unit_kStateUnknown];
+}
+
+typedef struct StateQuery {
+	DiskInfo* disk;
+	UnitQuirks;
+	enum UnitPowerState state;
+}StateQuery;
+
+static void
+queryStateTask(size_t index, void* ex) {
+	StateQuery* q = &((StateQuery*)ex)[index];
+	q->quirks = 0;
+	unit_getPowerState(q->disk->handle, (UnitQuirks*)&q->quirks, &q->state);
+}
+
+static inline void
+showStateQuery(const StateQuery* q) {
+	wprintf(L"%2u: %ls\n", q->disk->id, getPowerStateText(q->state));
+}
+
+// Only REQUEST SENSE and ATA CHECK POWER MODE are sent, so sleeping disks stay asleep.
+static void
+showDiskStates(DiskSet* ds, const Cmd* cmd) {
+	const UINT32 jobs = cmd->jobs ? cmd->jobs : kDefaultJobs;
+	StateQuery* queries = heap_alloc(0, sizeof(*queries) * ds->count);
+	if (!queries) {
+		for (UINT32 i = 0; i < ds->count; ++i) {
+			StateQuery q = { .disk = ds->items[i] };
+			queryStateTask(0, &q);
+			showStateQuery(&q);
+		}
+		return;
+	}
+
+	for (UINT32 i = 0; i < ds->count; ++i) {
+		queries[i].disk = ds->items[i];
+	}
+	task_run(ds->count, jobs, queryStateTask, queries);
+	for (UINT32 i = 0; i < ds->count; ++i) {
+		showStateQuery(&queries[i]);
+	}
+	heap_free(0, queries);
+}
+
+static inline void
+showStateHeader(void) {
+	static const wchar_t kT[] =
+		L"ID: State\n";
+	SHOW_STATIC_TEXT(kT);
+	showHeaderSplitter();
+}
+
+enum {
+	kDefaultInterval = 60,
+};
+
+static HANDLE gStopEvent;
+
+static BOOL WINAPI
+onConsoleCtrl(DWORD type) {
+	switch (type) {
+	case CTRL_C_EVENT:
+	case CTRL_BREAK_EVENT:
+	case CTRL_CLOSE_EVENT:
+		SetEvent(gStopEvent);
+		return TRUE;
+	}
+	return FALSE;
+}
+
+// Ctrl+C sets gStopEvent from now on. Return false if low memory.
+static bool
+beginStopEvent(void) {
+	gStopEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+	if (!gStopEvent) return false;
+	SetConsoleCtrlHandler(onConsoleCtrl, TRUE);
+	return true;
+}
+
+static void
+endStopEvent(void) {
+	SetConsoleCtrlHandler(onConsoleCtrl, FALSE);
+	CloseHandle(gStopEvent);
+	gStopEvent = NULL;
+}
+
+static inline void
+showTime(void) {
+	SYSTEMTIME t;
+	GetLocalTime(&t);
+	wprintf(L"%02u:%02u:%02u ", t.wHour, t.wMinute, t.wSecond);
+}
+
+typedef void (*HotplugHandler)(const HotplugEvent* e, void* ex);
+
+// Disk arrivals and removals to handle while waiting
+typedef struct Follow {
+	Hotplug* hotplug;
+	HotplugHandler func;
+	void* ex;
+}Follow;
+
+// Handle queued events in order
+static void
+handleHotplug(const Follow* f) {
+	HotplugEvent events[16];
+	UINT32 n;
+	while ((n = hp_take(f->hotplug, events, _countof(events)))) {
+		for (UINT32 i = 0; i < n; ++i) {
+			f->func(&events[i], f->ex);
+		}
+	}
+}
+
+// Wait for the next poll, handling disk arrivals and removals as they come.
+// f: NULL if not following
+// Return false if stopped by Ctrl+C
+static bool
+waitInterval(const Cmd* cmd, const Follow* f) {
+	const DWORD interval = cmd->interval ? cmd->interval : kDefaultInterval;
+	const UINT64 due = GetTickCount64() + mon_getDelay(interval, cmd->jitter);
+	const HANDLE handles[] = { gStopEvent, f ? f->hotplug->event : NULL };
+	for (;;) {
+		const UINT64 now = GetTickCount64();
+		if (now >= due) return true;
+		DWORD r = WaitForMultipleObjects(f ? 2 : 1, handles, FALSE, (DWORD)(due - now));
+		if (r != WAIT_OBJECT_0 + 1) return r == WAIT_TIMEOUT;
+		handleHotplug(f);
+	}
+}
+
+static bool
+isRequested(const Cmd* cmd, UINT32 id) {
+	if (!cmd->diskCount) return true;
+	for (UINT32 i = 0; i < cmd->diskCount; ++i) {
+		if (cmd->diskIds[i] == id) return true;
+	}
+	return false;
+}
+
+// Add an arrived disk to ds, query it once and show it. Other disks are not touched.
+// Return: the disk, or NULL if not asked for, already in ds, or failed to open
+static DiskInfo*
+addArrivedDisk(DiskSet* ds, UINT32 id, const Cmd* cmd) {
+	if (!isRequested(cmd, id)) return NULL;
+	DiskInfo* di = dskset_addDisk(ds, id);
+	if (!di) return NULL;
+
+	InventoryItem q = { .disk = di };
+	queryDisk(&q, false, false);
+	showTime();
+	wprintf(L"Arrived:\n");
+	showDiskQuery(&q, false);
+	return di;
+}
+
+static void
+removeLeftDisk(DiskSet* ds, DiskInfo* di) {
+	showTime();
+	wprintf(L"%2u: Removed\n", di->id);
+	dskset_removeDisk(ds, di->id);
+}
+
+// Return: NULL if not asked for, or not available with simulated disks
+static Hotplug*
+beginHotplug(const Cmd* cmd, bool* ok) {
+	*ok = true;
+	if (!cmd->hotplug || cmd->simulate) return NULL;
+
+	Hotplug* hp = hp_create(true);
+	if (!hp) {
+		showError(L"Failed to subscribe to disk arrivals.");
+		*ok = false;
+	}
+	return hp;
+}
+
+static void
+showMonitorStates(const Monitor* m, bool changedOnly) {
+	for (UINT32 i = 0; i < m->count; ++i) {
+		const MonitorDisk* d = &m->disks[i];
+		if (changedOnly && d->state == d->lastState) continue;
+
+		showTime();
+		wprintf(L"%2u: ", d->disk->id);
+		if (changedOnly) wprintf(L"%ls -> ", getPowerStateText(d->lastState));
+		wprintf(L"%ls\n", getPowerStateText(d->state));
+	}
+}
+
+static void
+showResidency(const Monitor* m) {
+	for (UINT32 i = 0; i < m->count; ++i) {
+		const MonitorDisk* d = &m->disks[i];
+		wprintf(L"%2u: ", d->disk->id);
+		for (int s = 0; s < unit_kStateCount; ++s) {
+			if (d->residency[s]) wprintf(L"%ls:%llus ", getPowerStateText(s), d->residency[s] / 1000);
+		}
+		wprintf(L"Transitions:%u\n", d->transitions);
+	}
+}
+
+typedef struct MonitorFollow {
+	DiskSet* ds;
+	Monitor* m;
+	const Cmd* cmd;
+}MonitorFollow;
+
+static void
+followMonitor(const HotplugEvent* e, void* ex) {
+	MonitorFollow* f = (MonitorFollow*)ex;
+	if (e->kind == hp_kArrival) {
+		DiskInfo* di = addArrivedDisk(f->ds, e->diskId, f->cmd);
+		if (!di) return;
+		Monitor* m = mon_addDisk(f->m, di);
+		if (m) {
+			f->m = m;
+		}
+		else {
+			dskset_removeDisk(f->ds, di->id);
+		}
+		return;
+	}
+
+	DiskInfo* di = dskset_find(f->ds, e->diskId);
+	if (!di) return;
+	mon_removeDisk(f->m, di);
+	removeLeftDisk(f->ds, di);
+}
+
+// Poll until Ctrl+C, showing state changes as they are seen. Devices are opened only once.
+static bool
+monitorDisks(DiskSet* ds, const Cmd* cmd) {
+	static const wchar_t* kLowMem = L"Low memory to monitor disks.";
+
+	bool ok;
+	Hotplug* hp = beginHotplug(cmd, &ok);
+	if (!ok) return false;
+	const UINT32 jobs = cmd->jobs ? cmd->jobs : kDefaultJobs;
+	MonitorFollow mf = {
+		.ds = ds,
+		.m = mon_create(ds),
+		.cmd = cmd,
+	};
+	if (!mf.m || !beginStopEvent()) {
+		mon_destroy(mf.m);
+		hp_destroy(hp);
+		showError(kLowMem);
+		return false;
+	}
+	const Follow follow = {
+		.hotplug = hp,
+		.func = followMonitor,
+		.ex = &mf,
+	};
+	wprintf(L"Polling every %u seconds. Press Ctrl+C to stop.\n", cmd->interval ? cmd->interval : kDefaultInterval);
+
+	mon_poll(mf.m, jobs);
+	showMonitorStates(mf.m, false);
+	while (waitInterval(cmd, hp ? &follow : NULL)) {
+		if (mon_poll(mf.m, jobs)) showMonitorStates(mf.m, true);
+	}
+
+	mon_settle(mf.m);
+	newline();
+	showResidency(mf.m);
+
+	endStopEvent();
+	hp_destroy(hp);
+	mon_destroy(mf.m);
+	return true;
+}
+
+enum {
+	kDefaultIdle = 1800,
+	kDefaultMinGap = 3600,
+};
+
+// Volumes are flushed but left online, unlike P. Next I/O spins the disk up again.
+static bool
+governorStop(DiskInfo* di, DWORD idleSeconds, void* ex) {
+	showTime();
+	wprintf(L"%2u: No I/O for %u seconds. Stopping... ", di->id, idleSeconds);
+	dsk_flush(di);
+	if (!unit_stop(di->handle, false)) {
+		wprintf(kTextFailed);
+		return false;
+	}
+	wprintf(kTextDone);
+	return true;
+}
+
+typedef struct GovernorFollow {
+	DiskSet* ds;
+	Governor* g;
+	const Cmd* cmd;
+}GovernorFollow;
+
+static void
+followGovernor(const HotplugEvent* e, void* ex) {
+	GovernorFollow* f = (GovernorFollow*)ex;
+	if (e->kind == hp_kArrival) {
+		DiskInfo* di = addArrivedDisk(f->ds, e->diskId, f->cmd);
+		if (!di) return;
+		Governor* g = gov_addDisk(f->g, di);
+		if (g) {
+			f->g = g;
+		}
+		else {
+			dskset_removeDisk(f->ds, di->id);
+		}
+		return;
+	}
+
+	DiskInfo* di = dskset_find(f->ds, e->diskId);
+	if (!di) return;
+	gov_removeDisk(f->g, di);
+	removeLeftDisk(f->ds, di);
+}
+
+// Stop disks after they've been idle for a while, until Ctrl+C.
+static bool
+governDisks(DiskSet* ds, const Cmd* cmd) {
+	static const wchar_t* kLowMem = L"Low memory to govern disks.";
+
+	bool ok;
+	Hotplug* hp = beginHotplug(cmd, &ok);
+	if (!ok) return false;
+	const DWORD idle = cmd->idle ? cmd->idle : kDefaultIdle;
+	GovernorFollow gf = {
+		.ds = ds,
+		.g = gov_create(ds, idle, cmd->minGap ? cmd->minGap : kDefaultMinGap),
+		.cmd = cmd,
+	};
+	if (!gf.g || !beginStopEvent()) {
+		gov_destroy(gf.g);
+		hp_destroy(hp);
+		showError(kLowMem);
+		return false;
+	}
+	const Follow follow = {
+		.hotplug = hp,
+		.func = followGovernor,
+		.ex = &gf,
+	};
+	wprintf(L"Stopping disks without I/O for %u seconds. Press Ctrl+C to stop.\n", idle);
+
+	do {
+		gov_tick(gf.g, GetTickCount64(), governorStop, NULL);
+	} while (waitInterval(cmd, hp ? &follow : NULL));
+
+	endStopEvent();
+	hp_destroy(hp);
+	gov_destroy(gf.g);
+	return true;
+}
+
+// Get path of a data file in "%ProgramData%\SDP". Create the directory if not exists.
+// Quirks change which commands are sent and inventory what L shows, so only Administrators may write them:
+// the directory is secured, and a file owned by anyone else is not used.
+static bool
+getDataFilePath(wchar_t* path, size_t cch, const wchar_t* name) {
+	wchar_t dir[MAX_PATH];
+	DWORD len = GetEnvironmentVariable(L"ProgramData", dir, ARRAYSIZE(dir));
+	if (!len || len >= ARRAYSIZE(dir)) return false;
+	HRESULT hr = StringCchCat(dir, ARRAYSIZE(dir), L"\\SDP");
+	if (FAILED(hr)) return false;
+	if (!uac_secureDirectory(dir)) return false;
+
+	hr = StringCchPrintf(path, cch, L"%ls\\%ls", dir, name);
+	return SUCCEEDED(hr) && uac_canTrustFile(path);
+}
+
+static inline DiskSet*
+createDiskSet(const Cmd* cmd, const wchar_t* dosDevices, const wchar_t** errmsg) {
+	return dskset_create(cmd->diskCount ? cmd->diskIds : NULL, cmd->diskCount, dosDevices, errmsg);
+}
+
+// Whether loadInventory or inv_save may run for cmd, so the identity of devices is needed to hash them
+static bool
+usesInventory(const Cmd* cmd) {
+	if (cmd->intent == cmd_kList && !cmd->refresh) return true;
+	if (cmd->diskCount) return false;
+	return cmd->intent == cmd_kList || cmd->intent == cmd_kTimerList || cmd->intent == cmd_kBatch;
+}
+
+// Load inventory for plain listing, unless asked to refresh.
+static Inventory*
+loadInventory(const Cmd* cmd, const wchar_t* path, UINT64 deviceHash) {
+	if (cmd->intent != cmd_kList || cmd->refresh) return NULL;
+
+	return inv_load(path, deviceHash, cmd->diskCount ? cmd->diskIds : NULL, cmd->diskCount);
+}
+
+enum {
+	kExitSuccess,
+	kExitFail,
+	kExitCmd,
+	kExitPrivilege,
+	kExitDiskSet,
+};
+
+static const wchar_t*
+getIntentName(enum Intent intent) {
+	static const wchar_t* kNames[] = {
+		[cmd_kList] = L"list",
+		[cmd_kStop] = L"stop",
+		[cmd_kState] = L"state",
+		[cmd_kMonitor] = L"monitor",
+		[cmd_kGovern] = L"govern",
+		[cmd_kStart] = L"start",
+		[cmd_kTimerList] = L"timerlist",
+		[cmd_kTimerWrite] = L"timerwrite",
+		[cmd_kBatch] = L"batch",
+	};
+	if (intent >= _countof(kNames) || !kNames[intent]) return L"command";
+	return kNames[intent];
+}
+
+static void
+showStatsHeader(void) {
+	static const wchar_t kT[] = L"\nstats\tphase\tdisks\tmicroseconds\tcommands\tcommandsPerDisk\tallocations\tallocatedBytes\tpeakBytes\n";
+	SHOW_STATIC_TEXT(kT);
+}
+
+static void
+showStats(const wchar_t* phase, const StatsPhase* p, UINT32 disks) {
+	const INT64 perDisk = disks ? p->commands * 100 / disks : 0;
+	wprintf(
+		L"stats\t%ls\t%u\t%llu\t%lld\t%lld.%02lld\t%lld\t%lld\t%lld\n",
+		phase, disks, p->microseconds, p->commands, perDisk / 100, perDisk % 100,
+		p->allocations, p->allocatedBytes, p->peakBytes
+	);
+}
+
+// A failed query must not be served from inventory until someone uses --refresh
+static bool
+hasAllInfo(const InventoryItem* items, UINT32 count) {
+	for (UINT32 i = 0; i < count; ++i) {
+		if (!items[i].hasInfo) return false;
+	}
+	return true;
+}
+
+// invPath: Where to save inventory after a full listing. NULL not to save
+static int
+doCommand(DiskSet* ds, Cmd* cmd, const wchar_t* invPath, UINT64 deviceHash) {
+	int ret = kExitSuccess;
+	bool hasTimer = false;
+
+	switch (cmd->intent) {
+	case cmd_kTimerList:
+		hasTimer = true;
+		// fall through
+	case cmd_kList:
+		if (cmd->format == cmd_kFormatText) showHeader(hasTimer);
+		InventoryItem* items = listDisks(ds, hasTimer, cmd, cmd->format);
+		if (items) {
+			// Only a full listing where every disk answered describes the whole device set
+			if (invPath && !cmd->diskCount && hasAllInfo(items, ds->count)) inv_save(invPath, deviceHash, ds, items);
+			heap_free(0, items);
+		}
+		break;
+	case cmd_kState:
+		showStateHeader();
+		showDiskStates(ds, cmd);
+		break;
+	case cmd_kMonitor:
+		showStateHeader();
+		if (!monitorDisks(ds, cmd)) ret = kExitFail;
+		break;
+	case cmd_kGovern:
+		if (!governDisks(ds, cmd)) ret = kExitFail;
+		break;
+	case cmd_kStart:
+		if (!startDisks(ds, cmd)) ret = kExitFail;
+		break;
+	case cmd_kStop:
+		showHeader(false);
+		if (!stopDisks(ds, cmd)) ret = kExitFail;
+		break;
+	case cmd_kTimerWrite:
+		showHeader(false);
+		if (!forEachDiskDo(ds, writeTimers, cmd)) ret = kExitFail;
+		break;
+	}
+	return ret;
+}
+
+// Disks of ds that op names, or all of ds if it names none. Handles are shared with ds.
+// view: If view->items is not ds->items, free it with heap_free and destroy view->ids
+// Return false if a disk is not in ds, or low memory
+static bool
+selectDisks(DiskSet* view, const DiskSet* ds, const Cmd* op, const wchar_t** errmsg) {
+	static const wchar_t* kLowMem = L"Low memory to select disks.";
+	static const wchar_t* kNotInSet = L"Disk not opened for this batch.";
+	static const wchar_t* kDupIds = L"Duplicate disk numbers not allowed.";
+
+	view->volumeSet = ds->volumeSet;
+	view->count = 0;
+	view->items = ds->items;
+	view->ids = ds->ids;
+	if (!op->diskCount) {
+		view->count = ds->count;
+		return true;
+	}
+
+	view->items = heap_alloc(0, sizeof(*view->items) * op->diskCount);
+	if (!view->items || !idm_init(&view->ids, op->diskCount)) {
+		if (view->items) heap_free(0, view->items);
+		*errmsg = kLowMem;
+		return false;
+	}
+	for (UINT32 i = 0; i < op->diskCount; ++i) {
+		DiskInfo* di = dskset_find(ds, op->diskIds[i]);
+		if (!di || !idm_add(&view->ids, di->id, view->count)) {
+			heap_free(0, view->items);
+			idm_destroy(&view->ids);
+			*errmsg = di ? kDupIds : kNotInSet;
+			return false;
+		}
+		view->items[view->count++] = di;
+	}
+	return true;
+}
+
+static void
+showBatchError(UINT32 line, const wchar_t* errmsg) {
+	wchar_t t[256];
+	if (line) {
+		StringCchPrintf(t, ARRAYSIZE(t), L"Line %u: %ls", line, errmsg);
+	}
+	else {
+		StringCchCopy(t, ARRAYSIZE(t), errmsg);
+	}
+	showError(t);
+}
+
+// Run operations of the batch one after another on ds, reusing its open handles, and report each of them.
+// A failed operation doesn't stop the others.
+// invPath: Where to save inventory after listing all disks. NULL not to save
+static int
+runBatch(DiskSet* ds, const Cmd* cmd, const wchar_t* invPath, UINT64 deviceHash) {
+	// An operation naming no disks covers all disks only if the batch does
+	if (cmd->diskCount) invPath = NULL;
+	UINT32 errLine;
+	const wchar_t* errmsg = NULL;
+	Batch* b = batch_load(cmd->batchPath, &errLine, &errmsg);
+	if (!b) {
+		showBatchError(errLine, errmsg);
+		return kExitCmd;
+	}
+
+	UINT32 failed = 0;
+	for (UINT32 i = 0; i < b->count; ++i) {
+		const BatchOp* op = &b->ops[i];
+		wprintf(L"[%u/%u] Line %u: %ls\n", i + 1, b->count, op->line, getIntentName(op->cmd->intent));
+		// Operations write with the console or file handle too. Keep each report around its output when redirected.
+		fflush(stdout);
+
+		int ret = kExitFail;
+		DiskSet view;
+		if (selectDisks(&view, ds, op->cmd, &errmsg)) {
+			TraceSpan span;
+			trace_begin(&span, getIntentName(op->cmd->intent));
+			ret = doCommand(&view, op->cmd, invPath, deviceHash);
+			trace_end(&span);
+			if (view.items != ds->items) {
+				heap_free(0, view.items);
+				idm_destroy(&view.ids);
+			}
+		}
+		else {
+			showBatchError(op->line, errmsg);
+			newline();
+		}
+		if (ret != kExitSuccess) ++failed;
+		wprintf(L"[%u/%u] Line %u: %ls", i + 1, b->count, op->line, ret == kExitSuccess ? kTextDone : kTextFailed);
+		fflush(stdout);
+	}
+	wprintf(L"%u of %u operations done\n", b->count - failed, b->count);
+	batch_destroy(b);
+	return failed ? kExitFail : kExitSuccess;
+}
+
+// enumeration: Stats of creating ds, shown with those of the command for --stats
+static int
+runCommand(DiskSet* ds, Cmd* cmd, const wchar_t* invPath, UINT64 deviceHash, StatsPhase* enumeration) {
+	StatsPhase run;
+	TraceSpan span;
+	if (cmd->stats) stats_begin(&run);
+	trace_begin(&span, getIntentName(cmd->intent));
+	int ret = cmd->intent == cmd_kBatch
+		? runBatch(ds, cmd, invPath, deviceHash)
+		: doCommand(ds, cmd, invPath, deviceHash);
+	trace_end(&span);
+	if (cmd->tracePath && !trace_save(cmd->tracePath, ds)) showError(L"Failed to save trace.");
+	if (!cmd->stats) return ret;
+
+	stats_end(&run);
+	showStatsHeader();
+	showStats(L"enumerate", enumeration, ds->count);
+	showStats(getIntentName(cmd->intent), &run, ds->count);
+	return ret;
+}
+
+// Run on simulated disks. Neither privilege nor data files are touched.
+static int
+simulate(Cmd* cmd) {
+	SimTarget* t = sim_create(cmd->simulate);
+	if (!t) {
+		showError(L"Low memory to simulate disks.");
+		return kExitDiskSet;
+	}
+	for (UINT32 i = cmd->simHang; cmd->simHang && i <= t->count; i += cmd->simHang) {
+		t->disks[i - 1].hang = true;
+	}
+
+	StatsPhase enumeration;
+	if (cmd->stats) stats_begin(&enumeration);
+	const wchar_t* errmsg = NULL;
+	DiskSet* ds = sim_createDiskSet(t, cmd->diskCount ? cmd->diskIds : NULL, cmd->diskCount, &errmsg);
+	if (!ds) {
+		showError(errmsg);
+		sim_destroy(t);
+		return kExitDiskSet;
+	}
+	if (cmd->stats) stats_end(&enumeration);
+
+	int ret = runCommand(ds, cmd, NULL, 0, &enumeration);
+	sim_destroyDiskSet(ds);
+	sim_destroy(t);
+	return ret;
+}
+
+int wmain(int argc, wchar_t** argv)
+{
+	warn();
+	showTitle();
+
+	const wchar_t* errmsg = NULL;
+	Cmd* cmd = cmd_parse(argc, argv, &errmsg);
+	if (!cmd) {
+		showError(errmsg);
+		return kExitCmd;
+	}
+	if (cmd->stats) stats_enable();
+	if (cmd->tracePath && !trace_enable(trace_kDefaultCapacity)) {
+		showError(L"Low memory to trace.");
+		return kExitFail;
+	}
+	if (!tp_startWatchdog(cmd->deadline)) {
+		showError(L"Failed to start command watchdog.");
+		return kExitFail;
+	}
+
+	bool isElevated = uac_isElevated();
+	switch (cmd->intent) {
+	case cmd_kHelp:
+		help();
+		if (!isElevated) showPrivilegeTip();
+		return kExitSuccess;
+	case cmd_kTimerHelp:
+		timerHelp();
+		if (!isElevated) showPrivilegeTip();
+		return kExitSuccess;
+	}
+
+	if (cmd->simulate) return simulate(cmd);
+
+	if (!isElevated) {
+		showPrivilegeError();
+		return kExitPrivilege;
+	}
+
+	StatsPhase enumeration;
+	TraceSpan span;
+	if (cmd->stats) stats_begin(&enumeration);
+	trace_begin(&span, L"List devices");
+	wchar_t invPath[MAX_PATH];
+	const bool hasInvPath = usesInventory(cmd) && getDataFilePath(invPath, ARRAYSIZE(invPath), kInventoryFileName);
+	wchar_t* dosDevices = dev_manuList(hasInvPath);
+	trace_end(&span);
+	if (!dosDevices) {
+		showError(L"Low memory to get device list.");
+		return kExitDiskSet;
+	}
+	const UINT64 deviceHash = hasInvPath ? inv_hashDevices(dosDevices) : 0;
+
+	Inventory* inv = hasInvPath ? loadInventory(cmd, invPath, deviceHash) : NULL;
+	if (inv) {
+		heap_free(0, dosDevices);
+		if (cmd->format == cmd_kFormatText) showHeader(false);
+		showInventory(inv, cmd->format);
+		if (cmd->stats) {
+			stats_end(&enumeration);
+			showStatsHeader();
+			showStats(L"inventory", &enumeration, inv->count);
+		}
+		inv_destroy(inv);
+		return kExitSuccess;
+	}
+
+	trace_begin(&span, L"Enumerate");
+	DiskSet* ds = createDiskSet(cmd, dosDevices, &errmsg);
+	trace_end(&span);
+	heap_free(0, dosDevices);
+	if (!ds) {
+		showError(errmsg);
+		return kExitDiskSet;
+	}
+	if (cmd->stats) stats_end(&enumeration);
+
+	wchar_t quirkPath[MAX_PATH];
+	bool hasQuirkPath = getDataFilePath(quirkPath, ARRAYSIZE(quirkPath), kQuirkFileName);
+	if (hasQuirkPath) quirk_load(quirkPath);
+
+	int ret = runCommand(ds, cmd, hasInvPath ? invPath : NULL, deviceHash, &enumeration);
+
+	if (hasQuirkPath) quirk_save(quirkPath);
+	dskset_destroy(ds);
+	return ret;
+}
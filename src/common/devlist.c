@@ -0,0 +1,200 @@
+#include "devlist.h"
+
+#include <winioctl.h>
+#include <cfgmgr32.h>
+#pragma comment(lib, "cfgmgr32.lib")
+#include <strsafe.h>
+
+#include "heap.h"
+
+
+enum {
+	kInitialCch = 4096,
+	kCchVolumePath = 50, // "\\?\Volume{GUID}\"
+};
+
+// Defined here, so INITGUID is not needed before Windows.h.
+const GUID dev_kDiskInterface = { 0x53F56307, 0xB6BF, 0x11D0, { 0x94, 0xF2, 0x00, 0xA0, 0xC9, 0x1E, 0xFB, 0x8B } };
+
+// Multi-sz growing as names are added
+typedef struct NameList {
+	wchar_t* p;
+	size_t cch; // Used, excluding the final NUL
+	size_t capacity;
+}NameList;
+
+static bool
+initList(NameList* l) {
+	l->p = heap_alloc(0, sizeof(*l->p) * kInitialCch);
+	if (!l->p) return false;
+	l->p[0] = L'\0';
+	l->cch = 0;
+	l->capacity = kInitialCch;
+	return true;
+}
+
+static bool
+addName(NameList* l, const wchar_t* name, size_t len) {
+	const size_t need = l->cch + len + 2; // NUL of the name, and the final NUL
+	if (need > l->capacity) {
+		size_t capacity = max(l->capacity * 2, need);
+		wchar_t* p = heap_alloc(0, sizeof(*p) * capacity);
+		if (!p) return false;
+		CopyMemory(p, l->p, sizeof(*p) * (l->cch + 1));
+		heap_free(0, l->p);
+		l->p = p;
+		l->capacity = capacity;
+	}
+
+	CopyMemory(l->p + l->cch, name, sizeof(*name) * len);
+	l->cch += len;
+	l->p[l->cch++] = L'\0';
+	l->p[l->cch] = L'\0';
+	return true;
+}
+
+// Open a disk interface without access, which is enough to ask its number.
+bool
+dev_getDiskNumber(const wchar_t* interfacePath, DWORD* number)
+{
+	HANDLE h = CreateFile(interfacePath, 0, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING, 0, NULL);
+	if (h == INVALID_HANDLE_VALUE) return false;
+
+	STORAGE_DEVICE_NUMBER n;
+	DWORD cb;
+	BOOL ok = DeviceIoControl(h, IOCTL_STORAGE_GET_DEVICE_NUMBER, NULL, 0, &n, sizeof(n), &cb, NULL);
+	CloseHandle(h);
+	if (!ok || n.DeviceType != FILE_DEVICE_DISK) return false;
+
+	*number = n.DeviceNumber;
+	return true;
+}
+
+wchar_t*
+dev_manuDiskInterfaces(void)
+{
+	wchar_t* p = NULL;
+	CONFIGRET cr;
+	do {
+		// Disks may arrive between the two calls, then ask the size again.
+		ULONG cch = 0;
+		cr = CM_Get_Device_Interface_List_Size(&cch, (LPGUID)&dev_kDiskInterface, NULL, CM_GET_DEVICE_INTERFACE_LIST_PRESENT);
+		if (cr != CR_SUCCESS) break;
+		if (p) heap_free(0, p);
+		p = heap_alloc(0, sizeof(*p) * cch);
+		if (!p) return NULL;
+		cr = CM_Get_Device_Interface_List((LPGUID)&dev_kDiskInterface, NULL, p, cch, CM_GET_DEVICE_INTERFACE_LIST_PRESENT);
+	} while (cr == CR_BUFFER_SMALL);
+
+	if (cr == CR_SUCCESS) return p;
+	if (p) heap_free(0, p);
+	return NULL;
+}
+
+// identify: Add the interface path after each name
+// Return false if disk interfaces can't be listed, or low memory
+static bool
+addDisks(NameList* l, bool identify) {
+	wchar_t* interfaces = dev_manuDiskInterfaces();
+	if (!interfaces) return false;
+
+	bool ok = true;
+	for (const wchar_t* p = interfaces; *p && ok; p += lstrlen(p) + 1) {
+		DWORD number;
+		if (!dev_getDiskNumber(p, &number)) continue;
+
+		wchar_t name[24]; // "PhysicalDrive" and 10 digits
+		HRESULT hr = StringCchPrintf(name, ARRAYSIZE(name), L"PhysicalDrive%lu", number);
+		if (FAILED(hr)) continue;
+		ok = addName(l, name, lstrlen(name)) && (!identify || addName(l, p, lstrlen(p)));
+	}
+	heap_free(0, interfaces);
+	return ok;
+}
+
+// Add mount points of volumePath, which is "\\?\Volume{GUID}\"
+// Return false if low memory
+static bool
+addMountPoints(NameList* l, const wchar_t* volumePath) {
+	DWORD cch = 0;
+	GetVolumePathNamesForVolumeName(volumePath, NULL, 0, &cch);
+	if (GetLastError() != ERROR_MORE_DATA || cch <= 1) return true;
+
+	wchar_t* buf = heap_alloc(0, sizeof(*buf) * cch);
+	if (!buf) return false;
+	bool ok = true;
+	if (GetVolumePathNamesForVolumeName(volumePath, buf, cch, &cch)) {
+		for (const wchar_t* p = buf; *p && ok; p += lstrlen(p) + 1) {
+			ok = addName(l, p, lstrlen(p));
+		}
+	}
+	heap_free(0, buf);
+	return ok;
+}
+
+// identify: Add mount points after each name
+// Return false if low memory, or the volume list is broken
+static bool
+addVolumes(NameList* l, bool identify) {
+	wchar_t path[kCchVolumePath];
+	HANDLE find = FindFirstVolume(path, ARRAYSIZE(path));
+	if (find == INVALID_HANDLE_VALUE) return GetLastError() == ERROR_NO_MORE_FILES;
+
+	bool ok = true;
+	do {
+		// "\\?\Volume{GUID}\" to "Volume{GUID}"
+		size_t len;
+		HRESULT hr = StringCchLength(path, ARRAYSIZE(path), &len);
+		if (FAILED(hr) || len <= 5) continue;
+		ok = addName(l, path + 4, len - 5) && (!identify || addMountPoints(l, path));
+	} while (ok && FindNextVolume(find, path, ARRAYSIZE(path)));
+	if (ok && GetLastError() != ERROR_NO_MORE_FILES) ok = false;
+
+	FindVolumeClose(find);
+	return ok;
+}
+
+static wchar_t*
+manuDosDevices(void) {
+	DWORD cch = 20480; // Initial buffer size. will be doubled each time if seen not enough.
+	wchar_t* p = heap_alloc(0, sizeof(*p) * cch);
+	if (!p) return NULL;
+	DWORD rcch = QueryDosDevice(NULL, p, cch);
+	if (rcch) return p;
+
+	while (GetLastError() == ERROR_INSUFFICIENT_BUFFER) {
+		cch += cch;
+		heap_free(0, p);
+		p = heap_alloc(0, sizeof(*p) * cch);
+		if (!p) return NULL;
+		rcch = QueryDosDevice(NULL, p, cch);
+		if (rcch) return p;
+	}
+
+	heap_free(0, p);
+	return NULL;
+}
+
+wchar_t*
+dev_manuList(bool identify)
+{
+	NameList l;
+	if (!initList(&l)) return NULL;
+
+	if (addDisks(&l, identify) && addVolumes(&l, identify)) return l.p;
+
+	heap_free(0, l.p);
+	return manuDosDevices();
+}
+
+wchar_t*
+dev_manuVolumeList(void)
+{
+	NameList l;
+	if (!initList(&l)) return NULL;
+
+	if (addVolumes(&l, false)) return l.p;
+
+	heap_free(0, l.p);
+	return NULL;
+}
@@ -0,0 +1,34 @@
+#pragma once
+
+#include <sdkddkver.h>
+#include <Windows.h>
+
+#include <stdbool.h>
+
+
+// List disks and volumes as "PhysicalDrive#" and "Volume{GUID}" names in a multi-sz, like QueryDosDevice names them.
+// Disk device interfaces and the volume list are read directly, so the cost doesn't grow with other DOS devices.
+// Falls back to scanning all DOS device names if disk interfaces can't be listed. Names have no identity then.
+// identify: Follow each name by what identifies the device behind it, which starts with neither prefix:
+//           the disk's interface path, which holds its hardware and instance IDs, or the volume's mount points.
+//           Mount points cost a query per volume, so ask only if the identity is used, as by inv_hashDevices.
+// Return NULL if low memory. User must call heap_free() after use.
+wchar_t*
+dev_manuList(bool identify);
+
+// List volumes only, as "Volume{GUID}" names in a multi-sz.
+// Return NULL if failed. User must call heap_free() after use.
+wchar_t*
+dev_manuVolumeList(void);
+
+// List paths of present disk device interfaces in a multi-sz.
+// Return NULL if failed. User must call heap_free() after use.
+wchar_t*
+dev_manuDiskInterfaces(void);
+
+// Get disk number, as in "PhysicalDrive#", of a disk device interface.
+bool
+dev_getDiskNumber(const wchar_t* interfacePath, DWORD* number);
+
+// GUID_DEVINTERFACE_DISK
+extern const GUID dev_kDiskInterface;
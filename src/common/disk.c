@@ -1,439 +1,852 @@
-#include "disk.h"
-
-#include <strsafe.h>
-#pragma comment(lib, "strsafe.lib")
-
-#include <stddef.h> // offsetof. GCC i686 requires this
-#include <assert.h>
-
-#include "multisz.h"
-#include "heap.h"
-
-
-// Return: If successful, return physical drive id, which is >=0.
-//         If failed, return a negative number.
-int
-dskid_parse(const wchar_t* t)
-{
-	int n = 0;
-	for (; *t; ++t) {
-		if (*t < L'0' || *t > L'9') return -1;
-		int orig = n;
-		n *= 10;
-		n += *t - L'0';
-		if (n < orig) return -1;
-	}
-	return n;
-}
-
-
-static HANDLE
-openDevice(const wchar_t* dosDeviceName) {
-	wchar_t name[MAX_PATH];
-	HRESULT hr = StringCchPrintf(name, ARRAYSIZE(name), L"\\\\.\\%ls", dosDeviceName);
-	if (FAILED(hr)) return INVALID_HANDLE_VALUE;
-
-	HANDLE h = CreateFile(
-		name,
-		GENERIC_READ | GENERIC_WRITE,
-		FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING, 0, NULL
-	);
-	return h;
-}
-
-// If successful, return buffer pointer. User must call HeapFree(GetProcessHeap(),...) after use.
-// If failed, return NULL.
-static VOLUME_DISK_EXTENTS*
-vol_manuDiskExtents(HANDLE h) {
-	VOLUME_DISK_EXTENTS* de = heap_alloc(0, sizeof(*de));
-	if (!de) return NULL;
-
-	DWORD cb;
-	BOOL ok = DeviceIoControl(
-		h, IOCTL_VOLUME_GET_VOLUME_DISK_EXTENTS, NULL, 0,
-		de, sizeof(*de), &cb, NULL
-	);
-	if (ok) return de;
-
-	while (GetLastError() == ERROR_MORE_DATA) {
-		size_t sz = offsetof(VOLUME_DISK_EXTENTS, Extents[de->NumberOfDiskExtents]);
-		heap_free(0, de);
-		de = heap_alloc(0, sz);
-		if (!de) return NULL;
-		ok = DeviceIoControl(
-			h, IOCTL_VOLUME_GET_VOLUME_DISK_EXTENTS, NULL, 0,
-			de, (DWORD)sz, &cb, NULL
-		);
-		if (ok) return de;
-	}
-
-	heap_free(0, de);
-	return NULL;
-}
-
-static wchar_t*
-vol_manuMountPoints(const wchar_t* volName) {
-	wchar_t path[50]; // 50 is enough for "\\?\Volume{GUID}\";
-	HRESULT hr = StringCchPrintf(path, ARRAYSIZE(path), L"\\\\?\\%ls\\", volName);
-	if (FAILED(hr)) return NULL;
-
-	DWORD cch = 0;
-	BOOL rc = GetVolumePathNamesForVolumeName(path, NULL, 0, &cch);
-	if (GetLastError() != ERROR_MORE_DATA) return NULL;
-	if (cch <= 1) return NULL;
-
-	wchar_t* buf = heap_alloc(0, sizeof(*buf) * cch);
-	if (!buf) return NULL;
-	rc = GetVolumePathNamesForVolumeName(path, buf, cch, &cch);
-	if (!rc) {
-		heap_free(0, buf);
-		return NULL;
-	}
-	return buf;
-}
-
-static void
-fillVolumeInfo(VolumeInfo* vi, HANDLE h, const wchar_t* name, const VOLUME_DISK_EXTENTS* de) {
-	vi->handle = h;
-	StringCchCopy(vi->name, ARRAYSIZE(vi->name), name);
-	vi->isLocked = false;
-	vi->mountPoints = vol_manuMountPoints(name);
-	vi->diskCount = de->NumberOfDiskExtents;
-	for (UINT32 i = 0; i < vi->diskCount; ++i) {
-		vi->disks[i] = de->Extents[i].DiskNumber;
-	}
-}
-
-static VolumeInfo*
-vol_manuInfo(const wchar_t* dosDeviceName) {
-	HANDLE h = openDevice(dosDeviceName);
-	if (h == INVALID_HANDLE_VALUE) return NULL;
-
-	VOLUME_DISK_EXTENTS* de = vol_manuDiskExtents(h);
-	if (!de) {
-		CloseHandle(h);
-		return NULL;
-	}
-
-	VolumeInfo* vi = heap_alloc(0, offsetof(VolumeInfo, disks[de->NumberOfDiskExtents]));
-	if (!vi) {
-		CloseHandle(h);
-		heap_free(0, de);
-		return NULL;
-	}
-
-	fillVolumeInfo(vi, h, dosDeviceName, de);
-	return vi;
-}
-
-static inline bool
-vol_lock(HANDLE h) {
-	return DeviceIoControl(h, FSCTL_LOCK_VOLUME, NULL, 0, NULL, 0, &(DWORD){0}, NULL);
-}
-
-static inline bool
-vol_dismount(HANDLE h) {
-	return DeviceIoControl(h, FSCTL_DISMOUNT_VOLUME, NULL, 0, NULL, 0, &(DWORD){0}, NULL);
-}
-
-static inline bool
-vol_offline(HANDLE h) {
-	return DeviceIoControl(h, IOCTL_VOLUME_OFFLINE, NULL, 0, NULL, 0, &(DWORD){0}, NULL);
-}
-
-static void
-volset_destroy(VolumeSet* s) {
-	if (!s) return;
-
-	for (UINT32 i = 0; i < s->count; ++i) {
-		VolumeInfo* info = s->items[i];
-		CloseHandle(info->handle);
-		if (info->mountPoints) heap_free(0, info->mountPoints);
-		heap_free(0, info);
-	}
-	heap_free(0, s);
-}
-
-
-static UINT
-getDosDeviceType(const wchar_t* dosDevice) {
-	wchar_t path[MAX_PATH];
-	HRESULT hr = StringCchPrintf(path, ARRAYSIZE(path), L"\\\\?\\%ls\\", dosDevice);
-	if (FAILED(hr)) return DRIVE_UNKNOWN;
-	return GetDriveType(path);
-}
-
-static VolumeSet*
-createEmptyVolumeSet(size_t itemCount) {
-	VolumeSet* s = heap_alloc(0, sizeof(*s));
-	if (!s) return NULL;
-	s->items = heap_alloc(0, sizeof(s->items[0]) * itemCount);
-	if (!s->items) {
-		heap_free(0, s);
-		return NULL;
-	}
-
-	s->count = 0;
-	return s;
-}
-
-// Filter given volume names, only volumes that are DRIVE_FIXED type will be add to set.
-// Param VolumeNames: May has the form of "Volume{xxxxxxxx-xxxx-xxxx-xxxx-xxxxxxxxxxxx}", as returned by QueryDosDevice().
-static VolumeSet*
-volset_createFromNames(const wchar_t** volumeNames, size_t count) {
-	assert(volumeNames);
-
-	VolumeSet* s = createEmptyVolumeSet(count);
-	if (!s) return NULL;
-
-	for (size_t i = 0; i < count; ++i) {
-		const wchar_t* name = *volumeNames++;
-		if (getDosDeviceType(name) != DRIVE_FIXED) continue;
-		
-		VolumeInfo* info = vol_manuInfo(name);
-		if (!info) continue;
-		s->items[s->count] = info;
-		++s->count;
-	}
-
-	return s;
-}
-
-static VolumeSet*
-volset_createFromDosDevices(const wchar_t* dosDevices) {
-	size_t count;
-	const wchar_t** names = msz_manuStringListStartsWith(&count, L"Volume", dosDevices);
-	if (!names) return NULL;
-
-	VolumeSet* vs = volset_createFromNames(names, count);
-	heap_free(0, names);
-	
-	return vs;
-}
-
-void
-dskset_destroy(DiskSet* s)
-{
-	if (!s) return;
-
-	volset_destroy(s->volumeSet);
-	for (UINT32 i = 0; i < s->count; ++i) {
-		DiskInfo* info = s->items[i];
-		CloseHandle(info->handle);
-		heap_free(0, info);
-	}
-	heap_free(0, s);
-}
-
-static DiskSet*
-createEmptyDiskSet(size_t itemCount) {
-	DiskSet* s = heap_alloc(0, sizeof(*s));
-	if (!s) return NULL;
-	s->items = heap_alloc(0, sizeof(s->items[0]) * itemCount);
-	if (!s->items) {
-		heap_free(0, s);
-		return NULL;
-	}
-
-	s->volumeSet = NULL;
-	s->count = 0;
-	return s;
-}
-
-static HANDLE
-openDisk(UINT32 id) {
-	wchar_t name[28]; // 28 is to hold "\\.\PhysicalDrive##########" with 10 digits(enough for UINT32).
-	HRESULT hr = StringCchPrintf(name, ARRAYSIZE(name), L"\\\\.\\PhysicalDrive%u", id);
-	if (FAILED(hr)) return INVALID_HANDLE_VALUE;
-
-	return openDevice(name);
-}
-
-static size_t
-getVolumesOnDisk(const VolumeInfo** info, size_t infoSize, const VolumeSet* vs, UINT32 diskId) {
-	if (!vs) return 0;
-
-	size_t c = 0;
-	for (size_t i = 0; i < vs->count; ++i) {
-		const VolumeInfo* vi = vs->items[i];
-		for (size_t j = 0; j < vi->diskCount; ++j) {
-			if (vi->disks[j] == diskId) {
-				++c;
-				if (info) {
-					if (c > infoSize) return 0;
-					*info++ = vi;
-				}
-			}
-		}
-	}
-	return c;
-}
-
-static DiskInfo*
-dsk_manuInfo(UINT32 id, const VolumeSet* vs) {
-	HANDLE h = openDisk(id);
-	if (h == INVALID_HANDLE_VALUE) return NULL;
-
-	size_t volCount = getVolumesOnDisk(NULL, 0, vs, id);
-	size_t sz = offsetof(DiskInfo, volumes[volCount]);
-	DiskInfo* info = heap_alloc(0, sz);
-	if (!info) {
-		CloseHandle(h);
-		return NULL;
-	}
-
-	info->handle = h;
-	info->id = id;
-	info->volumeCount = (UINT32)volCount;
-	if (volCount) getVolumesOnDisk(&info->volumes[0], volCount, vs, id);
-	
-	return info;
-}
-
-static DiskSet*
-dskset_createFromIds(const UINT32* ids, size_t count, const wchar_t* dosDevices) {
-	assert(ids);
-	assert(count);
-	assert(dosDevices);
-
-	DiskSet* s = createEmptyDiskSet(count);
-	if (!s) return NULL;
-
-	s->volumeSet = volset_createFromDosDevices(dosDevices);
-	// volumeSet allowed to be NULL.
-	for (size_t i = 0; i < count; ++i) {
-		DiskInfo* info = dsk_manuInfo(*ids++, s->volumeSet);
-		if (!info) {
-			dskset_destroy(s);
-			return NULL;
-		}
-		s->items[s->count++] = info;
-	}
-
-	return s;
-}
-
-static UINT32*
-manuDiskIds(const wchar_t** names, size_t count) {
-	assert(names);
-	assert(count);
-
-	UINT32* ids = heap_alloc(0, sizeof(*ids) * count);
-	if (!ids) return NULL;
-	for (size_t i = 0; i < count; ++i) {
-		int id = dskid_parse((*names) + 13); // 13 is the length of "PhysicalDrive".
-		if (id < 0) {
-			heap_free(0, ids);
-			return NULL;
-		}
-		ids[i] = (UINT32)id;
-		++names;
-	}
-	return ids;
-}
-
-static bool
-hasDupIds(const UINT32* ids, size_t count) {
-	for (size_t i = 0; i < count - 1; ++i) {
-		for (size_t j = i + 1; j < count; ++j) {
-			if (ids[i] == ids[j]) return true;
-		}
-	}
-	return false;
-}
-
-// Check whether each and every lids exists in rids.
-static bool
-hasNonexistentId(const UINT32* lids, size_t lcount, const UINT32* rids, size_t rcount) {
-	for (size_t i = 0; i < lcount; ++i) {
-		bool found = false;
-		for (size_t j = 0; j < rcount; ++j) {
-			if (lids[i] == rids[j]) {
-				found = true;
-				break;
-			}
-		}
-		if (!found) return true;
-	}
-	return false;
-}
-
-// Given diskIds considered valid if the following conditions are all met:
-//   1. Given idCount is less or equal to nameCount.
-//   2. No duplicates in diskIds.
-//   3. Each and every diskIds exists in given names.
-// Return: If diskIds checked valid, return diskIds back.
-//         If diskIds checked not valid, return NULL.
-//         If diskIds is NULL, return pointer to ids buffer generated from names. User must call HeapFree() after use.
-static UINT32*
-validateDiskIds(const UINT32* diskIds, size_t idCount, const wchar_t** names, size_t nameCount, const wchar_t** errmsg) {
-	static const wchar_t* kBadIdCount = L"Disk numbers exceeds physical drive count.";
-	static const wchar_t* kDupIds = L"Duplicate disk numbers not allowed.";
-	static const wchar_t* kLowMem = L"Low memory to generate disk number list.";
-	static const wchar_t* kBadId = L"No such physical drive number.";
-
-	if (diskIds) {
-		if (idCount > nameCount) {
-			*errmsg = kBadIdCount;
-			return NULL;
-		}
-		if (hasDupIds(diskIds, idCount)) {
-			*errmsg = kDupIds;
-			return NULL;
-		}
-	}
-
-	UINT32* nameIds = manuDiskIds(names, nameCount);
-	if (!nameIds) {
-		*errmsg = kLowMem;
-		return NULL;
-	}
-	if (!diskIds) return nameIds;
-
-	UINT32* rlt = (UINT32*)diskIds;
-	if (hasNonexistentId(diskIds, idCount, nameIds, nameCount)) {
-		*errmsg = kBadId;
-		rlt = NULL;
-	}
-	heap_free(0, nameIds);
-	return rlt;
-}
-
-DiskSet*
-dskset_create(const UINT32* diskIds, size_t count, const wchar_t* dosDevices, const wchar_t** errmsg)
-{
-	static const wchar_t* kNoPhyDrive = L"No physical drive.";
-
-	size_t nameCount;
-	const wchar_t** names = msz_manuStringListStartsWith(&nameCount, L"PhysicalDrive", dosDevices);
-	if (!names) {
-		*errmsg = kNoPhyDrive;
-		return NULL;
-	}
-
-	UINT32* ids = validateDiskIds(diskIds, count, names, nameCount, errmsg);
-	heap_free(0, names);
-	if (!ids) return NULL;
-	
-	if (ids != diskIds) count = nameCount;
-	DiskSet* ds = dskset_createFromIds(ids, count, dosDevices);
-
-	if (ids != diskIds) heap_free(0, ids);
-	return ds;
-}
-
-bool
-dsk_eject(DiskInfo* di)
-{
-	for (UINT32 i = 0; i < di->volumeCount; ++i) {
-		VolumeInfo* vi = di->volumes[i];
-		if (vi->isLocked) continue;
-
-		vi->isLocked = vol_lock(vi->handle);
-		if (!vi->isLocked) return false;
-
-		if (vi->mountPoints) vol_dismount(vi->handle);
-		vol_offline(vi->handle);
-	}
-	return true;
-}
+#include "disk.h"
+
+#include <strsafe.h>
+#pragma comment(lib, "strsafe.lib")
+
+#include <stddef.h> // offsetof. GCC i686 requires this
+#include <assert.h>
+
+#include "multisz.h"
+#include "heap.h"
+#include "idmap.h"
+#include "task.h"
+#include "devlist.h"
+#include "trace.h"
+
+
+// Return: If successful, return physical drive id, which is >=0.
+//         If failed, return a negative number.
+int
+dskid_parse(const wchar_t* t)
+{
+	int n = 0;
+	for (; *t; ++t) {
+		if (*t < L'0' || *t > L'9') return -1;
+		int orig = n;
+		n *= 10;
+		n += *t - L'0';
+		if (n < orig) return -1;
+	}
+	return n;
+}
+
+
+// access: 0 to query device properties only. Opening a volume so doesn't mount its file system.
+static HANDLE
+openDevice(const wchar_t* dosDeviceName, DWORD access, DWORD flags) {
+	wchar_t name[MAX_PATH];
+	HRESULT hr = StringCchPrintf(name, ARRAYSIZE(name), L"\\\\.\\%ls", dosDeviceName);
+	if (FAILED(hr)) return INVALID_HANDLE_VALUE;
+
+	HANDLE h = CreateFile(
+		name,
+		access,
+		FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING, flags, NULL
+	);
+	return h;
+}
+
+// If successful, return buffer pointer. User must call HeapFree(GetProcessHeap(),...) after use.
+// If failed, return NULL.
+static VOLUME_DISK_EXTENTS*
+vol_manuDiskExtents(HANDLE h) {
+	VOLUME_DISK_EXTENTS* de = heap_alloc(0, sizeof(*de));
+	if (!de) return NULL;
+
+	DWORD cb;
+	BOOL ok = DeviceIoControl(
+		h, IOCTL_VOLUME_GET_VOLUME_DISK_EXTENTS, NULL, 0,
+		de, sizeof(*de), &cb, NULL
+	);
+	if (ok) return de;
+
+	while (GetLastError() == ERROR_MORE_DATA) {
+		size_t sz = offsetof(VOLUME_DISK_EXTENTS, Extents[de->NumberOfDiskExtents]);
+		heap_free(0, de);
+		de = heap_alloc(0, sz);
+		if (!de) return NULL;
+		ok = DeviceIoControl(
+			h, IOCTL_VOLUME_GET_VOLUME_DISK_EXTENTS, NULL, 0,
+			de, (DWORD)sz, &cb, NULL
+		);
+		if (ok) return de;
+	}
+
+	heap_free(0, de);
+	return NULL;
+}
+
+static wchar_t*
+vol_manuMountPoints(const wchar_t* volName) {
+	wchar_t path[50]; // 50 is enough for "\\?\Volume{GUID}\";
+	HRESULT hr = StringCchPrintf(path, ARRAYSIZE(path), L"\\\\?\\%ls\\", volName);
+	if (FAILED(hr)) return NULL;
+
+	DWORD cch = 0;
+	BOOL rc = GetVolumePathNamesForVolumeName(path, NULL, 0, &cch);
+	if (GetLastError() != ERROR_MORE_DATA) return NULL;
+	if (cch <= 1) return NULL;
+
+	wchar_t* buf = heap_alloc(0, sizeof(*buf) * cch);
+	if (!buf) return NULL;
+	rc = GetVolumePathNamesForVolumeName(path, buf, cch, &cch);
+	if (!rc) {
+		heap_free(0, buf);
+		return NULL;
+	}
+	return buf;
+}
+
+static void
+fillVolumeInfo(VolumeInfo* vi, HANDLE h, const wchar_t* name, const VOLUME_DISK_EXTENTS* de) {
+	vi->handle = h;
+	StringCchCopy(vi->name, ARRAYSIZE(vi->name), name);
+	vi->isLocked = false;
+	vi->isResolved = false;
+	vi->mountPoints = NULL;
+	vi->diskCount = de->NumberOfDiskExtents;
+	for (UINT32 i = 0; i < vi->diskCount; ++i) {
+		vi->disks[i] = de->Extents[i].DiskNumber;
+	}
+}
+
+static bool
+isOnDisks(const VOLUME_DISK_EXTENTS* de, const IdMap* disks) {
+	for (DWORD i = 0; i < de->NumberOfDiskExtents; ++i) {
+		if (idm_find(disks, de->Extents[i].DiskNumber) != idm_kNone) return true;
+	}
+	return false;
+}
+
+static VOLUME_DISK_EXTENTS*
+vol_queryDiskExtents(const wchar_t* dosDeviceName) {
+	HANDLE h = openDevice(dosDeviceName, 0, 0);
+	if (h == INVALID_HANDLE_VALUE) return NULL;
+
+	VOLUME_DISK_EXTENTS* de = vol_manuDiskExtents(h);
+	CloseHandle(h);
+	return de;
+}
+
+static UINT
+getDosDeviceType(const wchar_t* dosDevice) {
+	wchar_t path[MAX_PATH];
+	HRESULT hr = StringCchPrintf(path, ARRAYSIZE(path), L"\\\\?\\%ls\\", dosDevice);
+	if (FAILED(hr)) return DRIVE_UNKNOWN;
+	return GetDriveType(path);
+}
+
+// Extents are queried through a handle without access first, so volumes on other disks cost one cheap open.
+// Return NULL if failed, or if the volume is not on any of disks.
+static VolumeInfo*
+vol_manuInfo(const wchar_t* dosDeviceName, const IdMap* disks) {
+	VOLUME_DISK_EXTENTS* de = vol_queryDiskExtents(dosDeviceName);
+	if (!de) return NULL;
+	if (!isOnDisks(de, disks) || getDosDeviceType(dosDeviceName) != DRIVE_FIXED) {
+		heap_free(0, de);
+		return NULL;
+	}
+
+	HANDLE h = openDevice(dosDeviceName, GENERIC_READ | GENERIC_WRITE, 0);
+	if (h == INVALID_HANDLE_VALUE) {
+		heap_free(0, de);
+		return NULL;
+	}
+
+	VolumeInfo* vi = heap_alloc(0, offsetof(VolumeInfo, disks[de->NumberOfDiskExtents]));
+	if (!vi) {
+		CloseHandle(h);
+		heap_free(0, de);
+		return NULL;
+	}
+
+	fillVolumeInfo(vi, h, dosDeviceName, de);
+	heap_free(0, de);
+	return vi;
+}
+
+static inline bool
+vol_lock(HANDLE h) {
+	return DeviceIoControl(h, FSCTL_LOCK_VOLUME, NULL, 0, NULL, 0, &(DWORD){0}, NULL);
+}
+
+static inline bool
+vol_dismount(HANDLE h) {
+	return DeviceIoControl(h, FSCTL_DISMOUNT_VOLUME, NULL, 0, NULL, 0, &(DWORD){0}, NULL);
+}
+
+static inline bool
+vol_unlock(HANDLE h) {
+	return DeviceIoControl(h, FSCTL_UNLOCK_VOLUME, NULL, 0, NULL, 0, &(DWORD){0}, NULL);
+}
+
+enum {
+	kLockRetryDelay = 100, // Milliseconds
+};
+
+// Lock fails while files are open on the volume. Retry until they are closed, or wait milliseconds are up.
+static bool
+vol_lockWithin(HANDLE h, DWORD wait) {
+	const UINT64 due = GetTickCount64() + wait;
+	for (;;) {
+		if (vol_lock(h)) return true;
+		if (GetLastError() != ERROR_ACCESS_DENIED || GetTickCount64() >= due) return false;
+		Sleep(kLockRetryDelay);
+	}
+}
+
+static inline bool
+vol_offline(HANDLE h) {
+	return DeviceIoControl(h, IOCTL_VOLUME_OFFLINE, NULL, 0, NULL, 0, &(DWORD){0}, NULL);
+}
+
+static inline bool
+vol_online(HANDLE h) {
+	return DeviceIoControl(h, IOCTL_VOLUME_ONLINE, NULL, 0, NULL, 0, &(DWORD){0}, NULL);
+}
+
+static void
+vol_destroy(VolumeInfo* info) {
+	if (info->handle != INVALID_HANDLE_VALUE) CloseHandle(info->handle);
+	if (info->mountPoints) heap_free(0, info->mountPoints);
+	heap_free(0, info);
+}
+
+static void
+volset_destroy(VolumeSet* s) {
+	if (!s) return;
+
+	for (UINT32 i = 0; i < s->count; ++i) {
+		vol_destroy(s->items[i]);
+	}
+	heap_free(0, s->items);
+	heap_free(0, s);
+}
+
+
+static VolumeSet*
+createEmptyVolumeSet(size_t itemCount) {
+	VolumeSet* s = heap_alloc(0, sizeof(*s));
+	if (!s) return NULL;
+	s->items = heap_alloc(0, sizeof(s->items[0]) * itemCount);
+	if (!s->items) {
+		heap_free(0, s);
+		return NULL;
+	}
+
+	s->count = 0;
+	return s;
+}
+
+// Filter given volume names, only volumes that are DRIVE_FIXED type and on one of disks will be add to set.
+// Param VolumeNames: May has the form of "Volume{xxxxxxxx-xxxx-xxxx-xxxx-xxxxxxxxxxxx}", as returned by QueryDosDevice().
+static VolumeSet*
+volset_createFromNames(const wchar_t** volumeNames, size_t count, const IdMap* disks) {
+	assert(volumeNames);
+
+	VolumeSet* s = createEmptyVolumeSet(count);
+	if (!s) return NULL;
+
+	for (size_t i = 0; i < count; ++i) {
+		const wchar_t* name = *volumeNames++;
+		VolumeInfo* info = vol_manuInfo(name, disks);
+		if (!info) continue;
+		info->index = s->count;
+		s->items[s->count] = info;
+		++s->count;
+	}
+
+	return s;
+}
+
+static VolumeSet*
+volset_createFromDosDevices(const wchar_t* dosDevices, const IdMap* disks) {
+	size_t count;
+	const wchar_t** names = msz_manuStringListStartsWith(&count, L"Volume", dosDevices);
+	if (!names) return NULL;
+
+	VolumeSet* vs = volset_createFromNames(names, count, disks);
+	heap_free(0, names);
+	
+	return vs;
+}
+
+void
+dskset_destroy(DiskSet* s)
+{
+	if (!s) return;
+
+	volset_destroy(s->volumeSet);
+	for (UINT32 i = 0; i < s->count; ++i) {
+		DiskInfo* info = s->items[i];
+		if (info->handle != INVALID_HANDLE_VALUE) CloseHandle(info->handle);
+		heap_free(0, info);
+	}
+	heap_free(0, s->items);
+	idm_destroy(&s->ids);
+	heap_free(0, s);
+}
+
+static DiskSet*
+createEmptyDiskSet(size_t itemCount) {
+	DiskSet* s = heap_alloc(0, sizeof(*s));
+	if (!s) return NULL;
+	s->items = heap_alloc(0, sizeof(s->items[0]) * itemCount);
+	if (!s->items) {
+		heap_free(0, s);
+		return NULL;
+	}
+
+	s->volumeSet = NULL;
+	s->count = 0;
+	s->ids.entries = NULL;
+	return s;
+}
+
+static HANDLE
+openDisk(UINT32 id, DWORD flags) {
+	wchar_t name[28]; // 28 is to hold "\\.\PhysicalDrive##########" with 10 digits(enough for UINT32).
+	HRESULT hr = StringCchPrintf(name, ARRAYSIZE(name), L"\\\\.\\PhysicalDrive%u", id);
+	if (FAILED(hr)) return INVALID_HANDLE_VALUE;
+
+	return openDevice(name, GENERIC_READ | GENERIC_WRITE, flags);
+}
+
+// A volume with more than one extent on a disk is still one volume of the disk
+static inline bool
+isFirstExtentOnDisk(const VolumeInfo* vi, UINT32 extent) {
+	for (UINT32 i = 0; i < extent; ++i) {
+		if (vi->disks[i] == vi->disks[extent]) return false;
+	}
+	return true;
+}
+
+// Count volumes of each disk in one pass over the volume set.
+// counts[i] is of the disk at position i in disks.
+static void
+countVolumes(UINT32* counts, const VolumeSet* vs, const IdMap* disks) {
+	for (UINT32 i = 0; vs && i < vs->count; ++i) {
+		const VolumeInfo* vi = vs->items[i];
+		for (UINT32 j = 0; j < vi->diskCount; ++j) {
+			const UINT32 pos = idm_find(disks, vi->disks[j]);
+			if (pos != idm_kNone && isFirstExtentOnDisk(vi, j)) ++counts[pos];
+		}
+	}
+}
+
+// Link each volume to its disks in one pass, in the same order as countVolumes counted them.
+static void
+linkVolumes(DiskSet* s, const IdMap* disks) {
+	const VolumeSet* vs = s->volumeSet;
+	for (UINT32 i = 0; vs && i < vs->count; ++i) {
+		VolumeInfo* vi = vs->items[i];
+		for (UINT32 j = 0; j < vi->diskCount; ++j) {
+			const UINT32 pos = idm_find(disks, vi->disks[j]);
+			if (pos == idm_kNone || !isFirstExtentOnDisk(vi, j)) continue;
+			DiskInfo* di = s->items[pos];
+			di->volumes[di->volumeCount++] = vi;
+		}
+	}
+}
+
+// volumeCount: Room for volumes. They are linked by linkVolumes.
+static DiskInfo*
+dsk_manuInfo(UINT32 id, UINT32 volumeCount) {
+	HANDLE h = openDisk(id, 0);
+	if (h == INVALID_HANDLE_VALUE) return NULL;
+
+	size_t sz = offsetof(DiskInfo, volumes[volumeCount]);
+	DiskInfo* info = heap_alloc(0, sz);
+	if (!info) {
+		CloseHandle(h);
+		return NULL;
+	}
+
+	info->handle = h;
+	info->id = id;
+	info->volumeCount = 0;
+	return info;
+}
+
+// ids: Validated to have no duplicates
+static DiskSet*
+dskset_createFromIds(const UINT32* ids, size_t count, const wchar_t* dosDevices) {
+	assert(ids);
+	assert(count);
+	assert(dosDevices);
+
+	// Disk number to position in set. Built once, so linking volumes takes linear time.
+	IdMap disks;
+	if (!idm_init(&disks, count)) return NULL;
+	for (size_t i = 0; i < count; ++i) {
+		idm_add(&disks, ids[i], (UINT32)i);
+	}
+	UINT32* counts = heap_alloc(HEAP_ZERO_MEMORY, sizeof(*counts) * count);
+	DiskSet* s = counts ? createEmptyDiskSet(count) : NULL;
+	if (!s) {
+		if (counts) heap_free(0, counts);
+		idm_destroy(&disks);
+		return NULL;
+	}
+
+	TraceSpan span;
+	trace_begin(&span, L"Scan volumes");
+	s->volumeSet = volset_createFromDosDevices(dosDevices, &disks);
+	trace_end(&span);
+	// volumeSet allowed to be NULL.
+	countVolumes(counts, s->volumeSet, &disks);
+	trace_begin(&span, L"Open disks");
+	for (size_t i = 0; i < count; ++i) {
+		DiskInfo* info = dsk_manuInfo(ids[i], counts[i]);
+		if (!info) {
+			dskset_destroy(s);
+			s = NULL;
+			break;
+		}
+		s->items[s->count++] = info;
+	}
+	trace_end(&span);
+	heap_free(0, counts);
+	if (!s) {
+		idm_destroy(&disks);
+		return NULL;
+	}
+
+	linkVolumes(s, &disks);
+	s->ids = disks; // Positions are the same in s
+	return s;
+}
+
+static UINT32*
+manuDiskIds(const wchar_t** names, size_t count) {
+	assert(names);
+	assert(count);
+
+	UINT32* ids = heap_alloc(0, sizeof(*ids) * count);
+	if (!ids) return NULL;
+	for (size_t i = 0; i < count; ++i) {
+		int id = dskid_parse((*names) + 13); // 13 is the length of "PhysicalDrive".
+		if (id < 0) {
+			heap_free(0, ids);
+			return NULL;
+		}
+		ids[i] = (UINT32)id;
+		++names;
+	}
+	return ids;
+}
+
+// found: Set true if any id is there more than once
+// Return false if low memory to check
+static bool
+findDupIds(const UINT32* ids, size_t count, bool* found) {
+	IdMap m;
+	if (!idm_init(&m, count)) return false;
+
+	*found = false;
+	for (size_t i = 0; i < count && !*found; ++i) {
+		*found = !idm_add(&m, ids[i], (UINT32)i);
+	}
+	idm_destroy(&m);
+	return true;
+}
+
+// Check whether each and every lids exists in rids.
+// found: Set true if any doesn't
+// Return false if low memory to check
+static bool
+findNonexistentId(const UINT32* lids, size_t lcount, const UINT32* rids, size_t rcount, bool* found) {
+	IdMap m;
+	if (!idm_init(&m, rcount)) return false;
+	for (size_t i = 0; i < rcount; ++i) {
+		idm_add(&m, rids[i], (UINT32)i);
+	}
+
+	*found = false;
+	for (size_t i = 0; i < lcount && !*found; ++i) {
+		*found = idm_find(&m, lids[i]) == idm_kNone;
+	}
+	idm_destroy(&m);
+	return true;
+}
+
+// Given diskIds considered valid if the following conditions are all met:
+//   1. Given idCount is less or equal to nameCount.
+//   2. No duplicates in diskIds.
+//   3. Each and every diskIds exists in given names.
+// Return: If diskIds checked valid, return diskIds back.
+//         If diskIds checked not valid, return NULL.
+//         If diskIds is NULL, return pointer to ids buffer generated from names. User must call HeapFree() after use.
+static UINT32*
+validateDiskIds(const UINT32* diskIds, size_t idCount, const wchar_t** names, size_t nameCount, const wchar_t** errmsg) {
+	static const wchar_t* kBadIdCount = L"Disk numbers exceeds physical drive count.";
+	static const wchar_t* kDupIds = L"Duplicate disk numbers not allowed.";
+	static const wchar_t* kLowMem = L"Low memory to generate disk number list.";
+	static const wchar_t* kLowMemCheck = L"Low memory to check disk numbers.";
+	static const wchar_t* kBadId = L"No such physical drive number.";
+
+	bool found;
+	if (diskIds) {
+		if (idCount > nameCount) {
+			*errmsg = kBadIdCount;
+			return NULL;
+		}
+		if (!findDupIds(diskIds, idCount, &found)) {
+			*errmsg = kLowMemCheck;
+			return NULL;
+		}
+		if (found) {
+			*errmsg = kDupIds;
+			return NULL;
+		}
+	}
+
+	UINT32* nameIds = manuDiskIds(names, nameCount);
+	if (!nameIds) {
+		*errmsg = kLowMem;
+		return NULL;
+	}
+	if (!diskIds) return nameIds;
+
+	UINT32* rlt = (UINT32*)diskIds;
+	if (!findNonexistentId(diskIds, idCount, nameIds, nameCount, &found)) {
+		*errmsg = kLowMemCheck;
+		rlt = NULL;
+	}
+	else if (found) {
+		*errmsg = kBadId;
+		rlt = NULL;
+	}
+	heap_free(0, nameIds);
+	return rlt;
+}
+
+DiskSet*
+dskset_create(const UINT32* diskIds, size_t count, const wchar_t* dosDevices, const wchar_t** errmsg)
+{
+	static const wchar_t* kNoPhyDrive = L"No physical drive.";
+
+	size_t nameCount;
+	const wchar_t** names = msz_manuStringListStartsWith(&nameCount, L"PhysicalDrive", dosDevices);
+	if (!names) {
+		*errmsg = kNoPhyDrive;
+		return NULL;
+	}
+
+	UINT32* ids = validateDiskIds(diskIds, count, names, nameCount, errmsg);
+	heap_free(0, names);
+	if (!ids) return NULL;
+	
+	if (ids != diskIds) count = nameCount;
+	DiskSet* ds = dskset_createFromIds(ids, count, dosDevices);
+
+	if (ids != diskIds) heap_free(0, ids);
+	return ds;
+}
+
+typedef struct EjectPlan {
+	VolumeInfo** volumes; // Nodes of the graph. Each volume once, however many disks it spans.
+	UINT32 count;
+	DWORD lockWait;
+}EjectPlan;
+
+static void
+lockVolumeTask(size_t index, void* ex) {
+	const EjectPlan* plan = (const EjectPlan*)ex;
+	VolumeInfo* vi = plan->volumes[index];
+	vi->isLocked = vol_lockWithin(vi->handle, plan->lockWait);
+}
+
+static void
+offlineVolumeTask(size_t index, void* ex) {
+	const EjectPlan* plan = (const EjectPlan*)ex;
+	VolumeInfo* vi = plan->volumes[index];
+	if (vol_getMountPoints(vi)) vol_dismount(vi->handle);
+	vol_offline(vi->handle);
+}
+
+static bool
+areVolumesLocked(const DiskInfo* di) {
+	for (UINT32 i = 0; i < di->volumeCount; ++i) {
+		if (!di->volumes[i]->isLocked) return false;
+	}
+	return true;
+}
+
+// Keep volumes just locked that an ejected disk needs. Unlock the others so they stay usable.
+static void
+planOffline(EjectPlan* plan, const IdMap* ejected) {
+	UINT32 n = 0;
+	for (UINT32 i = 0; i < plan->count; ++i) {
+		VolumeInfo* vi = plan->volumes[i];
+		if (!vi->isLocked) continue;
+
+		bool needed = false;
+		for (UINT32 j = 0; j < vi->diskCount && !needed; ++j) {
+			needed = idm_find(ejected, vi->disks[j]) != idm_kNone;
+		}
+		if (needed) {
+			plan->volumes[n++] = vi;
+		}
+		else {
+			vol_unlock(vi->handle);
+			vi->isLocked = false;
+		}
+	}
+	plan->count = n;
+}
+
+bool
+dskset_eject(DiskSet* s, UINT32 workers, DWORD lockWait, bool* ejected)
+{
+	const UINT32 volumeCount = s->volumeSet ? s->volumeSet->count : 0;
+	EjectPlan plan = {
+		.volumes = heap_alloc(0, sizeof(*plan.volumes) * (volumeCount ? volumeCount : 1)),
+		.lockWait = lockWait,
+	};
+	bool* planned = heap_alloc(HEAP_ZERO_MEMORY, sizeof(*planned) * (volumeCount ? volumeCount : 1));
+	IdMap disks;
+	if (!plan.volumes || !planned || !idm_init(&disks, s->count)) {
+		if (plan.volumes) heap_free(0, plan.volumes);
+		if (planned) heap_free(0, planned);
+		return false;
+	}
+	// Only volumes of disks in s, since s may be a part of a larger set sharing its volume set
+	for (UINT32 i = 0; i < s->count; ++i) {
+		const DiskInfo* di = s->items[i];
+		for (UINT32 j = 0; j < di->volumeCount; ++j) {
+			VolumeInfo* vi = di->volumes[j];
+			if (vi->isLocked || planned[vi->index]) continue;
+
+			planned[vi->index] = true;
+			plan.volumes[plan.count++] = vi;
+		}
+	}
+	heap_free(0, planned);
+
+	TraceSpan span;
+	trace_begin(&span, L"Lock volumes");
+	task_run(plan.count, workers, lockVolumeTask, &plan);
+	trace_end(&span);
+
+	for (UINT32 i = 0; i < s->count; ++i) {
+		ejected[i] = areVolumesLocked(s->items[i]);
+		if (ejected[i]) idm_add(&disks, s->items[i]->id, i);
+	}
+	planOffline(&plan, &disks);
+
+	trace_begin(&span, L"Offline volumes");
+	task_run(plan.count, workers, offlineVolumeTask, &plan);
+	trace_end(&span);
+
+	idm_destroy(&disks);
+	heap_free(0, plan.volumes);
+	return true;
+}
+
+bool
+dsk_flush(DiskInfo* di)
+{
+	bool ok = true;
+	for (UINT32 i = 0; i < di->volumeCount; ++i) {
+		VolumeInfo* vi = di->volumes[i];
+		if (vi->isLocked || !vol_getMountPoints(vi)) continue;
+
+		if (!FlushFileBuffers(vi->handle)) ok = false;
+	}
+	return ok;
+}
+
+bool
+dsk_online(DiskInfo* di)
+{
+	bool ok = true;
+	for (UINT32 i = 0; i < di->volumeCount; ++i) {
+		VolumeInfo* vi = di->volumes[i];
+		if (vi->isLocked) continue;
+
+		if (!vol_online(vi->handle)) ok = false;
+	}
+	return ok;
+}
+
+const wchar_t*
+vol_getMountPoints(VolumeInfo* vi)
+{
+	if (!vi->isResolved) {
+		vi->mountPoints = vol_manuMountPoints(vi->name);
+		vi->isResolved = true;
+	}
+	return vi->mountPoints;
+}
+
+HANDLE
+dsk_openAsync(const DiskInfo* di)
+{
+	HANDLE h = openDisk(di->id, FILE_FLAG_OVERLAPPED);
+	if (h != INVALID_HANDLE_VALUE) trace_addAlias(h, di->handle);
+	return h;
+}
+
+// Copy items to a larger array.
+// Return false if low memory, then items are unchanged.
+static bool
+growItems(void*** items, UINT32 count, UINT32 more) {
+	void** p = heap_alloc(0, sizeof(*p) * (count + more));
+	if (!p) return false;
+	CopyMemory(p, *items, sizeof(*p) * count);
+	heap_free(0, *items);
+	*items = p;
+	return true;
+}
+
+static VolumeInfo*
+findVolume(const VolumeSet* vs, const wchar_t* name) {
+	for (UINT32 i = 0; i < vs->count; ++i) {
+		if (!wcscmp(vs->items[i]->name, name)) return vs->items[i];
+	}
+	return NULL;
+}
+
+// Whether vi is on any disk still in s
+static bool
+isOnAnyDisk(const DiskSet* s, const VolumeInfo* vi) {
+	for (UINT32 i = 0; i < vi->diskCount; ++i) {
+		if (dskset_find(s, vi->disks[i])) return true;
+	}
+	return false;
+}
+
+// Swap the last volume into the place of vi, and destroy vi
+static void
+removeVolume(VolumeSet* vs, VolumeInfo* vi) {
+	assert(vs->items[vi->index] == vi);
+
+	VolumeInfo* last = vs->items[--vs->count];
+	vs->items[vi->index] = last;
+	last->index = vi->index;
+	vol_destroy(vi);
+}
+
+// Map ids of all disks of s again, after positions changed. Nothing is allocated.
+static void
+reindex(DiskSet* s) {
+	idm_clear(&s->ids);
+	for (UINT32 i = 0; i < s->count; ++i) {
+		idm_add(&s->ids, s->items[i]->id, i);
+	}
+}
+
+bool
+dskset_index(DiskSet* s)
+{
+	IdMap ids;
+	if (!idm_init(&ids, s->count)) return false;
+	for (UINT32 i = 0; i < s->count; ++i) {
+		if (!idm_add(&ids, s->items[i]->id, i)) {
+			idm_destroy(&ids);
+			return false;
+		}
+	}
+	idm_destroy(&s->ids);
+	s->ids = ids;
+	return true;
+}
+
+// Make room in s->ids for one more disk
+// Return false if low memory, then s->ids is kept
+static bool
+reserveIndex(DiskSet* s) {
+	if (s->count < idm_getCapacity(&s->ids)) return true;
+
+	IdMap ids;
+	if (!idm_init(&ids, (size_t)s->count + 1)) return false;
+	idm_destroy(&s->ids);
+	s->ids = ids;
+	reindex(s);
+	return true;
+}
+
+DiskInfo*
+dskset_find(const DiskSet* s, UINT32 id)
+{
+	const UINT32 pos = idm_find(&s->ids, id);
+	return pos == idm_kNone ? NULL : s->items[pos];
+}
+
+DiskInfo*
+dskset_addDisk(DiskSet* s, UINT32 id)
+{
+	if (dskset_find(s, id)) return NULL;
+
+	wchar_t* names = dev_manuVolumeList();
+	if (!names) return NULL;
+	IdMap disks;
+	VolumeSet* found = NULL;
+	if (idm_init(&disks, 1)) {
+		idm_add(&disks, id, 0);
+		found = volset_createFromDosDevices(names, &disks);
+		idm_destroy(&disks);
+	}
+	heap_free(0, names);
+	if (!found) found = createEmptyVolumeSet(0); // No volume at all, or low memory
+	if (!found) return NULL;
+
+	if (!s->volumeSet) s->volumeSet = createEmptyVolumeSet(0);
+	VolumeSet* vs = s->volumeSet;
+	DiskInfo* di = dsk_manuInfo(id, found->count);
+	bool ok = di
+		&& vs
+		&& reserveIndex(s)
+		&& growItems((void***)&s->items, s->count, 1)
+		&& growItems((void***)&vs->items, vs->count, found->count);
+	if (!ok) {
+		if (di) {
+			CloseHandle(di->handle);
+			heap_free(0, di);
+		}
+		volset_destroy(found);
+		return NULL;
+	}
+
+	for (UINT32 i = 0; i < found->count; ++i) {
+		VolumeInfo* vi = found->items[i];
+		VolumeInfo* known = findVolume(vs, vi->name);
+		if (known) {
+			// Spanned volume, already opened for another disk
+			vol_destroy(vi);
+			vi = known;
+		}
+		else {
+			vi->index = vs->count;
+			vs->items[vs->count++] = vi;
+		}
+		di->volumes[di->volumeCount++] = vi;
+	}
+	found->count = 0;
+	volset_destroy(found);
+
+	idm_add(&s->ids, id, s->count);
+	s->items[s->count++] = di;
+	return di;
+}
+
+bool
+dskset_removeDisk(DiskSet* s, UINT32 id)
+{
+	const UINT32 pos = idm_find(&s->ids, id);
+	if (pos == idm_kNone) return false;
+
+	DiskInfo* di = s->items[pos];
+	MoveMemory(&s->items[pos], &s->items[pos + 1], sizeof(s->items[0]) * (s->count - pos - 1));
+	--s->count;
+	reindex(s); // Disks after pos moved
+
+	for (UINT32 i = 0; i < di->volumeCount; ++i) {
+		VolumeInfo* vi = di->volumes[i];
+		if (!isOnAnyDisk(s, vi)) removeVolume(s->volumeSet, vi);
+	}
+	if (di->handle != INVALID_HANDLE_VALUE) CloseHandle(di->handle);
+	heap_free(0, di);
+	return true;
+}
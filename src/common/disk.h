@@ -1,50 +1,99 @@
-#pragma once
-
-#include <sdkddkver.h>
-#include <windows.h>
-
-#include <stdbool.h>
-
-
-typedef struct VolumeInfo {
-	HANDLE handle;
-	wchar_t name[46]; // 45 is for "Volume{xxxxxxxx-xxxx-xxxx-xxxx-xxxxxxxxxxxx}". Add 1 for padding.
-	bool isLocked;
-	wchar_t* mountPoints;
-	UINT32 diskCount;
-	UINT32 disks[1]; // Disk numbers as in "PhysicalDrive#"
-}VolumeInfo;
-
-typedef struct VolumeSet {
-	UINT32 count;
-	VolumeInfo** items;
-}VolumeSet;
-
-
-typedef struct DiskInfo {
-	HANDLE handle;
-	UINT32 id;
-	// wchar_t name[28]; // 28 is to hold "\\.\PhysicalDrive##########" with 10 digits (enough for UINT32).
-	UINT32 volumeCount;
-	VolumeInfo* volumes[1];
-}DiskInfo;
-
-typedef struct DiskSet {
-	VolumeSet* volumeSet;
-	UINT32 count;
-	DiskInfo** items;
-}DiskSet;
-
-
-int
-dskid_parse(const wchar_t* t);
-
-void
-dskset_destroy(DiskSet* s);
-
-DiskSet*
-dskset_create(const UINT32* diskIds, size_t count, const wchar_t* dosDevices, const wchar_t** errmsg);
-
-// Do 3 things to related volumes in order: // 1. Lock; 2. Dismount; 3. Offline.
-bool
-dsk_eject(DiskInfo* di);
+#pragma once
+
+#include <sdkddkver.h>
+#include <windows.h>
+
+#include <stdbool.h>
+
+#include "idmap.h"
+
+
+typedef struct VolumeInfo {
+	HANDLE handle;
+	UINT32 index; // Position in VolumeSet
+	wchar_t name[46]; // 45 is for "Volume{xxxxxxxx-xxxx-xxxx-xxxx-xxxxxxxxxxxx}". Add 1 for padding.
+	bool isLocked;
+	bool isResolved; // mountPoints fetched
+	wchar_t* mountPoints; // Use vol_getMountPoints. Fetched on first use, since only listing shows them.
+	UINT32 diskCount;
+	UINT32 disks[1]; // Disk numbers as in "PhysicalDrive#"
+}VolumeInfo;
+
+typedef struct VolumeSet {
+	UINT32 count;
+	VolumeInfo** items;
+}VolumeSet;
+
+
+typedef struct DiskInfo {
+	HANDLE handle;
+	UINT32 id;
+	// wchar_t name[28]; // 28 is to hold "\\.\PhysicalDrive##########" with 10 digits (enough for UINT32).
+	UINT32 volumeCount;
+	VolumeInfo* volumes[1];
+}DiskInfo;
+
+typedef struct DiskSet {
+	VolumeSet* volumeSet;
+	UINT32 count;
+	DiskInfo** items;
+	IdMap ids; // Disk number to position in items
+}DiskSet;
+
+
+int
+dskid_parse(const wchar_t* t);
+
+void
+dskset_destroy(DiskSet* s);
+
+// Only volumes on the given disks are scanned, so naming a few disks is fast on hosts with many volumes.
+DiskSet*
+dskset_create(const UINT32* diskIds, size_t count, const wchar_t* dosDevices, const wchar_t** errmsg);
+
+// Map disk numbers to positions in s, for a set not made by dskset_create. Old s->ids is destroyed.
+// Return false if low memory, or duplicate disk numbers in s
+bool
+dskset_index(DiskSet* s);
+
+// Return: disk of id in s, or NULL if not in s
+DiskInfo*
+dskset_find(const DiskSet* s, UINT32 id);
+
+// Open disk id and volumes on it, and add them to the end of s, e.g. when the disk arrives.
+// Other disks and their handles are not touched. A spanned volume already in s is shared, not opened again.
+// Return: the new disk, or NULL if failed or already in s
+DiskInfo*
+dskset_addDisk(DiskSet* s, UINT32 id);
+
+// Close disk id and its volumes not on other disks of s, and remove them from s, e.g. when the disk is gone.
+// Return false if id is not in s
+bool
+dskset_removeDisk(DiskSet* s, UINT32 id);
+
+// Prepare all disks of s to be stopped by doing 3 things to their volumes in order: 1. Lock; 2. Dismount; 3. Offline.
+// Planned up front as a graph: each volume is done once, however many disks it spans, and a disk depends on all its volumes. Independent volumes are locked by at most workers threads at the same time,
+// each waiting at most lockWait milliseconds for open files to be closed.
+// Volumes needed by a disk that can be stopped are then dismounted and taken offline. Others are unlocked and left usable.
+// ejected: ejected[i] is set true if all volumes of s->items[i] are locked, so the disk can be stopped
+// Return false if low memory. Nothing is locked then.
+bool
+dskset_eject(DiskSet* s, UINT32 workers, DWORD lockWait, bool* ejected);
+
+// Flush related volumes, leaving them mounted and usable.
+bool
+dsk_flush(DiskInfo* di);
+
+// Bring related volumes online, e.g. after they were taken offline by dskset_eject in an earlier run.
+bool
+dsk_online(DiskInfo* di);
+
+// Get mount points of the volume as multi-sz, fetching them on first call.
+// Return NULL if the volume has no mount point.
+const wchar_t*
+vol_getMountPoints(VolumeInfo* vi);
+
+// Open another handle to the disk for overlapped I/O. di.handle is synchronous.
+// Return INVALID_HANDLE_VALUE if failed. Caller must close it.
+HANDLE
+dsk_openAsync(const DiskInfo* di);
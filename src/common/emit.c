@@ -0,0 +1,178 @@
+#include "emit.h"
+
+#include <strsafe.h>
+
+#include <stdarg.h>
+#include <stdio.h>
+
+#include "heap.h"
+
+
+enum {
+	kMinCapacity = 4096, // Chars
+	kCchChunk = 1024, // Chars converted at a time if a whole buffer can't be
+};
+
+void
+emit_init(Emitter* e, HANDLE h)
+{
+	DWORD mode;
+	e->handle = h;
+	e->isConsole = GetConsoleMode(h, &mode);
+	e->ok = true;
+	e->size = 0;
+	e->capacity = 0;
+	e->data = NULL;
+}
+
+void
+emit_destroy(Emitter* e)
+{
+	if (e->data) heap_free(0, e->data);
+	e->data = NULL;
+	e->size = 0;
+	e->capacity = 0;
+}
+
+static void
+writeFile(Emitter* e, const char* data, DWORD cb) {
+	DWORD written;
+	if (!WriteFile(e->handle, data, cb, &written, NULL) || written != cb) e->ok = false;
+}
+
+// Convert a chunk at a time, not splitting a surrogate pair
+static void
+writeUtf8Chunks(Emitter* e, const wchar_t* t, size_t cch) {
+	char chunk[kCchChunk * 3];
+	while (cch) {
+		int n = cch > kCchChunk ? kCchChunk : (int)cch;
+		if (n < (int)cch && IS_HIGH_SURROGATE(t[n - 1])) --n;
+		const int cb = WideCharToMultiByte(CP_UTF8, 0, t, n, chunk, sizeof(chunk), NULL, NULL);
+		if (!cb) {
+			e->ok = false;
+			return;
+		}
+		writeFile(e, chunk, (DWORD)cb);
+		t += n;
+		cch -= n;
+	}
+}
+
+static void
+writeOut(Emitter* e, const wchar_t* t, size_t cch) {
+	if (!cch) return;
+	fflush(stdout); // Text printed before by CRT goes first
+	if (e->isConsole) {
+		if (!WriteConsoleW(e->handle, t, (DWORD)cch, &(DWORD){0}, NULL)) e->ok = false;
+		return;
+	}
+
+	const int cb = WideCharToMultiByte(CP_UTF8, 0, t, (int)cch, NULL, 0, NULL, NULL);
+	char* data = cb ? heap_alloc(0, cb) : NULL;
+	if (!data) {
+		writeUtf8Chunks(e, t, cch);
+		return;
+	}
+	WideCharToMultiByte(CP_UTF8, 0, t, (int)cch, data, cb, NULL, NULL);
+	writeFile(e, data, (DWORD)cb);
+	heap_free(0, data);
+}
+
+// Return false if low memory, then data is unchanged
+static bool
+grow(Emitter* e, size_t more) {
+	size_t capacity = e->capacity ? e->capacity : kMinCapacity;
+	while (capacity < e->size + more) capacity *= 2;
+	if (capacity == e->capacity) return true;
+
+	wchar_t* data = heap_alloc(0, sizeof(*data) * capacity);
+	if (!data) return false;
+	if (e->data) {
+		CopyMemory(data, e->data, sizeof(*data) * e->size);
+		heap_free(0, e->data);
+	}
+	e->data = data;
+	e->capacity = capacity;
+	return true;
+}
+
+void
+emit_text(Emitter* e, const wchar_t* t, size_t cch)
+{
+	if (!grow(e, cch)) {
+		emit_flush(e);
+		writeOut(e, t, cch);
+		return;
+	}
+	CopyMemory(e->data + e->size, t, sizeof(*t) * cch);
+	e->size += cch;
+}
+
+void
+emit_printf(Emitter* e, const wchar_t* fmt, ...)
+{
+	wchar_t line[emit_kCchLine];
+	va_list args;
+	va_start(args, fmt);
+	StringCchVPrintfW(line, ARRAYSIZE(line), fmt, args); // Cut if too long
+	va_end(args);
+
+	size_t cch = 0;
+	StringCchLengthW(line, ARRAYSIZE(line), &cch);
+	emit_text(e, line, cch);
+}
+
+void
+emit_json(Emitter* e, const wchar_t* t)
+{
+	emit_text(e, L"\"", 1);
+	const wchar_t* run = t;
+	for (; *t; ++t) {
+		if (*t >= L' ' && *t != L'"' && *t != L'\\') continue;
+
+		emit_text(e, run, t - run);
+		if (*t == L'"' || *t == L'\\') {
+			emit_printf(e, L"\\%lc", *t);
+		}
+		else {
+			emit_printf(e, L"\\u%04X", *t);
+		}
+		run = t + 1;
+	}
+	emit_text(e, run, t - run);
+	emit_text(e, L"\"", 1);
+}
+
+void
+emit_csv(Emitter* e, const wchar_t* t)
+{
+	emit_text(e, L"\"", 1);
+	const wchar_t* run = t;
+	for (; *t; ++t) {
+		if (*t != L'"') continue;
+
+		emit_text(e, run, t - run + 1);
+		run = t; // The quote again
+	}
+	emit_text(e, run, t - run);
+	emit_text(e, L"\"", 1);
+}
+
+bool
+emit_flush(Emitter* e)
+{
+	writeOut(e, e->data, e->size);
+	e->size = 0;
+	return e->ok;
+}
+
+WORD
+emit_setAttr(Emitter* e, WORD attr)
+{
+	emit_flush(e);
+	CONSOLE_SCREEN_BUFFER_INFO info;
+	if (!e->isConsole || !GetConsoleScreenBufferInfo(e->handle, &info)) return attr;
+
+	SetConsoleTextAttribute(e->handle, attr);
+	return info.wAttributes;
+}
@@ -0,0 +1,61 @@
+#pragma once
+
+#include <sdkddkver.h>
+#include <Windows.h>
+
+#include <stdbool.h>
+
+
+#define EMIT_STATIC_TEXT(e, x) emit_text(e, x, _countof(x) - 1)
+
+
+enum {
+	emit_kCchLine = 512, // Formatted text longer than this is cut. Use emit_text for long strings.
+};
+
+// Output assembled in one growable buffer, and written with a single call by emit_flush.
+// A console gets it by WriteConsoleW. A file or pipe gets UTF-8, so redirected output keeps every part.
+// If the buffer can't grow, what's pending is written out, so no output is lost.
+// stdout of CRT is flushed before each write, so mixing with wprintf keeps the order.
+typedef struct Emitter {
+	HANDLE handle;
+	bool isConsole;
+	bool ok; // false after a failed write. Sticks until emit_destroy.
+	size_t size; // Chars in data
+	size_t capacity;
+	wchar_t* data;
+}Emitter;
+
+
+// Nothing is allocated until the first output
+void
+emit_init(Emitter* e, HANDLE h);
+
+// Pending output is dropped. Call emit_flush first to keep it.
+void
+emit_destroy(Emitter* e);
+
+void
+emit_text(Emitter* e, const wchar_t* t, size_t cch);
+
+// Like wprintf
+void
+emit_printf(Emitter* e, const wchar_t* fmt, ...);
+
+// Quoted and escaped as a JSON string
+void
+emit_json(Emitter* e, const wchar_t* t);
+
+// Quoted as a CSV field, doubling quotes in it
+void
+emit_csv(Emitter* e, const wchar_t* t);
+
+// Write pending output at once.
+// Return false if any write failed since emit_init.
+bool
+emit_flush(Emitter* e);
+
+// Flush, then set console text attribute for what follows. Nothing to set if not a console.
+// Return: attribute before, to be set back
+WORD
+emit_setAttr(Emitter* e, WORD attr);
@@ -0,0 +1,122 @@
+#include "governor.h"
+
+#include <winioctl.h>
+
+#include <stddef.h> // offsetof. GCC i686 requires this
+#include <assert.h>
+
+#include "heap.h"
+
+
+bool
+gov_readDiskPerformance(const DiskInfo* di, IoCounters* c, void* ex)
+{
+	DISK_PERFORMANCE perf;
+	DWORD cb;
+	BOOL ok = DeviceIoControl(
+		di->handle, IOCTL_DISK_PERFORMANCE, NULL, 0,
+		&perf, sizeof(perf), &cb, NULL
+	);
+	if (!ok) return false;
+
+	c->completed = (UINT64)perf.ReadCount + perf.WriteCount;
+	c->inFlight = perf.QueueDepth;
+	return true;
+}
+
+Governor*
+gov_create(const DiskSet* ds, DWORD idleSeconds, DWORD minGapSeconds)
+{
+	assert(ds && ds->count);
+
+	Governor* g = heap_alloc(HEAP_ZERO_MEMORY, offsetof(Governor, disks[ds->count]));
+	if (!g) return NULL;
+
+	g->source = gov_readDiskPerformance;
+	g->idle = idleSeconds * 1000ULL;
+	g->minGap = minGapSeconds * 1000ULL;
+	g->count = ds->count;
+	g->diskCapacity = ds->count;
+	for (UINT32 i = 0; i < ds->count; ++i) {
+		g->disks[i].disk = ds->items[i];
+	}
+	return g;
+}
+
+void
+gov_destroy(Governor* g)
+{
+	if (g) heap_free(0, g);
+}
+
+Governor*
+gov_addDisk(Governor* g, DiskInfo* di)
+{
+	Governor* t = g;
+	if (g->count == g->diskCapacity) {
+		const UINT32 capacity = g->diskCapacity * 2;
+		t = heap_alloc(0, offsetof(Governor, disks[capacity]));
+		if (!t) return NULL;
+
+		CopyMemory(t, g, offsetof(Governor, disks[g->count]));
+		heap_free(0, g);
+		t->diskCapacity = capacity;
+	}
+	t->disks[t->count++] = (GovernorDisk){ .disk = di };
+	return t;
+}
+
+void
+gov_removeDisk(Governor* g, const DiskInfo* di)
+{
+	UINT32 i = 0;
+	while (i < g->count && g->disks[i].disk != di) ++i;
+	if (i == g->count) return;
+
+	MoveMemory(&g->disks[i], &g->disks[i + 1], sizeof(g->disks[0]) * (g->count - i - 1));
+	--g->count;
+}
+
+void
+gov_setSource(Governor* g, IoCounterSource source, void* ex)
+{
+	assert(source);
+
+	g->source = source;
+	g->sourceEx = ex;
+}
+
+static bool
+shouldStop(const Governor* g, const GovernorDisk* d, UINT64 now) {
+	if (d->isStopped || d->last.inFlight) return false;
+	if (now - d->lastIo < g->idle) return false;
+	return !d->lastStop || now - d->lastStop >= g->minGap;
+}
+
+UINT32
+gov_tick(Governor* g, UINT64 now, GovernorStop stop, void* ex)
+{
+	UINT32 stopped = 0;
+	for (UINT32 i = 0; i < g->count; ++i) {
+		GovernorDisk* d = &g->disks[i];
+		IoCounters c;
+		if (!g->source(d->disk, &c, g->sourceEx)) continue;
+
+		// The first reading only sets the baseline, the disk may have been busy just before.
+		if (!d->hasCounters || c.completed != d->last.completed || c.inFlight) {
+			d->lastIo = now;
+			d->isStopped = false;
+		}
+		d->last = c;
+		d->hasCounters = true;
+		if (!shouldStop(g, d, now)) continue;
+
+		d->lastStop = now;
+		if (!stop(d->disk, (DWORD)((now - d->lastIo) / 1000), ex)) continue;
+		d->isStopped = true;
+		++stopped;
+		// Don't take I/O of stopping, e.g. flushing volumes, as a wake up.
+		if (g->source(d->disk, &c, g->sourceEx)) d->last = c;
+	}
+	return stopped;
+}
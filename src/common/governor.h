@@ -0,0 +1,71 @@
+#pragma once
+
+#include <sdkddkver.h>
+#include <Windows.h>
+
+#include <stdbool.h>
+
+#include "disk.h"
+
+
+typedef struct IoCounters {
+	UINT64 completed; // Reads and writes completed
+	UINT32 inFlight; // Requests queued or being served
+}IoCounters;
+
+// Read I/O counters of a disk. Return false if not available.
+typedef bool (*IoCounterSource)(const DiskInfo* di, IoCounters* c, void* ex);
+
+// Stop an idle disk. Return false if failed.
+typedef bool (*GovernorStop)(DiskInfo* di, DWORD idleSeconds, void* ex);
+
+typedef struct GovernorDisk {
+	DiskInfo* disk;
+	IoCounters last;
+	bool hasCounters;
+	bool isStopped; // Stopped and no I/O seen since
+	UINT64 lastIo; // Tick count when I/O was last seen
+	UINT64 lastStop; // Tick count of last stop attempt, 0 if none
+}GovernorDisk;
+
+typedef struct Governor {
+	IoCounterSource source;
+	void* sourceEx;
+	UINT64 idle; // Milliseconds without I/O before stopping
+	UINT64 minGap; // Milliseconds between two stops of a disk
+	UINT32 count;
+	UINT32 diskCapacity; // Of disks. Grown by doubling as disks arrive.
+	GovernorDisk disks[1];
+}Governor;
+
+
+// Read counters with IOCTL_DISK_PERFORMANCE. ex is not used.
+bool
+gov_readDiskPerformance(const DiskInfo* di, IoCounters* c, void* ex);
+
+// Govern all disks in ds, reading counters with gov_readDiskPerformance. ds must outlive the governor.
+Governor*
+gov_create(const DiskSet* ds, DWORD idleSeconds, DWORD minGapSeconds);
+
+void
+gov_destroy(Governor* g);
+
+// Start governing di, e.g. after it arrived. Its first counters only set the baseline.
+// Return: the governor, moved if it had to grow. NULL if low memory, then g is unchanged.
+Governor*
+gov_addDisk(Governor* g, DiskInfo* di);
+
+// Stop governing di, e.g. before it's removed from its disk set.
+void
+gov_removeDisk(Governor* g, const DiskInfo* di);
+
+// Replace counter source, e.g. to replay recorded counters.
+void
+gov_setSource(Governor* g, IoCounterSource source, void* ex);
+
+// Read counters of all disks, and stop those idle for long enough.
+// A disk is skipped if it has I/O in flight, or was stopped less than minGap ago.
+// now: Tick count
+// Return: count of disks stopped
+UINT32
+gov_tick(Governor* g, UINT64 now, GovernorStop stop, void* ex);
@@ -1,17 +1,22 @@
-#pragma once
-
-#include <sdkddkver.h>
-#include <Windows.h>
-
-#include <stdbool.h>
-
-
-static inline void*
-heap_alloc(DWORD flags, size_t cb) {
-	return HeapAlloc(GetProcessHeap(), flags, cb);
-}
-
-static inline bool
-heap_free(DWORD flags, void* mem) {
-	return HeapFree(GetProcessHeap(), flags, mem);
-}
+#pragma once
+
+#include <sdkddkver.h>
+#include <Windows.h>
+
+#include <stdbool.h>
+
+#include "stats.h"
+
+
+static inline void*
+heap_alloc(DWORD flags, size_t cb) {
+	void* mem = HeapAlloc(GetProcessHeap(), flags, cb);
+	stats_onAlloc(mem, cb);
+	return mem;
+}
+
+static inline bool
+heap_free(DWORD flags, void* mem) {
+	stats_onFree(mem);
+	return HeapFree(GetProcessHeap(), flags, mem);
+}
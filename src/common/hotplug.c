@@ -0,0 +1,199 @@
+#include "hotplug.h"
+
+#include <cfgmgr32.h>
+#pragma comment(lib, "cfgmgr32.lib")
+#include <strsafe.h>
+
+#include <assert.h>
+
+#include "heap.h"
+#include "devlist.h"
+
+
+enum {
+	kMinCapacity = 16,
+	kMaxPath = 1024, // Interface paths are much shorter
+};
+
+// Copy items to a larger array.
+// Return false if low memory, then items are unchanged.
+static bool
+grow(void** items, UINT32* capacity, UINT32 count, size_t cbItem) {
+	if (count < *capacity) return true;
+
+	const UINT32 n = *capacity ? *capacity * 2 : kMinCapacity;
+	void* p = heap_alloc(0, cbItem * n);
+	if (!p) return false;
+	if (*items) {
+		CopyMemory(p, *items, cbItem * count);
+		heap_free(0, *items);
+	}
+	*items = p;
+	*capacity = n;
+	return true;
+}
+
+// Lock must be held
+static bool
+postLocked(Hotplug* hp, HotplugKind kind, UINT32 diskId) {
+	if (!grow((void**)&hp->events, &hp->capacity, hp->count, sizeof(*hp->events))) return false;
+	hp->events[hp->count++] = (HotplugEvent){ .kind = kind, .diskId = diskId };
+	SetEvent(hp->event);
+	return true;
+}
+
+// Lock must be held
+// Return: index of path, or pathCount if not found
+static UINT32
+findPath(const Hotplug* hp, const wchar_t* path) {
+	UINT32 i = 0;
+	while (i < hp->pathCount && lstrcmpi(hp->paths[i].path, path)) ++i;
+	return i;
+}
+
+// Remember the disk number of an interface path.
+// Lock must be held
+static void
+addPath(Hotplug* hp, const wchar_t* path, UINT32 diskId) {
+	const UINT32 i = findPath(hp, path);
+	if (i < hp->pathCount) {
+		hp->paths[i].diskId = diskId;
+		return;
+	}
+
+	size_t cch;
+	if (FAILED(StringCchLength(path, kMaxPath, &cch))) return;
+	if (!grow((void**)&hp->paths, &hp->pathCapacity, hp->pathCount, sizeof(*hp->paths))) return;
+	wchar_t* copy = heap_alloc(0, sizeof(*copy) * (cch + 1));
+	if (!copy) return;
+	StringCchCopy(copy, cch + 1, path);
+	hp->paths[hp->pathCount++] = (HotplugPath){ .path = copy, .diskId = diskId };
+}
+
+// Forget an interface path.
+// Lock must be held
+// Return false if the path was not seen
+static bool
+removePath(Hotplug* hp, const wchar_t* path, UINT32* diskId) {
+	const UINT32 i = findPath(hp, path);
+	if (i == hp->pathCount) return false;
+
+	*diskId = hp->paths[i].diskId;
+	heap_free(0, hp->paths[i].path);
+	hp->paths[i] = hp->paths[--hp->pathCount];
+	return true;
+}
+
+// Called on a system thread. The number of an arriving disk is read here, it can't be read once the disk is gone.
+static DWORD CALLBACK
+onNotification(HCMNOTIFICATION notification, PVOID context, CM_NOTIFY_ACTION action, PCM_NOTIFY_EVENT_DATA data, DWORD cb) {
+	Hotplug* hp = (Hotplug*)context;
+	const wchar_t* path = data->u.DeviceInterface.SymbolicLink;
+	DWORD number;
+
+	switch (action) {
+	case CM_NOTIFY_ACTION_DEVICEINTERFACEARRIVAL:
+		if (!dev_getDiskNumber(path, &number)) break;
+		AcquireSRWLockExclusive(&hp->lock);
+		addPath(hp, path, number);
+		postLocked(hp, hp_kArrival, number);
+		ReleaseSRWLockExclusive(&hp->lock);
+		break;
+	case CM_NOTIFY_ACTION_DEVICEINTERFACEREMOVAL:
+		AcquireSRWLockExclusive(&hp->lock);
+		if (removePath(hp, path, &number)) postLocked(hp, hp_kRemoval, number);
+		ReleaseSRWLockExclusive(&hp->lock);
+		break;
+	}
+	return ERROR_SUCCESS;
+}
+
+// Learn numbers of disks present before the subscription, so their removal is reported by number.
+// Each is posted as an arrival too: the caller listed its disks before subscribing, and may have missed one
+// attached in between. Disks it has are skipped by it.
+static void
+addPresentPaths(Hotplug* hp) {
+	wchar_t* interfaces = dev_manuDiskInterfaces();
+	if (!interfaces) return;
+
+	for (const wchar_t* p = interfaces; *p; p += lstrlen(p) + 1) {
+		DWORD number;
+		if (!dev_getDiskNumber(p, &number)) continue;
+		AcquireSRWLockExclusive(&hp->lock);
+		if (findPath(hp, p) == hp->pathCount) {
+			addPath(hp, p, number);
+			postLocked(hp, hp_kArrival, number);
+		}
+		ReleaseSRWLockExclusive(&hp->lock);
+	}
+	heap_free(0, interfaces);
+}
+
+Hotplug*
+hp_create(bool listen)
+{
+	Hotplug* hp = heap_alloc(HEAP_ZERO_MEMORY, sizeof(*hp));
+	if (!hp) return NULL;
+
+	InitializeSRWLock(&hp->lock);
+	hp->event = CreateEvent(NULL, TRUE, FALSE, NULL);
+	if (!hp->event) {
+		heap_free(0, hp);
+		return NULL;
+	}
+	if (!listen) return hp;
+
+	// Subscribe before listing present disks, so a disk attached in between is seen by one or the other
+	CM_NOTIFY_FILTER filter = {
+		.cbSize = sizeof(filter),
+		.FilterType = CM_NOTIFY_FILTER_TYPE_DEVICEINTERFACE,
+		.u.DeviceInterface.ClassGuid = dev_kDiskInterface,
+	};
+	HCMNOTIFICATION notification;
+	if (CM_Register_Notification(&filter, hp, onNotification, &notification) != CR_SUCCESS) {
+		hp_destroy(hp);
+		return NULL;
+	}
+	hp->notification = notification;
+	addPresentPaths(hp);
+	return hp;
+}
+
+void
+hp_destroy(Hotplug* hp)
+{
+	if (!hp) return;
+
+	if (hp->notification) CM_Unregister_Notification((HCMNOTIFICATION)hp->notification);
+	for (UINT32 i = 0; i < hp->pathCount; ++i) {
+		heap_free(0, hp->paths[i].path);
+	}
+	if (hp->paths) heap_free(0, hp->paths);
+	if (hp->events) heap_free(0, hp->events);
+	CloseHandle(hp->event);
+	heap_free(0, hp);
+}
+
+bool
+hp_post(Hotplug* hp, HotplugKind kind, UINT32 diskId)
+{
+	AcquireSRWLockExclusive(&hp->lock);
+	bool ok = postLocked(hp, kind, diskId);
+	ReleaseSRWLockExclusive(&hp->lock);
+	return ok;
+}
+
+UINT32
+hp_take(Hotplug* hp, HotplugEvent* events, UINT32 count)
+{
+	assert(events);
+
+	AcquireSRWLockExclusive(&hp->lock);
+	const UINT32 n = min(count, hp->count);
+	CopyMemory(events, hp->events, sizeof(*events) * n);
+	MoveMemory(hp->events, hp->events + n, sizeof(*events) * (hp->count - n));
+	hp->count -= n;
+	if (!hp->count) ResetEvent(hp->event);
+	ReleaseSRWLockExclusive(&hp->lock);
+	return n;
+}
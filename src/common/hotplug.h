@@ -0,0 +1,59 @@
+#pragma once
+
+#include <sdkddkver.h>
+#include <Windows.h>
+
+#include <stdbool.h>
+
+
+typedef enum HotplugKind {
+	hp_kArrival,
+	hp_kRemoval,
+}HotplugKind;
+
+typedef struct HotplugEvent {
+	HotplugKind kind;
+	UINT32 diskId; // As in "PhysicalDrive#"
+}HotplugEvent;
+
+// Disk interface seen, to tell the number of a disk when it's gone
+typedef struct HotplugPath {
+	wchar_t* path;
+	UINT32 diskId;
+}HotplugPath;
+
+// Queue of disk arrivals and removals, filled by device interface notifications on a system thread.
+typedef struct Hotplug {
+	HANDLE event; // Set while events are queued. Wait on it with other handles.
+	SRWLOCK lock;
+	HANDLE notification; // HCMNOTIFICATION. NULL if events are only posted by hp_post.
+	UINT32 count;
+	UINT32 capacity;
+	HotplugEvent* events;
+	UINT32 pathCount;
+	UINT32 pathCapacity;
+	HotplugPath* paths;
+}Hotplug;
+
+
+// Subscribe to arrival and removal of disk device interfaces.
+// Disks present at subscription are queued as arrivals too, so none attached since the caller listed disks is missed.
+// The caller skips arrivals of disks it already has.
+// listen: false to take events only from hp_post, e.g. to replay them without devices.
+// Return NULL if failed.
+Hotplug*
+hp_create(bool listen);
+
+// Unsubscribe, and wait for a notification being delivered.
+void
+hp_destroy(Hotplug* hp);
+
+// Queue an event, as notifications do.
+// Return false if low memory.
+bool
+hp_post(Hotplug* hp, HotplugKind kind, UINT32 diskId);
+
+// Take queued events in order, at most count. The event is reset when the queue is empty.
+// Return: count of events taken
+UINT32
+hp_take(Hotplug* hp, HotplugEvent* events, UINT32 count);
@@ -0,0 +1,85 @@
+#include "idmap.h"
+
+#include <assert.h>
+
+#include "heap.h"
+
+
+enum {
+	kMinCapacity = 16, // 2^4
+};
+
+// Fibonacci hashing. Disk numbers are mostly small and dense, so spread them over the table.
+static inline UINT32
+getSlot(const IdMap* m, UINT32 id) {
+	return (id * 2654435769u) >> m->shift;
+}
+
+bool
+idm_init(IdMap* m, size_t count)
+{
+	assert(count <= MAXDWORD / 4);
+
+	size_t capacity = kMinCapacity;
+	UINT32 shift = 32 - 4;
+	while (capacity < count * 2) {
+		capacity *= 2;
+		--shift;
+	}
+
+	m->entries = heap_alloc(0, sizeof(*m->entries) * capacity);
+	if (!m->entries) return false;
+	for (size_t i = 0; i < capacity; ++i) {
+		m->entries[i].value = idm_kNone;
+	}
+	m->mask = (UINT32)(capacity - 1);
+	m->shift = shift;
+	return true;
+}
+
+void
+idm_destroy(IdMap* m)
+{
+	if (m->entries) heap_free(0, m->entries);
+	m->entries = NULL;
+}
+
+void
+idm_clear(IdMap* m)
+{
+	for (UINT32 i = 0; i <= m->mask; ++i) {
+		m->entries[i].value = idm_kNone;
+	}
+}
+
+UINT32
+idm_getCapacity(const IdMap* m)
+{
+	return (m->mask + 1) / 2;
+}
+
+bool
+idm_add(IdMap* m, UINT32 id, UINT32 value)
+{
+	assert(value != idm_kNone);
+
+	for (UINT32 i = getSlot(m, id);; i = (i + 1) & m->mask) {
+		IdMapEntry* e = &m->entries[i];
+		if (e->value == idm_kNone) {
+			e->id = id;
+			e->value = value;
+			return true;
+		}
+		if (e->id == id) return false;
+	}
+}
+
+UINT32
+idm_find(const IdMap* m, UINT32 id)
+{
+	for (UINT32 i = getSlot(m, id);; i = (i + 1) & m->mask) {
+		const IdMapEntry* e = &m->entries[i];
+		if (e->value == idm_kNone) return idm_kNone;
+		if (e->id == id) return e->value;
+	}
+}
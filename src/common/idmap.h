@@ -0,0 +1,50 @@
+#pragma once
+
+#include <sdkddkver.h>
+#include <Windows.h>
+
+#include <stdbool.h>
+
+
+enum {
+	idm_kNone = MAXDWORD,
+};
+
+typedef struct IdMapEntry {
+	UINT32 id;
+	UINT32 value; // idm_kNone if the entry is free
+}IdMapEntry;
+
+// Map from disk number to a value, like position of the disk in a set.
+// Open addressing, with capacity at least twice the count, so lookup takes constant time.
+typedef struct IdMap {
+	UINT32 mask; // Capacity - 1
+	UINT32 shift; // 32 - log2(capacity)
+	IdMapEntry* entries;
+}IdMap;
+
+
+// count: Max count of ids to be added
+// Return false if low memory
+bool
+idm_init(IdMap* m, size_t count);
+
+void
+idm_destroy(IdMap* m);
+
+// Remove all ids, keeping the capacity
+void
+idm_clear(IdMap* m);
+
+// Return: max count of ids the map takes in constant time
+UINT32
+idm_getCapacity(const IdMap* m);
+
+// value: Must not be idm_kNone
+// Return false if id is already in the map. The value is kept then.
+bool
+idm_add(IdMap* m, UINT32 id, UINT32 value);
+
+// Return: value of id, or idm_kNone if id is not in the map
+UINT32
+idm_find(const IdMap* m, UINT32 id);
@@ -0,0 +1,409 @@
+#include "inventory.h"
+
+#include <strsafe.h>
+
+#include <stddef.h> // offsetof. GCC i686 requires this
+#include <assert.h>
+
+#include "heap.h"
+
+
+enum {
+	kMagic = 0x49504453, // "SDPI"
+	kVersion = 1,
+	kNoText = 0xFFFFFFFF,
+};
+
+// File layout: InvFileHeader, InvDiskRecord[diskCount], InvVolumeRecord[volumeCount], UINT32 refs[refCount], wchar_t text[textCch]
+typedef struct InvFileHeader {
+	DWORD magic;
+	DWORD version;
+	DWORD unitInfoSize;
+	DWORD diskCount;
+	UINT64 deviceHash;
+	DWORD volumeCount;
+	DWORD refCount;
+	DWORD textCch;
+	DWORD reserved;
+}InvFileHeader;
+
+typedef struct InvDiskRecord {
+	UINT32 id;
+	UINT32 hasInfo;
+	UINT32 firstRef; // refs[firstRef] is the index of first volume
+	UINT32 volumeCount;
+	UnitInfo info;
+}InvDiskRecord;
+
+typedef struct InvVolumeRecord {
+	wchar_t name[46];
+	UINT32 mountPoints; // Offset of multisz in text, or kNoText
+	UINT32 firstRef; // refs[firstRef] is the first disk number
+	UINT32 diskCount;
+}InvVolumeRecord;
+
+typedef struct InvFileView {
+	const InvFileHeader* header;
+	const InvDiskRecord* disks;
+	const InvVolumeRecord* volumes;
+	const UINT32* refs;
+	const wchar_t* text;
+}InvFileView;
+
+
+enum {
+	kFnvBasis = 14695981039346656037ULL,
+};
+
+// FNV-1a, going on from h. A NUL is hashed after t, so "ab" "c" differs from "a" "bc".
+static UINT64
+hashName(UINT64 h, const wchar_t* t) {
+	for (; *t; ++t) {
+		h ^= (WORD)*t;
+		h *= 1099511628211ULL;
+	}
+	return h * 1099511628211ULL;
+}
+
+static inline bool
+isDeviceName(const wchar_t* t) {
+	return !wcsncmp(t, L"PhysicalDrive", 13) || !wcsncmp(t, L"Volume", 6);
+}
+
+// Interface path "\\?\..." or mount point "X:\...". Other DOS device names have no backslash.
+static inline bool
+isIdentity(const wchar_t* t) {
+	return t[0] == L'\\' || (t[0] && t[1] == L':' && t[2] == L'\\');
+}
+
+UINT64
+inv_hashDevices(const wchar_t* dosDevices)
+{
+	assert(dosDevices);
+
+	UINT64 sum = 0;
+	const wchar_t* p = dosDevices;
+	while (*p) {
+		if (!isDeviceName(p)) {
+			p += lstrlen(p) + 1;
+			continue;
+		}
+
+		UINT64 h = hashName(kFnvBasis, p);
+		for (p += lstrlen(p) + 1; *p && isIdentity(p); p += lstrlen(p) + 1) {
+			h = hashName(h, p);
+		}
+		sum += h;
+	}
+	return sum;
+}
+
+// Count of wchar_t in multisz, including the final NUL
+static DWORD
+getMultiszCch(const wchar_t* msz) {
+	const wchar_t* p = msz;
+	while (*p) {
+		p += lstrlen(p) + 1;
+	}
+	return (DWORD)(p - msz) + 1;
+}
+
+static UINT32
+findVolumeIndex(const VolumeSet* vs, const VolumeInfo* vi) {
+	assert(vi->index < vs->count && vs->items[vi->index] == vi);
+	return vi->index;
+}
+
+static void
+fillFileView(InvFileView* v, BYTE* data) {
+	v->header = (const InvFileHeader*)data;
+	v->disks = (const InvDiskRecord*)(v->header + 1);
+	v->volumes = (const InvVolumeRecord*)(v->disks + v->header->diskCount);
+	v->refs = (const UINT32*)(v->volumes + v->header->volumeCount);
+	v->text = (const wchar_t*)(v->refs + v->header->refCount);
+}
+
+static UINT64
+getFileSize(const InvFileHeader* h) {
+	return sizeof(InvFileHeader)
+		+ (UINT64)sizeof(InvDiskRecord) * h->diskCount
+		+ (UINT64)sizeof(InvVolumeRecord) * h->volumeCount
+		+ (UINT64)sizeof(UINT32) * h->refCount
+		+ (UINT64)sizeof(wchar_t) * h->textCch;
+}
+
+bool
+inv_save(const wchar_t* path, UINT64 deviceHash, const DiskSet* ds, const InventoryItem* items)
+{
+	const VolumeSet* vs = ds->volumeSet;
+	InvFileHeader hdr = {
+		.magic = kMagic,
+		.version = kVersion,
+		.unitInfoSize = sizeof(UnitInfo),
+		.diskCount = ds->count,
+		.deviceHash = deviceHash,
+		.volumeCount = vs ? vs->count : 0,
+	};
+	for (UINT32 i = 0; i < ds->count; ++i) {
+		hdr.refCount += ds->items[i]->volumeCount;
+	}
+	for (UINT32 i = 0; i < hdr.volumeCount; ++i) {
+		VolumeInfo* vi = vs->items[i];
+		hdr.refCount += vi->diskCount;
+		const wchar_t* mountPoints = vol_getMountPoints(vi);
+		if (mountPoints) hdr.textCch += getMultiszCch(mountPoints);
+	}
+
+	const UINT64 size = getFileSize(&hdr);
+	if (size > MAXDWORD) return false;
+	BYTE* data = heap_alloc(HEAP_ZERO_MEMORY, (size_t)size);
+	if (!data) return false;
+	*(InvFileHeader*)data = hdr;
+	InvFileView v;
+	fillFileView(&v, data);
+
+	UINT32* refs = (UINT32*)v.refs;
+	UINT32 ref = 0;
+	for (UINT32 i = 0; i < ds->count; ++i) {
+		const DiskInfo* di = ds->items[i];
+		assert(items[i].disk == di);
+		InvDiskRecord* r = (InvDiskRecord*)&v.disks[i];
+		r->id = di->id;
+		r->hasInfo = items[i].hasInfo;
+		if (items[i].hasInfo) r->info = items[i].info;
+		r->firstRef = ref;
+		r->volumeCount = di->volumeCount;
+		for (UINT32 j = 0; j < di->volumeCount; ++j) {
+			refs[ref++] = findVolumeIndex(vs, di->volumes[j]);
+		}
+	}
+
+	wchar_t* text = (wchar_t*)v.text;
+	DWORD textPos = 0;
+	for (UINT32 i = 0; i < hdr.volumeCount; ++i) {
+		VolumeInfo* vi = vs->items[i];
+		InvVolumeRecord* r = (InvVolumeRecord*)&v.volumes[i];
+		StringCchCopy(r->name, ARRAYSIZE(r->name), vi->name);
+		r->mountPoints = kNoText;
+		const wchar_t* mountPoints = vol_getMountPoints(vi);
+		if (mountPoints) {
+			DWORD cch = getMultiszCch(mountPoints);
+			CopyMemory(text + textPos, mountPoints, sizeof(wchar_t) * cch);
+			r->mountPoints = textPos;
+			textPos += cch;
+		}
+		r->firstRef = ref;
+		r->diskCount = vi->diskCount;
+		for (UINT32 j = 0; j < vi->diskCount; ++j) {
+			refs[ref++] = vi->disks[j];
+		}
+	}
+
+	bool ok = false;
+	HANDLE f = CreateFile(path, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (f != INVALID_HANDLE_VALUE) {
+		DWORD cb;
+		ok = WriteFile(f, data, (DWORD)size, &cb, NULL) && cb == size;
+		CloseHandle(f);
+		if (!ok) DeleteFile(path);
+	}
+	heap_free(0, data);
+	return ok;
+}
+
+// Return: pointer to heap copy of the multisz at offset in text, or NULL if out of range.
+static wchar_t*
+manuMountPoints(const InvFileView* v, UINT32 offset) {
+	const DWORD textCch = v->header->textCch;
+	if (offset >= textCch) return NULL;
+
+	// Must end with an empty string inside text
+	const wchar_t* msz = v->text + offset;
+	DWORD cch = 0;
+	bool terminated = false;
+	for (DWORD i = offset; i < textCch; ++i) {
+		if (!v->text[i] && (i == offset || !v->text[i - 1])) {
+			cch = i - offset + 1;
+			terminated = true;
+			break;
+		}
+	}
+	if (!terminated) return NULL;
+
+	wchar_t* p = heap_alloc(0, sizeof(*p) * cch);
+	if (p) CopyMemory(p, msz, sizeof(*p) * cch);
+	return p;
+}
+
+static VolumeInfo*
+restoreVolume(const InvFileView* v, const InvVolumeRecord* r) {
+	if (r->firstRef > v->header->refCount || r->diskCount > v->header->refCount - r->firstRef) return NULL;
+
+	VolumeInfo* vi = heap_alloc(0, offsetof(VolumeInfo, disks[r->diskCount]));
+	if (!vi) return NULL;
+
+	vi->handle = INVALID_HANDLE_VALUE;
+	StringCchCopyN(vi->name, ARRAYSIZE(vi->name), r->name, ARRAYSIZE(r->name) - 1);
+	vi->isLocked = false;
+	vi->isResolved = true;
+	vi->mountPoints = NULL;
+	if (r->mountPoints != kNoText) {
+		vi->mountPoints = manuMountPoints(v, r->mountPoints);
+		if (!vi->mountPoints) {
+			heap_free(0, vi);
+			return NULL;
+		}
+	}
+	vi->diskCount = r->diskCount;
+	for (UINT32 i = 0; i < r->diskCount; ++i) {
+		vi->disks[i] = v->refs[r->firstRef + i];
+	}
+	return vi;
+}
+
+static VolumeSet*
+restoreVolumeSet(const InvFileView* v) {
+	const DWORD count = v->header->volumeCount;
+	VolumeSet* s = heap_alloc(0, sizeof(*s));
+	if (!s) return NULL;
+	s->count = 0;
+	s->items = heap_alloc(0, sizeof(s->items[0]) * (count ? count : 1));
+	if (!s->items) {
+		heap_free(0, s);
+		return NULL;
+	}
+
+	for (DWORD i = 0; i < count; ++i) {
+		VolumeInfo* vi = restoreVolume(v, &v->volumes[i]);
+		if (!vi) break;
+		vi->index = s->count;
+		s->items[s->count++] = vi;
+	}
+	return s;
+}
+
+static DiskInfo*
+restoreDisk(const InvFileView* v, const InvDiskRecord* r, const VolumeSet* vs) {
+	if (r->firstRef > v->header->refCount || r->volumeCount > v->header->refCount - r->firstRef) return NULL;
+
+	DiskInfo* di = heap_alloc(0, offsetof(DiskInfo, volumes[r->volumeCount]));
+	if (!di) return NULL;
+
+	di->handle = INVALID_HANDLE_VALUE;
+	di->id = r->id;
+	di->volumeCount = r->volumeCount;
+	for (UINT32 i = 0; i < r->volumeCount; ++i) {
+		UINT32 index = v->refs[r->firstRef + i];
+		if (index >= vs->count) {
+			heap_free(0, di);
+			return NULL;
+		}
+		di->volumes[i] = vs->items[index];
+	}
+	return di;
+}
+
+static const InvDiskRecord*
+findDiskRecord(const InvFileView* v, UINT32 id) {
+	for (DWORD i = 0; i < v->header->diskCount; ++i) {
+		if (v->disks[i].id == id) return &v->disks[i];
+	}
+	return NULL;
+}
+
+static inline void
+terminateStrings(UnitInfo* info) {
+	info->vendor[unit_kLenVendorId] = L'\0';
+	info->product[unit_kLenProductId] = L'\0';
+	info->revision[unit_kLenRevision] = L'\0';
+	info->serial[unit_kLenSerial] = L'\0';
+}
+
+static Inventory*
+restoreInventory(const InvFileView* v, const UINT32* diskIds, size_t count) {
+	if (!diskIds) count = v->header->diskCount;
+	if (!count) return NULL;
+
+	Inventory* inv = heap_alloc(0, offsetof(Inventory, items[count]));
+	if (!inv) return NULL;
+	inv->count = 0;
+	inv->diskSet = heap_alloc(0, sizeof(DiskSet));
+	if (!inv->diskSet) goto err;
+	inv->diskSet->count = 0;
+	inv->diskSet->volumeSet = NULL;
+	inv->diskSet->ids.entries = NULL;
+	inv->diskSet->items = heap_alloc(0, sizeof(inv->diskSet->items[0]) * count);
+	if (!inv->diskSet->items) goto err;
+
+	VolumeSet* vs = restoreVolumeSet(v);
+	inv->diskSet->volumeSet = vs;
+	if (!vs || vs->count != v->header->volumeCount) goto err;
+
+	for (size_t i = 0; i < count; ++i) {
+		const InvDiskRecord* r = diskIds ? findDiskRecord(v, diskIds[i]) : &v->disks[i];
+		if (!r) goto err;
+		DiskInfo* di = restoreDisk(v, r, vs);
+		if (!di) goto err;
+		inv->diskSet->items[inv->diskSet->count++] = di;
+
+		InventoryItem* item = &inv->items[inv->count++];
+		item->disk = di;
+		item->hasInfo = r->hasInfo;
+		item->timedOut = false;
+		if (item->hasInfo) {
+			item->info = r->info;
+			terminateStrings(&item->info);
+		}
+	}
+	if (!dskset_index(inv->diskSet)) goto err;
+	return inv;
+
+err:
+	inv_destroy(inv);
+	return NULL;
+}
+
+void
+inv_destroy(Inventory* inv)
+{
+	if (!inv) return;
+
+	dskset_destroy(inv->diskSet);
+	heap_free(0, inv);
+}
+
+Inventory*
+inv_load(const wchar_t* path, UINT64 deviceHash, const UINT32* diskIds, size_t count)
+{
+	HANDLE f = CreateFile(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (f == INVALID_HANDLE_VALUE) return NULL;
+
+	Inventory* inv = NULL;
+	LARGE_INTEGER size;
+	HANDLE map = NULL;
+	BYTE* data = NULL;
+	if (!GetFileSizeEx(f, &size) || size.QuadPart < sizeof(InvFileHeader)) goto end;
+	map = CreateFileMapping(f, NULL, PAGE_READONLY, 0, 0, NULL);
+	if (!map) goto end;
+	data = MapViewOfFile(map, FILE_MAP_READ, 0, 0, 0);
+	if (!data) goto end;
+
+	const InvFileHeader* hdr = (const InvFileHeader*)data;
+	if (hdr->magic != kMagic
+		|| hdr->version != kVersion
+		|| hdr->unitInfoSize != sizeof(UnitInfo)
+		|| hdr->deviceHash != deviceHash
+		|| getFileSize(hdr) != (UINT64)size.QuadPart) {
+		goto end;
+	}
+
+	InvFileView v;
+	fillFileView(&v, data);
+	inv = restoreInventory(&v, diskIds, count);
+
+end:
+	if (data) UnmapViewOfFile(data);
+	if (map) CloseHandle(map);
+	CloseHandle(f);
+	return inv;
+}
@@ -0,0 +1,44 @@
+#pragma once
+
+#include <sdkddkver.h>
+#include <Windows.h>
+
+#include <stdbool.h>
+
+#include "disk.h"
+#include "unit.h"
+
+
+// A disk and the unit info queried from it
+typedef struct InventoryItem {
+	DiskInfo* disk;
+	bool hasInfo;
+	bool timedOut; // Query failed because a command timed out. Not saved.
+	UnitInfo info;
+}InventoryItem;
+
+// Disks restored from an inventory file. Disk and volume handles are INVALID_HANDLE_VALUE.
+typedef struct Inventory {
+	DiskSet* diskSet;
+	UINT32 count;
+	InventoryItem items[1];
+}Inventory;
+
+
+// Hash "PhysicalDrive#" and "Volume{...}" names in dosDevices, each with the identity that follows it as listed by dev_manuList(true).
+// So another drive taking the same number, or a volume mounted elsewhere, changes the hash. Order of names doesn't matter.
+UINT64
+inv_hashDevices(const wchar_t* dosDevices);
+
+void
+inv_destroy(Inventory* inv);
+
+// Load inventory from file, without opening any device.
+// diskIds: Disks to load, in that order. If NULL, load all disks in file.
+// Return: NULL if file is missing, broken, saved with another device hash, or lacks any of diskIds.
+Inventory*
+inv_load(const wchar_t* path, UINT64 deviceHash, const UINT32* diskIds, size_t count);
+
+// Save all disks in ds with their unit info. items[i].disk must be ds->items[i].
+bool
+inv_save(const wchar_t* path, UINT64 deviceHash, const DiskSet* ds, const InventoryItem* items);
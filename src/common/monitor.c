@@ -0,0 +1,235 @@
+#include "monitor.h"
+
+#include <stddef.h> // offsetof. GCC i686 requires this
+#include <assert.h>
+
+#include "heap.h"
+#include "task.h"
+#include "transport.h"
+
+
+static void
+freeWork(Monitor* m) {
+	if (m->queries) heap_free(0, m->queries);
+	unit_destroyPowerWork(m->work);
+	m->queries = NULL;
+	m->work = NULL;
+	m->capacity = 0;
+}
+
+// Make room to poll at least count disks through the port.
+// Return false if low memory, then the old room is kept.
+static bool
+reserveWork(Monitor* m, UINT32 count) {
+	if (count <= m->capacity) return true;
+
+	const UINT32 capacity = max(count, m->capacity * 2);
+	UnitPowerQuery* queries = heap_alloc(0, sizeof(*queries) * capacity);
+	UnitPowerWork* work = unit_createPowerWork(capacity);
+	if (!queries || !work) {
+		if (queries) heap_free(0, queries);
+		unit_destroyPowerWork(work);
+		return false;
+	}
+	freeWork(m);
+	m->queries = queries;
+	m->work = work;
+	m->capacity = capacity;
+	return true;
+}
+
+static void
+closePort(Monitor* m) {
+	for (UINT32 i = 0; i < m->count; ++i) {
+		MonitorDisk* d = &m->disks[i];
+		if (d->asyncHandle != INVALID_HANDLE_VALUE) CloseHandle(d->asyncHandle);
+		d->asyncHandle = INVALID_HANDLE_VALUE;
+	}
+	if (m->port) CloseHandle(m->port);
+	m->port = NULL;
+	freeWork(m);
+}
+
+// Without a port for every disk, fall back to the thread pool.
+// A replaced transport may not know handles opened here, so it always uses the pool.
+static void
+openPort(Monitor* m) {
+	if (!tp_isDefault()) return;
+
+	m->port = tp_createPort();
+	if (!m->port) return;
+	if (!reserveWork(m, m->count)) {
+		closePort(m);
+		return;
+	}
+
+	for (UINT32 i = 0; i < m->count; ++i) {
+		MonitorDisk* d = &m->disks[i];
+		d->asyncHandle = dsk_openAsync(d->disk);
+		if (d->asyncHandle == INVALID_HANDLE_VALUE || !tp_associate(m->port, d->asyncHandle)) {
+			closePort(m);
+			return;
+		}
+	}
+}
+
+Monitor*
+mon_create(const DiskSet* ds)
+{
+	assert(ds && ds->count);
+
+	Monitor* m = heap_alloc(HEAP_ZERO_MEMORY, offsetof(Monitor, disks[ds->count]));
+	if (!m) return NULL;
+
+	m->count = ds->count;
+	m->diskCapacity = ds->count;
+	for (UINT32 i = 0; i < ds->count; ++i) {
+		m->disks[i].disk = ds->items[i];
+		m->disks[i].asyncHandle = INVALID_HANDLE_VALUE;
+	}
+	openPort(m);
+	return m;
+}
+
+void
+mon_destroy(Monitor* m)
+{
+	if (!m) return;
+
+	closePort(m);
+	heap_free(0, m);
+}
+
+Monitor*
+mon_addDisk(Monitor* m, DiskInfo* di)
+{
+	Monitor* t = m;
+	if (m->count == m->diskCapacity) {
+		const UINT32 capacity = m->diskCapacity * 2;
+		t = heap_alloc(0, offsetof(Monitor, disks[capacity]));
+		if (!t) return NULL;
+
+		CopyMemory(t, m, offsetof(Monitor, disks[m->count]));
+		heap_free(0, m);
+		t->diskCapacity = capacity;
+	}
+	MonitorDisk* d = &t->disks[t->count++];
+	*d = (MonitorDisk){
+		.disk = di,
+		.asyncHandle = INVALID_HANDLE_VALUE,
+		.added = t->polls ? GetTickCount64() : 0,
+	};
+
+	// Without a port for the new disk, all disks fall back to the thread pool.
+	if (t->port) {
+		d->asyncHandle = dsk_openAsync(di);
+		if (d->asyncHandle == INVALID_HANDLE_VALUE
+			|| !tp_associate(t->port, d->asyncHandle)
+			|| !reserveWork(t, t->count)
+		) {
+			closePort(t);
+		}
+	}
+	return t;
+}
+
+void
+mon_removeDisk(Monitor* m, const DiskInfo* di)
+{
+	UINT32 i = 0;
+	while (i < m->count && m->disks[i].disk != di) ++i;
+	if (i == m->count) return;
+
+	// Completion of the handle may still be queued to the port. Batches wait for all of theirs, so none is.
+	if (m->disks[i].asyncHandle != INVALID_HANDLE_VALUE) CloseHandle(m->disks[i].asyncHandle);
+	MoveMemory(&m->disks[i], &m->disks[i + 1], sizeof(m->disks[0]) * (m->count - i - 1));
+	--m->count;
+}
+
+static void
+pollTask(size_t index, void* ex) {
+	MonitorDisk* d = &((Monitor*)ex)->disks[index];
+	d->lastState = d->state;
+	unit_getPowerState(d->disk->handle, (UnitQuirks*)&d->quirks, &d->state);
+}
+
+// Return false if the port broke
+static bool
+pollBatch(Monitor* m) {
+	assert(m->capacity >= m->count);
+	UnitPowerQuery* queries = m->queries;
+	for (UINT32 i = 0; i < m->count; ++i) {
+		queries[i].handle = m->disks[i].asyncHandle;
+		queries[i].quirks = m->disks[i].quirks;
+	}
+	bool ok = unit_getPowerStates(m->port, queries, m->count, m->work);
+	for (UINT32 i = 0; ok && i < m->count; ++i) {
+		MonitorDisk* d = &m->disks[i];
+		d->lastState = d->state;
+		d->state = queries[i].state;
+		d->quirks = queries[i].quirks;
+	}
+	return ok;
+}
+
+UINT32
+mon_poll(Monitor* m, UINT32 jobs)
+{
+	// A broken port stays closed. Its work is left to pending I/O, and the pool polls from now on.
+	if (m->port && !pollBatch(m)) closePort(m);
+	if (!m->port) task_run(m->count, jobs, pollTask, m);
+	const UINT64 now = GetTickCount64();
+	if (!m->polls) {
+		m->firstPoll = m->lastPoll = now;
+		++m->polls;
+		return 0;
+	}
+
+	// A state is assumed to last until the next poll sees another one
+	UINT32 changed = 0;
+	for (UINT32 i = 0; i < m->count; ++i) {
+		MonitorDisk* d = &m->disks[i];
+		d->residency[d->lastState] += now - max(m->lastPoll, d->added);
+		if (d->state == d->lastState) continue;
+		++d->transitions;
+		++changed;
+	}
+	m->lastPoll = now;
+	++m->polls;
+	return changed;
+}
+
+void
+mon_settle(Monitor* m)
+{
+	if (!m->polls) return;
+
+	const UINT64 now = GetTickCount64();
+	for (UINT32 i = 0; i < m->count; ++i) {
+		MonitorDisk* d = &m->disks[i];
+		d->residency[d->state] += now - max(m->lastPoll, d->added);
+	}
+	m->lastPoll = now;
+}
+
+// xorshift32, good enough to spread polls of many hosts
+static UINT32
+nextRandom(void) {
+	static UINT32 x;
+	if (!x) x = ((UINT32)GetTickCount64() ^ (GetCurrentProcessId() << 16)) | 1;
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	return x;
+}
+
+DWORD
+mon_getDelay(DWORD interval, UINT32 jitter)
+{
+	assert(jitter <= 100);
+
+	const UINT64 ms = interval * 1000ULL;
+	const UINT64 range = ms * jitter / 100;
+	if (!range) return (DWORD)ms;
+	return (DWORD)(ms - range + nextRandom() % (range * 2 + 1));
+}
@@ -0,0 +1,68 @@
+#pragma once
+
+#include <sdkddkver.h>
+#include <Windows.h>
+
+#include <stdbool.h>
+
+#include "disk.h"
+#include "unit.h"
+
+
+typedef struct MonitorDisk {
+	DiskInfo* disk;
+	HANDLE asyncHandle; // Overlapped handle of disk, associated with Monitor.port
+	UnitQuirks;
+	enum UnitPowerState state; // Seen by the last poll
+	enum UnitPowerState lastState; // Seen by the poll before
+	UINT64 residency[unit_kStateCount]; // Milliseconds spent in each state
+	UINT32 transitions;
+	UINT64 added; // Tick count, if added after polls began. Residency counts from it, not from the poll before.
+}MonitorDisk;
+
+// Polling through the port allocates nothing: queries and contexts of commands are kept for the monitored set,
+// and grown as disks are added. Polling by the thread pool allocates for its threads.
+typedef struct Monitor {
+	HANDLE port; // NULL if disks are polled by a thread pool instead
+	UINT32 capacity; // Of queries and work
+	UnitPowerQuery* queries;
+	UnitPowerWork* work;
+	UINT64 firstPoll; // Tick count
+	UINT64 lastPoll;
+	UINT32 polls;
+	UINT32 count;
+	UINT32 diskCapacity; // Of disks. Grown by doubling as disks arrive.
+	MonitorDisk disks[1];
+}Monitor;
+
+
+// Monitor all disks in ds. ds must outlive the monitor.
+Monitor*
+mon_create(const DiskSet* ds);
+
+void
+mon_destroy(Monitor* m);
+
+// Start polling di, e.g. after it arrived. Its state is unknown until the next poll.
+// Return: the monitor, moved if it had to grow. NULL if low memory, then m is unchanged.
+Monitor*
+mon_addDisk(Monitor* m, DiskInfo* di);
+
+// Stop polling di, e.g. before it's removed from its disk set.
+void
+mon_removeDisk(Monitor* m, const DiskInfo* di);
+
+// Poll power state of all disks. Commands to all disks are in flight at the same time through the completion port.
+// Without a port, disks are polled by jobs threads.
+// Time since the last poll counts for the state seen then.
+// Return: count of disks whose state changed
+UINT32
+mon_poll(Monitor* m, UINT32 jobs);
+
+// Count time since the last poll without polling. Call before reading residency.
+void
+mon_settle(Monitor* m);
+
+// Return: milliseconds to wait before next poll, interval randomized by up to jitter percent either way.
+DWORD
+mon_getDelay(DWORD interval, UINT32 jitter);
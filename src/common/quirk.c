@@ -0,0 +1,185 @@
+#include "quirk.h"
+
+#include <sdkddkver.h>
+#include <Windows.h>
+#include <strsafe.h>
+
+#include "heap.h"
+
+
+enum {
+	kMagic = 0x51504453, // "SDPQ"
+	kVersion = 1,
+	kMaxRecords = 4096,
+};
+
+typedef struct QuirkRecord {
+	wchar_t vendor[unit_kCchVendorId];
+	wchar_t product[unit_kCchProductId];
+	wchar_t revision[unit_kCchRevision];
+	wchar_t serial[unit_kCchSerial];
+	BYTE quirks;
+}QuirkRecord;
+
+typedef struct QuirkFileHeader {
+	DWORD magic;
+	DWORD version;
+	DWORD recordSize;
+	DWORD count;
+}QuirkFileHeader;
+
+static SRWLOCK gLock = SRWLOCK_INIT;
+static QuirkRecord* gRecords;
+static UINT32 gRecordCount;
+static UINT32 gRecordCapacity;
+static bool gDirty;
+
+
+static bool
+isSameDevice(const QuirkRecord* r, const UnitInfo* info) {
+	return !wcscmp(r->serial, info->serial)
+		&& !wcscmp(r->product, info->product)
+		&& !wcscmp(r->vendor, info->vendor)
+		&& !wcscmp(r->revision, info->revision);
+}
+
+// Lock must be held
+static QuirkRecord*
+findRecord(const UnitInfo* info) {
+	for (UINT32 i = 0; i < gRecordCount; ++i) {
+		if (isSameDevice(&gRecords[i], info)) return &gRecords[i];
+	}
+	return NULL;
+}
+
+// Lock must be held
+static QuirkRecord*
+addRecord(void) {
+	if (gRecordCount == gRecordCapacity) {
+		if (gRecordCapacity >= kMaxRecords) return NULL;
+		UINT32 capacity = gRecordCapacity ? gRecordCapacity * 2 : 16;
+		QuirkRecord* p = heap_alloc(0, sizeof(*p) * capacity);
+		if (!p) return NULL;
+		if (gRecords) {
+			CopyMemory(p, gRecords, sizeof(*p) * gRecordCount);
+			heap_free(0, gRecords);
+		}
+		gRecords = p;
+		gRecordCapacity = capacity;
+	}
+	return &gRecords[gRecordCount++];
+}
+
+static inline void
+terminateStrings(QuirkRecord* r) {
+	r->vendor[unit_kLenVendorId] = L'\0';
+	r->product[unit_kLenProductId] = L'\0';
+	r->revision[unit_kLenRevision] = L'\0';
+	r->serial[unit_kLenSerial] = L'\0';
+}
+
+static bool
+readRecords(HANDLE f) {
+	QuirkFileHeader hdr;
+	DWORD cb;
+	if (!ReadFile(f, &hdr, sizeof(hdr), &cb, NULL) || cb != sizeof(hdr)) return false;
+	if (hdr.magic != kMagic || hdr.version != kVersion) return false;
+	if (hdr.recordSize != sizeof(QuirkRecord) || hdr.count > kMaxRecords) return false;
+	if (!hdr.count) return true;
+
+	QuirkRecord* p = heap_alloc(0, sizeof(*p) * hdr.count);
+	if (!p) return false;
+	DWORD size = sizeof(*p) * hdr.count;
+	if (!ReadFile(f, p, size, &cb, NULL) || cb != size) {
+		heap_free(0, p);
+		return false;
+	}
+	for (DWORD i = 0; i < hdr.count; ++i) {
+		terminateStrings(&p[i]);
+	}
+
+	gRecords = p;
+	gRecordCount = hdr.count;
+	gRecordCapacity = hdr.count;
+	return true;
+}
+
+void
+quirk_load(const wchar_t* path)
+{
+	AcquireSRWLockExclusive(&gLock);
+	if (gRecords) heap_free(0, gRecords);
+	gRecords = NULL;
+	gRecordCount = 0;
+	gRecordCapacity = 0;
+	gDirty = false;
+
+	HANDLE f = CreateFile(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (f != INVALID_HANDLE_VALUE) {
+		readRecords(f);
+		CloseHandle(f);
+	}
+	ReleaseSRWLockExclusive(&gLock);
+}
+
+bool
+quirk_save(const wchar_t* path)
+{
+	AcquireSRWLockExclusive(&gLock);
+	if (!gDirty) {
+		ReleaseSRWLockExclusive(&gLock);
+		return true;
+	}
+
+	bool ok = false;
+	HANDLE f = CreateFile(path, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (f != INVALID_HANDLE_VALUE) {
+		QuirkFileHeader hdr = {
+			.magic = kMagic,
+			.version = kVersion,
+			.recordSize = sizeof(QuirkRecord),
+			.count = gRecordCount,
+		};
+		DWORD size = sizeof(QuirkRecord) * gRecordCount;
+		DWORD cb;
+		ok = WriteFile(f, &hdr, sizeof(hdr), &cb, NULL) && cb == sizeof(hdr);
+		if (ok && size) ok = WriteFile(f, gRecords, size, &cb, NULL) && cb == size;
+		CloseHandle(f);
+	}
+	if (ok) gDirty = false;
+
+	ReleaseSRWLockExclusive(&gLock);
+	return ok;
+}
+
+BYTE
+quirk_find(const UnitInfo* info)
+{
+	AcquireSRWLockShared(&gLock);
+	const QuirkRecord* r = findRecord(info);
+	BYTE quirks = r ? r->quirks : 0;
+	ReleaseSRWLockShared(&gLock);
+	return quirks;
+}
+
+void
+quirk_update(const UnitInfo* info)
+{
+	AcquireSRWLockExclusive(&gLock);
+	QuirkRecord* r = findRecord(info);
+	if (r) {
+		if (r->quirks != info->quirks) {
+			r->quirks = info->quirks;
+			gDirty = true;
+		}
+	}
+	else if ((r = addRecord())) {
+		StringCchCopy(r->vendor, ARRAYSIZE(r->vendor), info->vendor);
+		StringCchCopy(r->product, ARRAYSIZE(r->product), info->product);
+		StringCchCopy(r->revision, ARRAYSIZE(r->revision), info->revision);
+		StringCchCopy(r->serial, ARRAYSIZE(r->serial), info->serial);
+		r->quirks = info->quirks;
+		gDirty = true;
+	}
+	ReleaseSRWLockExclusive(&gLock);
+}
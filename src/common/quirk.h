@@ -0,0 +1,27 @@
+#pragma once
+
+#include <stdbool.h>
+#include <wchar.h>
+
+#include "unit.h"
+
+
+// Process-wide cache of command forms learned per device, keyed by vendor, product, revision and serial.
+// All functions are thread-safe.
+
+// Load cache from file. If file doesn't exist or is broken, start with an empty cache.
+void
+quirk_load(const wchar_t* path);
+
+// Write cache to file if anything was learned since quirk_load.
+// Return: true if nothing to write or written successfully.
+bool
+quirk_save(const wchar_t* path);
+
+// Return: learned quirks of the device identified by info, or 0 if never seen.
+BYTE
+quirk_find(const UnitInfo* info);
+
+// Remember info->quirks for the device identified by info.
+void
+quirk_update(const UnitInfo* info);
@@ -0,0 +1,187 @@
+#include "report.h"
+
+#include <wchar.h>
+
+
+enum {
+	kCsvInfoColumns = 10, // vendor to quirks
+	kCsvTimerColumns = 1 + unit_kPowerConditionCount * 3,
+	kMsPerTimerUnit = 100, // Timers in mode page are in 100 milliseconds
+};
+
+static const wchar_t* kConditionNames[unit_kPowerConditionCount] = {
+	L"idleA",
+	L"idleB",
+	L"idleC",
+	L"standbyY",
+	L"standbyZ",
+};
+
+static const wchar_t*
+getStatusName(const InventoryItem* q) {
+	if (q->hasInfo) return L"ok";
+	return q->timedOut ? L"timedOut" : L"noInfo";
+}
+
+static const wchar_t*
+getFormFactorName(enum UnitFormFactor f) {
+	static const wchar_t* kName[] = {
+		L"n/a",
+		L"5.25",
+		L"3.5",
+		L"2.5",
+		L"1.8",
+		L"1.8-",
+		L"other",
+	};
+	return f < unit_kFormFactorOther ? kName[f] : kName[unit_kFormFactorOther];
+}
+
+static inline UINT64
+toMs(DWORD timer) {
+	return (UINT64)timer * kMsPerTimerUnit;
+}
+
+static void
+putJsonInfo(Emitter* e, const UnitInfo* p) {
+	EMIT_STATIC_TEXT(e, L",\"vendor\":");
+	emit_json(e, p->vendor);
+	EMIT_STATIC_TEXT(e, L",\"product\":");
+	emit_json(e, p->product);
+	EMIT_STATIC_TEXT(e, L",\"revision\":");
+	emit_json(e, p->revision);
+	EMIT_STATIC_TEXT(e, L",\"serial\":");
+	emit_json(e, p->serial);
+	emit_printf(e, L",\"blockSize\":%lu,\"blockCount\":%llu,\"bytes\":%llu,\"formFactor\":",
+		p->blockSize, p->blockCount, p->blockCount * p->blockSize);
+	emit_json(e, getFormFactorName(p->formFactor));
+	emit_printf(e, L",\"rpm\":%hu,\"quirks\":%u", p->rpm, p->quirks);
+}
+
+static void
+putJsonTimers(Emitter* e, const UnitInfo* p) {
+	emit_printf(e, L",\"timerWritable\":%ls,\"timers\":{", p->timerWritable ? L"true" : L"false");
+	for (int i = 0; i < unit_kPowerConditionCount; ++i) {
+		emit_printf(e, L"%ls\"%ls\":{\"enabled\":%ls,\"current\":%llu,\"changeableMask\":%lu,\"default\":%llu}",
+			i ? L"," : L"", kConditionNames[i], p->timerMask & 1 << i ? L"true" : L"false",
+			toMs(p->timers[i]), p->timersModMask[i], toMs(p->timersDefault[i]));
+	}
+	EMIT_STATIC_TEXT(e, L"}");
+}
+
+static void
+putJsonVolume(Emitter* e, VolumeInfo* vi) {
+	EMIT_STATIC_TEXT(e, L"{\"name\":");
+	emit_json(e, vi->name);
+	EMIT_STATIC_TEXT(e, L",\"disks\":[");
+	for (UINT32 i = 0; i < vi->diskCount; ++i) {
+		emit_printf(e, i ? L",%u" : L"%u", vi->disks[i]);
+	}
+	EMIT_STATIC_TEXT(e, L"],\"mountPoints\":[");
+	const wchar_t* mountPoints = vol_getMountPoints(vi);
+	for (const wchar_t* mp = mountPoints; mp && *mp; mp += wcslen(mp) + 1) {
+		if (mp != mountPoints) EMIT_STATIC_TEXT(e, L",");
+		emit_json(e, mp);
+	}
+	EMIT_STATIC_TEXT(e, L"]}");
+}
+
+void
+report_putJson(Emitter* e, const InventoryItem* q, bool hasTimer)
+{
+	const DiskInfo* di = q->disk;
+	emit_printf(e, L"{\"id\":%u,\"status\":\"%ls\"", di->id, getStatusName(q));
+	if (q->hasInfo) {
+		putJsonInfo(e, &q->info);
+		if (hasTimer) putJsonTimers(e, &q->info);
+	}
+	EMIT_STATIC_TEXT(e, L",\"volumes\":[");
+	for (UINT32 i = 0; i < di->volumeCount; ++i) {
+		if (i) EMIT_STATIC_TEXT(e, L",");
+		putJsonVolume(e, di->volumes[i]);
+	}
+	EMIT_STATIC_TEXT(e, L"]}\n");
+}
+
+void
+report_putCsvHeader(Emitter* e, bool hasTimer)
+{
+	EMIT_STATIC_TEXT(e, L"id,status,vendor,product,revision,serial,blockSize,blockCount,bytes,formFactor,rpm,quirks");
+	if (hasTimer) {
+		EMIT_STATIC_TEXT(e, L",timerWritable");
+		for (int i = 0; i < unit_kPowerConditionCount; ++i) {
+			const wchar_t* name = kConditionNames[i];
+			emit_printf(e, L",%ls,%lsChangeableMask,%lsDefault", name, name, name);
+		}
+	}
+	EMIT_STATIC_TEXT(e, L",volumes\r\n");
+}
+
+static void
+putCsvEmpty(Emitter* e, int columns) {
+	for (int i = 0; i < columns; ++i) {
+		EMIT_STATIC_TEXT(e, L",");
+	}
+}
+
+static void
+putCsvInfo(Emitter* e, const UnitInfo* p) {
+	const wchar_t* texts[] = { p->vendor, p->product, p->revision, p->serial };
+	for (int i = 0; i < _countof(texts); ++i) {
+		EMIT_STATIC_TEXT(e, L",");
+		emit_csv(e, texts[i]);
+	}
+	emit_printf(e, L",%lu,%llu,%llu,", p->blockSize, p->blockCount, p->blockCount * p->blockSize);
+	emit_csv(e, getFormFactorName(p->formFactor));
+	emit_printf(e, L",%hu,%u", p->rpm, p->quirks);
+}
+
+// Current timer is empty if the condition is not enabled
+static void
+putCsvTimers(Emitter* e, const UnitInfo* p) {
+	emit_printf(e, L",%ls", p->timerWritable ? L"true" : L"false");
+	for (int i = 0; i < unit_kPowerConditionCount; ++i) {
+		if (p->timerMask & 1 << i) {
+			emit_printf(e, L",%llu", toMs(p->timers[i]));
+		}
+		else {
+			EMIT_STATIC_TEXT(e, L",");
+		}
+		emit_printf(e, L",%lu,%llu", p->timersModMask[i], toMs(p->timersDefault[i]));
+	}
+}
+
+// Volume names and mount points can't have quotes, so the field needs no escaping
+static void
+putCsvVolumes(Emitter* e, const DiskInfo* di) {
+	EMIT_STATIC_TEXT(e, L",\"");
+	for (UINT32 i = 0; i < di->volumeCount; ++i) {
+		VolumeInfo* vi = di->volumes[i];
+		if (i) EMIT_STATIC_TEXT(e, L"|");
+		emit_text(e, vi->name, wcslen(vi->name));
+		EMIT_STATIC_TEXT(e, L">");
+		for (UINT32 j = 0; j < vi->diskCount; ++j) {
+			emit_printf(e, j ? L" %u" : L"%u", vi->disks[j]);
+		}
+		for (const wchar_t* mp = vol_getMountPoints(vi); mp && *mp; mp += wcslen(mp) + 1) {
+			EMIT_STATIC_TEXT(e, L">");
+			emit_text(e, mp, wcslen(mp));
+		}
+	}
+	EMIT_STATIC_TEXT(e, L"\"");
+}
+
+void
+report_putCsv(Emitter* e, const InventoryItem* q, bool hasTimer)
+{
+	emit_printf(e, L"%u,%ls", q->disk->id, getStatusName(q));
+	if (q->hasInfo) {
+		putCsvInfo(e, &q->info);
+		if (hasTimer) putCsvTimers(e, &q->info);
+	}
+	else {
+		putCsvEmpty(e, kCsvInfoColumns + (hasTimer ? kCsvTimerColumns : 0));
+	}
+	putCsvVolumes(e, q->disk);
+	EMIT_STATIC_TEXT(e, L"\r\n");
+}
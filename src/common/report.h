@@ -0,0 +1,24 @@
+#pragma once
+
+#include <sdkddkver.h>
+#include <Windows.h>
+
+#include <stdbool.h>
+
+#include "emit.h"
+#include "inventory.h"
+
+
+// Machine-readable disk listing. Timers are in milliseconds. rpm is as reported: 1 for non-rotating media, 0 if not reported.
+// Timer fields are only put if hasTimer, since they are not queried otherwise.
+
+// One JSON object per line, with unit info, timers and volumes of the disk
+void
+report_putJson(Emitter* e, const InventoryItem* q, bool hasTimer);
+
+void
+report_putCsvHeader(Emitter* e, bool hasTimer);
+
+// One row. Volumes are in one field, separated by "|". Each is its name, its disks and its mount points, separated by ">".
+void
+report_putCsv(Emitter* e, const InventoryItem* q, bool hasTimer);
@@ -0,0 +1,613 @@
+#include "simdisk.h"
+
+#define _NTSCSI_USER_MODE_
+#if defined(__GNUC__)
+#include <ddk/scsi.h>
+#else
+#include <scsi.h>
+#endif
+#undef _NTSCSI_USER_MODE_
+
+#include <strsafe.h>
+
+#include <stddef.h> // offsetof. GCC i686 requires this
+#include <assert.h>
+
+#include "heap.h"
+
+
+enum {
+	kPagePowerCondition = 0x1A,
+	kPageCaching = 0x08,
+	kPageAll = 0x3F,
+	kCbPowerConditionPage = 2 + 0x26,
+	kCbCachingPage = 2 + 0x12,
+	kCbModeData = 8 + kCbCachingPage + kCbPowerConditionPage, // header(10) and both pages
+	kCbFixedSense = 18,
+	kAtaCheckPowerMode = 0xE5,
+
+	// P.760, spc5r22.pdf - Annex F.2 Additional sense codes
+	kAscNotReady = 0x04,
+	kAscInvalidOpcode = 0x20,
+	kAscInvalidFieldInCdb = 0x24,
+	kAscInvalidFieldInParameters = 0x26,
+	kAscLowPower = 0x5E,
+};
+
+// Only one target, as TransportSend has no context
+static SimTarget* gTarget;
+
+static inline void
+putBe16(BYTE* p, WORD v) {
+	p[0] = (BYTE)(v >> 8);
+	p[1] = (BYTE)v;
+}
+
+static inline void
+putBe32(BYTE* p, DWORD v) {
+	putBe16(p, (WORD)(v >> 16));
+	putBe16(p + 2, (WORD)v);
+}
+
+static inline void
+putBe64(BYTE* p, UINT64 v) {
+	putBe32(p, (DWORD)(v >> 32));
+	putBe32(p + 4, (DWORD)v);
+}
+
+static inline DWORD
+getBe32(const BYTE* p) {
+	return (DWORD)p[0] << 24 | (DWORD)p[1] << 16 | (DWORD)p[2] << 8 | p[3];
+}
+
+// ASCII field padded with spaces, as in INQUIRY data
+static inline void
+putString(BYTE* p, const char* s, size_t cb) {
+	size_t i = 0;
+	for (; i < cb && s[i]; ++i) p[i] = s[i];
+	for (; i < cb; ++i) p[i] = ' ';
+}
+
+// Return: disk of h, or NULL if h is not a simulated disk
+static SimDisk*
+findDisk(HANDLE h) {
+	if (!gTarget) return NULL;
+
+	const BYTE* p = (const BYTE*)h;
+	const BYTE* first = (const BYTE*)gTarget->disks;
+	if (p < first || p >= first + sizeof(SimDisk) * gTarget->count) return NULL;
+	if ((p - first) % sizeof(SimDisk)) return NULL;
+	return (SimDisk*)p;
+}
+
+// Power condition reached by timers since the disk became ready.
+// Caller holds d->lock
+static enum UnitPowerState
+getState(const SimDisk* d, UINT64 now) {
+	static const struct {
+		enum PowerConditon condition;
+		enum UnitPowerState state;
+	} kDeepestFirst[] = {
+		{ unit_kStandbyZ, unit_kStateStandbyZ },
+		{ unit_kStandbyY, unit_kStateStandbyY },
+		{ unit_kIdleC, unit_kStateIdleC },
+		{ unit_kIdleB, unit_kStateIdleB },
+		{ unit_kIdleA, unit_kStateIdleA },
+	};
+
+	if (d->stopped) return unit_kStateStopped;
+	if (now < d->readyAt) return unit_kStateActive;
+
+	const UINT64 elapsed = (now - d->readyAt) / 100;
+	for (int i = 0; i < _countof(kDeepestFirst); ++i) {
+		const enum PowerConditon c = kDeepestFirst[i].condition;
+		if (!(d->enabledTimers >> c & 1) || !d->timers[c]) continue;
+		if (elapsed >= d->timers[c]) return kDeepestFirst[i].state;
+	}
+	return unit_kStateActive;
+}
+
+static void
+fillFixedSense(BYTE* sense, BYTE key, BYTE asc, BYTE ascq) {
+	ZeroMemory(sense, kCbFixedSense);
+	sense[0] = SCSI_SENSE_ERRORCODE_FIXED_CURRENT;
+	sense[2] = key;
+	sense[7] = kCbFixedSense - 8;
+	sense[12] = asc;
+	sense[13] = ascq;
+}
+
+static bool
+checkCondition(ScsiCommand* cmd, BYTE key, BYTE asc, BYTE ascq) {
+	fillFixedSense(cmd->sense, key, asc, ascq);
+	cmd->senseSize = kCbFixedSense;
+	cmd->status = SCSISTAT_CHECK_CONDITION;
+	cmd->dataSize = 0;
+	return true;
+}
+
+static inline bool
+rejectCommand(ScsiCommand* cmd, BYTE asc) {
+	return checkCondition(cmd, SCSI_SENSE_ILLEGAL_REQUEST, asc, 0);
+}
+
+static bool
+good(ScsiCommand* cmd) {
+	cmd->status = SCSISTAT_GOOD;
+	cmd->dataSize = 0;
+	return true;
+}
+
+// allocLength: ALLOCATION LENGTH field of CDB
+static bool
+returnData(ScsiCommand* cmd, const BYTE* data, DWORD size, DWORD allocLength) {
+	DWORD cb = min(size, allocLength);
+	if (cmd->direction != tp_kIn) cb = 0;
+	cb = min(cb, cmd->dataSize);
+	CopyMemory(cmd->data, data, cb);
+	cmd->status = SCSISTAT_GOOD;
+	cmd->dataSize = cb;
+	return true;
+}
+
+static bool
+inquiry(SimDisk* d, ScsiCommand* cmd) {
+	const BYTE* cdb = cmd->cdb;
+	const DWORD allocLength = cdb[3] << 8 | cdb[4];
+	BYTE data[64] = { 0 };
+
+	if (!(cdb[1] & 1)) {
+		if (cdb[2]) return rejectCommand(cmd, kAscInvalidFieldInCdb);
+		// P.289, spc5r22.pdf - 6.7.2 Standard INQUIRY data
+		data[2] = 0x06; // SPC-4
+		data[3] = 0x02;
+		data[4] = 36 - 5;
+		putString(data + 8, d->vendor, unit_kLenVendorId);
+		putString(data + 16, d->product, unit_kLenProductId);
+		putString(data + 32, d->revision, unit_kLenRevision);
+		return returnData(cmd, data, 36, allocLength);
+	}
+
+	switch (cdb[2]) {
+	case 0x80: {
+		// Unit Serial Number
+		size_t len = 0;
+		StringCchLengthA(d->serial, ARRAYSIZE(d->serial), &len);
+		data[1] = 0x80;
+		data[3] = (BYTE)len;
+		CopyMemory(data + 4, d->serial, len);
+		return returnData(cmd, data, 4 + (DWORD)len, allocLength);
+	}
+	case 0xB1:
+		// Block Device Characteristics
+		data[1] = 0xB1;
+		data[3] = 0x3C;
+		putBe16(data + 4, d->rpm);
+		data[7] = d->formFactor & 0x0F;
+		return returnData(cmd, data, 64, allocLength);
+	}
+	return rejectCommand(cmd, kAscInvalidFieldInCdb);
+}
+
+static bool
+readCapacity10(SimDisk* d, ScsiCommand* cmd) {
+	if (d->rejectReadCapacity10) return rejectCommand(cmd, kAscInvalidOpcode);
+
+	BYTE data[8];
+	const UINT64 last = d->blockCount - 1;
+	putBe32(data, last > MAXDWORD ? MAXDWORD : (DWORD)last);
+	putBe32(data + 4, d->blockSize);
+	return returnData(cmd, data, sizeof(data), sizeof(data));
+}
+
+static bool
+serviceActionIn16(SimDisk* d, ScsiCommand* cmd) {
+	// Only READ CAPACITY(16)
+	if ((cmd->cdb[1] & 0x1F) != 0x10) return rejectCommand(cmd, kAscInvalidFieldInCdb);
+
+	BYTE data[32] = { 0 };
+	putBe64(data, d->blockCount - 1);
+	putBe32(data + 8, d->blockSize);
+	return returnData(cmd, data, sizeof(data), getBe32(cmd->cdb + 10));
+}
+
+// P642, spc5r22.pdf - 7.5.16 Power Condition mode page
+static void
+putPowerConditionPage(BYTE* p, const SimDisk* d, BYTE pageControl) {
+	DWORD changeable[unit_kPowerConditionCount];
+	const DWORD* timers = d->timers;
+	BYTE enabled = d->enabledTimers;
+	switch (pageControl) {
+	case 1:
+		for (int i = 0; i < unit_kPowerConditionCount; ++i) {
+			changeable[i] = d->changeableTimers >> i & 1 ? MAXDWORD : 0;
+		}
+		timers = changeable;
+		enabled = d->changeableTimers;
+		break;
+	case 2:
+		timers = d->timersDefault;
+		break;
+	}
+
+	ZeroMemory(p, kCbPowerConditionPage);
+	p[0] = 0x80 | kPagePowerCondition; // PS
+	p[1] = kCbPowerConditionPage - 2;
+	p[2] = enabled >> unit_kStandbyY & 1;
+	p[3] = (enabled >> unit_kStandbyZ & 1)
+		| (enabled >> unit_kIdleA & 1) << 1
+		| (enabled >> unit_kIdleB & 1) << 2
+		| (enabled >> unit_kIdleC & 1) << 3;
+	putBe32(p + 4, timers[unit_kIdleA]);
+	putBe32(p + 8, timers[unit_kStandbyZ]);
+	putBe32(p + 12, timers[unit_kIdleB]);
+	putBe32(p + 16, timers[unit_kIdleC]);
+	putBe32(p + 20, timers[unit_kStandbyY]);
+}
+
+static bool
+modeSense(SimDisk* d, ScsiCommand* cmd, bool is10) {
+	if (is10 && d->rejectModeSense10) return rejectCommand(cmd, kAscInvalidOpcode);
+
+	const BYTE* cdb = cmd->cdb;
+	const BYTE pageCode = cdb[2] & 0x3F;
+	const BYTE pageControl = cdb[2] >> 6;
+	if (pageCode != kPagePowerCondition && pageCode != kPageAll) return rejectCommand(cmd, kAscInvalidFieldInCdb);
+	if (pageCode == kPageAll && d->rejectModeSenseAll) return rejectCommand(cmd, kAscInvalidFieldInCdb);
+
+	// No block descriptors
+	BYTE data[kCbModeData] = { 0 };
+	const DWORD cbHeader = is10 ? 8 : 4;
+	DWORD size = cbHeader;
+	if (pageCode == kPageAll) {
+		data[size] = kPageCaching;
+		data[size + 1] = kCbCachingPage - 2;
+		size += kCbCachingPage;
+	}
+	AcquireSRWLockShared(&d->lock);
+	putPowerConditionPage(data + size, d, pageControl);
+	ReleaseSRWLockShared(&d->lock);
+	size += kCbPowerConditionPage;
+
+	if (is10) {
+		putBe16(data, (WORD)(size - 2));
+		return returnData(cmd, data, size, cdb[7] << 8 | cdb[8]);
+	}
+	data[0] = (BYTE)(size - 1);
+	return returnData(cmd, data, size, cdb[4]);
+}
+
+// Apply timers in a power condition page of MODE SELECT parameter list.
+// Only changeable timers can be changed.
+static bool
+modeSelect(SimDisk* d, ScsiCommand* cmd, bool is10) {
+	if (is10 && d->rejectModeSelect10) return rejectCommand(cmd, kAscInvalidOpcode);
+	if (cmd->direction != tp_kOut) return rejectCommand(cmd, kAscInvalidFieldInCdb);
+
+	const BYTE* data = cmd->data;
+	const DWORD size = cmd->dataSize;
+	const DWORD cbHeader = is10 ? 8 : 4;
+	if (size < cbHeader) return rejectCommand(cmd, kAscInvalidFieldInParameters);
+
+	const DWORD offset = cbHeader + (is10 ? data[6] << 8 | data[7] : data[3]);
+	if (offset + kCbPowerConditionPage > size) return rejectCommand(cmd, kAscInvalidFieldInParameters);
+
+	const BYTE* p = data + offset;
+	if ((p[0] & 0x3F) != kPagePowerCondition || p[1] != kCbPowerConditionPage - 2) {
+		return rejectCommand(cmd, kAscInvalidFieldInParameters);
+	}
+
+	const BYTE enabled = (p[2] & 1) << unit_kStandbyY
+		| (p[3] & 1) << unit_kStandbyZ
+		| (p[3] >> 1 & 1) << unit_kIdleA
+		| (p[3] >> 2 & 1) << unit_kIdleB
+		| (p[3] >> 3 & 1) << unit_kIdleC;
+	DWORD timers[unit_kPowerConditionCount];
+	timers[unit_kIdleA] = getBe32(p + 4);
+	timers[unit_kStandbyZ] = getBe32(p + 8);
+	timers[unit_kIdleB] = getBe32(p + 12);
+	timers[unit_kIdleC] = getBe32(p + 16);
+	timers[unit_kStandbyY] = getBe32(p + 20);
+
+	AcquireSRWLockExclusive(&d->lock);
+	bool ok = !((enabled ^ d->enabledTimers) & ~d->changeableTimers);
+	for (int i = 0; ok && i < unit_kPowerConditionCount; ++i) {
+		if (timers[i] != d->timers[i] && !(d->changeableTimers >> i & 1)) ok = false;
+	}
+	if (ok) {
+		d->enabledTimers = enabled;
+		CopyMemory(d->timers, timers, sizeof(timers));
+	}
+	ReleaseSRWLockExclusive(&d->lock);
+
+	return ok ? good(cmd) : rejectCommand(cmd, kAscInvalidFieldInParameters);
+}
+
+// Power condition field is ignored. Only START bit counts.
+static bool
+startStopUnit(SimDisk* d, ScsiCommand* cmd) {
+	const bool immed = cmd->cdb[1] & 1;
+	const bool start = cmd->cdb[4] & 1;
+	const UINT64 now = GetTickCount64();
+
+	DWORD wait = 0;
+	AcquireSRWLockExclusive(&d->lock);
+	if (start) {
+		const enum UnitPowerState state = getState(d, now);
+		const bool spunDown = state == unit_kStateStopped || state == unit_kStateStandbyY || state == unit_kStateStandbyZ;
+		if (spunDown) d->readyAt = now + d->spinUp;
+		else if (now >= d->readyAt) d->readyAt = now;
+		d->stopped = false;
+		wait = (DWORD)(d->readyAt - now);
+	}
+	else {
+		d->stopped = true;
+		wait = d->spinDown;
+	}
+	ReleaseSRWLockExclusive(&d->lock);
+
+	if (!immed) Sleep(wait);
+	return good(cmd);
+}
+
+static bool
+testUnitReady(SimDisk* d, ScsiCommand* cmd) {
+	const UINT64 now = GetTickCount64();
+
+	AcquireSRWLockShared(&d->lock);
+	const bool stopped = d->stopped;
+	const bool becomingReady = now < d->readyAt;
+	ReleaseSRWLockShared(&d->lock);
+
+	if (stopped) return checkCondition(cmd, SCSI_SENSE_NOT_READY, kAscNotReady, 0x02);
+	if (becomingReady) return checkCondition(cmd, SCSI_SENSE_NOT_READY, kAscNotReady, 0x01);
+	return good(cmd);
+}
+
+// Sense data of REQUEST SENSE reports low power conditions, see getStateFromSense in unit.c
+static bool
+requestSense(SimDisk* d, ScsiCommand* cmd) {
+	static const BYTE kLowPowerAscq[unit_kStateCount] = {
+		[unit_kStateIdleA] = 0x01,
+		[unit_kStateIdleB] = 0x05,
+		[unit_kStateIdleC] = 0x07,
+		[unit_kStateStandbyY] = 0x09,
+		[unit_kStateStandbyZ] = 0x02,
+	};
+
+	AcquireSRWLockShared(&d->lock);
+	const enum UnitPowerState state = getState(d, GetTickCount64());
+	ReleaseSRWLockShared(&d->lock);
+
+	BYTE data[kCbFixedSense];
+	if (state == unit_kStateStopped) fillFixedSense(data, SCSI_SENSE_NOT_READY, kAscNotReady, 0x02);
+	else if (d->satSense || !kLowPowerAscq[state]) fillFixedSense(data, SCSI_SENSE_NO_SENSE, 0, 0);
+	else fillFixedSense(data, SCSI_SENSE_NO_SENSE, kAscLowPower, kLowPowerAscq[state]);
+	return returnData(cmd, data, sizeof(data), cmd->cdb[4]);
+}
+
+// ATA CHECK POWER MODE with CK_COND. Registers are returned in descriptor format sense data.
+static bool
+ataPassThrough16(SimDisk* d, ScsiCommand* cmd) {
+	static const BYTE kCounts[unit_kStateCount] = {
+		[unit_kStateActive] = 0xFF,
+		[unit_kStateIdleA] = 0x80,
+		[unit_kStateIdleB] = 0x82,
+		[unit_kStateIdleC] = 0x83,
+		[unit_kStateStandbyY] = 0x01,
+		[unit_kStateStandbyZ] = 0x00,
+		[unit_kStateStopped] = 0x00,
+	};
+
+	if (d->rejectAtaPassThrough) return rejectCommand(cmd, kAscInvalidOpcode);
+	if (cmd->cdb[14] != kAtaCheckPowerMode) return rejectCommand(cmd, kAscInvalidFieldInCdb);
+
+	AcquireSRWLockShared(&d->lock);
+	const enum UnitPowerState state = getState(d, GetTickCount64());
+	ReleaseSRWLockShared(&d->lock);
+
+	// SAT-4 - ATA Status Return sense data descriptor
+	BYTE* sense = cmd->sense;
+	ZeroMemory(sense, tp_kCbSense);
+	sense[0] = 0x72;
+	sense[1] = SCSI_SENSE_RECOVERED_ERROR;
+	sense[3] = 0x1D; // ATA PASS THROUGH INFORMATION AVAILABLE
+	sense[7] = 14;
+	sense[8] = 0x09;
+	sense[9] = 0x0C;
+	sense[13] = kCounts[state];
+	sense[21] = 0x50; // DRDY, DSC
+	cmd->senseSize = 22;
+	cmd->status = SCSISTAT_CHECK_CONDITION;
+	cmd->dataSize = 0;
+	return true;
+}
+
+bool
+sim_send(HANDLE h, ScsiCommand* cmd)
+{
+	SimDisk* d = findDisk(h);
+	if (!d) {
+		SetLastError(ERROR_INVALID_HANDLE);
+		return false;
+	}
+
+	if (d->hang) {
+		Sleep(cmd->timeout * 1000);
+		SetLastError(ERROR_SEM_TIMEOUT);
+		return false;
+	}
+	if (d->latency) Sleep(d->latency);
+
+	switch (cmd->cdb[0]) {
+	case SCSIOP_TEST_UNIT_READY:
+		return testUnitReady(d, cmd);
+	case SCSIOP_REQUEST_SENSE:
+		return requestSense(d, cmd);
+	case SCSIOP_INQUIRY:
+		return inquiry(d, cmd);
+	case SCSIOP_MODE_SELECT:
+		return modeSelect(d, cmd, false);
+	case SCSIOP_MODE_SENSE:
+		return modeSense(d, cmd, false);
+	case SCSIOP_START_STOP_UNIT:
+		return startStopUnit(d, cmd);
+	case SCSIOP_READ_CAPACITY:
+		return readCapacity10(d, cmd);
+	case SCSIOP_MODE_SELECT10:
+		return modeSelect(d, cmd, true);
+	case SCSIOP_MODE_SENSE10:
+		return modeSense(d, cmd, true);
+	case SCSIOP_READ_CAPACITY16:
+		return serviceActionIn16(d, cmd);
+	case SCSIOP_ATA_PASSTHROUGH16:
+		return ataPassThrough16(d, cmd);
+	}
+	return rejectCommand(cmd, kAscInvalidOpcode);
+}
+
+// Disk i of the fleet. Kinds take turns, so any count above 3 has all of them.
+static void
+initDisk(SimDisk* d, UINT32 i, UINT64 now) {
+	enum {
+		kKindSas,
+		kKindSata,
+		kKindUsb,
+		kKindLargeSas,
+		kKindCount,
+	};
+	static const char* kProducts[kKindCount] = { "SIM SAS", "SIM SATA", "SIM USB", "SIM SAS XL" };
+
+	const UINT32 kind = i % kKindCount;
+	StringCchCopyA(d->vendor, ARRAYSIZE(d->vendor), "SDP");
+	StringCchCopyA(d->product, ARRAYSIZE(d->product), kProducts[kind]);
+	StringCchCopyA(d->revision, ARRAYSIZE(d->revision), "0001");
+	StringCchPrintfA(d->serial, ARRAYSIZE(d->serial), "SIM%08X", i);
+	d->blockSize = 512;
+	d->blockCount = kind == kKindLargeSas ? 7814037168ULL * 4 : 7814037168ULL; // 16 TB and 4 TB
+	d->rpm = 7200;
+	d->formFactor = unit_kFormFactor35;
+	switch (kind) {
+	case kKindSas:
+	case kKindLargeSas:
+		d->rejectAtaPassThrough = 1;
+		break;
+	case kKindSata:
+		d->satSense = true;
+		break;
+	case kKindUsb:
+		d->satSense = true;
+		d->rejectReadCapacity10 = 1;
+		d->rejectModeSense10 = 1;
+		d->rejectModeSelect10 = 1;
+		d->rejectModeSenseAll = 1;
+		break;
+	}
+	d->latency = 2 + i * 7 % 20;
+	d->spinUp = 3000 + i % 5 * 1000;
+	d->spinDown = 500;
+
+	// Idle A after 2 seconds, and standby Z after 15 minutes if supported
+	const TimerMask idleA = { .timerIdleA = 1 };
+	const TimerMask standbyZ = { .timerStandbyZ = 1 };
+	d->enabledTimers = idleA.timerMask;
+	if (kind != kKindUsb) d->enabledTimers |= standbyZ.timerMask;
+	d->changeableTimers = d->enabledTimers;
+	d->timers[unit_kIdleA] = d->timersDefault[unit_kIdleA] = 20;
+	d->timers[unit_kStandbyZ] = d->timersDefault[unit_kStandbyZ] = 9000;
+
+	InitializeSRWLock(&d->lock);
+	d->readyAt = now;
+}
+
+SimTarget*
+sim_create(UINT32 count)
+{
+	assert(count);
+	assert(!gTarget);
+
+	SimTarget* t = heap_alloc(HEAP_ZERO_MEMORY, offsetof(SimTarget, disks[count]));
+	if (!t) return NULL;
+
+	const UINT64 now = GetTickCount64();
+	t->count = count;
+	for (UINT32 i = 0; i < count; ++i) initDisk(&t->disks[i], i, now);
+
+	gTarget = t;
+	tp_set(sim_send);
+	return t;
+}
+
+void
+sim_destroy(SimTarget* t)
+{
+	if (!t) return;
+
+	assert(t == gTarget);
+	tp_set(NULL);
+	gTarget = NULL;
+	heap_free(0, t);
+}
+
+HANDLE
+sim_getHandle(SimTarget* t, UINT32 index)
+{
+	assert(index < t->count);
+
+	return (HANDLE)&t->disks[index];
+}
+
+DiskSet*
+sim_createDiskSet(SimTarget* t, const UINT32* diskIds, size_t count, const wchar_t** errmsg)
+{
+	static const wchar_t* kBadId = L"No such physical drive number.";
+	static const wchar_t* kDupIds = L"Duplicate disk numbers not allowed.";
+	static const wchar_t* kLowMem = L"Low memory to create disk set.";
+
+	if (!diskIds) count = t->count;
+	for (size_t i = 0; diskIds && i < count; ++i) {
+		if (diskIds[i] >= t->count) {
+			*errmsg = kBadId;
+			return NULL;
+		}
+	}
+
+	DiskSet* s = heap_alloc(HEAP_ZERO_MEMORY, sizeof(*s));
+	if (s) s->items = heap_alloc(HEAP_ZERO_MEMORY, sizeof(s->items[0]) * count);
+	if (!s || !s->items || !idm_init(&s->ids, count)) {
+		sim_destroyDiskSet(s);
+		*errmsg = kLowMem;
+		return NULL;
+	}
+
+	for (size_t i = 0; i < count; ++i) {
+		DiskInfo* info = heap_alloc(HEAP_ZERO_MEMORY, sizeof(*info));
+		if (!info) {
+			sim_destroyDiskSet(s);
+			*errmsg = kLowMem;
+			return NULL;
+		}
+		info->id = diskIds ? diskIds[i] : (UINT32)i;
+		info->handle = sim_getHandle(t, info->id);
+		if (!idm_add(&s->ids, info->id, s->count)) {
+			heap_free(0, info);
+			sim_destroyDiskSet(s);
+			*errmsg = kDupIds;
+			return NULL;
+		}
+		s->items[s->count++] = info;
+	}
+	return s;
+}
+
+// Handles of simulated disks are not to be closed
+void
+sim_destroyDiskSet(DiskSet* s)
+{
+	if (!s) return;
+
+	for (UINT32 i = 0; i < s->count; ++i) heap_free(0, s->items[i]);
+	if (s->items) heap_free(0, s->items);
+	idm_destroy(&s->ids);
+	heap_free(0, s);
+}
@@ -0,0 +1,79 @@
+#pragma once
+
+#include <sdkddkver.h>
+#include <Windows.h>
+
+#include <stdbool.h>
+
+#include "disk.h"
+#include "transport.h"
+#include "unit.h"
+
+
+// CDB forms a simulated disk rejects with ILLEGAL REQUEST, like some bridges do
+typedef union SimRejects {
+	struct {
+		BYTE rejectReadCapacity10 : 1;
+		BYTE rejectModeSense10 : 1;
+		BYTE rejectModeSelect10 : 1;
+		BYTE rejectModeSenseAll : 1; // MODE SENSE with page code 0x3F
+		BYTE rejectAtaPassThrough : 1; // Not behind a SAT layer
+	};
+	BYTE rejects;
+}SimRejects;
+
+// Model and state of one simulated disk. Change the model before sending commands.
+typedef struct SimDisk {
+	char vendor[unit_kCchVendorId];
+	char product[unit_kCchProductId];
+	char revision[unit_kCchRevision];
+	char serial[unit_kCchSerial];
+	DWORD blockSize;
+	UINT64 blockCount;
+	WORD rpm;
+	BYTE formFactor; // enum UnitFormFactor
+	SimRejects;
+	bool satSense; // Like a SAT layer, REQUEST SENSE never reports a low power condition
+	bool hang; // Commands never complete, and fail after their timeout
+	DWORD latency; // Milliseconds each command takes
+	DWORD spinUp; // Milliseconds from START to ready
+	DWORD spinDown; // Milliseconds a STOP takes without IMMED
+	BYTE enabledTimers; // Bits as in TimerMask
+	BYTE changeableTimers;
+	DWORD timers[unit_kPowerConditionCount]; // In 100 milliseconds, as in power condition mode page
+	DWORD timersDefault[unit_kPowerConditionCount];
+
+	SRWLOCK lock;
+	bool stopped;
+	UINT64 readyAt; // Tick count when spin-up completes. Timers count from it.
+}SimDisk;
+
+typedef struct SimTarget {
+	UINT32 count;
+	SimDisk disks[1];
+}SimTarget;
+
+
+// Create a mixed fleet of count disks: SAS, SATA behind SAT, USB bridges rejecting 10-byte forms, and large SAS.
+// All commands are routed to the fleet by tp_set until sim_destroy. Only one target can exist at a time.
+// Return NULL if low memory.
+SimTarget*
+sim_create(UINT32 count);
+
+// Restore the default transport
+void
+sim_destroy(SimTarget* t);
+
+HANDLE
+sim_getHandle(SimTarget* t, UINT32 index);
+
+// Transport answering commands with the current target
+bool
+sim_send(HANDLE h, ScsiCommand* cmd);
+
+// Like dskset_create, on simulated disks. Disks have no volumes.
+DiskSet*
+sim_createDiskSet(SimTarget* t, const UINT32* diskIds, size_t count, const wchar_t** errmsg);
+
+void
+sim_destroyDiskSet(DiskSet* s);
@@ -0,0 +1,152 @@
+#include "spin.h"
+
+#include <assert.h>
+
+#include "heap.h"
+#include "task.h"
+
+
+static bool
+issue(SpinJob* job, SpinTarget target) {
+	return target == spin_kStart ? unit_start(job->handle, true) : unit_stop(job->handle, true);
+}
+
+static bool
+reached(SpinJob* job, SpinTarget target) {
+	if (target == spin_kStart) return unit_testReady(job->handle) == unit_kReady;
+
+	enum UnitPowerState state;
+	if (unit_getPowerState(job->handle, (UnitQuirks*)&job->quirks, &state)) {
+		switch (state) {
+		case unit_kStateStandbyY:
+		case unit_kStateStandbyZ:
+		case unit_kStateStopped:
+			return true;
+		}
+	}
+	// Bridges reporting no sense and without SAT can't tell the power condition,
+	// but still answer TEST UNIT READY with NOT READY, INITIALIZING COMMAND REQUIRED (04/02) once stopped.
+	return unit_testReady(job->handle) == unit_kStopped;
+}
+
+// Keep the slot of a start that timed out until the device settles
+// Return true if it did, or policy.holdLimit passed
+static bool
+released(SpinJob* job, const SpinPolicy* policy) {
+	const enum UnitReadiness r = unit_testReady(job->handle);
+	return r == unit_kReady || r == unit_kStopped || GetTickCount64() - job->issued >= policy->holdLimit;
+}
+
+// Poll job. Touches nothing but job, so jobs can be polled from different threads.
+// Return tick count of next poll, or 0 if job is finished.
+static UINT64
+poll(SpinJob* job, SpinTarget target, const SpinPolicy* policy) {
+	if (job->holding) {
+		if (released(job, policy)) return 0;
+	}
+	else {
+		const bool ok = reached(job, target);
+		job->elapsed = (DWORD)(GetTickCount64() - job->issued);
+		if (ok) {
+			job->result = spin_kDone;
+			return 0;
+		}
+		if (job->elapsed >= policy->timeout) {
+			job->result = spin_kTimedOut;
+			if (target != spin_kStart || job->elapsed >= policy->holdLimit) return 0;
+			job->holding = true;
+		}
+	}
+
+	job->delay = min(job->delay * 2, policy->maxDelay);
+	return GetTickCount64() + job->delay;
+}
+
+// Return true if job is in transition
+static bool
+start(SpinJob* job, SpinTarget target, const SpinPolicy* policy) {
+	job->issued = GetTickCount64();
+	job->elapsed = 0;
+	if (!issue(job, target)) {
+		job->result = spin_kRejected;
+		return false;
+	}
+	job->delay = policy->firstDelay;
+	job->nextPoll = GetTickCount64() + job->delay;
+	return true;
+}
+
+typedef struct SpinRound {
+	SpinJob** due;
+	SpinTarget target;
+	const SpinPolicy* policy;
+}SpinRound;
+
+static void
+pollTask(size_t index, void* ex) {
+	const SpinRound* r = (const SpinRound*)ex;
+	SpinJob* job = r->due[index];
+	job->nextPoll = poll(job, r->target, r->policy);
+}
+
+void
+spin_run(SpinJob* jobs, UINT32 count, SpinTarget target, const SpinPolicy* policy)
+{
+	assert(policy->firstDelay && policy->firstDelay <= policy->maxDelay);
+	assert(policy->holdLimit >= policy->timeout);
+
+	for (UINT32 i = 0; i < count; ++i) {
+		jobs[i].issued = 0;
+		jobs[i].nextPoll = 0;
+		jobs[i].holding = false;
+	}
+
+	// Without memory for a round, due jobs are polled in order from the calling thread
+	SpinRound round = {
+		.due = heap_alloc(0, sizeof(SpinJob*) * (count ? count : 1)),
+		.target = target,
+		.policy = policy,
+	};
+	UINT32 toIssue = 0;
+	for (;;) {
+		UINT32 active = 0;
+		for (UINT32 i = 0; i < toIssue; ++i) {
+			if (jobs[i].nextPoll) ++active;
+		}
+		while (toIssue < count && (!policy->maxActive || active < policy->maxActive)) {
+			SpinJob* job = &jobs[toIssue++];
+			if (job->result != spin_kPending) continue;
+			if (start(job, target, policy)) ++active;
+		}
+		if (!active) break;
+
+		const UINT64 now = GetTickCount64();
+		UINT64 next = 0;
+		UINT32 due = 0;
+		for (UINT32 i = 0; i < toIssue; ++i) {
+			SpinJob* job = &jobs[i];
+			if (!job->nextPoll) continue;
+			if (job->nextPoll > now) {
+				if (!next || job->nextPoll < next) next = job->nextPoll;
+				continue;
+			}
+			if (round.due) {
+				round.due[due++] = job;
+			}
+			else {
+				job->nextPoll = poll(job, target, policy);
+				++due;
+			}
+		}
+		// Freed slots are filled right away
+		if (due) {
+			if (round.due) task_run(due, due, pollTask, &round);
+			continue;
+		}
+
+		const UINT64 after = GetTickCount64();
+		if (next > after) Sleep((DWORD)(next - after));
+	}
+
+	if (round.due) heap_free(0, round.due);
+}
@@ -0,0 +1,52 @@
+#pragma once
+
+#include <sdkddkver.h>
+#include <Windows.h>
+
+#include <stdbool.h>
+
+#include "unit.h"
+
+
+typedef enum SpinTarget {
+	spin_kStart,
+	spin_kStop,
+}SpinTarget;
+
+typedef enum SpinResult {
+	spin_kPending,
+	spin_kDone,
+	spin_kRejected, // START STOP UNIT failed
+	spin_kTimedOut,
+	spin_kSkipped, // Set by caller to leave the device alone
+}SpinResult;
+
+typedef struct SpinJob {
+	HANDLE handle;
+	UnitQuirks; // For power state polling. Set to 0 if unknown
+	SpinResult result;
+	DWORD elapsed; // Milliseconds from command to target state seen, or to giving up
+	UINT64 issued; // Tick count, 0 if not issued yet
+	UINT64 nextPoll; // Tick count, 0 if not in transition
+	DWORD delay;
+	bool holding; // Timed out starting, but keeps its slot while the device may still draw spin-up current
+}SpinJob;
+
+// Polling backoff in milliseconds. Delay doubles after each poll, up to maxDelay.
+typedef struct SpinPolicy {
+	DWORD firstDelay;
+	DWORD maxDelay;
+	DWORD timeout;
+	UINT32 maxActive; // Max devices in transition at the same time, 0 means no limit
+	DWORD holdLimit; // Milliseconds from issue a timed-out start keeps its slot at most. Not less than timeout.
+}SpinPolicy;
+
+
+// Send START STOP UNIT with IMMED to pending jobs in order, and poll them until each reaches target state or times out.
+// Jobs due at the same time are polled by threads of their own, so a device slow to answer doesn't delay the others.
+// At most policy.maxActive jobs are in transition, the next job is issued as soon as one is finished.
+// A start that timed out is finished only when the device reports ready or stopped, or at policy.holdLimit,
+// so the limit holds for devices slow to spin up.
+// Start is reached when TEST UNIT READY is good. Stop is reached when power state is stopped or standby.
+void
+spin_run(SpinJob* jobs, UINT32 count, SpinTarget target, const SpinPolicy* policy);
@@ -0,0 +1,77 @@
+#include "stats.h"
+
+
+static volatile bool gEnabled;
+static LARGE_INTEGER gFrequency;
+static volatile LONG64 gCommands;
+static volatile LONG64 gAllocations;
+static volatile LONG64 gAllocatedBytes;
+static volatile LONG64 gLiveBytes;
+static volatile LONG64 gPeakBytes;
+
+void
+stats_enable(void)
+{
+	QueryPerformanceFrequency(&gFrequency);
+	gEnabled = true;
+}
+
+static void
+raisePeak(LONG64 live) {
+	for (;;) {
+		const LONG64 peak = gPeakBytes;
+		if (live <= peak) return;
+		if (InterlockedCompareExchange64(&gPeakBytes, live, peak) == peak) return;
+	}
+}
+
+void
+stats_onAlloc(void* mem, size_t cb)
+{
+	if (!gEnabled || !mem) return;
+
+	InterlockedIncrement64(&gAllocations);
+	InterlockedExchangeAdd64(&gAllocatedBytes, (LONG64)cb);
+	raisePeak(InterlockedExchangeAdd64(&gLiveBytes, (LONG64)cb) + (LONG64)cb);
+}
+
+void
+stats_onFree(void* mem)
+{
+	if (!gEnabled || !mem) return;
+
+	const SIZE_T cb = HeapSize(GetProcessHeap(), 0, mem);
+	if (cb == (SIZE_T)-1) return;
+	InterlockedExchangeAdd64(&gLiveBytes, -(LONG64)cb);
+}
+
+void
+stats_onCommand(void)
+{
+	if (gEnabled) InterlockedIncrement64(&gCommands);
+}
+
+void
+stats_begin(StatsPhase* p)
+{
+	QueryPerformanceCounter(&p->startTime);
+	p->startCommands = gCommands;
+	p->startAllocations = gAllocations;
+	p->startAllocatedBytes = gAllocatedBytes;
+	p->startLiveBytes = gLiveBytes;
+	// Peak of this phase starts from what is in use now
+	InterlockedExchange64(&gPeakBytes, p->startLiveBytes);
+}
+
+void
+stats_end(StatsPhase* p)
+{
+	LARGE_INTEGER now;
+	QueryPerformanceCounter(&now);
+	const UINT64 ticks = (UINT64)(now.QuadPart - p->startTime.QuadPart);
+	p->microseconds = gFrequency.QuadPart ? ticks * 1000000 / (UINT64)gFrequency.QuadPart : 0;
+	p->commands = gCommands - p->startCommands;
+	p->allocations = gAllocations - p->startAllocations;
+	p->allocatedBytes = gAllocatedBytes - p->startAllocatedBytes;
+	p->peakBytes = gPeakBytes - p->startLiveBytes;
+}
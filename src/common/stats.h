@@ -0,0 +1,44 @@
+#pragma once
+
+#include <sdkddkver.h>
+#include <Windows.h>
+
+#include <stdbool.h>
+
+
+// Cost of one phase of a run, as deltas of process-wide counters
+typedef struct StatsPhase {
+	UINT64 microseconds;
+	INT64 commands; // SCSI commands sent
+	INT64 allocations;
+	INT64 allocatedBytes;
+	INT64 peakBytes; // Peak heap bytes in use during the phase, above its start
+	// Internal
+	LARGE_INTEGER startTime;
+	INT64 startCommands;
+	INT64 startAllocations;
+	INT64 startAllocatedBytes;
+	INT64 startLiveBytes;
+}StatsPhase;
+
+
+// Start counting. Frees of blocks allocated before it count too, so enable it early.
+void
+stats_enable(void);
+
+// Called by heap_alloc and heap_free
+void
+stats_onAlloc(void* mem, size_t cb);
+
+void
+stats_onFree(void* mem);
+
+// Called by transport for each command sent
+void
+stats_onCommand(void);
+
+void
+stats_begin(StatsPhase* p);
+
+void
+stats_end(StatsPhase* p);
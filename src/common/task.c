@@ -0,0 +1,66 @@
+#include "task.h"
+
+#include <assert.h>
+
+#include "heap.h"
+
+
+typedef struct TaskQueue {
+	volatile LONG next;
+	LONG count;
+	TaskHandler func;
+	void* ex;
+}TaskQueue;
+
+static void
+drain(TaskQueue* q) {
+	for (;;) {
+		LONG i = InterlockedIncrement(&q->next) - 1;
+		if (i >= q->count) return;
+		q->func((size_t)i, q->ex);
+	}
+}
+
+static DWORD WINAPI
+workerProc(LPVOID param) {
+	drain((TaskQueue*)param);
+	return 0;
+}
+
+void
+task_run(size_t count, UINT32 workerCount, TaskHandler func, void* ex)
+{
+	assert(func);
+	assert(count <= MAXLONG);
+
+	if (workerCount > count) workerCount = (UINT32)count;
+	if (workerCount > MAXIMUM_WAIT_OBJECTS) workerCount = MAXIMUM_WAIT_OBJECTS;
+
+	TaskQueue q = {
+		.next = 0,
+		.count = (LONG)count,
+		.func = func,
+		.ex = ex,
+	};
+
+	// The calling thread is one of the workers.
+	HANDLE* threads = NULL;
+	DWORD threadCount = 0;
+	if (workerCount > 1) threads = heap_alloc(0, sizeof(*threads) * (workerCount - 1));
+	if (threads) {
+		for (UINT32 i = 1; i < workerCount; ++i) {
+			HANDLE h = CreateThread(NULL, 0, workerProc, &q, 0, NULL);
+			if (!h) break;
+			threads[threadCount++] = h;
+		}
+	}
+
+	drain(&q);
+
+	if (!threads) return;
+	if (threadCount) WaitForMultipleObjects(threadCount, threads, TRUE, INFINITE);
+	for (DWORD i = 0; i < threadCount; ++i) {
+		CloseHandle(threads[i]);
+	}
+	heap_free(0, threads);
+}
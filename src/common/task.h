@@ -0,0 +1,15 @@
+#pragma once
+
+#include <sdkddkver.h>
+#include <Windows.h>
+
+#include <stdbool.h>
+
+
+typedef void (*TaskHandler)(size_t index, void* ex);
+
+// Call func once for each index in [0, count), using at most workerCount threads.
+// The calling thread works too, and returns after all indexes are done.
+// If workerCount <= 1 or threads can't be created, indexes are handled in order on the calling thread.
+void
+task_run(size_t count, UINT32 workerCount, TaskHandler func, void* ex);
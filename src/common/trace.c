@@ -0,0 +1,340 @@
+#include "trace.h"
+
+#define _NTSCSI_USER_MODE_
+#if defined(__GNUC__)
+#include <ddk/scsi.h>
+#else
+#include <scsi.h>
+#endif
+#undef _NTSCSI_USER_MODE_
+
+#include <strsafe.h>
+
+#include <stdarg.h>
+#include <stddef.h> // offsetof. GCC i686 requires this
+#include <stdlib.h>
+#include <assert.h>
+
+#include "heap.h"
+
+
+typedef enum TraceKind {
+	kKindCommand,
+	kKindSpan,
+}TraceKind;
+
+typedef struct TraceEvent {
+	UINT64 start; // QPC ticks
+	UINT64 end;
+	TraceKind kind;
+	DWORD thread;
+	union {
+		struct {
+			HANDLE handle;
+			DWORD dataSize;
+			BYTE opcode;
+			BYTE cdbLength;
+			BYTE status;
+			bool delivered;
+		};
+		const wchar_t* name;
+	};
+}TraceEvent;
+
+typedef struct TraceRing {
+	volatile LONG64 next; // Events ever recorded
+	UINT32 capacity;
+	UINT64 origin; // QPC ticks when enabled
+	UINT64 frequency;
+	TraceEvent events[1];
+}TraceRing;
+
+typedef struct TraceAlias {
+	HANDLE handle;
+	HANDLE primary;
+}TraceAlias;
+
+// Handle of a disk, and the track of its commands
+typedef struct TraceTrack {
+	HANDLE handle;
+	UINT32 id;
+}TraceTrack;
+
+enum {
+	kCbOut = 65536, // Output buffer of trace_save
+	kCchLine = 512,
+	kMinAliases = 16,
+};
+
+static TraceRing* gRing;
+static SRWLOCK gAliasLock = SRWLOCK_INIT;
+static TraceAlias* gAliases;
+static UINT32 gAliasCount;
+static UINT32 gAliasCapacity;
+
+bool
+trace_enable(UINT32 capacity)
+{
+	assert(capacity);
+	assert(!gRing);
+
+	TraceRing* r = heap_alloc(HEAP_ZERO_MEMORY, offsetof(TraceRing, events[capacity]));
+	if (!r) return false;
+
+	LARGE_INTEGER t;
+	QueryPerformanceFrequency(&t);
+	r->frequency = (UINT64)t.QuadPart;
+	QueryPerformanceCounter(&t);
+	r->origin = (UINT64)t.QuadPart;
+	r->capacity = capacity;
+	gRing = r;
+	return true;
+}
+
+UINT64
+trace_now(void)
+{
+	if (!gRing) return 0;
+
+	LARGE_INTEGER t;
+	QueryPerformanceCounter(&t);
+	return (UINT64)t.QuadPart;
+}
+
+// Return: slot for next event. Threads record at the same time, each in its own slot.
+static TraceEvent*
+nextEvent(void) {
+	const LONG64 n = InterlockedIncrement64(&gRing->next) - 1;
+	return &gRing->events[(UINT64)n % gRing->capacity];
+}
+
+void
+trace_command(HANDLE h, const ScsiCommand* cmd, bool delivered, UINT64 start)
+{
+	if (!gRing || !start) return;
+
+	const UINT64 end = trace_now();
+	TraceEvent* e = nextEvent();
+	e->start = start;
+	e->end = end;
+	e->kind = kKindCommand;
+	e->thread = GetCurrentThreadId();
+	e->handle = h;
+	e->dataSize = delivered ? cmd->dataSize : 0;
+	e->opcode = cmd->cdb[0];
+	e->cdbLength = cmd->cdbLength;
+	e->status = cmd->status;
+	e->delivered = delivered;
+}
+
+// If low memory, h keeps a track of its own
+void
+trace_addAlias(HANDLE h, HANDLE primary)
+{
+	if (!gRing) return;
+
+	AcquireSRWLockExclusive(&gAliasLock);
+	if (gAliasCount == gAliasCapacity) {
+		const UINT32 capacity = gAliasCapacity ? gAliasCapacity * 2 : kMinAliases;
+		TraceAlias* p = heap_alloc(0, sizeof(*p) * capacity);
+		if (p && gAliases) {
+			CopyMemory(p, gAliases, sizeof(*p) * gAliasCount);
+			heap_free(0, gAliases);
+		}
+		if (p) {
+			gAliases = p;
+			gAliasCapacity = capacity;
+		}
+	}
+	if (gAliasCount < gAliasCapacity) gAliases[gAliasCount++] = (TraceAlias){ .handle = h, .primary = primary };
+	ReleaseSRWLockExclusive(&gAliasLock);
+}
+
+void
+trace_begin(TraceSpan* span, const wchar_t* name)
+{
+	span->name = name;
+	span->start = trace_now();
+}
+
+void
+trace_end(const TraceSpan* span)
+{
+	if (!gRing || !span->start) return;
+
+	const UINT64 end = trace_now();
+	TraceEvent* e = nextEvent();
+	e->start = span->start;
+	e->end = end;
+	e->kind = kKindSpan;
+	e->thread = GetCurrentThreadId();
+	e->name = span->name;
+}
+
+static const wchar_t*
+getOpcodeName(BYTE opcode) {
+	switch (opcode) {
+	case SCSIOP_TEST_UNIT_READY: return L"TEST UNIT READY";
+	case SCSIOP_REQUEST_SENSE: return L"REQUEST SENSE";
+	case SCSIOP_INQUIRY: return L"INQUIRY";
+	case SCSIOP_MODE_SELECT: return L"MODE SELECT(6)";
+	case SCSIOP_MODE_SENSE: return L"MODE SENSE(6)";
+	case SCSIOP_START_STOP_UNIT: return L"START STOP UNIT";
+	case SCSIOP_READ_CAPACITY: return L"READ CAPACITY(10)";
+	case SCSIOP_MODE_SELECT10: return L"MODE SELECT(10)";
+	case SCSIOP_MODE_SENSE10: return L"MODE SENSE(10)";
+	case SCSIOP_READ_CAPACITY16: return L"SERVICE ACTION IN(16)";
+	case SCSIOP_ATA_PASSTHROUGH16: return L"ATA PASS-THROUGH(16)";
+	}
+	return NULL;
+}
+
+// Buffered file output. Errors stick until close.
+typedef struct TraceOut {
+	HANDLE file;
+	bool ok;
+	DWORD size;
+	char data[kCbOut];
+}TraceOut;
+
+static void
+flush(TraceOut* o) {
+	if (o->ok && o->size) {
+		DWORD cb;
+		o->ok = WriteFile(o->file, o->data, o->size, &cb, NULL) && cb == o->size;
+	}
+	o->size = 0;
+}
+
+static void
+put(TraceOut* o, const char* fmt, ...) {
+	char line[kCchLine];
+	va_list args;
+	va_start(args, fmt);
+	HRESULT hr = StringCchVPrintfA(line, ARRAYSIZE(line), fmt, args);
+	va_end(args);
+	if (FAILED(hr)) {
+		o->ok = false;
+		return;
+	}
+
+	size_t len = 0;
+	StringCchLengthA(line, ARRAYSIZE(line), &len);
+	if (o->size + len > kCbOut) flush(o);
+	CopyMemory(o->data + o->size, line, len);
+	o->size += (DWORD)len;
+}
+
+static int
+compareTracks(const void* a, const void* b) {
+	const ULONG_PTR l = (ULONG_PTR)((const TraceTrack*)a)->handle;
+	const ULONG_PTR r = (ULONG_PTR)((const TraceTrack*)b)->handle;
+	return l < r ? -1 : l > r;
+}
+
+static const TraceTrack*
+findTrack(const TraceTrack* tracks, UINT32 count, HANDLE h) {
+	const TraceTrack key = { .handle = h };
+	return bsearch(&key, tracks, count, sizeof(*tracks), compareTracks);
+}
+
+// Map handles of disks in ds, and their aliases, to disk numbers. Sorted by handle, so each event is looked up
+// by binary search. Built once, so export takes O(events * log(disks)).
+// Return NULL if there's no disk, or low memory. Commands go to tracks named by handle then.
+static TraceTrack*
+buildTracks(const DiskSet* ds, UINT32* count) {
+	*count = 0;
+	if (!ds || !ds->count) return NULL;
+	TraceTrack* tracks = heap_alloc(0, sizeof(*tracks) * ((size_t)ds->count + gAliasCount));
+	if (!tracks) return NULL;
+
+	for (UINT32 i = 0; i < ds->count; ++i) {
+		tracks[i] = (TraceTrack){ .handle = ds->items[i]->handle, .id = ds->items[i]->id };
+	}
+	qsort(tracks, ds->count, sizeof(*tracks), compareTracks);
+	UINT32 n = ds->count;
+	for (UINT32 i = 0; i < gAliasCount; ++i) {
+		const TraceTrack* t = findTrack(tracks, ds->count, gAliases[i].primary);
+		if (t) tracks[n++] = (TraceTrack){ .handle = gAliases[i].handle, .id = t->id };
+	}
+	qsort(tracks, n, sizeof(*tracks), compareTracks);
+	*count = n;
+	return tracks;
+}
+
+// Track of a command: disk number if known, else the handle
+static UINT64
+getTrack(const TraceTrack* tracks, UINT32 count, HANDLE h) {
+	const TraceTrack* t = tracks ? findTrack(tracks, count, h) : NULL;
+	return t ? t->id : (UINT64)(ULONG_PTR)h;
+}
+
+static inline UINT64
+toMicroseconds(UINT64 ticks) {
+	return ticks / gRing->frequency * 1000000 + ticks % gRing->frequency * 1000000 / gRing->frequency;
+}
+
+static void
+putEvent(TraceOut* o, const TraceEvent* e, const TraceTrack* tracks, UINT32 trackCount) {
+	const UINT64 ts = toMicroseconds(e->start - gRing->origin);
+	const UINT64 dur = toMicroseconds(e->end - e->start);
+	const char* sep = ",\n";
+
+	if (e->kind == kKindSpan) {
+		put(o, "%s{\"name\":\"%ls\",\"cat\":\"phase\",\"ph\":\"X\",\"ts\":%llu,\"dur\":%llu,\"pid\":1,\"tid\":%lu}",
+			sep, e->name, ts, dur, e->thread);
+		return;
+	}
+
+	const wchar_t* name = getOpcodeName(e->opcode);
+	const char* fmt = name
+		? "%s{\"name\":\"%ls\",\"cat\":\"scsi\",\"ph\":\"X\",\"ts\":%llu,\"dur\":%llu,\"pid\":2,\"tid\":%llu,"
+		: "%s{\"name\":\"0x%02X\",\"cat\":\"scsi\",\"ph\":\"X\",\"ts\":%llu,\"dur\":%llu,\"pid\":2,\"tid\":%llu,";
+	const UINT64 track = getTrack(tracks, trackCount, e->handle);
+	if (name) put(o, fmt, sep, name, ts, dur, track);
+	else put(o, fmt, sep, e->opcode, ts, dur, track);
+	put(o, "\"args\":{\"cdbLength\":%u,\"delivered\":%s,\"status\":%u,\"bytes\":%lu,\"thread\":%lu}}",
+		e->cdbLength, e->delivered ? "true" : "false", e->status, e->dataSize, e->thread);
+}
+
+bool
+trace_save(const wchar_t* path, const DiskSet* ds)
+{
+	if (!gRing) return false;
+
+	TraceOut* o = heap_alloc(0, sizeof(*o));
+	if (!o) return false;
+	o->file = CreateFile(path, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (o->file == INVALID_HANDLE_VALUE) {
+		heap_free(0, o);
+		return false;
+	}
+	o->ok = true;
+	o->size = 0;
+
+	// Oldest first. Only the last capacity events are still in the ring.
+	const UINT64 next = (UINT64)gRing->next;
+	const UINT64 first = next > gRing->capacity ? next - gRing->capacity : 0;
+	put(o, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+	put(o, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,\"args\":{\"name\":\"Phases\"}},\n");
+	put(o, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":2,\"args\":{\"name\":\"Disks\"}}");
+	for (UINT32 i = 0; ds && i < ds->count; ++i) {
+		put(o, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":2,\"tid\":%u,\"args\":{\"name\":\"PhysicalDrive%u\"}}",
+			ds->items[i]->id, ds->items[i]->id);
+	}
+	AcquireSRWLockShared(&gAliasLock);
+	UINT32 trackCount;
+	TraceTrack* tracks = buildTracks(ds, &trackCount);
+	ReleaseSRWLockShared(&gAliasLock);
+	for (UINT64 i = first; i < next; ++i) {
+		putEvent(o, &gRing->events[i % gRing->capacity], tracks, trackCount);
+	}
+	if (tracks) heap_free(0, tracks);
+	put(o, "\n]}\n");
+	flush(o);
+
+	bool ok = o->ok;
+	CloseHandle(o->file);
+	heap_free(0, o);
+	return ok;
+}
@@ -0,0 +1,51 @@
+#pragma once
+
+#include <sdkddkver.h>
+#include <Windows.h>
+
+#include <stdbool.h>
+
+#include "disk.h"
+#include "transport.h"
+
+
+enum {
+	trace_kDefaultCapacity = 65536, // Events kept. Older ones are overwritten.
+};
+
+// A named time span, like one phase of enumeration
+typedef struct TraceSpan {
+	const wchar_t* name;
+	UINT64 start;
+}TraceSpan;
+
+
+// Start recording into a ring buffer of capacity events.
+// Return false if low memory.
+bool
+trace_enable(UINT32 capacity);
+
+// Return: timestamp for trace_command, or 0 if tracing is off
+UINT64
+trace_now(void);
+
+// Record a command sent at start, as returned by trace_now. Called by transport.
+void
+trace_command(HANDLE h, const ScsiCommand* cmd, bool delivered, UINT64 start);
+
+// Record h as another handle to the device opened as primary, e.g. for overlapped I/O.
+// Its commands go to the track of primary then. Nothing is recorded if tracing is off.
+void
+trace_addAlias(HANDLE h, HANDLE primary);
+
+// name must be a static string
+void
+trace_begin(TraceSpan* span, const wchar_t* name);
+
+void
+trace_end(const TraceSpan* span);
+
+// Write events in the ring as Chrome trace JSON, which Perfetto reads too.
+// ds: Names disk tracks by disk number. Commands to other handles, or to aliases of them, go to tracks named by handle.
+bool
+trace_save(const wchar_t* path, const DiskSet* ds);
@@ -0,0 +1,356 @@
+#include "transport.h"
+
+#include <winioctl.h>
+#include <ntddscsi.h>
+
+#include <stddef.h> // offsetof. GCC i686 requires this
+#include <assert.h>
+
+#include "heap.h"
+#include "stats.h"
+#include "trace.h"
+
+
+// SCSI_PASS_THROUGH_DIRECT with sense buffer behind it
+typedef struct PassThroughWithSense {
+	SCSI_PASS_THROUGH_DIRECT sptd;
+	ULONG filler; // realign sense buffer
+	BYTE sense[tp_kCbSense];
+}PassThroughWithSense;
+
+static TransportSend gSend = tp_sendPassThrough;
+
+// Overlapped pass through of one command in a batch
+typedef struct BatchContext {
+	OVERLAPPED overlapped;
+	PassThroughWithSense p;
+	UINT64 start; // For trace
+	bool pending;
+}BatchContext;
+
+// Synchronous command in flight, watched by the watchdog
+typedef struct Flight {
+	HANDLE thread; // Thread sending the command. NULL if the slot is free.
+	UINT64 expiry; // Tick count to cancel the command at
+	bool cancelled;
+}Flight;
+
+enum {
+	kBatchGrace = 5, // Seconds to wait beyond command timeout before cancelling
+	kMaxFlights = MAXIMUM_WAIT_OBJECTS + 1, // Workers of task_run, and the calling thread
+	kWatchdogPeriod = 250, // Milliseconds
+};
+
+static SRWLOCK gFlightLock = SRWLOCK_INIT;
+static Flight gFlights[kMaxFlights];
+static HANDLE gWatchdog; // Timer queue timer. NULL if not started.
+static UINT64 gDeadline; // Tick count when the run ends. 0 means no deadline.
+
+// Cancel commands past their expiry. A command not started yet when cancelled is tried again on next tick.
+static VOID CALLBACK
+watchdogProc(PVOID param, BOOLEAN fired) {
+	const UINT64 now = GetTickCount64();
+	AcquireSRWLockExclusive(&gFlightLock);
+	for (int i = 0; i < kMaxFlights; ++i) {
+		Flight* f = &gFlights[i];
+		if (!f->thread || f->cancelled || now < f->expiry) continue;
+		f->cancelled = CancelSynchronousIo(f->thread);
+	}
+	ReleaseSRWLockExclusive(&gFlightLock);
+}
+
+// Watch the calling thread until endFlight.
+// Return: slot of the thread, or NULL if not watched. Then the command is left to the driver timeout.
+static Flight*
+beginFlight(DWORD timeout) {
+	if (!gWatchdog) return NULL;
+
+	HANDLE thread;
+	const HANDLE process = GetCurrentProcess();
+	// CancelSynchronousIo needs THREAD_TERMINATE
+	if (!DuplicateHandle(process, GetCurrentThread(), process, &thread, THREAD_TERMINATE, FALSE, 0)) return NULL;
+
+	UINT64 expiry = GetTickCount64() + (timeout + kBatchGrace) * 1000ULL;
+	if (gDeadline && expiry > gDeadline) expiry = gDeadline;
+
+	Flight* f = NULL;
+	AcquireSRWLockExclusive(&gFlightLock);
+	for (int i = 0; i < kMaxFlights; ++i) {
+		if (gFlights[i].thread) continue;
+		f = &gFlights[i];
+		*f = (Flight){ .thread = thread, .expiry = expiry };
+		break;
+	}
+	ReleaseSRWLockExclusive(&gFlightLock);
+
+	if (!f) CloseHandle(thread);
+	return f;
+}
+
+// Return: true if the watchdog cancelled the command
+static bool
+endFlight(Flight* f) {
+	if (!f) return false;
+
+	AcquireSRWLockExclusive(&gFlightLock);
+	const HANDLE thread = f->thread;
+	const bool cancelled = f->cancelled;
+	f->thread = NULL;
+	ReleaseSRWLockExclusive(&gFlightLock);
+
+	CloseHandle(thread);
+	return cancelled;
+}
+
+// Shorten timeout of cmd to the deadline.
+// Return false if the deadline has passed, with ERROR_TIMEOUT.
+static bool
+applyDeadline(ScsiCommand* cmd) {
+	if (!gDeadline) return true;
+
+	const UINT64 now = GetTickCount64();
+	if (now >= gDeadline) {
+		SetLastError(ERROR_TIMEOUT);
+		return false;
+	}
+	const UINT64 left = (gDeadline - now + 999) / 1000;
+	if (cmd->timeout > left) cmd->timeout = (DWORD)left;
+	return true;
+}
+
+static void
+fillPassThrough(PassThroughWithSense* p, const ScsiCommand* cmd) {
+	static const UCHAR kDirections[] = {
+		[tp_kNone] = SCSI_IOCTL_DATA_UNSPECIFIED,
+		[tp_kIn] = SCSI_IOCTL_DATA_IN,
+		[tp_kOut] = SCSI_IOCTL_DATA_OUT,
+	};
+	assert(cmd->cdbLength <= sizeof(cmd->cdb));
+	assert(cmd->direction == tp_kNone || cmd->data);
+
+	*p = (PassThroughWithSense){
+		.sptd = {
+			.Length = sizeof(SCSI_PASS_THROUGH_DIRECT),
+			.CdbLength = cmd->cdbLength,
+			.SenseInfoLength = tp_kCbSense,
+			.DataIn = kDirections[cmd->direction],
+			.DataTransferLength = cmd->direction == tp_kNone ? 0 : cmd->dataSize,
+			.TimeOutValue = cmd->timeout,
+			.DataBuffer = cmd->direction == tp_kNone ? NULL : cmd->data,
+			.SenseInfoOffset = offsetof(PassThroughWithSense, sense),
+		},
+	};
+	CopyMemory(p->sptd.Cdb, cmd->cdb, cmd->cdbLength);
+}
+
+static void
+readPassThrough(ScsiCommand* cmd, const PassThroughWithSense* p) {
+	cmd->status = p->sptd.ScsiStatus;
+	cmd->dataSize = p->sptd.DataTransferLength;
+	cmd->senseSize = min(p->sptd.SenseInfoLength, tp_kCbSense);
+	CopyMemory(cmd->sense, p->sense, cmd->senseSize);
+}
+
+bool
+tp_sendPassThrough(HANDLE h, ScsiCommand* cmd)
+{
+	PassThroughWithSense p;
+	fillPassThrough(&p, cmd);
+
+	Flight* f = beginFlight(cmd->timeout);
+	DWORD cb = 0;
+	BOOL ok = DeviceIoControl(
+		h, IOCTL_SCSI_PASS_THROUGH_DIRECT,
+		&p, sizeof(p),
+		&p, sizeof(p),
+		&cb, FALSE
+	);
+	const DWORD error = ok ? ERROR_SUCCESS : GetLastError();
+	const bool cancelled = endFlight(f);
+	if (!ok) {
+		SetLastError(cancelled ? ERROR_TIMEOUT : error);
+		return false;
+	}
+
+	readPassThrough(cmd, &p);
+	return true;
+}
+
+void
+tp_set(TransportSend send)
+{
+	gSend = send ? send : tp_sendPassThrough;
+}
+
+bool
+tp_send(HANDLE h, ScsiCommand* cmd)
+{
+	cmd->status = 0;
+	cmd->senseSize = 0;
+	if (!applyDeadline(cmd)) return false;
+	stats_onCommand();
+	const UINT64 start = trace_now();
+	bool ok = gSend(h, cmd);
+	trace_command(h, cmd, ok, start);
+	return ok;
+}
+
+bool
+tp_isDefault(void)
+{
+	return gSend == tp_sendPassThrough;
+}
+
+bool
+tp_startWatchdog(DWORD deadline)
+{
+	assert(!gWatchdog);
+
+	if (deadline) gDeadline = GetTickCount64() + deadline * 1000ULL;
+	HANDLE timer;
+	if (!CreateTimerQueueTimer(&timer, NULL, watchdogProc, NULL, kWatchdogPeriod, kWatchdogPeriod, WT_EXECUTEDEFAULT)) return false;
+	gWatchdog = timer;
+	return true;
+}
+
+bool
+tp_isTimeout(DWORD error)
+{
+	return error == ERROR_TIMEOUT || error == ERROR_SEM_TIMEOUT;
+}
+
+HANDLE
+tp_createPort(void)
+{
+	return CreateIoCompletionPort(INVALID_HANDLE_VALUE, NULL, 0, 1);
+}
+
+bool
+tp_associate(HANDLE port, HANDLE h)
+{
+	return CreateIoCompletionPort(h, port, 0, 0) == port;
+}
+
+struct TransportBatch {
+	UINT32 capacity;
+	bool abandoned; // The port broke while commands were pending. They still own contexts, so never free them.
+	BatchContext contexts[1];
+};
+
+TransportBatch*
+tp_createBatch(UINT32 capacity)
+{
+	TransportBatch* b = heap_alloc(0, offsetof(TransportBatch, contexts[capacity ? capacity : 1]));
+	if (!b) return NULL;
+	b->capacity = capacity;
+	b->abandoned = false;
+	return b;
+}
+
+void
+tp_destroyBatch(TransportBatch* b)
+{
+	if (b && !b->abandoned) heap_free(0, b);
+}
+
+// Cancel commands still pending
+static void
+cancelBatch(TransportItem* items, BatchContext* contexts, UINT32 count) {
+	for (UINT32 i = 0; i < count; ++i) {
+		if (contexts[i].pending) CancelIoEx(items[i].handle, &contexts[i].overlapped);
+	}
+}
+
+bool
+tp_sendBatch(HANDLE port, TransportItem* items, UINT32 count, TransportBatch* work)
+{
+	if (work && work->abandoned) return false;
+	if (!count) return true;
+
+	// A replaced transport has no overlapped form
+	if (!tp_isDefault()) {
+		for (UINT32 i = 0; i < count; ++i) {
+			items[i].delivered = tp_send(items[i].handle, items[i].command);
+		}
+		return true;
+	}
+
+	assert(!work || work->capacity >= count);
+	TransportBatch* b = work ? work : tp_createBatch(count);
+	if (!b) {
+		for (UINT32 i = 0; i < count; ++i) items[i].delivered = false;
+		return true;
+	}
+	BatchContext* contexts = b->contexts;
+	ZeroMemory(contexts, sizeof(*contexts) * count);
+
+	UINT32 pending = 0;
+	DWORD timeout = 0;
+	for (UINT32 i = 0; i < count; ++i) {
+		TransportItem* t = &items[i];
+		BatchContext* x = &contexts[i];
+		t->command->status = 0;
+		t->command->senseSize = 0;
+		t->delivered = false;
+		if (!applyDeadline(t->command)) continue;
+
+		fillPassThrough(&x->p, t->command);
+		stats_onCommand();
+		x->start = trace_now();
+		BOOL ok = DeviceIoControl(
+			t->handle, IOCTL_SCSI_PASS_THROUGH_DIRECT,
+			&x->p, sizeof(x->p),
+			&x->p, sizeof(x->p),
+			NULL, &x->overlapped
+		);
+		if (!ok && GetLastError() != ERROR_IO_PENDING) {
+			trace_command(t->handle, t->command, false, x->start);
+			continue;
+		}
+
+		// Completion is queued to the port even if the command is done at once
+		x->pending = true;
+		++pending;
+		timeout = max(timeout, t->command->timeout);
+	}
+
+	UINT64 expiry = GetTickCount64() + (timeout + kBatchGrace) * 1000ULL;
+	if (gDeadline && expiry > gDeadline) expiry = gDeadline;
+	bool cancelled = false;
+	while (pending) {
+		DWORD wait = INFINITE;
+		if (!cancelled) {
+			const UINT64 now = GetTickCount64();
+			wait = now < expiry ? (DWORD)(expiry - now) : 0;
+		}
+		DWORD cb = 0;
+		ULONG_PTR key = 0;
+		OVERLAPPED* o = NULL;
+		BOOL ok = GetQueuedCompletionStatus(port, &cb, &key, &o, wait);
+		if (!o) {
+			// The port is broken. Pending I/O still owns contexts, so leak them.
+			if (cancelled) {
+				b->abandoned = true;
+				return false;
+			}
+
+			// Timed out. Cancel the rest, and wait for their completion
+			cancelBatch(items, contexts, count);
+			cancelled = true;
+			continue;
+		}
+
+		BatchContext* x = CONTAINING_RECORD(o, BatchContext, overlapped);
+		x->pending = false;
+		--pending;
+		const UINT32 i = (UINT32)(x - contexts);
+		if (ok) {
+			readPassThrough(items[i].command, &x->p);
+			items[i].delivered = true;
+		}
+		trace_command(items[i].handle, items[i].command, ok, x->start);
+	}
+
+	if (b != work) tp_destroyBatch(b);
+	return true;
+}
@@ -0,0 +1,103 @@
+#pragma once
+
+#include <sdkddkver.h>
+#include <Windows.h>
+
+#include <stdbool.h>
+
+
+enum {
+	tp_kCbSense = 32,
+};
+
+typedef enum TransportDirection {
+	tp_kNone,
+	tp_kIn,
+	tp_kOut,
+}TransportDirection;
+
+// One SCSI command with its data and results
+typedef struct ScsiCommand {
+	BYTE cdb[16];
+	BYTE cdbLength;
+	TransportDirection direction;
+	DWORD timeout; // Seconds
+	void* data;
+	DWORD dataSize; // In: size of data. Out: bytes transferred
+	BYTE status; // SCSI status
+	BYTE senseSize; // Valid bytes in sense
+	BYTE sense[tp_kCbSense];
+}ScsiCommand;
+
+// One command of a batch
+typedef struct TransportItem {
+	HANDLE handle; // Opened with FILE_FLAG_OVERLAPPED, and associated with the port
+	ScsiCommand* command;
+	bool delivered; // Out: as returned by TransportSend
+	UINT32 context; // Free for caller
+}TransportItem;
+
+// Deliver cmd to device h.
+// Return false if the command can't be delivered. Otherwise SCSI status is in cmd.status.
+typedef bool (*TransportSend)(HANDLE h, ScsiCommand* cmd);
+
+
+// Send through IOCTL_SCSI_PASS_THROUGH_DIRECT. The default transport.
+bool
+tp_sendPassThrough(HANDLE h, ScsiCommand* cmd);
+
+// Replace the transport of all unit_* functions. Set it before sending any command.
+// NULL restores the default.
+void
+tp_set(TransportSend send);
+
+// Send cmd through current transport. All commands to devices go through here.
+bool
+tp_send(HANDLE h, ScsiCommand* cmd);
+
+// Return false if the transport is replaced by tp_set
+bool
+tp_isDefault(void);
+
+// Cancel synchronous pass-through commands still running after their timeout, for bridges ignoring it.
+// Commands cancelled this way, or sent after the deadline, fail with ERROR_TIMEOUT.
+// The deadline also shortens timeouts of commands sent before it, through any transport.
+// Start it before sending any command. It runs until the process exits.
+// deadline: Seconds from now the run must end in. 0 means no deadline.
+bool
+tp_startWatchdog(DWORD deadline);
+
+// Return: true if error, as from GetLastError after a command failed, means the command timed out
+bool
+tp_isTimeout(DWORD error);
+
+// Return: I/O completion port for tp_sendBatch, or NULL if failed. Close with CloseHandle.
+HANDLE
+tp_createPort(void);
+
+// Complete overlapped I/O of h to port. A handle can be associated with only one port.
+bool
+tp_associate(HANDLE port, HANDLE h);
+
+// Contexts of commands in flight for tp_sendBatch. Kept between batches, so sending one allocates nothing.
+// Abandoned if the port breaks while commands are pending. It can't be used again then,
+// and tp_destroyBatch leaves it to the pending I/O.
+typedef struct TransportBatch TransportBatch;
+
+// capacity: Max commands in one batch
+// Return NULL if low memory
+TransportBatch*
+tp_createBatch(UINT32 capacity);
+
+void
+tp_destroyBatch(TransportBatch* b);
+
+// Send all commands at the same time, and wait until all of them complete.
+// Commands still running after their timeout or the deadline of tp_startWatchdog are cancelled.
+// Falls back to sending one by one if the transport is replaced by tp_set.
+// A port must be used by one batch at a time.
+// work: With capacity of at least count, or NULL to allocate contexts for this batch only
+// Return false if the port broke with commands pending, or work was abandoned before. Nothing is sent then.
+//        Pending commands may still write to their data and sense, so never free or reuse them.
+bool
+tp_sendBatch(HANDLE port, TransportItem* items, UINT32 count, TransportBatch* work);
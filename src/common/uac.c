@@ -1,19 +1,71 @@
-#include "uac.h"
-
-#include <Windows.h>
-#pragma comment(lib, "Advapi32.lib")
-
-
-bool
-uac_isElevated(void)
-{
-	HANDLE h;
-	if (!OpenProcessToken(GetCurrentProcess(), TOKEN_QUERY, &h)) return false;
-
-	TOKEN_ELEVATION token = { 0 };
-	GetTokenInformation(h, TokenElevation, &token, sizeof(token), &(DWORD){0});
-	// TODO: deal with XP?
-	CloseHandle(h);
-
-	return token.TokenIsElevated;
-}
+#include "uac.h"
+
+#include <Windows.h>
+#include <aclapi.h>
+#include <sddl.h>
+#pragma comment(lib, "Advapi32.lib")
+
+
+// Owned by Administrators. Protected DACL: full control for SYSTEM and Administrators, inherited by files in it.
+static const wchar_t* kAdminOnly = L"O:BAD:P(A;OICI;FA;;;SY)(A;OICI;FA;;;BA)";
+
+
+bool
+uac_isElevated(void)
+{
+	HANDLE h;
+	if (!OpenProcessToken(GetCurrentProcess(), TOKEN_QUERY, &h)) return false;
+
+	TOKEN_ELEVATION token = { 0 };
+	GetTokenInformation(h, TokenElevation, &token, sizeof(token), &(DWORD){0});
+	// TODO: deal with XP?
+	CloseHandle(h);
+
+	return token.TokenIsElevated;
+}
+
+// Return false if owner of path can't be read, or is neither Administrators nor SYSTEM
+static bool
+hasTrustedOwner(const wchar_t* path) {
+	PSID owner = NULL;
+	PSECURITY_DESCRIPTOR sd = NULL;
+	if (GetNamedSecurityInfo(path, SE_FILE_OBJECT, OWNER_SECURITY_INFORMATION, &owner, NULL, NULL, NULL, &sd) != ERROR_SUCCESS) return false;
+
+	const bool ok = IsWellKnownSid(owner, WinBuiltinAdministratorsSid) || IsWellKnownSid(owner, WinLocalSystemSid);
+	LocalFree(sd);
+	return ok;
+}
+
+bool
+uac_secureDirectory(const wchar_t* path)
+{
+	PSECURITY_DESCRIPTOR sd;
+	if (!ConvertStringSecurityDescriptorToSecurityDescriptor(kAdminOnly, SDDL_REVISION_1, &sd, NULL)) return false;
+
+	SECURITY_ATTRIBUTES sa = { .nLength = sizeof(sa), .lpSecurityDescriptor = sd };
+	bool ok = CreateDirectory(path, &sa) || GetLastError() == ERROR_ALREADY_EXISTS;
+	// A directory made before, by an older version or by a user, may let users create files.
+	// Take it over only if an administrator made it, and it's not a link to somewhere else.
+	const DWORD attr = ok ? GetFileAttributes(path) : INVALID_FILE_ATTRIBUTES;
+	ok = attr != INVALID_FILE_ATTRIBUTES
+		&& (attr & FILE_ATTRIBUTE_DIRECTORY)
+		&& !(attr & FILE_ATTRIBUTE_REPARSE_POINT)
+		&& hasTrustedOwner(path);
+	if (ok) {
+		BOOL present;
+		BOOL defaulted;
+		PACL dacl = NULL;
+		ok = GetSecurityDescriptorDacl(sd, &present, &dacl, &defaulted)
+			&& SetNamedSecurityInfo((wchar_t*)path, SE_FILE_OBJECT, DACL_SECURITY_INFORMATION | PROTECTED_DACL_SECURITY_INFORMATION,
+				NULL, NULL, dacl, NULL) == ERROR_SUCCESS;
+	}
+	LocalFree(sd);
+	return ok;
+}
+
+bool
+uac_canTrustFile(const wchar_t* path)
+{
+	if (GetFileAttributes(path) == INVALID_FILE_ATTRIBUTES && GetLastError() == ERROR_FILE_NOT_FOUND) return true;
+	return hasTrustedOwner(path);
+}
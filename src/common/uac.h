@@ -1,7 +1,18 @@
-#pragma once
-
-#include <stdbool.h>
-
-
-bool
-uac_isElevated(void);
+#pragma once
+
+#include <stdbool.h>
+#include <wchar.h>
+
+
+bool
+uac_isElevated(void);
+
+// Create directory path, or take it over if it exists, so only Administrators and SYSTEM can create or change files in it.
+// Return false if failed, or the directory is owned by someone else or is a link, so files in it can't be trusted.
+bool
+uac_secureDirectory(const wchar_t* path);
+
+// Return false if path exists but is owned by neither Administrators nor SYSTEM, e.g. planted by a user before
+// its directory was secured.
+bool
+uac_canTrustFile(const wchar_t* path);
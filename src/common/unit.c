@@ -1,881 +1,1357 @@
-#include "unit.h"
-
-#include <winioctl.h>
-#define _NTSCSI_USER_MODE_
-#if defined(__GNUC__)
-#include <ddk/scsi.h>
-#else
-#include <scsi.h>
-#include <intrin.h> // _byteswap_*
-#endif
-#undef _NTSCSI_USER_MODE_
-#include <ntddscsi.h>
-
-#include <strsafe.h>
-
-
-enum {
-	kTimeOut = 60,
-};
-
-typedef enum ModeType {
-	kModeCurrent,
-	kModeChangeable,
-	kModeDefault,
-	KModeSaved
-}ModeType;
-
-#pragma pack(push, scsidata, 1)
-// P.208, sbc4r22.pdf - 5.20.2 READ CAPACITY (10) parameter data
-typedef struct ReadCapacityData10 {
-	DWORD lbLast;
-	DWORD lbSize;
-}ReadCapacityData10;
-
-// P.210, sbc4r22.pdf - 5.21.2 READ CAPACITY (16) parameter data
-typedef struct ReadCapacityData16 {
-	uint64_t lbLast;
-	uint32_t lbSize;
-	BYTE prot_en : 1;
-	BYTE p_type : 3;
-	BYTE zbc2Restricted : 2;
-	BYTE reserved12 : 2;
-	BYTE logBlkPerPhyBlkExp : 4;
-	BYTE p_i_exponent : 4;
-	BYTE lowestAlignedLogBlkAddrHi : 6;
-	BYTE lbprz : 1;
-	BYTE lbpme : 1;
-	BYTE lowestAlignedLogBlkAddrLo;
-	BYTE reserved16[16];
-}ReadCapacityData16;
-
-// P.209, sbc4r22.pdf - 5.21 READ CAPACITY (16) command
-typedef struct Cdb16ServiceActionIn {
-	BYTE operationCode;
-	BYTE serviceAction : 5;
-	BYTE reserved1 : 3;
-	BYTE obsolete2[8];
-	BYTE allocationLength[4];
-	BYTE reserved14;
-	BYTE control;
-}Cdb16ServiceActionIn;
-
-// P.289, spc5r22.pdf - 6.7.2 Standard INQUIRY data
-typedef struct StandardInquiryData {
-	BYTE type : 5;
-	BYTE qualifier : 3;
-	BYTE reserved1 : 6;
-	BYTE isConglomerate : 1;
-	BYTE isRemovable : 1;
-	BYTE version;
-	BYTE responseDataFormat : 4;
-	BYTE supportHistoricalLUN : 1;
-	BYTE supportNormACA : 1;
-	BYTE reserved3 : 2;
-	BYTE additionalLength;
-	// byte-5
-	BYTE supportProtection : 1;
-	BYTE reserved5 : 2;
-	BYTE support3rdPartyCopy : 1;
-	BYTE TPGS : 2;
-	BYTE obsolete5 : 1;
-	BYTE supportSCC : 1;
-	// byte-6
-	BYTE reserved6_0 : 4;
-	BYTE withMultiPorts : 1;
-	BYTE vs6 : 1;
-	BYTE hasEnclosureServices : 1;
-	BYTE obsolete6_7 : 1;
-	// byte-7
-	BYTE vs7 : 1;
-	BYTE supportCommandQueue : 1;
-	BYTE reserved7 : 6;
-	// byte-8
-	BYTE vendorId[8];
-	BYTE productId[16];
-	BYTE revision[4];
-}StandardInquiryData;
-
-// P.744, spc5r22.pdf - 7.7.19 Unit Serial Number VPD page
-typedef struct SerialNumberData {
-	BYTE deviceType : 5;
-	BYTE qualifier : 3;
-	BYTE pageCode;
-	BYTE pageLength[2];
-	BYTE serialNumber[1];
-}SerialNumberData;
-
-// P.370, sbc4r22.pdf - 6.6.2 Block Device Characteristics VPD page
-typedef struct CharacteristicsData {
-	BYTE deviceType : 5;
-	BYTE qualifier : 3;
-	BYTE pageCode; // 0xB1
-	BYTE pageLength[2];
-	WORD rpm;
-	BYTE type;
-	BYTE formFactor : 4;
-	BYTE waceReq : 2; // write after cryptographic erase required
-	BYTE wabeReq : 2; // write after block erase required
-	// byte-8
-	BYTE vbuls : 1; // verify byte check unmapped LBA supported
-	BYTE fuab : 1; // force unit access behavior
-	BYTE bocs : 1; // background operation control supported
-	BYTE rbwz : 1; // reassign blocks write zero
-	BYTE zoned : 2;
-	BYTE reserved8 : 2;
-	BYTE reserved9[3];
-	DWORD depopulationTime;
-	BYTE reserved[48];
-}CharacteristicsData;
-
-// P.624, spc5r22.pdf - Table 444 - Mode parameter header(10)
-typedef struct ModeHeader10 {
-	BYTE modeDataLength[2];
-	BYTE mediumType;
-	BYTE deviceParameter; // See P.342, sbc4r22.pdf - Table 230 - DEVICE-SPECIFIC PARAMETER field for direct access block devices
-	BYTE longLba : 1;
-	BYTE mh_reserved4 : 7;
-	BYTE mh_reserved5;
-	BYTE blockDescriptorLength[2];
-}ModeHeader10;
-
-// P.623, spc5r22.pdf - 7.5.6 Mode parameter header formats
-typedef struct ModeHeader6 {
-	BYTE modeDataLength;
-	BYTE mediumType;
-	BYTE deviceParameter; // See P.342, sbc4r22.pdf - Table 230 - DEVICE-SPECIFIC PARAMETER field for direct access block devices
-	BYTE blockDescriptorLength;
-}ModeHeader6;
-
-// P642, spc5r22.pdf - 7.5.16 Power Condition mode page
-#define POWER_CONDITION_MODE_PAGE_MEMBERS 	BYTE pageCode : 6;/* 0x1A */\
-	BYTE subPageFormat : 1;\
-	BYTE parametersSaveable : 1;\
-	BYTE pageLength;/* 0x26, 38 */\
-	BYTE standbyY : 1;\
-	BYTE reserved2 : 5;\
-	BYTE pmBgPrecedence : 2;\
-	BYTE standbyZ : 1;\
-	BYTE idleA : 1;\
-	BYTE idleB : 1;\
-	BYTE idleC : 1;\
-	BYTE reserved3 : 4;\
-	DWORD timerIdleA;\
-	DWORD timerStandbyZ;\
-	DWORD timerIdleB;\
-	DWORD timerIdleC;\
-	DWORD timerStandbyY;\
-	BYTE reserved24[15];\
-	BYTE reserved39 : 2;\
-	BYTE ccfStopped : 2;\
-	BYTE ccfStandby : 2;\
-	BYTE ccfIdle : 2
-
-typedef struct PowerConditionModePage {
-	POWER_CONDITION_MODE_PAGE_MEMBERS;
-}PowerConditionModePage;
-
-#define POWER_CONDITION_MODE_PAGE_UNION union {\
-	struct {\
-		POWER_CONDITION_MODE_PAGE_MEMBERS;\
-	};\
-	PowerConditionModePage modePage;\
-}
-
-typedef struct PowerConditionData10 {
-	ModeHeader10;
-	POWER_CONDITION_MODE_PAGE_UNION;
-}PowerConditionData10;
-
-typedef struct PowerConditionData6 {
-	ModeHeader6;
-	POWER_CONDITION_MODE_PAGE_UNION;
-}PowerConditionData6;
-
-typedef struct Cdb10ModeSense {
-	BYTE operationCode; // 0x5A
-	BYTE reserved1 : 3;
-	BYTE disableBlockDescriptors : 1;
-	BYTE longLbaAccepted : 1;
-	BYTE reserved1_2 : 3;
-	BYTE pageCode : 6;
-	BYTE pageControl : 2;
-	BYTE subPageCode;
-	BYTE reserved4[3];
-	BYTE allocLength[2];
-	BYTE control;
-}Cdb10ModeSense;
-
-typedef struct Cdb6ModeSense {
-	BYTE operationCode; // 0x1A
-	BYTE reserved1 : 3;
-	BYTE disableBlockDescriptors : 1;
-	BYTE reserved1_2 : 4;
-	BYTE pageCode : 6;
-	BYTE pageControl : 2;
-	BYTE subPageCode;
-	BYTE allocLength;
-	BYTE control;
-}Cdb6ModeSense;
-
-typedef struct Cdb10ModeSelect {
-	BYTE operationCode; // 0x55
-	BYTE savePages : 1;
-	BYTE revertToDefaults : 1;
-	BYTE reserved1_1 : 2;
-	BYTE pageFormat : 1;
-	BYTE reserved1_2 : 3;
-	BYTE reserved2[5];
-	BYTE parameterListLength[2];
-	BYTE control;
-}Cdb10ModeSelect;
-
-typedef struct Cdb6ModeSelect {
-	BYTE operationCode; // 0x15
-	BYTE savePages : 1;
-	BYTE revertToDefaults : 1;
-	BYTE reserved1_1 : 2;
-	BYTE pageFormat : 1;
-	BYTE reserved1_2 : 3;
-	BYTE reserved2[2];
-	BYTE parameterListLength;
-	BYTE control;
-}Cdb6ModeSelect;
-#pragma pack(pop, scsidata)
-
-// This function has no practical use. So it's commented out.
-//bool
-//unit_start(HANDLE h) {
-//	SCSI_PASS_THROUGH spt = {
-//		.Length = sizeof(SCSI_PASS_THROUGH),
-//		.DataIn = SCSI_IOCTL_DATA_OUT,
-//		.TimeOutValue = kTimeOut,
-//		.CdbLength = CDB6GENERIC_LENGTH,
-//		.Cdb[0] = SCSIOP_START_STOP_UNIT,
-//		.Cdb[4] = 1,
-//	};
-//
-//	DWORD cb = 0;
-//	return DeviceIoControl(
-//		h, IOCTL_SCSI_PASS_THROUGH,
-//		&spt, sizeof(SCSI_PASS_THROUGH),
-//		&spt, sizeof(SCSI_PASS_THROUGH),
-//		&cb, FALSE
-//	);
-//}
-
-bool
-unit_stop(HANDLE h)
-{
-	SCSI_PASS_THROUGH spt = {
-		.Length = sizeof(SCSI_PASS_THROUGH),
-		.DataIn = SCSI_IOCTL_DATA_OUT,
-		.TimeOutValue = kTimeOut,
-		.CdbLength = CDB6GENERIC_LENGTH,
-		.Cdb[0] = SCSIOP_START_STOP_UNIT,
-	};
-
-	DWORD cb = 0;
-	return DeviceIoControl(
-		h, IOCTL_SCSI_PASS_THROUGH,
-		&spt, sizeof(SCSI_PASS_THROUGH),
-		&spt, sizeof(SCSI_PASS_THROUGH),
-		&cb, FALSE
-	);
-}
-
-#ifdef _DEBUG
-static bool
-dump(const wchar_t* path, const BYTE* bin, DWORD size) {
-	HANDLE f = CreateFile(path, GENERIC_WRITE, FILE_SHARE_READ, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
-	if (f == INVALID_HANDLE_VALUE) return false;
-
-	DWORD cb;
-	BOOL ok = WriteFile(f, bin, size, &cb, NULL);
-
-	CloseHandle(f);
-	return ok;
-}
-#endif // _DEBUG
-
-// Since CreateFile activates the drive, it's pointless to check power condition using this function
-//static const SENSE_DATA*
-//getSense(HANDLE h) {
-//	static SENSE_DATA data;
-//
-//	SCSI_PASS_THROUGH_DIRECT sptd = {
-//		.Length = sizeof(SCSI_PASS_THROUGH_DIRECT),
-//		.CdbLength = CDB6GENERIC_LENGTH,
-//		.DataBuffer = &data,
-//		.DataTransferLength = sizeof(data),
-//		.TimeOutValue = kTimeOut,
-//		.DataIn = SCSI_IOCTL_DATA_IN,
-//		.Cdb[0] = SCSIOP_REQUEST_SENSE,
-//		.Cdb[4] = sizeof(data),
-//	};
-//
-//	DWORD cb = 0;
-//	BOOL ok = DeviceIoControl(
-//		h, IOCTL_SCSI_PASS_THROUGH_DIRECT,
-//		&sptd, sizeof(SCSI_PASS_THROUGH_DIRECT),
-//		&sptd, sizeof(SCSI_PASS_THROUGH_DIRECT),
-//		&cb, FALSE
-//	);
-//
-//	if (!ok || sptd.ScsiStatus != SCSISTAT_GOOD) {
-//		return NULL;
-//	}
-//
-//	return &data;
-//}
-
-// Return pointer to inner static buffer
-static const ReadCapacityData10*
-getCapacity10(HANDLE h) {
-	static ReadCapacityData10 data;
-
-	SCSI_PASS_THROUGH_DIRECT sptd = {
-		.Length = sizeof(SCSI_PASS_THROUGH_DIRECT),
-		.CdbLength = CDB10GENERIC_LENGTH,
-		.DataBuffer = &data,
-		.DataTransferLength = sizeof(data),
-		.TimeOutValue = kTimeOut,
-		.DataIn = SCSI_IOCTL_DATA_IN,
-		.Cdb[0] = SCSIOP_READ_CAPACITY,
-	};
-
-	DWORD cb = 0;
-	BOOL ok = DeviceIoControl(
-		h, IOCTL_SCSI_PASS_THROUGH_DIRECT,
-		&sptd, sizeof(SCSI_PASS_THROUGH_DIRECT),
-		&sptd, sizeof(SCSI_PASS_THROUGH_DIRECT),
-		&cb, FALSE
-	);
-
-	if (!ok || sptd.ScsiStatus != SCSISTAT_GOOD) {
-		return NULL;
-	}
-	return &data;
-}
-
-static const ReadCapacityData16*
-getCapacity16(HANDLE h) {
-	static ReadCapacityData16 data;
-
-	SCSI_PASS_THROUGH_DIRECT sptd = {
-		.Length = sizeof(SCSI_PASS_THROUGH_DIRECT),
-		.CdbLength = 16,
-		.DataBuffer = &data,
-		.DataTransferLength = sizeof(data),
-		.TimeOutValue = kTimeOut,
-		.DataIn = SCSI_IOCTL_DATA_IN,
-	};
-	Cdb16ServiceActionIn* cdb = (Cdb16ServiceActionIn*)sptd.Cdb;
-	cdb->operationCode = SCSIOP_READ_CAPACITY16;
-	cdb->serviceAction = 0x10;
-	cdb->allocationLength[3] = sizeof(data);
-
-	DWORD cb = 0;
-	BOOL ok = DeviceIoControl(
-		h, IOCTL_SCSI_PASS_THROUGH_DIRECT,
-		&sptd, sizeof(SCSI_PASS_THROUGH_DIRECT),
-		&sptd, sizeof(SCSI_PASS_THROUGH_DIRECT),
-		&cb, FALSE
-	);
-
-	if (!ok || sptd.ScsiStatus != SCSISTAT_GOOD) {
-		return NULL;
-	}
-	return &data;
-}
-
-static bool
-getCapacity(HANDLE h, uint32_t* lbSize, uint64_t* lbCount) {
-	const ReadCapacityData10* p10 = getCapacity10(h);
-	if (p10 && p10->lbLast != ~(DWORD)0) {
-		*lbSize = _byteswap_ulong(p10->lbSize);
-		*lbCount = 1ULL + _byteswap_ulong(p10->lbLast);
-		return true;
-	}
-	const ReadCapacityData16* p16 = getCapacity16(h);
-	if (p16 && p16->lbLast != ~(uint64_t)0) {
-		*lbSize = _byteswap_ulong(p16->lbSize);
-		*lbCount = 1ULL + _byteswap_uint64(p16->lbLast);
-		return true;
-	}
-	return false;
-}
-
-// Return pointer to inner static buffer
-static const StandardInquiryData*
-getStandardInquiry(HANDLE h) {
-	static StandardInquiryData data;
-
-	SCSI_PASS_THROUGH_DIRECT sptd = {
-		.Length = sizeof(SCSI_PASS_THROUGH_DIRECT),
-		.CdbLength = CDB6GENERIC_LENGTH,
-		.DataBuffer = &data,
-		.DataTransferLength = sizeof(data),
-		.TimeOutValue = kTimeOut,
-		.DataIn = SCSI_IOCTL_DATA_IN,
-		.Cdb[0] = SCSIOP_INQUIRY,
-		.Cdb[4] = sizeof(data),
-	};
-
-	DWORD cb = 0;
-	BOOL ok = DeviceIoControl(
-		h, IOCTL_SCSI_PASS_THROUGH_DIRECT,
-		&sptd, sizeof(SCSI_PASS_THROUGH_DIRECT),
-		&sptd, sizeof(SCSI_PASS_THROUGH_DIRECT),
-		&cb, FALSE
-	);
-
-	if (!ok || sptd.ScsiStatus != SCSISTAT_GOOD) {
-		return NULL;
-	}
-	return &data;
-}
-
-// Return pointer to inner static buffer
-static const PowerConditionData10*
-getPowerCondition10(HANDLE h, ModeType type) {
-	static PowerConditionData10 data;
-
-	SCSI_PASS_THROUGH_DIRECT sptd = {
-		.Length = sizeof(SCSI_PASS_THROUGH_DIRECT),
-		.CdbLength = CDB10GENERIC_LENGTH,
-		.DataBuffer = &data,
-		.DataTransferLength = sizeof(data),
-		.TimeOutValue = kTimeOut,
-		.DataIn = SCSI_IOCTL_DATA_IN,
-	};
-	Cdb10ModeSense* cdb = (Cdb10ModeSense*)sptd.Cdb;
-	cdb->operationCode = SCSIOP_MODE_SENSE10;
-	cdb->disableBlockDescriptors = 1;
-	cdb->pageCode = 0x1A;
-	cdb->pageControl = type;
-	cdb->allocLength[1] = sizeof(data);
-
-	DWORD cb = 0;
-	BOOL ok = DeviceIoControl(
-		h, IOCTL_SCSI_PASS_THROUGH_DIRECT,
-		&sptd, sizeof(SCSI_PASS_THROUGH_DIRECT),
-		&sptd, sizeof(SCSI_PASS_THROUGH_DIRECT),
-		&cb, FALSE
-	);
-
-	if (!ok || sptd.ScsiStatus != SCSISTAT_GOOD) {
-		return NULL;
-	}
-
-	return &data;
-}
-
-// Return pointer to inner static buffer
-static const PowerConditionData6*
-getPowerCondition6(HANDLE h, ModeType type) {
-	static PowerConditionData6 data;
-
-	SCSI_PASS_THROUGH_DIRECT sptd = {
-		.Length = sizeof(SCSI_PASS_THROUGH_DIRECT),
-		.CdbLength = CDB6GENERIC_LENGTH,
-		.DataBuffer = &data,
-		.DataTransferLength = sizeof(data),
-		.TimeOutValue = kTimeOut,
-		.DataIn = SCSI_IOCTL_DATA_IN,
-	};
-	Cdb6ModeSense* cdb = (Cdb6ModeSense*)sptd.Cdb;
-	cdb->operationCode = SCSIOP_MODE_SENSE;
-	cdb->disableBlockDescriptors = 1;
-	cdb->pageCode = 0x1A;
-	cdb->pageControl = type;
-	cdb->allocLength = sizeof(data);
-
-	DWORD cb = 0;
-	BOOL ok = DeviceIoControl(
-		h, IOCTL_SCSI_PASS_THROUGH_DIRECT,
-		&sptd, sizeof(SCSI_PASS_THROUGH_DIRECT),
-		&sptd, sizeof(SCSI_PASS_THROUGH_DIRECT),
-		&cb, FALSE
-	);
-
-	if (!ok || sptd.ScsiStatus != SCSISTAT_GOOD) {
-		return NULL;
-	}
-
-	return &data;
-}
-
-static const PowerConditionModePage*
-getPowerCondition(HANDLE h, ModeType type) {
-	const PowerConditionData10* p10 = getPowerCondition10(h, type);
-	if (p10) return &p10->modePage;
-	const PowerConditionData6* p6 = getPowerCondition6(h, type);
-	return p6 ? &p6->modePage : NULL;
-}
-
-static bool
-setPowerCondition10(HANDLE h, const PowerConditionData10* p) {
-	SCSI_PASS_THROUGH_DIRECT sptd = {
-		.Length = sizeof(SCSI_PASS_THROUGH_DIRECT),
-		.CdbLength = CDB10GENERIC_LENGTH,
-		.DataBuffer = (PVOID)p,
-		.DataTransferLength = sizeof(PowerConditionData10),
-		.TimeOutValue = kTimeOut,
-		.DataIn = SCSI_IOCTL_DATA_OUT,
-	};
-	Cdb10ModeSelect* cdb = (Cdb10ModeSelect*)sptd.Cdb;
-	cdb->operationCode = SCSIOP_MODE_SELECT10;
-	cdb->savePages = 1;
-	cdb->pageFormat = 1;
-	cdb->parameterListLength[1] = sizeof(PowerConditionData10);
-
-	DWORD cb = 0;
-	BOOL ok = DeviceIoControl(
-		h, IOCTL_SCSI_PASS_THROUGH_DIRECT,
-		&sptd, sizeof(SCSI_PASS_THROUGH_DIRECT),
-		&sptd, sizeof(SCSI_PASS_THROUGH_DIRECT),
-		&cb, FALSE
-	);
-
-	if (!ok || sptd.ScsiStatus != SCSISTAT_GOOD) {
-		return false;
-	}
-
-	return true;
-}
-
-static bool
-setPowerCondition6(HANDLE h, const PowerConditionData6* p) {
-	SCSI_PASS_THROUGH_DIRECT sptd = {
-		.Length = sizeof(SCSI_PASS_THROUGH_DIRECT),
-		.CdbLength = CDB6GENERIC_LENGTH,
-		.DataBuffer = (PVOID)p,
-		.DataTransferLength = sizeof(PowerConditionData6),
-		.TimeOutValue = kTimeOut,
-		.DataIn = SCSI_IOCTL_DATA_OUT,
-	};
-	Cdb6ModeSelect* cdb = (Cdb6ModeSelect*)sptd.Cdb;
-	cdb->operationCode = SCSIOP_MODE_SELECT;
-	cdb->savePages = 1;
-	cdb->pageFormat = 1;
-	cdb->parameterListLength = sizeof(PowerConditionData6);
-
-	DWORD cb = 0;
-	BOOL ok = DeviceIoControl(
-		h, IOCTL_SCSI_PASS_THROUGH_DIRECT,
-		&sptd, sizeof(SCSI_PASS_THROUGH_DIRECT),
-		&sptd, sizeof(SCSI_PASS_THROUGH_DIRECT),
-		&cb, FALSE
-	);
-
-	if (!ok || sptd.ScsiStatus != SCSISTAT_GOOD) {
-		return false;
-	}
-
-	return true;
-}
-
-// Return pointer to inner static buffer
-static const BYTE*
-getVpdPage(HANDLE h, ULONG* size, BYTE pageCode) {
-	static BYTE data[128];
-
-	SCSI_PASS_THROUGH_DIRECT sptd = {
-		.Length = sizeof(SCSI_PASS_THROUGH_DIRECT),
-		.CdbLength = CDB6GENERIC_LENGTH,
-		.DataBuffer = data,
-		.DataTransferLength = sizeof(data),
-		.TimeOutValue = kTimeOut,
-		.DataIn = SCSI_IOCTL_DATA_IN,
-		.Cdb[0] = SCSIOP_INQUIRY,
-		.Cdb[1] = 1, // EVPD
-		.Cdb[2] = pageCode,
-		.Cdb[4] = (BYTE)sizeof(data),
-	};
-
-	DWORD cb = 0;
-	BOOL ok = DeviceIoControl(
-		h, IOCTL_SCSI_PASS_THROUGH_DIRECT,
-		&sptd, sizeof(SCSI_PASS_THROUGH_DIRECT),
-		&sptd, sizeof(SCSI_PASS_THROUGH_DIRECT),
-		&cb, FALSE
-	);
-
-	if (!ok
-		|| sptd.ScsiStatus != SCSISTAT_GOOD) {
-		return NULL;
-	}
-
-	*size = sptd.DataTransferLength;
-	return data;
-}
-
-// CharacteristicsData is fixed in length
-static inline const CharacteristicsData*
-getCharacteristics(HANDLE h) {
-	ULONG size;
-	const BYTE* p = getVpdPage(h, &size, 0xB1);
-	return (const CharacteristicsData*)p;
-}
-
-static inline const SerialNumberData*
-getSerialNumber(HANDLE h) {
-	ULONG size;
-	const BYTE* data = getVpdPage(h, &size, 0x80);
-	return (const SerialNumberData*)data;
-}
-
-// Count string length excluding tailing spaces and NULs
-static inline int
-getStringLen(const UCHAR* str, int cb) {
-	if (!str) return 0;
-
-	for (int i = cb - 1; i >= 0; --i) {
-		if (str[i] == 0x20) continue;
-		if (str[i] == 0x00) continue;
-		return i + 1;
-	}
-	return 0;
-}
-
-static inline void
-normalizeString(wchar_t* t, const UCHAR* str, int cb) {
-	const int len = getStringLen(str, cb);
-	int i = 0;
-	for (; i < len; ++i) {
-		t[i] = str[i];
-	}
-	t[i] = L'\0';
-}
-
-static void
-fillInquiry(UnitInfo* info, const StandardInquiryData* inquiry) {
-	normalizeString(info->vendor, inquiry->vendorId, unit_kLenVendorId);
-	normalizeString(info->product, inquiry->productId, unit_kLenProductId);
-	normalizeString(info->revision, inquiry->revision, unit_kLenRevision);
-}
-
-static void
-fillSerial(UnitInfo* info, const SerialNumberData* serial) {
-	if (serial) {
-		const int serialLen = min(serial->pageLength[1], unit_kLenSerial);
-		normalizeString(info->serial, serial->serialNumber, serialLen);
-	}
-	else {
-		info->serial[0] = L'\0';
-	}
-}
-
-static void
-fillCharacteristics(UnitInfo* info, const CharacteristicsData* p) {
-	if (p) {
-		info->formFactor = p->formFactor;
-		info->rpm = _byteswap_ushort(p->rpm);
-	}
-	else {
-		info->formFactor = unit_kFormFactorNA;
-		info->rpm = 0;
-	}
-}
-
-// Since CreateFile activates the drive, it's pointless to use this function
-//static void
-//fillPowerCondition(UnitInfo* info, const SENSE_DATA* p) {
-//	info->powerCondition = unit_kPowerConditionUnknown;
-//	if (p->ErrorCode != SCSI_SENSE_ERRORCODE_FIXED_CURRENT) return;
-//
-//	// See P.760, spc5r22.pdf - Annex F.2 Additional sense codes
-//
-//	if (p->SenseKey == SCSI_SENSE_NOT_READY
-//		&& p->AdditionalSenseCode == 0x04
-//		&& p->AdditionalSenseCodeQualifier == 0x02) {
-//		info->powerCondition = unit_kStopped;
-//		return;
-//	}
-//
-//	if (p->SenseKey != SCSI_SENSE_NO_SENSE) return;
-//
-//	switch (p->AdditionalSenseCode) {
-//	case 0x00:
-//		if (!p->AdditionalSenseCodeQualifier) info->powerCondition = unit_kActive;
-//		break;
-//	case 0x5E:
-//		switch (p->AdditionalSenseCodeQualifier) {
-//		case 0x00:
-//		case 0x02:
-//		case 0x04:
-//			info->powerCondition = unit_kStandbyZ;
-//			break;
-//		case 0x01:
-//		case 0x03:
-//			info->powerCondition = unit_kIdleA;
-//			break;
-//		case 0x05:
-//		case 0x06:
-//			info->powerCondition = unit_kIdleB;
-//			break;
-//		case 0x07:
-//		case 0x08:
-//			info->powerCondition = unit_kIdleC;
-//			break;
-//		case 0x09:
-//		case 0x0A:
-//			info->powerCondition = unit_kStandbyY;
-//			break;
-//		}
-//		break;
-//	}
-//}
-
-bool
-unit_getInfo(HANDLE h, UnitInfo* info)
-{
-	const StandardInquiryData* inquiry = getStandardInquiry(h);
-	if (!inquiry) return false;
-
-	if (!getCapacity(h, &info->blockSize, &info->blockCount)) {
-		info->blockSize = 0;
-		info->blockCount = 0;
-	}
-
-	fillInquiry(info, inquiry);
-	const SerialNumberData* serial = getSerialNumber(h);
-	fillSerial(info, serial);
-	const CharacteristicsData* charas = getCharacteristics(h);
-	fillCharacteristics(info, charas);
-
-	return true;
-}
-
-static void
-fillTimerMask(UnitInfo* info, const PowerConditionModePage* p) {
-	info->timerIdleA = p->idleA;
-	info->timerIdleB = p->idleB;
-	info->timerIdleC = p->idleC;
-	info->timerStandbyY = p->standbyY;
-	info->timerStandbyZ = p->standbyZ;
-}
-
-static void
-doFillTimers(DWORD* timers, const PowerConditionModePage* p) {
-	timers[unit_kIdleA] = p->idleA ? _byteswap_ulong(p->timerIdleA) : 0;
-	timers[unit_kIdleB] = p->idleB ? _byteswap_ulong(p->timerIdleB) : 0;
-	timers[unit_kIdleC] = p->idleC ? _byteswap_ulong(p->timerIdleC) : 0;
-	timers[unit_kStandbyY] = p->standbyY ? _byteswap_ulong(p->timerStandbyY) : 0;
-	timers[unit_kStandbyZ] = p->standbyZ ? _byteswap_ulong(p->timerStandbyZ) : 0;
-}
-
-static void
-fillTimers(UnitInfo* info, ModeType type, const PowerConditionModePage* p) {
-	DWORD* timers = NULL;
-	switch (type) {
-	case kModeCurrent:
-		timers = info->timers;
-		break;
-	case kModeChangeable:
-		timers = info->timersModMask;
-		break;
-	case kModeDefault:
-		timers = info->timersDefault;
-		break;
-	}
-	if (!timers) return;
-
-	doFillTimers(timers, p);
-}
-
-bool
-unit_getTimers(HANDLE h, UnitInfo* info)
-{
-	info->timerMask = 0;
-	const PowerConditionModePage* p = getPowerCondition(h, kModeCurrent);
-	if (!p) return false;
-
-	info->timerWritable = p->parametersSaveable;
-	fillTimerMask(info, p);
-	fillTimers(info, kModeCurrent, p);
-
-	p = getPowerCondition(h, kModeChangeable);
-	if (p) fillTimers(info, kModeChangeable, p);
-	
-	p = getPowerCondition(h, kModeDefault);
-	if (p) fillTimers(info, kModeDefault, p);
-
-	return true;
-}
-
-static bool
-timersWritable(const UnitInfo* info, BYTE mask, const DWORD* timers) {
-	if (!info->timerWritable) return false;
-	if (!mask) return false;
-	//if (!info->timerMask) return false; // covered by the next line
-	if ((info->timerMask | mask) != info->timerMask) return false;
-
-	for (int i = 0; i < unit_kPowerConditionCount && mask; ++i) {
-		if (mask & 1) {
-			if ((timers[i] & info->timersModMask[i]) != timers[i]) return false;
-		}
-		mask >>= 1;
-	}
-
-	return true;
-}
-
-static void
-setPowerConditionModePage(PowerConditionModePage* p, BYTE mask, const DWORD* timers) {
-	const TimerMask* tm = (TimerMask*)&mask;
-	if (tm->timerIdleA) p->timerIdleA = _byteswap_ulong(timers[unit_kIdleA]);
-	if (tm->timerIdleB) p->timerIdleB = _byteswap_ulong(timers[unit_kIdleB]);
-	if (tm->timerIdleC) p->timerIdleC = _byteswap_ulong(timers[unit_kIdleC]);
-	if (tm->timerStandbyY) p->timerStandbyY = _byteswap_ulong(timers[unit_kStandbyY]);
-	if (tm->timerStandbyZ) p->timerStandbyZ = _byteswap_ulong(timers[unit_kStandbyZ]);
-}
-
-static bool
-writeTimers10(HANDLE h, BYTE mask, const DWORD* timers) {
-	PowerConditionData10* p = (PowerConditionData10*)getPowerCondition10(h, kModeCurrent);
-	if (!p) return false;
-	setPowerConditionModePage(&p->modePage, mask, timers);
-	// bit reserved, P.342, sbc4r22.pdf - Table 230 - DEVICE-SPECIFIC PARAMETER field for direct access block devices
-	p->deviceParameter = 0;
-	// P.626, spc5r22.pdf - "When using the MODE SELECT command, the PS bit is reserved."
-	p->parametersSaveable = 0;
-	return setPowerCondition10(h, p);
-}
-
-static bool
-writeTimers6(HANDLE h, BYTE mask, const DWORD* timers) {
-	PowerConditionData6* p = (PowerConditionData6*)getPowerCondition6(h, kModeCurrent);
-	if (!p) return false;
-	setPowerConditionModePage(&p->modePage, mask, timers);
-	// see writeTimers10() for these 2 flags
-	p->deviceParameter = 0;
-	p->parametersSaveable = 0;
-	return setPowerCondition6(h, p);
-}
-
-static bool
-writeTimers(HANDLE h, BYTE mask, const DWORD* timers) {
-	if (writeTimers10(h, mask, timers)) return true;
-	return writeTimers6(h, mask, timers);
-}
-
-bool
-unit_setTimers(HANDLE h, BYTE mask, const DWORD timers[unit_kPowerConditionCount], const wchar_t** errmsg)
-{
-	static const wchar_t* kNoTimer = L"Device has no power condition timers.";
-	static const wchar_t* kNotWritable = L"Timers not writable.";
-
-	*errmsg = NULL;
-	UnitInfo info;
-	if (!unit_getTimers(h, &info)) {
-		*errmsg = kNoTimer;
-		return false;
-	}
-	if (!timersWritable(&info, mask, timers)) {
-		*errmsg = kNotWritable;
-		return false;
-	}
-	return writeTimers(h, mask, timers);
-}
+#include "unit.h"
+
+#include <winioctl.h>
+#define _NTSCSI_USER_MODE_
+#if defined(__GNUC__)
+#include <ddk/scsi.h>
+#else
+#include <scsi.h>
+#include <intrin.h> // _byteswap_*
+#endif
+#undef _NTSCSI_USER_MODE_
+
+#include <strsafe.h>
+
+#include <assert.h>
+
+#include "heap.h"
+#include "quirk.h"
+#include "transport.h"
+
+
+enum {
+	// Seconds. A hung bridge costs at most this per command, so queries are short.
+	kTimeOutQuery = 10, // INQUIRY, TEST UNIT READY, REQUEST SENSE, READ CAPACITY, ATA CHECK POWER MODE
+	kTimeOutModePage = 20, // MODE SENSE, MODE SELECT. Saving pages may write to media
+	kTimeOutStartStop = 120, // Spin-up of a large disk without IMMED
+	kPagePowerCondition = 0x1A,
+	kPageAll = 0x3F,
+	kAtaCheckPowerMode = 0xE5,
+};
+
+typedef enum ModeType {
+	kModeCurrent,
+	kModeChangeable,
+	kModeDefault,
+	KModeSaved
+}ModeType;
+
+#pragma pack(push, scsidata, 1)
+// P.208, sbc4r22.pdf - 5.20.2 READ CAPACITY (10) parameter data
+typedef struct ReadCapacityData10 {
+	DWORD lbLast;
+	DWORD lbSize;
+}ReadCapacityData10;
+
+// P.210, sbc4r22.pdf - 5.21.2 READ CAPACITY (16) parameter data
+typedef struct ReadCapacityData16 {
+	uint64_t lbLast;
+	uint32_t lbSize;
+	BYTE prot_en : 1;
+	BYTE p_type : 3;
+	BYTE zbc2Restricted : 2;
+	BYTE reserved12 : 2;
+	BYTE logBlkPerPhyBlkExp : 4;
+	BYTE p_i_exponent : 4;
+	BYTE lowestAlignedLogBlkAddrHi : 6;
+	BYTE lbprz : 1;
+	BYTE lbpme : 1;
+	BYTE lowestAlignedLogBlkAddrLo;
+	BYTE reserved16[16];
+}ReadCapacityData16;
+
+// P.209, sbc4r22.pdf - 5.21 READ CAPACITY (16) command
+typedef struct Cdb16ServiceActionIn {
+	BYTE operationCode;
+	BYTE serviceAction : 5;
+	BYTE reserved1 : 3;
+	BYTE obsolete2[8];
+	BYTE allocationLength[4];
+	BYTE reserved14;
+	BYTE control;
+}Cdb16ServiceActionIn;
+
+// P.289, spc5r22.pdf - 6.7.2 Standard INQUIRY data
+typedef struct StandardInquiryData {
+	BYTE type : 5;
+	BYTE qualifier : 3;
+	BYTE reserved1 : 6;
+	BYTE isConglomerate : 1;
+	BYTE isRemovable : 1;
+	BYTE version;
+	BYTE responseDataFormat : 4;
+	BYTE supportHistoricalLUN : 1;
+	BYTE supportNormACA : 1;
+	BYTE reserved3 : 2;
+	BYTE additionalLength;
+	// byte-5
+	BYTE supportProtection : 1;
+	BYTE reserved5 : 2;
+	BYTE support3rdPartyCopy : 1;
+	BYTE TPGS : 2;
+	BYTE obsolete5 : 1;
+	BYTE supportSCC : 1;
+	// byte-6
+	BYTE reserved6_0 : 4;
+	BYTE withMultiPorts : 1;
+	BYTE vs6 : 1;
+	BYTE hasEnclosureServices : 1;
+	BYTE obsolete6_7 : 1;
+	// byte-7
+	BYTE vs7 : 1;
+	BYTE supportCommandQueue : 1;
+	BYTE reserved7 : 6;
+	// byte-8
+	BYTE vendorId[8];
+	BYTE productId[16];
+	BYTE revision[4];
+}StandardInquiryData;
+
+// P.744, spc5r22.pdf - 7.7.19 Unit Serial Number VPD page
+typedef struct SerialNumberData {
+	BYTE deviceType : 5;
+	BYTE qualifier : 3;
+	BYTE pageCode;
+	BYTE pageLength[2];
+	BYTE serialNumber[1];
+}SerialNumberData;
+
+// P.370, sbc4r22.pdf - 6.6.2 Block Device Characteristics VPD page
+typedef struct CharacteristicsData {
+	BYTE deviceType : 5;
+	BYTE qualifier : 3;
+	BYTE pageCode; // 0xB1
+	BYTE pageLength[2];
+	WORD rpm;
+	BYTE type;
+	BYTE formFactor : 4;
+	BYTE waceReq : 2; // write after cryptographic erase required
+	BYTE wabeReq : 2; // write after block erase required
+	// byte-8
+	BYTE vbuls : 1; // verify byte check unmapped LBA supported
+	BYTE fuab : 1; // force unit access behavior
+	BYTE bocs : 1; // background operation control supported
+	BYTE rbwz : 1; // reassign blocks write zero
+	BYTE zoned : 2;
+	BYTE reserved8 : 2;
+	BYTE reserved9[3];
+	DWORD depopulationTime;
+	BYTE reserved[48];
+}CharacteristicsData;
+
+// P.624, spc5r22.pdf - Table 444 - Mode parameter header(10)
+typedef struct ModeHeader10 {
+	BYTE modeDataLength[2];
+	BYTE mediumType;
+	BYTE deviceParameter; // See P.342, sbc4r22.pdf - Table 230 - DEVICE-SPECIFIC PARAMETER field for direct access block devices
+	BYTE longLba : 1;
+	BYTE mh_reserved4 : 7;
+	BYTE mh_reserved5;
+	BYTE blockDescriptorLength[2];
+}ModeHeader10;
+
+// P.623, spc5r22.pdf - 7.5.6 Mode parameter header formats
+typedef struct ModeHeader6 {
+	BYTE modeDataLength;
+	BYTE mediumType;
+	BYTE deviceParameter; // See P.342, sbc4r22.pdf - Table 230 - DEVICE-SPECIFIC PARAMETER field for direct access block devices
+	BYTE blockDescriptorLength;
+}ModeHeader6;
+
+// P642, spc5r22.pdf - 7.5.16 Power Condition mode page
+#define POWER_CONDITION_MODE_PAGE_MEMBERS 	BYTE pageCode : 6;/* 0x1A */\
+	BYTE subPageFormat : 1;\
+	BYTE parametersSaveable : 1;\
+	BYTE pageLength;/* 0x26, 38 */\
+	BYTE standbyY : 1;\
+	BYTE reserved2 : 5;\
+	BYTE pmBgPrecedence : 2;\
+	BYTE standbyZ : 1;\
+	BYTE idleA : 1;\
+	BYTE idleB : 1;\
+	BYTE idleC : 1;\
+	BYTE reserved3 : 4;\
+	DWORD timerIdleA;\
+	DWORD timerStandbyZ;\
+	DWORD timerIdleB;\
+	DWORD timerIdleC;\
+	DWORD timerStandbyY;\
+	BYTE reserved24[15];\
+	BYTE reserved39 : 2;\
+	BYTE ccfStopped : 2;\
+	BYTE ccfStandby : 2;\
+	BYTE ccfIdle : 2
+
+typedef struct PowerConditionModePage {
+	POWER_CONDITION_MODE_PAGE_MEMBERS;
+}PowerConditionModePage;
+
+#define POWER_CONDITION_MODE_PAGE_UNION union {\
+	struct {\
+		POWER_CONDITION_MODE_PAGE_MEMBERS;\
+	};\
+	PowerConditionModePage modePage;\
+}
+
+typedef struct PowerConditionData10 {
+	ModeHeader10;
+	POWER_CONDITION_MODE_PAGE_UNION;
+}PowerConditionData10;
+
+typedef struct PowerConditionData6 {
+	ModeHeader6;
+	POWER_CONDITION_MODE_PAGE_UNION;
+}PowerConditionData6;
+
+typedef struct Cdb10ModeSense {
+	BYTE operationCode; // 0x5A
+	BYTE reserved1 : 3;
+	BYTE disableBlockDescriptors : 1;
+	BYTE longLbaAccepted : 1;
+	BYTE reserved1_2 : 3;
+	BYTE pageCode : 6;
+	BYTE pageControl : 2;
+	BYTE subPageCode;
+	BYTE reserved4[3];
+	BYTE allocLength[2];
+	BYTE control;
+}Cdb10ModeSense;
+
+typedef struct Cdb6ModeSense {
+	BYTE operationCode; // 0x1A
+	BYTE reserved1 : 3;
+	BYTE disableBlockDescriptors : 1;
+	BYTE reserved1_2 : 4;
+	BYTE pageCode : 6;
+	BYTE pageControl : 2;
+	BYTE subPageCode;
+	BYTE allocLength;
+	BYTE control;
+}Cdb6ModeSense;
+
+typedef struct Cdb10ModeSelect {
+	BYTE operationCode; // 0x55
+	BYTE savePages : 1;
+	BYTE revertToDefaults : 1;
+	BYTE reserved1_1 : 2;
+	BYTE pageFormat : 1;
+	BYTE reserved1_2 : 3;
+	BYTE reserved2[5];
+	BYTE parameterListLength[2];
+	BYTE control;
+}Cdb10ModeSelect;
+
+typedef struct Cdb6ModeSelect {
+	BYTE operationCode; // 0x15
+	BYTE savePages : 1;
+	BYTE revertToDefaults : 1;
+	BYTE reserved1_1 : 2;
+	BYTE pageFormat : 1;
+	BYTE reserved1_2 : 3;
+	BYTE reserved2[2];
+	BYTE parameterListLength;
+	BYTE control;
+}Cdb6ModeSelect;
+#pragma pack(pop, scsidata)
+
+enum {
+	kCbVpdPage = 128,
+};
+
+// Command data of one query. It lives on the stack of the unit_* function that sends the commands,
+// so unit_* functions are reentrant and different disks can be queried from different threads.
+typedef union UnitBuffer {
+	ReadCapacityData10 capacity10;
+	ReadCapacityData16 capacity16;
+	StandardInquiryData inquiry;
+	PowerConditionData10 powerCondition10;
+	PowerConditionData6 powerCondition6;
+	BYTE vpdPage[kCbVpdPage];
+	PowerConditionModePage modePage;
+}UnitBuffer;
+
+// Get sense key, ASC and ASCQ from fixed or descriptor format sense data.
+// Return false if format unknown
+static bool
+getSenseCodes(const BYTE* sense, DWORD cb, BYTE* key, BYTE* asc, BYTE* ascq) {
+	if (cb < 4) return false;
+
+	switch (sense[0] & 0x7F) {
+	case 0x70:
+	case 0x71:
+		if (cb < 14) return false;
+		*key = sense[2] & 0x0F;
+		*asc = sense[12];
+		*ascq = sense[13];
+		return true;
+	case 0x72:
+	case 0x73:
+		*key = sense[1] & 0x0F;
+		*asc = sense[2];
+		*ascq = sense[3];
+		return true;
+	}
+	return false;
+}
+
+// Outcome of a command, classified from status and sense data
+typedef enum CommandResult {
+	kResultGood,
+	kResultRetry, // Transient, like UNIT ATTENTION after a bus reset
+	kResultBecomingReady,
+	kResultUnsupported, // Command form rejected. Another form may work.
+	kResultError,
+}CommandResult;
+
+enum {
+	kRetryCount = 3,
+	kRetryDelay = 50, // Milliseconds, doubled for each retry
+	kMaxRetryDelay = 1000,
+	kReadyWait = 15000, // Max milliseconds to wait for a device becoming ready
+};
+
+// See P.760, spc5r22.pdf - Annex F.2 Additional sense codes
+static CommandResult
+classify(bool delivered, const ScsiCommand* c) {
+	if (!delivered) {
+		switch (GetLastError()) {
+		case ERROR_INVALID_FUNCTION:
+		case ERROR_INVALID_PARAMETER:
+		case ERROR_NOT_SUPPORTED:
+			return kResultUnsupported; // Rejected by driver or bridge before reaching the device
+		}
+		return kResultError;
+	}
+
+	switch (c->status) {
+	case SCSISTAT_GOOD:
+		return kResultGood;
+	case SCSISTAT_BUSY:
+	case SCSISTAT_QUEUE_FULL:
+		return kResultRetry;
+	case SCSISTAT_CHECK_CONDITION:
+		break;
+	default:
+		return kResultError;
+	}
+
+	BYTE key, asc, ascq;
+	if (!getSenseCodes(c->sense, c->senseSize, &key, &asc, &ascq)) return kResultError;
+	switch (key) {
+	case SCSI_SENSE_NO_SENSE:
+	case SCSI_SENSE_RECOVERED_ERROR:
+		return kResultGood; // Completed. ATA PASS-THROUGH returns registers this way
+	case SCSI_SENSE_UNIT_ATTENTION:
+	case SCSI_SENSE_ABORTED_COMMAND:
+		return kResultRetry;
+	case SCSI_SENSE_NOT_READY:
+		return asc == 0x04 && ascq == 0x01 ? kResultBecomingReady : kResultError;
+	case SCSI_SENSE_ILLEGAL_REQUEST:
+		// 20/00 invalid command operation code, 24/00 invalid field in CDB
+		return asc == 0x20 || asc == 0x24 ? kResultUnsupported : kResultError;
+	}
+	return kResultError;
+}
+
+// Send c, and retry with backoff while the result is transient.
+// waitReady: Also wait for a device becoming ready. Not for commands polling readiness.
+// Return: result of the last try, whose status and sense data are in c.
+static CommandResult
+sendCommand(HANDLE h, ScsiCommand* c, bool waitReady) {
+	const DWORD dataSize = c->dataSize;
+	DWORD delay = kRetryDelay;
+	DWORD waited = 0;
+	for (int retries = 0;;) {
+		c->dataSize = dataSize; // Transport sets it to bytes transferred
+		const CommandResult r = classify(tp_send(h, c), c);
+		if (r == kResultRetry) {
+			if (retries++ >= kRetryCount) return r;
+		}
+		else if (r == kResultBecomingReady && waitReady) {
+			if (waited >= kReadyWait) return r;
+		}
+		else {
+			return r;
+		}
+		Sleep(delay);
+		waited += delay;
+		delay = min(delay * 2, kMaxRetryDelay);
+	}
+}
+
+// See START STOP UNIT command in sbc4r22.pdf. With IMMED, status returns as soon as the CDB is validated.
+static bool
+startStopUnit(HANDLE h, bool start, bool immed) {
+	ScsiCommand c = {
+		.cdbLength = CDB6GENERIC_LENGTH,
+		.direction = tp_kNone,
+		.timeout = kTimeOutStartStop,
+		.cdb[0] = SCSIOP_START_STOP_UNIT,
+		.cdb[1] = immed,
+		.cdb[4] = start,
+	};
+
+	return sendCommand(h, &c, false) == kResultGood;
+}
+
+bool
+unit_start(HANDLE h, bool immed)
+{
+	return startStopUnit(h, true, immed);
+}
+
+bool
+unit_stop(HANDLE h, bool immed)
+{
+	return startStopUnit(h, false, immed);
+}
+
+#ifdef _DEBUG
+static bool
+dump(const wchar_t* path, const BYTE* bin, DWORD size) {
+	HANDLE f = CreateFile(path, GENERIC_WRITE, FILE_SHARE_READ, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (f == INVALID_HANDLE_VALUE) return false;
+
+	DWORD cb;
+	BOOL ok = WriteFile(f, bin, size, &cb, NULL);
+
+	CloseHandle(f);
+	return ok;
+}
+#endif // _DEBUG
+
+static inline void
+buildRequestSense(ScsiCommand* c, SENSE_DATA* data) {
+	*c = (ScsiCommand){
+		.cdbLength = CDB6GENERIC_LENGTH,
+		.data = data,
+		.dataSize = sizeof(*data),
+		.timeout = kTimeOutQuery,
+		.direction = tp_kIn,
+		.cdb[0] = SCSIOP_REQUEST_SENSE,
+		.cdb[4] = sizeof(*data),
+	};
+}
+
+// REQUEST SENSE never changes power condition. A device in a low power condition reports it in sense data.
+// Return data, or NULL if failed
+static const SENSE_DATA*
+getSense(HANDLE h, SENSE_DATA* data) {
+	ScsiCommand c;
+	buildRequestSense(&c, data);
+
+	BOOL ok = tp_send(h, &c);
+
+	if (!ok || c.status != SCSISTAT_GOOD) {
+		return NULL;
+	}
+
+	return data;
+}
+
+// ATA registers from CHECK POWER MODE, returned in sense data because of CK_COND
+// Return: ATA COUNT register, or -1 if failed
+static int
+getAtaCount(const BYTE* sense, DWORD cb) {
+	if (cb < 14) return -1;
+
+	switch (sense[0] & 0x7F) {
+	case 0x72: // Descriptor format. ASC/ASCQ 00/1D: ATA PASS THROUGH INFORMATION AVAILABLE
+		if (sense[2] != 0x00 || sense[3] != 0x1D) return -1;
+		for (DWORD offset = 8; offset + 14 <= min(cb, 8u + sense[7]); offset += 2 + sense[offset + 1]) {
+			const BYTE* d = sense + offset;
+			if (d[0] != 0x09) continue; // ATA Status Return descriptor
+			if (d[13] & 0x01) return -1; // ERR bit of STATUS
+			return d[5];
+		}
+		return -1;
+	case 0x70: // Fixed format. INFORMATION field holds ERROR, STATUS, DEVICE, COUNT
+		if (sense[12] != 0x00 || sense[13] != 0x1D) return -1;
+		if (sense[4] & 0x01) return -1;
+		return sense[6];
+	}
+	return -1;
+}
+
+static inline void
+buildCheckPowerMode(ScsiCommand* c) {
+	*c = (ScsiCommand){
+		.cdbLength = 16,
+		.direction = tp_kNone,
+		.timeout = kTimeOutQuery,
+		.cdb[0] = SCSIOP_ATA_PASSTHROUGH16,
+		.cdb[1] = 3 << 1, // PROTOCOL: Non-data
+		.cdb[2] = 0x20, // CK_COND: return ATA registers in sense data
+		.cdb[14] = kAtaCheckPowerMode,
+	};
+}
+
+// ATA CHECK POWER MODE through SAT ATA PASS-THROUGH(16). Like REQUEST SENSE, it never changes power mode.
+static CommandResult
+checkPowerMode(HANDLE h, ScsiCommand* c) {
+	buildCheckPowerMode(c);
+	return sendCommand(h, c, false);
+}
+
+enum UnitReadiness
+unit_testReady(HANDLE h)
+{
+	ScsiCommand c = {
+		.cdbLength = CDB6GENERIC_LENGTH,
+		.direction = tp_kNone,
+		.timeout = kTimeOutQuery,
+		.cdb[0] = SCSIOP_TEST_UNIT_READY,
+	};
+
+	const CommandResult r = sendCommand(h, &c, false);
+	if (r == kResultGood) return unit_kReady;
+	if (c.status != SCSISTAT_CHECK_CONDITION) return unit_kReadyUnknown;
+
+	BYTE key, asc, ascq;
+	if (!getSenseCodes(c.sense, c.senseSize, &key, &asc, &ascq)) return unit_kReadyUnknown;
+	if (key != SCSI_SENSE_NOT_READY) return unit_kReadyUnknown;
+	// P.760, spc5r22.pdf - Annex F.2: 04/01 becoming ready, 04/02 initializing command required
+	if (asc == 0x04 && ascq == 0x01) return unit_kBecomingReady;
+	if (asc == 0x04 && ascq == 0x02) return unit_kStopped;
+	return unit_kNotReady;
+}
+
+static CommandResult
+getCapacity10(HANDLE h, ReadCapacityData10* data) {
+	ScsiCommand c = {
+		.cdbLength = CDB10GENERIC_LENGTH,
+		.data = data,
+		.dataSize = sizeof(*data),
+		.timeout = kTimeOutQuery,
+		.direction = tp_kIn,
+		.cdb[0] = SCSIOP_READ_CAPACITY,
+	};
+
+	return sendCommand(h, &c, true);
+}
+
+static CommandResult
+getCapacity16(HANDLE h, ReadCapacityData16* data) {
+	ScsiCommand c = {
+		.cdbLength = 16,
+		.data = data,
+		.dataSize = sizeof(*data),
+		.timeout = kTimeOutQuery,
+		.direction = tp_kIn,
+	};
+	Cdb16ServiceActionIn* cdb = (Cdb16ServiceActionIn*)c.cdb;
+	cdb->operationCode = SCSIOP_READ_CAPACITY16;
+	cdb->serviceAction = 0x10;
+	cdb->allocationLength[3] = sizeof(*data);
+
+	return sendCommand(h, &c, true);
+}
+
+// Capacity too large for READ CAPACITY(10) is reported as unsupported, so READ CAPACITY(16) is tried.
+static CommandResult
+readCapacity10(HANDLE h, UnitBuffer* buf, uint32_t* lbSize, uint64_t* lbCount) {
+	const ReadCapacityData10* p = &buf->capacity10;
+	const CommandResult r = getCapacity10(h, &buf->capacity10);
+	if (r != kResultGood) return r;
+	if (p->lbLast == ~(DWORD)0) return kResultUnsupported;
+	*lbSize = _byteswap_ulong(p->lbSize);
+	*lbCount = 1ULL + _byteswap_ulong(p->lbLast);
+	return kResultGood;
+}
+
+static CommandResult
+readCapacity16(HANDLE h, UnitBuffer* buf, uint32_t* lbSize, uint64_t* lbCount) {
+	const ReadCapacityData16* p = &buf->capacity16;
+	const CommandResult r = getCapacity16(h, &buf->capacity16);
+	if (r != kResultGood) return r;
+	if (p->lbLast == ~(uint64_t)0) return kResultUnsupported;
+	*lbSize = _byteswap_ulong(p->lbSize);
+	*lbCount = 1ULL + _byteswap_uint64(p->lbLast);
+	return kResultGood;
+}
+
+// Try the learned form first. Fall back to the other one only if the device rejects the form, and learn from the result.
+static bool
+getCapacity(HANDLE h, UnitBuffer* buf, UnitQuirks* quirks, uint32_t* lbSize, uint64_t* lbCount) {
+	const bool use16 = quirks->useReadCapacity16;
+	CommandResult r = use16 ? readCapacity16(h, buf, lbSize, lbCount) : readCapacity10(h, buf, lbSize, lbCount);
+	if (r != kResultUnsupported) return r == kResultGood;
+
+	r = use16 ? readCapacity10(h, buf, lbSize, lbCount) : readCapacity16(h, buf, lbSize, lbCount);
+	if (r != kResultGood) return false;
+	quirks->useReadCapacity16 = !use16;
+	return true;
+}
+
+// Return data, or NULL if failed
+static const StandardInquiryData*
+getStandardInquiry(HANDLE h, StandardInquiryData* data) {
+	ScsiCommand c = {
+		.cdbLength = CDB6GENERIC_LENGTH,
+		.data = data,
+		.dataSize = sizeof(*data),
+		.timeout = kTimeOutQuery,
+		.direction = tp_kIn,
+		.cdb[0] = SCSIOP_INQUIRY,
+		.cdb[4] = sizeof(*data),
+	};
+
+	if (sendCommand(h, &c, true) != kResultGood) {
+		return NULL;
+	}
+	return data;
+}
+
+static CommandResult
+getPowerCondition10(HANDLE h, ModeType type, PowerConditionData10* data) {
+	ScsiCommand c = {
+		.cdbLength = CDB10GENERIC_LENGTH,
+		.data = data,
+		.dataSize = sizeof(*data),
+		.timeout = kTimeOutModePage,
+		.direction = tp_kIn,
+	};
+	Cdb10ModeSense* cdb = (Cdb10ModeSense*)c.cdb;
+	cdb->operationCode = SCSIOP_MODE_SENSE10;
+	cdb->disableBlockDescriptors = 1;
+	cdb->pageCode = kPagePowerCondition;
+	cdb->pageControl = type;
+	cdb->allocLength[1] = sizeof(*data);
+
+	return sendCommand(h, &c, true);
+}
+
+static CommandResult
+getPowerCondition6(HANDLE h, ModeType type, PowerConditionData6* data) {
+	ScsiCommand c = {
+		.cdbLength = CDB6GENERIC_LENGTH,
+		.data = data,
+		.dataSize = sizeof(*data),
+		.timeout = kTimeOutModePage,
+		.direction = tp_kIn,
+	};
+	Cdb6ModeSense* cdb = (Cdb6ModeSense*)c.cdb;
+	cdb->operationCode = SCSIOP_MODE_SENSE;
+	cdb->disableBlockDescriptors = 1;
+	cdb->pageCode = kPagePowerCondition;
+	cdb->pageControl = type;
+	cdb->allocLength = sizeof(*data);
+
+	return sendCommand(h, &c, true);
+}
+
+static inline CommandResult
+getPowerConditionIn(HANDLE h, ModeType type, UnitBuffer* buf, bool use6) {
+	return use6 ? getPowerCondition6(h, type, &buf->powerCondition6) : getPowerCondition10(h, type, &buf->powerCondition10);
+}
+
+// Try the learned form first. Fall back to the other one only if the device rejects the form, and learn from the result.
+static const PowerConditionModePage*
+getPowerCondition(HANDLE h, ModeType type, UnitBuffer* buf, UnitQuirks* quirks) {
+	bool use6 = quirks->useModeSense6;
+	CommandResult r = getPowerConditionIn(h, type, buf, use6);
+	if (r == kResultUnsupported) {
+		use6 = !use6;
+		r = getPowerConditionIn(h, type, buf, use6);
+		if (r == kResultGood) quirks->useModeSense6 = use6;
+	}
+	if (r != kResultGood) return NULL;
+
+	return use6 ? &buf->powerCondition6.modePage : &buf->powerCondition10.modePage;
+}
+
+// size: Set to size of data returned
+static CommandResult
+getModePages10(HANDLE h, ModeType type, BYTE data[unit_kCbModePages], DWORD* size) {
+	ScsiCommand c = {
+		.cdbLength = CDB10GENERIC_LENGTH,
+		.data = data,
+		.dataSize = unit_kCbModePages,
+		.timeout = kTimeOutModePage,
+		.direction = tp_kIn,
+	};
+	Cdb10ModeSense* cdb = (Cdb10ModeSense*)c.cdb;
+	cdb->operationCode = SCSIOP_MODE_SENSE10;
+	cdb->disableBlockDescriptors = 1;
+	cdb->pageCode = kPageAll;
+	cdb->pageControl = type;
+	cdb->allocLength[0] = (BYTE)(unit_kCbModePages >> 8);
+	cdb->allocLength[1] = (BYTE)unit_kCbModePages;
+
+	const CommandResult r = sendCommand(h, &c, true);
+	*size = r == kResultGood ? c.dataSize : 0;
+	return r;
+}
+
+// size: Set to size of data returned
+static CommandResult
+getModePages6(HANDLE h, ModeType type, BYTE data[unit_kCbModePages], DWORD* size) {
+	ScsiCommand c = {
+		.cdbLength = CDB6GENERIC_LENGTH,
+		.data = data,
+		.dataSize = 0xFF, // max allocation length of 6-byte CDB
+		.timeout = kTimeOutModePage,
+		.direction = tp_kIn,
+	};
+	Cdb6ModeSense* cdb = (Cdb6ModeSense*)c.cdb;
+	cdb->operationCode = SCSIOP_MODE_SENSE;
+	cdb->disableBlockDescriptors = 1;
+	cdb->pageCode = kPageAll;
+	cdb->pageControl = type;
+	cdb->allocLength = 0xFF;
+
+	const CommandResult r = sendCommand(h, &c, true);
+	*size = r == kResultGood ? c.dataSize : 0;
+	return r;
+}
+
+// Find power condition page in snapshot and copy it to page.
+// Pages shorter than PowerConditionModePage are zero-padded.
+// Return page, or NULL if not found
+static const PowerConditionModePage*
+findPowerConditionPage(const UnitModePages* pages, ModeType type, PowerConditionModePage* page) {
+	const BYTE* data = pages->data[type];
+	const DWORD size = pages->size[type];
+	DWORD offset;
+	if (pages->is6) {
+		if (size < sizeof(ModeHeader6)) return NULL;
+		const ModeHeader6* hdr = (const ModeHeader6*)data;
+		offset = sizeof(ModeHeader6) + hdr->blockDescriptorLength;
+	}
+	else {
+		if (size < sizeof(ModeHeader10)) return NULL;
+		const ModeHeader10* hdr = (const ModeHeader10*)data;
+		offset = sizeof(ModeHeader10) + (hdr->blockDescriptorLength[0] << 8 | hdr->blockDescriptorLength[1]);
+	}
+
+	// P.627, spc5r22.pdf - 7.5.7 Mode page and subpage formats and page codes
+	while (offset + 2 <= size) {
+		const BYTE* p = data + offset;
+		const bool isSubPage = p[0] & 0x40;
+		DWORD len;
+		if (isSubPage) {
+			if (offset + 4 > size) return NULL;
+			len = 4 + (p[2] << 8 | p[3]);
+		}
+		else {
+			len = 2 + p[1];
+		}
+		if (!isSubPage && (p[0] & 0x3F) == kPagePowerCondition) {
+			DWORD cb = min(len, size - offset);
+			if (cb > sizeof(*page)) cb = sizeof(*page);
+			ZeroMemory(page, sizeof(*page));
+			CopyMemory(page, p, cb);
+			return page;
+		}
+		offset += len;
+	}
+	return NULL;
+}
+
+// Bytes of mode data the device says it returned. Some bridges report the whole allocation length as transferred,
+// and the rest of the buffer must not be walked as pages.
+// size: Bytes transferred
+static DWORD
+clampModeData(const BYTE* data, DWORD size, bool is6) {
+	DWORD len;
+	if (is6) {
+		if (size < sizeof(ModeHeader6)) return 0;
+		len = ((const ModeHeader6*)data)->modeDataLength + 1;
+	}
+	else {
+		if (size < sizeof(ModeHeader10)) return 0;
+		const ModeHeader10* hdr = (const ModeHeader10*)data;
+		len = (hdr->modeDataLength[0] << 8 | hdr->modeDataLength[1]) + 2;
+	}
+	return min(len, size);
+}
+
+// Fetch all mode pages for each page control.
+// Return: true if current power condition page is in the snapshot
+static bool
+getModePages(HANDLE h, UnitModePages* pages, UnitQuirks* quirks) {
+	static const ModeType kTypes[] = { kModeCurrent, kModeChangeable, kModeDefault };
+
+	pages->is6 = quirks->useModeSense6;
+	for (int i = 0; i < _countof(kTypes); ++i) {
+		const ModeType type = kTypes[i];
+		DWORD size;
+		CommandResult r = pages->is6 ? getModePages6(h, type, pages->data[type], &size) : getModePages10(h, type, pages->data[type], &size);
+		if (r == kResultUnsupported && type == kModeCurrent) {
+			// Try the other form, and learn from the result.
+			pages->is6 = !pages->is6;
+			r = pages->is6 ? getModePages6(h, type, pages->data[type], &size) : getModePages10(h, type, pages->data[type], &size);
+			if (r == kResultGood) quirks->useModeSense6 = pages->is6;
+		}
+		size = clampModeData(pages->data[type], min(size, unit_kCbModePages), pages->is6);
+		pages->size[type] = (WORD)size;
+	}
+
+	PowerConditionModePage page;
+	return findPowerConditionPage(pages, kModeCurrent, &page);
+}
+
+static CommandResult
+setPowerCondition10(HANDLE h, const PowerConditionData10* p) {
+	ScsiCommand c = {
+		.cdbLength = CDB10GENERIC_LENGTH,
+		.data = (PVOID)p,
+		.dataSize = sizeof(PowerConditionData10),
+		.timeout = kTimeOutModePage,
+		.direction = tp_kOut,
+	};
+	Cdb10ModeSelect* cdb = (Cdb10ModeSelect*)c.cdb;
+	cdb->operationCode = SCSIOP_MODE_SELECT10;
+	cdb->savePages = 1;
+	cdb->pageFormat = 1;
+	cdb->parameterListLength[1] = sizeof(PowerConditionData10);
+
+	return sendCommand(h, &c, true);
+}
+
+static CommandResult
+setPowerCondition6(HANDLE h, const PowerConditionData6* p) {
+	ScsiCommand c = {
+		.cdbLength = CDB6GENERIC_LENGTH,
+		.data = (PVOID)p,
+		.dataSize = sizeof(PowerConditionData6),
+		.timeout = kTimeOutModePage,
+		.direction = tp_kOut,
+	};
+	Cdb6ModeSelect* cdb = (Cdb6ModeSelect*)c.cdb;
+	cdb->operationCode = SCSIOP_MODE_SELECT;
+	cdb->savePages = 1;
+	cdb->pageFormat = 1;
+	cdb->parameterListLength = sizeof(PowerConditionData6);
+
+	return sendCommand(h, &c, true);
+}
+
+// Return data, or NULL if failed
+static const BYTE*
+getVpdPage(HANDLE h, ULONG* size, BYTE pageCode, BYTE data[kCbVpdPage]) {
+	ScsiCommand c = {
+		.cdbLength = CDB6GENERIC_LENGTH,
+		.data = data,
+		.dataSize = kCbVpdPage,
+		.timeout = kTimeOutQuery,
+		.direction = tp_kIn,
+		.cdb[0] = SCSIOP_INQUIRY,
+		.cdb[1] = 1, // EVPD
+		.cdb[2] = pageCode,
+		.cdb[4] = (BYTE)kCbVpdPage,
+	};
+
+	if (sendCommand(h, &c, true) != kResultGood) {
+		return NULL;
+	}
+
+	*size = c.dataSize;
+	return data;
+}
+
+// CharacteristicsData is fixed in length
+static inline const CharacteristicsData*
+getCharacteristics(HANDLE h, UnitBuffer* buf) {
+	ULONG size;
+	const BYTE* p = getVpdPage(h, &size, 0xB1, buf->vpdPage);
+	return (const CharacteristicsData*)p;
+}
+
+static inline const SerialNumberData*
+getSerialNumber(HANDLE h, UnitBuffer* buf) {
+	ULONG size;
+	const BYTE* data = getVpdPage(h, &size, 0x80, buf->vpdPage);
+	return (const SerialNumberData*)data;
+}
+
+// Count string length excluding tailing spaces and NULs
+static inline int
+getStringLen(const UCHAR* str, int cb) {
+	if (!str) return 0;
+
+	for (int i = cb - 1; i >= 0; --i) {
+		if (str[i] == 0x20) continue;
+		if (str[i] == 0x00) continue;
+		return i + 1;
+	}
+	return 0;
+}
+
+static inline void
+normalizeString(wchar_t* t, const UCHAR* str, int cb) {
+	const int len = getStringLen(str, cb);
+	int i = 0;
+	for (; i < len; ++i) {
+		t[i] = str[i];
+	}
+	t[i] = L'\0';
+}
+
+static void
+fillInquiry(UnitInfo* info, const StandardInquiryData* inquiry) {
+	normalizeString(info->vendor, inquiry->vendorId, unit_kLenVendorId);
+	normalizeString(info->product, inquiry->productId, unit_kLenProductId);
+	normalizeString(info->revision, inquiry->revision, unit_kLenRevision);
+}
+
+static void
+fillSerial(UnitInfo* info, const SerialNumberData* serial) {
+	if (serial) {
+		const int serialLen = min(serial->pageLength[1], unit_kLenSerial);
+		normalizeString(info->serial, serial->serialNumber, serialLen);
+	}
+	else {
+		info->serial[0] = L'\0';
+	}
+}
+
+static void
+fillCharacteristics(UnitInfo* info, const CharacteristicsData* p) {
+	if (p) {
+		info->formFactor = p->formFactor;
+		info->rpm = _byteswap_ushort(p->rpm);
+	}
+	else {
+		info->formFactor = unit_kFormFactorNA;
+		info->rpm = 0;
+	}
+}
+
+// See P.760, spc5r22.pdf - Annex F.2 Additional sense codes
+static enum UnitPowerState
+getStateFromSense(const SENSE_DATA* p) {
+	if (p->ErrorCode != SCSI_SENSE_ERRORCODE_FIXED_CURRENT) return unit_kStateUnknown;
+
+	if (p->SenseKey == SCSI_SENSE_NOT_READY
+		&& p->AdditionalSenseCode == 0x04
+		&& p->AdditionalSenseCodeQualifier == 0x02) {
+		return unit_kStateStopped;
+	}
+
+	if (p->SenseKey != SCSI_SENSE_NO_SENSE) return unit_kStateUnknown;
+
+	switch (p->AdditionalSenseCode) {
+	case 0x00:
+		if (!p->AdditionalSenseCodeQualifier) return unit_kStateActive;
+		break;
+	case 0x5E:
+		switch (p->AdditionalSenseCodeQualifier) {
+		case 0x00:
+		case 0x02:
+		case 0x04:
+			return unit_kStateStandbyZ;
+		case 0x01:
+		case 0x03:
+			return unit_kStateIdleA;
+		case 0x05:
+		case 0x06:
+			return unit_kStateIdleB;
+		case 0x07:
+		case 0x08:
+			return unit_kStateIdleC;
+		case 0x09:
+		case 0x0A:
+			return unit_kStateStandbyY;
+		}
+		break;
+	}
+	return unit_kStateUnknown;
+}
+
+// See ACS-4 - CHECK POWER MODE, Table: Normal Outputs
+static enum UnitPowerState
+getStateFromAtaCount(int count) {
+	switch (count) {
+	case 0x00:
+	case 0x40: // NV Cache power mode, spindle spun down
+		return unit_kStateStandbyZ;
+	case 0x01:
+		return unit_kStateStandbyY;
+	case 0x80:
+	case 0x81:
+		return unit_kStateIdleA;
+	case 0x82:
+		return unit_kStateIdleB;
+	case 0x83:
+		return unit_kStateIdleC;
+	case 0x41: // NV Cache power mode, spindle spun up
+	case 0xFF:
+		return unit_kStateActive;
+	}
+	return unit_kStateUnknown;
+}
+
+// Only a low power condition is conclusive. SAT layers often report no sense whatever the ATA power mode is.
+static inline bool
+needsAtaCheck(const UnitQuirks* quirks, enum UnitPowerState state) {
+	if (state != unit_kStateActive && state != unit_kStateUnknown) return false;
+	return !quirks->noAtaPassThrough;
+}
+
+// Learn that the device has no SAT layer only if it rejects the command, or completes it without ATA registers.
+// Other failures may be transient, so the command is tried again on next poll.
+// r: Result of CHECK POWER MODE in c
+static void
+applyAtaCount(UnitQuirks* quirks, enum UnitPowerState* state, CommandResult r, const ScsiCommand* c) {
+	if (r == kResultUnsupported) {
+		quirks->noAtaPassThrough = 1;
+		return;
+	}
+	if (r != kResultGood) return;
+
+	const int count = getAtaCount(c->sense, c->senseSize);
+	if (count < 0) {
+		quirks->noAtaPassThrough = 1;
+		return;
+	}
+
+	const enum UnitPowerState ata = getStateFromAtaCount(count);
+	if (ata != unit_kStateUnknown) *state = ata;
+}
+
+bool
+unit_getPowerState(HANDLE h, UnitQuirks* quirks, enum UnitPowerState* state)
+{
+	SENSE_DATA sense;
+	const SENSE_DATA* p = getSense(h, &sense);
+	*state = p ? getStateFromSense(p) : unit_kStateUnknown;
+
+	if (needsAtaCheck(quirks, *state)) {
+		ScsiCommand c;
+		const CommandResult r = checkPowerMode(h, &c);
+		applyAtaCount(quirks, state, r, &c);
+	}
+	return *state != unit_kStateUnknown;
+}
+
+typedef struct PowerBatch {
+	ScsiCommand command;
+	SENSE_DATA sense;
+}PowerBatch;
+
+struct UnitPowerWork {
+	UINT32 capacity;
+	bool abandoned; // The port broke. Pending commands still write to batch, so it's never freed.
+	PowerBatch* batch;
+	TransportItem* items;
+	TransportBatch* transport;
+};
+
+void
+unit_destroyPowerWork(UnitPowerWork* w)
+{
+	if (!w) return;
+
+	if (w->batch && !w->abandoned) heap_free(0, w->batch);
+	if (w->items) heap_free(0, w->items);
+	tp_destroyBatch(w->transport);
+	heap_free(0, w);
+}
+
+UnitPowerWork*
+unit_createPowerWork(UINT32 capacity)
+{
+	UnitPowerWork* w = heap_alloc(HEAP_ZERO_MEMORY, sizeof(*w));
+	if (!w) return NULL;
+
+	const UINT32 n = capacity ? capacity : 1;
+	w->capacity = capacity;
+	w->batch = heap_alloc(0, sizeof(*w->batch) * n);
+	w->items = heap_alloc(0, sizeof(*w->items) * n);
+	w->transport = tp_createBatch(capacity);
+	if (!w->batch || !w->items || !w->transport) {
+		unit_destroyPowerWork(w);
+		return NULL;
+	}
+	return w;
+}
+
+bool
+unit_getPowerStates(HANDLE port, UnitPowerQuery* queries, UINT32 count, UnitPowerWork* work)
+{
+	assert(!work || work->capacity >= count);
+	if (work && work->abandoned) return false;
+	UnitPowerWork* w = work ? work : unit_createPowerWork(count);
+	if (!w) return false;
+	PowerBatch* batch = w->batch;
+	TransportItem* items = w->items;
+
+	// Round 1: REQUEST SENSE to all
+	for (UINT32 i = 0; i < count; ++i) {
+		buildRequestSense(&batch[i].command, &batch[i].sense);
+		items[i].handle = queries[i].handle;
+		items[i].command = &batch[i].command;
+	}
+	if (!tp_sendBatch(port, items, count, w->transport)) goto broken;
+	for (UINT32 i = 0; i < count; ++i) {
+		const ScsiCommand* c = &batch[i].command;
+		const bool ok = items[i].delivered && c->status == SCSISTAT_GOOD;
+		queries[i].state = ok ? getStateFromSense(&batch[i].sense) : unit_kStateUnknown;
+	}
+
+	// Round 2: ATA CHECK POWER MODE to those not conclusive yet
+	UINT32 n = 0;
+	for (UINT32 i = 0; i < count; ++i) {
+		if (!needsAtaCheck((UnitQuirks*)&queries[i].quirks, queries[i].state)) continue;
+		buildCheckPowerMode(&batch[n].command);
+		items[n].handle = queries[i].handle;
+		items[n].command = &batch[n].command;
+		items[n].context = i;
+		++n;
+	}
+	if (!tp_sendBatch(port, items, n, w->transport)) goto broken;
+	for (UINT32 j = 0; j < n; ++j) {
+		UnitPowerQuery* q = &queries[items[j].context];
+		const ScsiCommand* c = &batch[j].command;
+		const CommandResult r = items[j].delivered ? classify(true, c) : kResultError;
+		applyAtaCount((UnitQuirks*)&q->quirks, &q->state, r, c);
+	}
+
+	if (w != work) unit_destroyPowerWork(w);
+	return true;
+
+broken:
+	w->abandoned = true;
+	if (w != work) unit_destroyPowerWork(w);
+	return false;
+}
+
+bool
+unit_getInfo(HANDLE h, UnitInfo* info)
+{
+	UnitBuffer buf;
+	info->quirks = 0;
+	const StandardInquiryData* inquiry = getStandardInquiry(h, &buf.inquiry);
+	if (!inquiry) {
+		info->vendor[0] = info->product[0] = info->revision[0] = info->serial[0] = L'\0';
+		return false;
+	}
+	fillInquiry(info, inquiry);
+	const SerialNumberData* serial = getSerialNumber(h, &buf);
+	fillSerial(info, serial);
+
+	// Vendor, product, revision and serial identify the device in quirk cache
+	const BYTE quirks = info->quirks = quirk_find(info);
+	if (!getCapacity(h, &buf, (UnitQuirks*)&info->quirks, &info->blockSize, &info->blockCount)) {
+		info->blockSize = 0;
+		info->blockCount = 0;
+	}
+	if (info->quirks != quirks) quirk_update(info);
+
+	const CharacteristicsData* charas = getCharacteristics(h, &buf);
+	fillCharacteristics(info, charas);
+
+	return true;
+}
+
+static void
+fillTimerMask(UnitInfo* info, const PowerConditionModePage* p) {
+	info->timerIdleA = p->idleA;
+	info->timerIdleB = p->idleB;
+	info->timerIdleC = p->idleC;
+	info->timerStandbyY = p->standbyY;
+	info->timerStandbyZ = p->standbyZ;
+}
+
+static void
+doFillTimers(DWORD* timers, const PowerConditionModePage* p) {
+	timers[unit_kIdleA] = p->idleA ? _byteswap_ulong(p->timerIdleA) : 0;
+	timers[unit_kIdleB] = p->idleB ? _byteswap_ulong(p->timerIdleB) : 0;
+	timers[unit_kIdleC] = p->idleC ? _byteswap_ulong(p->timerIdleC) : 0;
+	timers[unit_kStandbyY] = p->standbyY ? _byteswap_ulong(p->timerStandbyY) : 0;
+	timers[unit_kStandbyZ] = p->standbyZ ? _byteswap_ulong(p->timerStandbyZ) : 0;
+}
+
+static void
+fillTimers(UnitInfo* info, ModeType type, const PowerConditionModePage* p) {
+	DWORD* timers = NULL;
+	switch (type) {
+	case kModeCurrent:
+		timers = info->timers;
+		break;
+	case kModeChangeable:
+		timers = info->timersModMask;
+		break;
+	case kModeDefault:
+		timers = info->timersDefault;
+		break;
+	}
+	if (!timers) return;
+
+	doFillTimers(timers, p);
+}
+
+// If pages is not NULL, take page from the snapshot. Otherwise read it from device.
+static const PowerConditionModePage*
+readPowerCondition(HANDLE h, ModeType type, UnitBuffer* buf, UnitQuirks* quirks, const UnitModePages* pages) {
+	if (pages) return findPowerConditionPage(pages, type, &buf->modePage);
+	return getPowerCondition(h, type, buf, quirks);
+}
+
+bool
+unit_getTimers(HANDLE h, UnitInfo* info, UnitModePages* pages)
+{
+	UnitBuffer buf;
+	UnitQuirks* quirks = (UnitQuirks*)&info->quirks;
+	const BYTE known = info->quirks;
+	info->timerMask = 0;
+	if (pages && !getModePages(h, pages, quirks)) {
+		pages->size[kModeCurrent] = 0;
+		pages = NULL;
+	}
+	const PowerConditionModePage* p = readPowerCondition(h, kModeCurrent, &buf, quirks, pages);
+	if (!p) return false;
+
+	info->timerWritable = p->parametersSaveable;
+	fillTimerMask(info, p);
+	fillTimers(info, kModeCurrent, p);
+
+	p = readPowerCondition(h, kModeChangeable, &buf, quirks, pages);
+	if (p) fillTimers(info, kModeChangeable, p);
+	
+	p = readPowerCondition(h, kModeDefault, &buf, quirks, pages);
+	if (p) fillTimers(info, kModeDefault, p);
+
+	if (info->quirks != known) quirk_update(info);
+	return true;
+}
+
+static bool
+timersWritable(const UnitInfo* info, BYTE mask, const DWORD* timers) {
+	if (!info->timerWritable) return false;
+	if (!mask) return false;
+	//if (!info->timerMask) return false; // covered by the next line
+	if ((info->timerMask | mask) != info->timerMask) return false;
+
+	for (int i = 0; i < unit_kPowerConditionCount && mask; ++i) {
+		if (mask & 1) {
+			if ((timers[i] & info->timersModMask[i]) != timers[i]) return false;
+		}
+		mask >>= 1;
+	}
+
+	return true;
+}
+
+static void
+setPowerConditionModePage(PowerConditionModePage* p, BYTE mask, const DWORD* timers) {
+	const TimerMask* tm = (TimerMask*)&mask;
+	if (tm->timerIdleA) p->timerIdleA = _byteswap_ulong(timers[unit_kIdleA]);
+	if (tm->timerIdleB) p->timerIdleB = _byteswap_ulong(timers[unit_kIdleB]);
+	if (tm->timerIdleC) p->timerIdleC = _byteswap_ulong(timers[unit_kIdleC]);
+	if (tm->timerStandbyY) p->timerStandbyY = _byteswap_ulong(timers[unit_kStandbyY]);
+	if (tm->timerStandbyZ) p->timerStandbyZ = _byteswap_ulong(timers[unit_kStandbyZ]);
+}
+
+static CommandResult
+writeTimers10(HANDLE h, BYTE mask, const DWORD* timers) {
+	PowerConditionData10 data;
+	PowerConditionData10* p = &data;
+	const CommandResult r = getPowerCondition10(h, kModeCurrent, &data);
+	if (r != kResultGood) return r;
+	setPowerConditionModePage(&p->modePage, mask, timers);
+	// bit reserved, P.342, sbc4r22.pdf - Table 230 - DEVICE-SPECIFIC PARAMETER field for direct access block devices
+	p->deviceParameter = 0;
+	// P.626, spc5r22.pdf - "When using the MODE SELECT command, the PS bit is reserved."
+	p->parametersSaveable = 0;
+	return setPowerCondition10(h, p);
+}
+
+static CommandResult
+writeTimers6(HANDLE h, BYTE mask, const DWORD* timers) {
+	PowerConditionData6 data;
+	PowerConditionData6* p = &data;
+	const CommandResult r = getPowerCondition6(h, kModeCurrent, &data);
+	if (r != kResultGood) return r;
+	setPowerConditionModePage(&p->modePage, mask, timers);
+	// see writeTimers10() for these 2 flags
+	p->deviceParameter = 0;
+	p->parametersSaveable = 0;
+	return setPowerCondition6(h, p);
+}
+
+// MODE SELECT page in the given form. Header is zeroed but medium type. See writeTimers10() for PS bit.
+static CommandResult
+selectPowerCondition(HANDLE h, bool is6, BYTE mediumType, const PowerConditionModePage* page) {
+	if (is6) {
+		PowerConditionData6 data = { 0 };
+		data.mediumType = mediumType;
+		data.modePage = *page;
+		data.parametersSaveable = 0;
+		return setPowerCondition6(h, &data);
+	}
+
+	PowerConditionData10 data = { 0 };
+	data.mediumType = mediumType;
+	data.modePage = *page;
+	data.parametersSaveable = 0;
+	return setPowerCondition10(h, &data);
+}
+
+// Read-modify-write current power condition page in snapshot. The page is the same in either form,
+// so it's written in the form learned for MODE SELECT, falling back to the other only if the device rejects it.
+// Return kResultUnsupported if the snapshot has no power condition page, so timers must be read again to write them.
+static CommandResult
+writeTimersFromModePages(HANDLE h, UnitQuirks* quirks, const UnitModePages* pages, BYTE mask, const DWORD* timers) {
+	PowerConditionModePage page;
+	if (!findPowerConditionPage(pages, kModeCurrent, &page)) return kResultUnsupported;
+	const BYTE* header = pages->data[kModeCurrent];
+	const BYTE mediumType = pages->is6 ? ((const ModeHeader6*)header)->mediumType : ((const ModeHeader10*)header)->mediumType;
+	setPowerConditionModePage(&page, mask, timers);
+
+	// Like writeTimers, either quirk means 6-byte first
+	const bool use6 = quirks->useModeSelect6 || quirks->useModeSense6 || pages->is6;
+	const CommandResult r = selectPowerCondition(h, use6, mediumType, &page);
+	if (r != kResultUnsupported) return r;
+	if (selectPowerCondition(h, !use6, mediumType, &page) != kResultGood) return kResultError;
+	quirks->useModeSelect6 = !use6;
+	return kResultGood;
+}
+
+// MODE SELECT(10) needs MODE SENSE(10) to read current page first, so either quirk means 6-byte first.
+// Fall back to the other form only if the device rejects the form.
+static bool
+writeTimers(HANDLE h, UnitQuirks* quirks, BYTE mask, const DWORD* timers) {
+	CommandResult r;
+	if (quirks->useModeSelect6 || quirks->useModeSense6) {
+		r = writeTimers6(h, mask, timers);
+		if (r != kResultUnsupported) return r == kResultGood;
+		if (writeTimers10(h, mask, timers) != kResultGood) return false;
+		// useModeSense6 was learned by reading, so keep it for later reads
+		quirks->useModeSelect6 = 0;
+		return true;
+	}
+
+	r = writeTimers10(h, mask, timers);
+	if (r != kResultUnsupported) return r == kResultGood;
+	if (writeTimers6(h, mask, timers) != kResultGood) return false;
+	quirks->useModeSelect6 = 1;
+	return true;
+}
+
+bool
+unit_setTimers(HANDLE h, UnitInfo* info, UnitModePages* pages, BYTE mask, const DWORD timers[unit_kPowerConditionCount], const wchar_t** errmsg)
+{
+	static const wchar_t* kNoTimer = L"Device has no power condition timers.";
+	static const wchar_t* kNotWritable = L"Timers not writable.";
+
+	*errmsg = NULL;
+	if (!unit_getTimers(h, info, pages)) {
+		*errmsg = kNoTimer;
+		return false;
+	}
+	if (!timersWritable(info, mask, timers)) {
+		*errmsg = kNotWritable;
+		return false;
+	}
+
+	const BYTE known = info->quirks;
+	UnitQuirks* quirks = (UnitQuirks*)&info->quirks;
+	// A snapshot without current page means device can't fetch all pages, see unit_getTimers()
+	CommandResult r = kResultUnsupported;
+	if (pages && pages->size[kModeCurrent]) r = writeTimersFromModePages(h, quirks, pages, mask, timers);
+	const bool ok = r == kResultUnsupported ? writeTimers(h, quirks, mask, timers) : r == kResultGood;
+	if (info->quirks != known) quirk_update(info);
+	return ok;
+}
@@ -1,86 +1,177 @@
-#pragma once
-
-#include <sdkddkver.h>
-#include <Windows.h>
-
-#include <stdbool.h>
-#include <stdint.h>
-
-
-enum {
-	unit_kLenVendorId = 8,
-	unit_kCchVendorId,
-	unit_kLenProductId = 16,
-	unit_kCchProductId,
-	unit_kLenRevision = 4,
-	unit_kCchRevision,
-
-	unit_kLenSerial = 48, // no limit by standard, but guess 48 should be enough
-	unit_kCchSerial,
-};
-
-enum PowerConditon {
-	unit_kIdle,
-	unit_kIdleA = unit_kIdle,
-	unit_kIdleB,
-	unit_kIdleC,
-	unit_kStandbyY,
-	unit_kStandbyZ,
-	unit_kStandby = unit_kStandbyZ,
-	unit_kPowerConditionCount,
-};
-
-enum UnitFormFactor {
-	unit_kFormFactorNA,
-	unit_kFormFactor525,
-	unit_kFormFactor35,
-	unit_kFormFactor25,
-	unit_kFormFactor18,
-	unit_kFormFactor18minus,
-	unit_kFormFactorOther,
-};
-
-typedef union TimerMask {
-	struct {
-		BYTE timerIdleA : 1;
-		BYTE timerIdleB : 1;
-		BYTE timerIdleC : 1;
-		BYTE timerStandbyY : 1;
-		BYTE timerStandbyZ : 1;
-	};
-	BYTE timerMask;
-}TimerMask;
-
-typedef struct UnitInfo {
-	DWORD blockSize;
-	uint64_t blockCount;
-	wchar_t vendor[unit_kCchVendorId];
-	wchar_t product[unit_kCchProductId];
-	wchar_t revision[unit_kCchRevision];
-	wchar_t serial[unit_kCchSerial];
-	enum UnitFormFactor formFactor;
-	WORD rpm;
-	TimerMask;
-	bool timerWritable;
-	DWORD timers[unit_kPowerConditionCount];
-	DWORD timersModMask[unit_kPowerConditionCount];
-	DWORD timersDefault[unit_kPowerConditionCount];
-}UnitInfo;
-
-
-bool
-unit_stop(HANDLE h);
-
-// Get basic info without timers.
-// If want timers, call unit_getTimers
-bool
-unit_getInfo(HANDLE h, UnitInfo* info);
-
-// Get timers without basic info
-// If want basic info, call unit_getInfo.
-// This function resets info.timerMask even if failed
-bool
-unit_getTimers(HANDLE h, UnitInfo* info);
-
-bool
-unit_setTimers(HANDLE h, BYTE mask, const DWORD timers[unit_kPowerConditionCount], const wchar_t** errmsg);
+#pragma once
+
+#include <sdkddkver.h>
+#include <Windows.h>
+
+#include <stdbool.h>
+#include <stdint.h>
+
+
+enum {
+	unit_kLenVendorId = 8,
+	unit_kCchVendorId,
+	unit_kLenProductId = 16,
+	unit_kCchProductId,
+	unit_kLenRevision = 4,
+	unit_kCchRevision,
+
+	unit_kLenSerial = 48, // no limit by standard, but guess 48 should be enough
+	unit_kCchSerial,
+
+	unit_kCbModePages = 2048, // all mode pages of a disk usually take less than 1 KB
+};
+
+enum PowerConditon {
+	unit_kIdle,
+	unit_kIdleA = unit_kIdle,
+	unit_kIdleB,
+	unit_kIdleC,
+	unit_kStandbyY,
+	unit_kStandbyZ,
+	unit_kStandby = unit_kStandbyZ,
+	unit_kPowerConditionCount,
+};
+
+// Power condition as reported by the device
+enum UnitPowerState {
+	unit_kStateUnknown,
+	unit_kStateActive,
+	unit_kStateIdleA,
+	unit_kStateIdleB,
+	unit_kStateIdleC,
+	unit_kStateStandbyY,
+	unit_kStateStandbyZ,
+	unit_kStateStopped,
+	unit_kStateCount,
+};
+
+// Result of TEST UNIT READY
+enum UnitReadiness {
+	unit_kReadyUnknown, // Command failed, or sense data not understood
+	unit_kReady,
+	unit_kBecomingReady, // Spinning up
+	unit_kStopped, // Needs START
+	unit_kNotReady, // Other reasons
+};
+
+enum UnitFormFactor {
+	unit_kFormFactorNA,
+	unit_kFormFactor525,
+	unit_kFormFactor35,
+	unit_kFormFactor25,
+	unit_kFormFactor18,
+	unit_kFormFactor18minus,
+	unit_kFormFactorOther,
+};
+
+typedef union TimerMask {
+	struct {
+		BYTE timerIdleA : 1;
+		BYTE timerIdleB : 1;
+		BYTE timerIdleC : 1;
+		BYTE timerStandbyY : 1;
+		BYTE timerStandbyZ : 1;
+	};
+	BYTE timerMask;
+}TimerMask;
+
+// Command forms learned to work for a device. All zero means nothing learned, so the 10-byte forms are tried first.
+typedef union UnitQuirks {
+	struct {
+		BYTE useReadCapacity16 : 1; // READ CAPACITY(10) failed or can't tell the capacity
+		BYTE useModeSense6 : 1; // MODE SENSE(10) rejected
+		BYTE useModeSelect6 : 1; // MODE SELECT(10) rejected
+		BYTE noAtaPassThrough : 1; // ATA PASS-THROUGH(16) rejected, not behind a SAT layer
+	};
+	BYTE quirks;
+}UnitQuirks;
+
+// Snapshot of all mode pages (page code 0x3F) as returned by MODE SENSE, header included.
+// One per page control: current, changeable, default.
+typedef struct UnitModePages {
+	bool is6; // Fetched by MODE SENSE(6)
+	WORD size[3];
+	BYTE data[3][unit_kCbModePages];
+}UnitModePages;
+
+typedef struct UnitPowerQuery {
+	HANDLE handle; // Opened with FILE_FLAG_OVERLAPPED, and associated with the completion port
+	UnitQuirks; // Kept between calls like for unit_getPowerState
+	enum UnitPowerState state;
+}UnitPowerQuery;
+
+typedef struct UnitInfo {
+	DWORD blockSize;
+	uint64_t blockCount;
+	wchar_t vendor[unit_kCchVendorId];
+	wchar_t product[unit_kCchProductId];
+	wchar_t revision[unit_kCchRevision];
+	wchar_t serial[unit_kCchSerial];
+	enum UnitFormFactor formFactor;
+	WORD rpm;
+	TimerMask;
+	bool timerWritable;
+	DWORD timers[unit_kPowerConditionCount];
+	DWORD timersModMask[unit_kPowerConditionCount];
+	DWORD timersDefault[unit_kPowerConditionCount];
+	UnitQuirks;
+}UnitInfo;
+
+
+// immed: Return as soon as the device accepts the command, not when it's done.
+//        Poll with unit_testReady or unit_getPowerState to see when the device gets there.
+bool
+unit_start(HANDLE h, bool immed);
+
+bool
+unit_stop(HANDLE h, bool immed);
+
+// TEST UNIT READY never starts a stopped device.
+enum UnitReadiness
+unit_testReady(HANDLE h);
+
+// Get power condition with REQUEST SENSE, then ATA CHECK POWER MODE if the device may be a SATA disk behind SAT.
+// Neither command makes the device leave its power condition, so it's safe to poll.
+// quirks: Set to 0 if unknown. Keep it between calls so devices without SAT cost only one command.
+// Return false if state is unknown.
+bool
+unit_getPowerState(HANDLE h, UnitQuirks* quirks, enum UnitPowerState* state);
+
+// Memory for unit_getPowerStates. Kept between calls, so polling allocates nothing.
+// Abandoned if the port breaks. unit_getPowerStates fails with it then, and what pending commands use is never freed.
+typedef struct UnitPowerWork UnitPowerWork;
+
+// capacity: Max queries in one call
+// Return NULL if low memory
+UnitPowerWork*
+unit_createPowerWork(UINT32 capacity);
+
+void
+unit_destroyPowerWork(UnitPowerWork* w);
+
+// Like unit_getPowerState for many devices. Commands of each round are all in flight at the same time,
+// completed through the I/O completion port. See tp_createPort.
+// work: With capacity of at least count, or NULL to allocate for this call only
+// Return false if low memory, or the port broke. States are unknown then. Poll another way, not with the port or work.
+bool
+unit_getPowerStates(HANDLE port, UnitPowerQuery* queries, UINT32 count, UnitPowerWork* work);
+
+// Get basic info without timers.
+// If want timers, call unit_getTimers
+// Different handles can be queried from different threads at the same time.
+// info.quirks is loaded from the quirk cache, and is reset even if failed.
+bool
+unit_getInfo(HANDLE h, UnitInfo* info);
+
+// Get timers without basic info
+// info.quirks must be set, usually by unit_getInfo. Set it to 0 if unknown.
+// pages: If not NULL, fetch all mode pages with one command per page control, and parse timers from them.
+//        Falls back to reading power condition page only if the device can't do that.
+// This function resets info.timerMask even if failed
+bool
+unit_getTimers(HANDLE h, UnitInfo* info, UnitModePages* pages);
+
+// info: As returned by unit_getInfo. Timers in it are refreshed.
+// pages: If not NULL, current mode page snapshot is kept in it and reused to write timers.
+bool
+unit_setTimers(HANDLE h, UnitInfo* info, UnitModePages* pages, BYTE mask, const DWORD timers[unit_kPowerConditionCount], const wchar_t** errmsg);